@@ -58,8 +58,30 @@ void MSGQMessage::takeOwnership(char * d, size_t sz) {
   data = d;
 }
 
+void MSGQMessage::borrow(msgq_queue_t * q, char * d, size_t sz) {
+  size = sz;
+  data = d;
+  borrowed_from = q;
+}
+
+bool MSGQMessage::release() {
+  if (borrowed_from == NULL){
+    return true;
+  }
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = size;
+  int r = msgq_msg_release(&msg, borrowed_from);
+  borrowed_from = NULL;
+  data = NULL;
+  size = 0;
+  return r == 0;
+}
+
 void MSGQMessage::close() {
-  if (size > 0){
+  if (borrowed_from != NULL){
+    release();
+  } else if (size > 0){
     delete[] data;
   }
   size = 0;
@@ -83,7 +105,10 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
     return r;
   }
 
-  msgq_init_subscriber(q);
+  r = msgq_init_subscriber(q);
+  if (r != 0){
+    return r;
+  }
 
   if (conflate){
     q->read_conflate = true;
@@ -95,7 +120,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+Message * MSGQSubSocket::receive(bool non_blocking, bool borrow){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -109,7 +134,8 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   MSGQMessage *r = NULL;
 
-  int rc = msgq_msg_recv(&msg, q);
+  auto recv = borrow ? msgq_msg_recv_borrow : msgq_msg_recv;
+  int rc = recv(&msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -119,7 +145,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv(&msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -141,16 +167,38 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   if (rc > 0){
     if (msgq_do_exit){
-      msgq_msg_close(&msg); // Free unused message on exit
+      // Free unused message on exit
+      if (borrow){
+        msgq_msg_release(&msg, q);
+      } else {
+        msgq_msg_close(&msg);
+      }
     } else {
       r = new MSGQMessage;
-      r->takeOwnership(msg.data, msg.size);
+      if (borrow){
+        r->borrow(q, msg.data, msg.size);
+      } else {
+        r->takeOwnership(msg.data, msg.size);
+      }
     }
   }
 
   return (Message*)r;
 }
 
+std::vector<Message *> MSGQSubSocket::receive_batch(size_t max_messages){
+  std::vector<msgq_msg_t> msgs(max_messages);
+  int n = msgq_msg_recv_batch(msgs.data(), max_messages, q);
+
+  std::vector<Message *> r;
+  for (int i = 0; i < n; i++){
+    MSGQMessage *m = new MSGQMessage;
+    m->takeOwnership(msgs[i].data, msgs[i].size);
+    r.push_back(m);
+  }
+  return r;
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -196,6 +244,24 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::send_batch(char **data, size_t *sizes, size_t count){
+  std::vector<msgq_msg_t> msgs(count);
+  for (size_t i = 0; i < count; i++){
+    msgs[i].data = data[i];
+    msgs[i].size = sizes[i];
+  }
+
+  return msgq_msg_send_batch(msgs.data(), count, q);
+}
+
+char *MSGQPubSocket::reserve(size_t size){
+  return msgq_msg_reserve(q, size);
+}
+
+int MSGQPubSocket::commit(size_t size){
+  return msgq_msg_commit(q, size);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -19,12 +19,15 @@ class MSGQMessage : public Message {
 private:
   char * data;
   size_t size;
+  msgq_queue_t * borrowed_from = NULL;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
   void takeOwnership(char *data, size_t size);
+  void borrow(msgq_queue_t *q, char *data, size_t size);
   size_t getSize(){return size;}
   char * getData(){return data;}
+  bool release();
   void close();
   ~MSGQMessage();
 };
@@ -33,11 +36,14 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  Message *receive(bool non_blocking, bool borrow);
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
-  Message *receive(bool non_blocking=false);
+  Message *receive(bool non_blocking=false) {return receive(non_blocking, false);}
+  Message *receive_borrowed(bool non_blocking=false) {return receive(non_blocking, true);}
+  std::vector<Message *> receive_batch(size_t max_messages);
   ~MSGQSubSocket();
 };
 
@@ -48,6 +54,9 @@ public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int send_batch(char **data, size_t *sizes, size_t count);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
@@ -44,6 +44,33 @@ SubSocket * SubSocket::create(Context * context, std::string endpoint, std::stri
   }
 }
 
+std::vector<Message *> SubSocket::receive_batch(size_t max_messages){
+  std::vector<Message *> msgs;
+  Message *msg = nullptr;
+  while (msgs.size() < max_messages && (msg = receive(true))){
+    msgs.push_back(msg);
+  }
+  return msgs;
+}
+
+int PubSocket::send_batch(char **data, size_t *sizes, size_t count){
+  for (size_t i = 0; i < count; i++){
+    if (send(data[i], sizes[i]) < 0){
+      return i > 0 ? i : -1;
+    }
+  }
+  return count;
+}
+
+char *PubSocket::reserve(size_t size){
+  reserve_buf.resize(size / sizeof(capnp::word) + 1);
+  return (char *)reserve_buf.data();
+}
+
+int PubSocket::commit(size_t size){
+  return send((char *)reserve_buf.data(), size);
+}
+
 PubSocket * PubSocket::create(){
   PubSocket * s;
   if (messaging_use_zmq()){
@@ -12,6 +12,9 @@
 
 #define MSG_MULTIPLE_PUBLISHERS 100
 
+// defined in services.h
+enum class ServiceId : int;
+
 bool messaging_use_zmq();
 
 class Context {
@@ -28,6 +31,8 @@ public:
   virtual void close() = 0;
   virtual size_t getSize() = 0;
   virtual char * getData() = 0;
+  // Ends a borrow from receive_borrowed(). False if the data may have been overwritten while it was held.
+  virtual bool release() { return true; }
   virtual ~Message(){};
 };
 
@@ -37,6 +42,11 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // The returned message may point directly into the transport's buffer. It stays valid
+  // until it is deleted or the next message is received, whichever comes first.
+  virtual Message *receive_borrowed(bool non_blocking=false) { return receive(non_blocking); }
+  // Receives up to max_messages messages that are ready, without blocking.
+  virtual std::vector<Message *> receive_batch(size_t max_messages);
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,11 +58,21 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Sends count messages at once. Returns the number of messages sent, or -1 on error.
+  virtual int send_batch(char **data, size_t *sizes, size_t count);
+  // Zero copy send: reserve returns a word aligned buffer for a message of up to size bytes,
+  // commit sends the first size bytes of it. Nothing else may be sent in between.
+  // reserve returns NULL if the socket can't send. Transports without shared memory go
+  // through a local buffer and send().
+  virtual char *reserve(size_t size);
+  virtual int commit(size_t size);
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
   virtual ~PubSocket(){};
+private:
+  std::vector<capnp::word> reserve_buf;
 };
 
 class Poller {
@@ -74,6 +94,7 @@ public:
   inline bool allValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, false); }
   inline bool allAliveAndValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, true); }
   void drain();
+  std::vector<Message *> drain(const char *name, size_t max_messages);
   ~SubMaster();
 
   uint64_t frame = 0;
@@ -84,17 +105,29 @@ public:
   uint64_t rcv_time(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
 
+  bool updated(ServiceId id) const;
+  bool alive(ServiceId id) const;
+  bool valid(ServiceId id) const;
+  uint64_t rcv_frame(ServiceId id) const;
+  uint64_t rcv_time(ServiceId id) const;
+  cereal::Event::Reader &operator[](ServiceId id) const;
+
 private:
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
-  Poller *poller_ = nullptr;
   struct SubMessage;
+  void update_msgs(uint64_t current_time, const std::vector<std::pair<SubMessage *, cereal::Event::Reader>> &messages);
+  SubMessage *find(const char *name) const;
+  SubMessage *find(ServiceId id) const;
+  Poller *poller_ = nullptr;
   std::map<SubSocket *, SubMessage *> messages_;
-  std::map<std::string, SubMessage *> services_;
+  std::vector<SubMessage *> services_;  // indexed by ServiceId
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  // builds in first_segment before allocating, it has to be zeroed and is zeroed again when done
+  MessageBuilder(kj::ArrayPtr<capnp::word> first_segment) : capnp::MallocMessageBuilder(first_segment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
@@ -118,12 +151,21 @@ private:
 class PubMaster {
 public:
   PubMaster(const std::vector<const char *> &service_list);
-  inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
+  int send(const char *name, capnp::byte *data, size_t size);
   int send(const char *name, MessageBuilder &msg);
+  int send(ServiceId id, capnp::byte *data, size_t size);
+  int send(ServiceId id, MessageBuilder &msg);
+  int send_batch(const char *name, const std::vector<MessageBuilder *> &msgs);
+  char *reserve(const char *name, size_t size);
+  int commit(const char *name, size_t size);
+  char *reserve(ServiceId id, size_t size);
+  int commit(ServiceId id, size_t size);
   ~PubMaster();
 
 private:
-  std::map<std::string, PubSocket *> sockets_;
+  PubSocket *find(const char *name) const;
+  PubSocket *find(ServiceId id) const;
+  std::vector<PubSocket *> sockets_;  // indexed by ServiceId
 };
 
 class AlignedBuffer {
@@ -6,8 +6,10 @@
 #include <cstdint>
 #include <chrono>
 #include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <csignal>
+#include <mutex>
 #include <random>
 
 #include <poll.h>
@@ -19,12 +21,100 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifndef __APPLE__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
+static msgq_wake_slot_t * wake_table = NULL;
+static std::once_flag wake_table_init;
+
+static msgq_wake_slot_t * msgq_get_wake_table(void){
+  std::call_once(wake_table_init, [](){
+    auto fd = open("/dev/shm/msgq_wake", O_RDWR | O_CREAT, 0777);
+    if (fd < 0) {
+      std::cout << "Warning, could not open wake table, falling back to polling" << std::endl;
+      return;
+    }
+
+    size_t size = NUM_WAKE_SLOTS * sizeof(msgq_wake_slot_t);
+    if (ftruncate(fd, size) == 0){
+      void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED){
+        wake_table = (msgq_wake_slot_t *)mem;
+      }
+    }
+    close(fd);
+  });
+
+  return wake_table;
+}
+
+// Releases the wake slot when the owning thread exits
+struct msgq_wake_slot_owner {
+  int slot = -1;
+  ~msgq_wake_slot_owner(){
+    if (slot >= 0){
+      reinterpret_cast<std::atomic<uint32_t>*>(&wake_table[slot].tid)->store(0);
+    }
+  }
+};
+
+static thread_local msgq_wake_slot_owner wake_slot_owner;
+
+static int msgq_get_wake_slot(void){
+#ifdef __APPLE__
+  return -1;
+#else
+  if (wake_slot_owner.slot >= 0){
+    return wake_slot_owner.slot;
+  }
+
+  msgq_wake_slot_t * table = msgq_get_wake_table();
+  if (table == NULL){
+    return -1;
+  }
+
+  uint32_t tid = syscall(SYS_gettid);
+
+  // Claim a free slot, on the second pass also take over slots of threads that are gone
+  for (int pass = 0; pass < 2; pass++){
+    for (int i = 0; i < NUM_WAKE_SLOTS; i++){
+      std::atomic<uint32_t> *owner = reinterpret_cast<std::atomic<uint32_t>*>(&table[i].tid);
+      uint32_t cur = *owner;
+
+      bool free = (cur == 0) || (pass == 1 && kill(cur, 0) != 0 && errno == ESRCH);
+      if (free && std::atomic_compare_exchange_strong(owner, &cur, tid)){
+        wake_slot_owner.slot = i;
+        return i;
+      }
+    }
+  }
+
+  return -1;
+#endif
+}
+
+static void msgq_wake_reader(uint64_t waiter){
+#ifndef __APPLE__
+  // waiter is the wake slot + 1, zero means the reader is not blocked
+  if (waiter == 0 || waiter > NUM_WAKE_SLOTS || wake_table == NULL){
+    return;
+  }
+
+  std::atomic<uint32_t> *seq = reinterpret_cast<std::atomic<uint32_t>*>(&wake_table[waiter - 1].seq);
+  (*seq)++;
+  syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static uint64_t msgq_nanos(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
 uint64_t msgq_get_uid(void){
@@ -71,6 +161,9 @@ void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
+  q->read_borrows[id]->store(MSGQ_NO_BORROW);
+  q->read_heartbeats[id]->store(msgq_nanos());
+  q->borrow_data = NULL;
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -84,7 +177,7 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
+  msgq_get_wake_table();
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -115,6 +208,8 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   msgq_header_t *header = (msgq_header_t *)mem;
 
   // Setup pointers to header segment
+  q->version = reinterpret_cast<std::atomic<uint64_t>*>(&header->version);
+  q->max_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_readers);
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
@@ -123,11 +218,25 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
     q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
     q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
     q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+    q->read_borrows[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_borrows[i]);
+    q->read_waiters[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_waiters[i]);
+    q->read_heartbeats[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_heartbeats[i]);
+    q->read_starts[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_starts[i]);
+  }
+
+  // A zero version means no publisher initialized the segment yet
+  uint64_t version = *q->version;
+  if (version != 0 && (version != MSGQ_VERSION || *q->max_readers != NUM_READERS)){
+    std::cout << "Warning, " << path << " was created with an incompatible header layout (version " << version
+              << ", " << *q->max_readers << " readers)" << std::endl;
   }
 
   q->data = mem + sizeof(msgq_header_t);
   q->size = size;
   q->reader_id = -1;
+  q->evicted = false;
+  q->borrow_data = NULL;
+  q->reserved = NULL;
 
   q->endpoint = path;
   q->read_conflate = false;
@@ -148,51 +257,134 @@ void msgq_init_publisher(msgq_queue_t * q) {
 
   *q->write_uid = uid;
   *q->num_readers = 0;
+  *q->version = MSGQ_VERSION;
+  *q->max_readers = NUM_READERS;
 
   for (size_t i = 0; i < NUM_READERS; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+    *q->read_borrows[i] = MSGQ_NO_BORROW;
+    *q->read_waiters[i] = 0;
+    *q->read_heartbeats[i] = 0;
+    *q->read_starts[i] = 0;
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
+// Start time of a thread in clock ticks since boot, 0 if it is gone or unknown
+static uint64_t msgq_thread_start_time(uint32_t tid){
+#ifdef __APPLE__
+  return 0;
+#else
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%u/stat", tid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0){
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0){
+    return 0;
+  }
+  buf[n] = '\0';
+
+  // The name can contain spaces, the fields after it start with the state as field 3
+  char * p = strrchr(buf, ')');
+  for (int field = 2; p != NULL && field < 22; field++){
+    p = strchr(p + 1, ' ');
+  }
+  return p != NULL ? strtoull(p + 1, NULL, 10) : 0;
+#endif
 }
 
-void msgq_init_subscriber(msgq_queue_t * q) {
+static bool msgq_reader_dead(msgq_queue_t * q, int id){
+  // The lower half of the uid is the thread id of the reader
+  uint64_t uid = *q->read_uids[id];
+  uint32_t tid = uid & 0xFFFFFFFF;
+  if (uid == 0 || (kill(tid, 0) != 0 && errno == ESRCH)){
+    return true;
+  }
+
+  // The thread id may have been reused by a thread that started after the reader
+  uint64_t start = *q->read_starts[id];
+  return start != 0 && start != msgq_thread_start_time(tid);
+}
+
+// Finds a reader slot that can be handed to a new subscriber when all slots are taken.
+// Prefers readers whose thread is gone, then readers whose lease expired. Returns -1 if
+// all readers are alive.
+static int msgq_find_stale_reader(msgq_queue_t * q){
+  uint64_t now = msgq_nanos();
+
+  int oldest_id = -1;
+  uint64_t oldest_heartbeat = UINT64_MAX;
+
+  for (int i = 0; i < NUM_READERS; i++){
+    if (msgq_reader_dead(q, i)){
+      return i;
+    }
+
+    // Readers blocked in a poll are alive
+    if (*q->read_waiters[i] != 0){
+      continue;
+    }
+
+    uint64_t heartbeat = *q->read_heartbeats[i];
+    if (heartbeat < oldest_heartbeat){
+      oldest_heartbeat = heartbeat;
+      oldest_id = i;
+    }
+  }
+
+  if (oldest_heartbeat == UINT64_MAX || now - oldest_heartbeat < READER_LEASE_NS){
+    return -1;
+  }
+
+  return oldest_id;
+}
+
+// Returns -1 if all reader slots are taken by live readers
+int msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
 
   uint64_t uid = msgq_get_uid();
+  uint64_t start = msgq_thread_start_time(uid & 0xFFFFFFFF);
 
   // Get reader id
   while (true){
     uint64_t cur_num_readers = *q->num_readers;
     uint64_t new_num_readers = cur_num_readers + 1;
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
+    // No more slots available. Take over the slot of a dead or inactive reader
     if (new_num_readers > NUM_READERS){
-      std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
+      int id = msgq_find_stale_reader(q);
+      if (id < 0){
+        if (!q->evicted){
+          std::cout << "Warning, " << q->endpoint << " has no free reader slots" << std::endl;
+        }
+        return -1;
+      }
+      uint64_t old_uid = *q->read_uids[id];
 
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
+      // Another subscriber might be reclaiming the same slot
+      if (!std::atomic_compare_exchange_strong(q->read_uids[id], &old_uid, uid)){
+        continue;
+      }
 
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
+      q->reader_id = id;
+      q->read_uid_local = uid;
 
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
-      }
+      *q->read_starts[id] = start;
+      *q->read_valids[id] = false;
+      *q->read_pointers[id] = 0;
+      *q->read_borrows[id] = MSGQ_NO_BORROW;
 
-      continue;
+      // Wake up the old reader in case it is in a poll, so it notices the eviction
+      msgq_wake_reader(q->read_waiters[id]->exchange(0));
+      break;
     }
 
     // Use atomic compare and swap to handle race condition
@@ -207,6 +399,9 @@ void msgq_init_subscriber(msgq_queue_t * q) {
       // on the first read the read pointer will be synchronized with the write pointer
       *q->read_valids[cur_num_readers] = false;
       *q->read_pointers[cur_num_readers] = 0;
+      *q->read_borrows[cur_num_readers] = MSGQ_NO_BORROW;
+      *q->read_waiters[cur_num_readers] = 0;
+      *q->read_starts[cur_num_readers] = start;
       *q->read_uids[cur_num_readers] = uid;
       break;
     }
@@ -214,27 +409,18 @@ void msgq_init_subscriber(msgq_queue_t * q) {
 
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
+  return 0;
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
-  // Die if we are no longer the active publisher
-  if (q->write_uid_local != *q->write_uid){
-    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
-    errno = EADDRINUSE;
-    return -1;
-  }
-
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+// Makes room for a message of up to size bytes at the write pointer, wrapping around and
+// invalidating the readers it overwrites. Returns where the size tag of the message goes.
+static char *msgq_msg_prepare(size_t size, msgq_queue_t *q, uint64_t num_readers, uint32_t &write_cycles, uint32_t &write_pointer){
+  uint64_t total_msg_size = ALIGN(size + sizeof(int64_t));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
   assert(3 * total_msg_size <= q->size);
 
-  uint64_t num_readers = *q->num_readers;
-
-  uint32_t write_cycles, write_pointer;
-  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
-
   char *p = q->data + write_pointer; // add base offset
 
   // Check remaining space
@@ -254,6 +440,12 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
       if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
         *q->read_valids[i] = false;
       }
+
+      // A borrowed message in the skipped tail is also about to be overwritten
+      uint64_t borrow = *q->read_borrows[i];
+      if (borrow != MSGQ_NO_BORROW && (borrow & 0xFFFFFFFF) > write_pointer && (borrow >> 32) != write_cycles) {
+        *q->read_valids[i] = false;
+      }
     }
 
     // Update global and local copies of write pointer and write_cycles
@@ -267,7 +459,7 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = ALIGN(start + sizeof(int64_t) + size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
@@ -276,30 +468,158 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
       *q->read_valids[i] = false;
     }
+
+    // Also invalidate readers that still hold a borrowed view into this area
+    uint64_t borrow = *q->read_borrows[i];
+    if (borrow != MSGQ_NO_BORROW){
+      uint32_t borrow_cycles, borrow_pointer;
+      UNPACK64(borrow_cycles, borrow_pointer, borrow);
+
+      if ((borrow_pointer >= start) && (borrow_pointer < end) && (borrow_cycles != write_cycles)) {
+        *q->read_valids[i] = false;
+      }
+    }
   }
 
+  return p;
+}
 
-  // Write size tag
+// Writes the size tag of a message whose data is in place and advances the local write pointer
+static void msgq_msg_finish(char *p, size_t size, uint32_t &write_pointer){
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
+  *size_p = size;
+  __sync_synchronize();
+
+  write_pointer = ALIGN(write_pointer + size + sizeof(int64_t));
+}
 
-  // Copy data
+// Writes a single message at the local write pointer, invalidating readers in its way.
+// The message only becomes visible to readers once the write pointer is published.
+static void msgq_msg_write(msgq_msg_t * msg, msgq_queue_t *q, uint64_t num_readers, uint32_t &write_cycles, uint32_t &write_pointer){
+  char *p = msgq_msg_prepare(msg->size, q, num_readers, write_cycles, write_pointer);
   memcpy(p + sizeof(int64_t), msg->data, msg->size);
-  __sync_synchronize();
+  msgq_msg_finish(p, msg->size, write_pointer);
+}
 
-  // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
-  PACK64(*q->write_pointer, write_cycles, new_ptr);
+static bool msgq_check_publisher(msgq_queue_t *q){
+  // Die if we are no longer the active publisher
+  if (q->write_uid_local != *q->write_uid){
+    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
+    errno = EADDRINUSE;
+    return false;
+  }
+  return true;
+}
 
-  // Notify readers
+static void msgq_notify_readers(msgq_queue_t *q, uint64_t num_readers){
+  // Notify readers that are blocked in a poll
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    msgq_wake_reader(*q->read_waiters[i]);
   }
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  msgq_msg_write(msg, q, num_readers, write_cycles, write_pointer);
+
+  // Update write pointer
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
+
+  msgq_notify_readers(q, num_readers);
 
   return msg->size;
 }
 
+// Reserves space for a message of up to size bytes and returns where its data goes, so it
+// can be built in place. Only one reservation per queue can be open at a time, and nothing
+// else may be sent on the queue until it is committed.
+char *msgq_msg_reserve(msgq_queue_t *q, size_t size){
+  if (!msgq_check_publisher(q)){
+    return NULL;
+  }
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  // Readers in the reserved area are invalidated now, the write pointer only moves on commit
+  char *p = msgq_msg_prepare(size, q, *q->num_readers, write_cycles, write_pointer);
+  q->reserved = p;
+  q->reserved_size = size;
+  return p + sizeof(int64_t);
+}
+
+// Publishes the open reservation as a message of size bytes, at most what was reserved
+int msgq_msg_commit(msgq_queue_t *q, size_t size){
+  assert(q->reserved != NULL && size <= q->reserved_size);
+  char *p = q->reserved;
+  q->reserved = NULL;
+
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+  assert(p == q->data + write_pointer);
+
+  msgq_msg_finish(p, size, write_pointer);
+
+  // Update write pointer
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
+
+  msgq_notify_readers(q, num_readers);
+
+  return size;
+}
+
+// Sends count messages with a single write pointer update and reader notification.
+// Returns the number of messages sent.
+int msgq_msg_send_batch(msgq_msg_t * msgs, size_t count, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  if (count == 0){
+    return 0;
+  }
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  for (size_t i = 0; i < count; i++){
+    msgq_msg_write(&msgs[i], q, num_readers, write_cycles, write_pointer);
+  }
+
+  // Update write pointer
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
+
+  msgq_notify_readers(q, num_readers);
+
+  return count;
+}
+
+
+// Stays detached and tries again on every call while all slots are taken, so only the first try is logged
+static int msgq_reattach_reader(msgq_queue_t * q){
+  if (!q->evicted){
+    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
+  }
+  int ret = msgq_init_subscriber(q);
+  q->evicted = ret != 0;
+  return ret;
+}
 
 int msgq_msg_ready(msgq_queue_t * q){
  start:
@@ -307,11 +627,14 @@ int msgq_msg_ready(msgq_queue_t * q){
   assert(id >= 0); // Make sure subscriber is initialized
 
   if (q->read_uid_local != *q->read_uids[id]){
-    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    if (msgq_reattach_reader(q) != 0){
+      return 0;
+    }
     goto start;
   }
 
+  q->read_heartbeats[id]->store(msgq_nanos(), std::memory_order_relaxed);
+
   // Check valid
   if (!*q->read_valids[id]){
     msgq_reset_reader(q);
@@ -328,17 +651,20 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+static int msgq_msg_recv_internal(msgq_msg_t * msg, msgq_queue_t * q, bool borrow){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
   if (q->read_uid_local != *q->read_uids[id]){
-    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    if (msgq_reattach_reader(q) != 0){
+      return 0;
+    }
     goto start;
   }
 
+  q->read_heartbeats[id]->store(msgq_nanos(), std::memory_order_relaxed);
+
   // Check valid
   if (!*q->read_valids[id]){
     msgq_reset_reader(q);
@@ -392,20 +718,32 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     }
   }
 
-  // Copy message
-  if (msgq_msg_init_size(msg, size) < 0)
-    return -1;
-
-  __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
-  __sync_synchronize();
+  if (borrow){
+    // Pin the message, the writer will invalidate this reader before overwriting it
+    PACK64(*q->read_borrows[id], read_cycles, read_pointer);
+    __sync_synchronize();
+
+    msg->size = size;
+    msg->data = p + sizeof(int64_t);
+    q->borrow_data = msg->data;
+  } else {
+    // Copy message
+    if (msgq_msg_init_size(msg, size) < 0)
+      return -1;
+
+    __sync_synchronize();
+    memcpy(msg->data, p + sizeof(int64_t), size);
+    __sync_synchronize();
+  }
 
   // Update read pointer
   PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
 
-  // Check if the actual data that was copied is valid
+  // Check if the actual data that was copied or pinned is valid
   if (!*q->read_valids[id]){
-    msgq_msg_close(msg);
+    if (!borrow){
+      msgq_msg_close(msg);
+    }
     msgq_reset_reader(q);
     goto start;
   }
@@ -414,17 +752,54 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   return msg->size;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, false);
+}
 
+// Receives up to max_count messages that are ready without blocking.
+// Returns the number of messages received, or -1 on allocation failure.
+int msgq_msg_recv_batch(msgq_msg_t * msgs, size_t max_count, msgq_queue_t * q){
+  size_t count = 0;
+  while (count < max_count){
+    int r = msgq_msg_recv_internal(&msgs[count], q, false);
+    if (r < 0){
+      return count > 0 ? count : -1;
+    } else if (r == 0){
+      break;
+    }
+    count++;
+  }
+  return count;
+}
 
-int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
-  int num = 0;
+// Receives a message without copying it. msg->data points into the shared segment,
+// is 8 byte aligned and must be treated as read-only. Only one message per queue can be
+// borrowed at a time, the previous borrow is superseded by the next call.
+int msgq_msg_recv_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, true);
+}
 
-  // Check if messages ready
-  for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
+// Ends a borrow. Returns 0 if the writer did not touch the borrowed data
+// while it was held, and -1 if it may have been overwritten or was superseded.
+int msgq_msg_release(msgq_msg_t * msg, msgq_queue_t * q){
+  int id = q->reader_id;
+  if (id < 0 || msg->data == NULL || msg->data != q->borrow_data){
+    return -1;
   }
 
+  bool valid = (q->read_uid_local == *q->read_uids[id]) && *q->read_valids[id];
+  if (valid){
+    q->read_borrows[id]->store(MSGQ_NO_BORROW);
+  }
+  q->borrow_data = NULL;
+
+  return valid ? 0 : -1;
+}
+
+// Fallback for platforms without futexes
+static int msgq_poll_sleep(msgq_pollitem_t * items, size_t nitems, int timeout){
+  int num = 0;
+
   int ms = (timeout == -1) ? 100 : timeout;
   struct timespec ts;
   ts.tv_sec = ms / 1000;
@@ -444,12 +819,82 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
       }
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    // exit if we had a timeout and the sleep finished, or a signal interrupted it
+    if ((timeout != -1 && ret == 0) || (ret != 0 && errno == EINTR)){
+      break;
+    }
+  }
+
+  return num;
+}
+
+static void msgq_poll_set_waiter(msgq_pollitem_t * items, size_t nitems, uint64_t waiter){
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_queue_t *q = items[i].q;
+    // An evicted reader must not touch the slot of its successor
+    if (q->reader_id >= 0 && *q->read_uids[q->reader_id] == q->read_uid_local){
+      *q->read_waiters[q->reader_id] = waiter;
+    }
+  }
+}
+
+int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  int num = 0;
+
+  // Check if messages ready
+  for (size_t i = 0; i < nitems; i++) {
+    items[i].revents = msgq_msg_ready(items[i].q);
+    if (items[i].revents) num++;
+  }
+
+  if (num > 0 || timeout == 0){
+    return num;
+  }
+
+  int slot = msgq_get_wake_slot();
+  if (slot < 0){
+    return msgq_poll_sleep(items, nitems, timeout);
+  }
+
+#ifndef __APPLE__
+  std::atomic<uint32_t> *seq = reinterpret_cast<std::atomic<uint32_t>*>(&wake_table[slot].seq);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  while (num == 0) {
+    // Read the sequence number before registering, a wakeup after this point makes the wait return immediately
+    uint32_t cur_seq = *seq;
+    msgq_poll_set_waiter(items, nitems, slot + 1);
+
+    // Check again, a message might have arrived before the writers could see us waiting
+    for (size_t i = 0; i < nitems; i++) {
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
+    }
+    if (num > 0){
+      break;
+    }
+
+    // Wake up periodically without timeout, in case a publisher restarted and reset the header
+    int64_t ms = 100;
+    if (timeout != -1){
+      ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (ms <= 0){
+        break;
+      }
+    }
+
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+    // Interrupted by a signal, let the caller handle it like a timeout
+    if (syscall(SYS_futex, seq, FUTEX_WAIT, cur_seq, &ts, NULL, 0) != 0 && errno == EINTR){
       break;
     }
   }
 
+  msgq_poll_set_waiter(items, nitems, 0);
+#endif
+
   return num;
 }
 
@@ -5,34 +5,66 @@
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#ifndef NUM_READERS
+#define NUM_READERS 128
+#endif
+#define NUM_WAKE_SLOTS 1024
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
+// Bump when the layout of msgq_header_t changes
+#define MSGQ_VERSION 3
+// Readers that did not touch their queue for this long can be replaced by new ones
+#define READER_LEASE_NS (10ULL * 1000 * 1000 * 1000)
+
+#define MSGQ_NO_BORROW 0xFFFFFFFFFFFFFFFF
+
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
 struct  msgq_header_t {
+  uint64_t version;
+  uint64_t max_readers;
   uint64_t num_readers;
   uint64_t write_pointer;
   uint64_t write_uid;
   uint64_t read_pointers[NUM_READERS];
   uint64_t read_valids[NUM_READERS];
   uint64_t read_uids[NUM_READERS];
+  uint64_t read_borrows[NUM_READERS];
+  uint64_t read_waiters[NUM_READERS];
+  uint64_t read_heartbeats[NUM_READERS];
+  uint64_t read_starts[NUM_READERS];
+};
+
+// Futex words of blocked readers, shared by all queues so a thread can wait on many queues at once
+struct msgq_wake_slot_t {
+  uint32_t seq;
+  uint32_t tid;
 };
 
 struct msgq_queue_t {
+  std::atomic<uint64_t> *version;
+  std::atomic<uint64_t> *max_readers;
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
   std::atomic<uint64_t> *read_pointers[NUM_READERS];
   std::atomic<uint64_t> *read_valids[NUM_READERS];
   std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *read_borrows[NUM_READERS];
+  std::atomic<uint64_t> *read_waiters[NUM_READERS];
+  std::atomic<uint64_t> *read_heartbeats[NUM_READERS];
+  std::atomic<uint64_t> *read_starts[NUM_READERS];
   char * mmap_p;
   char * data;
   size_t size;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  bool evicted;  // lost its reader slot and didn't get a new one yet
+  char * borrow_data;
+  char * reserved;
+  size_t reserved_size;
 
   bool read_conflate;
   std::string endpoint;
@@ -58,10 +90,18 @@ int msgq_msg_close(msgq_msg_t *msg);
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
-void msgq_init_subscriber(msgq_queue_t * q);
+int msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t count, msgq_queue_t *q);
+// Zero copy send: reserve returns where the data of a message of up to size bytes goes,
+// commit sends the first size bytes of it. Nothing else may be sent in between.
+char *msgq_msg_reserve(msgq_queue_t *q, size_t size);
+int msgq_msg_commit(msgq_queue_t *q, size_t size);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_batch(msgq_msg_t *msgs, size_t max_count, msgq_queue_t *q);
+int msgq_msg_recv_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_release(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
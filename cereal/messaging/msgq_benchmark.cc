@@ -0,0 +1,296 @@
+// Measures latency and throughput of msgq, zmq and the msgq -> zmq bridge.
+// Prints one JSON object per configuration, e.g.
+//   ./msgq_benchmark -t msgq,zmq -s 16,4096 -r 1,10 -n 1000 > results.jsonl
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "impl_msgq.h"
+#include "impl_zmq.h"
+
+#define ZMQ_PORT "8598"
+#define BRIDGE_PORT "8599"
+#define NUM_HISTOGRAM_BUCKETS 24  // power of two buckets, up to ~8 seconds in us
+
+struct BenchHeader {
+  uint64_t send_ns;
+  uint64_t seq;
+};
+
+struct BenchConfig {
+  std::string transport;
+  size_t size;
+  int num_readers;
+  bool conflate;
+  int count;
+  int interval_us;
+};
+
+struct ReaderResult {
+  std::vector<uint64_t> latencies_ns;
+  uint64_t received = 0;
+  uint64_t bytes = 0;
+  uint64_t first_ns = 0, last_ns = 0;
+  std::atomic<bool> done{false};
+};
+
+static inline uint64_t nanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<std::string> split(const std::string &s) {
+  std::vector<std::string> r;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) r.push_back(item);
+  return r;
+}
+
+static std::string endpoint_name() {
+  return "msgq_benchmark_" + std::to_string(getpid());
+}
+
+static PubSocket *create_pub(Context *msgq_ctx, Context *zmq_ctx, const std::string &transport) {
+  PubSocket *s;
+  if (transport == "zmq") {
+    s = new ZMQPubSocket();
+    s->connect(zmq_ctx, ZMQ_PORT, false);
+  } else {
+    // the bridge republishes msgq on zmq
+    s = new MSGQPubSocket();
+    s->connect(msgq_ctx, endpoint_name(), false);
+  }
+  return s;
+}
+
+static SubSocket *create_sub(Context *msgq_ctx, Context *zmq_ctx, const std::string &transport, bool conflate) {
+  SubSocket *s;
+  if (transport == "msgq") {
+    s = new MSGQSubSocket();
+    s->connect(msgq_ctx, endpoint_name(), "127.0.0.1", conflate, false);
+  } else {
+    s = new ZMQSubSocket();
+    s->connect(zmq_ctx, transport == "zmq" ? ZMQ_PORT : BRIDGE_PORT, "127.0.0.1", conflate, false);
+  }
+  return s;
+}
+
+static void bridge_thread(Context *msgq_ctx, Context *zmq_ctx, std::atomic<bool> *started, std::atomic<bool> *exit) {
+  MSGQSubSocket sub;
+  sub.connect(msgq_ctx, endpoint_name(), "127.0.0.1", false, false);
+  ZMQPubSocket pub;
+  pub.connect(zmq_ctx, BRIDGE_PORT, false);
+
+  MSGQPoller poller;
+  poller.registerSocket(&sub);
+  *started = true;
+
+  while (!*exit) {
+    for (auto s : poller.poll(100)) {
+      Message *msg = s->receive(true);
+      if (msg == NULL) continue;
+      pub.sendMessage(msg);
+      delete msg;
+    }
+  }
+}
+
+static void reader_thread(SubSocket *sock, const BenchConfig &cfg, ReaderResult *result, std::atomic<bool> *exit) {
+  Poller *poller = cfg.transport == "msgq" ? (Poller *)new MSGQPoller() : (Poller *)new ZMQPoller();
+  poller->registerSocket(sock);
+  result->latencies_ns.reserve(cfg.count);
+
+  while (!*exit) {
+    for (auto s : poller->poll(100)) {
+      Message *msg;
+      while ((msg = s->receive(true))) {
+        uint64_t t = nanos();
+        BenchHeader header;
+        memcpy(&header, msg->getData(), sizeof(header));
+        result->latencies_ns.push_back(t - header.send_ns);
+        result->bytes += msg->getSize();
+        if (result->received++ == 0) result->first_ns = t;
+        result->last_ns = t;
+        delete msg;
+
+        if (header.seq == (uint64_t)cfg.count - 1) {
+          result->done = true;
+        }
+      }
+    }
+    if (result->done) break;
+  }
+  delete poller;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[idx];
+}
+
+static void run(const BenchConfig &cfg, Context *msgq_ctx, Context *zmq_ctx) {
+  std::atomic<bool> exit(false), bridge_started(false);
+
+  PubSocket *pub = create_pub(msgq_ctx, zmq_ctx, cfg.transport);
+
+  std::thread bridge;
+  if (cfg.transport == "bridge") {
+    bridge = std::thread(bridge_thread, msgq_ctx, zmq_ctx, &bridge_started, &exit);
+    while (!bridge_started) std::this_thread::yield();
+  }
+
+  std::vector<SubSocket *> subs;
+  std::vector<ReaderResult> results(cfg.num_readers);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < cfg.num_readers; i++) {
+    subs.push_back(create_sub(msgq_ctx, zmq_ctx, cfg.transport, cfg.conflate));
+  }
+  for (int i = 0; i < cfg.num_readers; i++) {
+    readers.emplace_back(reader_thread, subs[i], std::cref(cfg), &results[i], &exit);
+  }
+
+  // zmq subscribers need time to connect
+  if (cfg.transport != "msgq") {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  std::vector<char> data(std::max(cfg.size, sizeof(BenchHeader)));
+  uint64_t start_ns = nanos();
+  for (int i = 0; i < cfg.count; i++) {
+    BenchHeader header = {.send_ns = nanos(), .seq = (uint64_t)i};
+    memcpy(data.data(), &header, sizeof(header));
+    pub->send(data.data(), data.size());
+
+    if (cfg.interval_us > 0) {
+      uint64_t next = start_ns + (i + 1) * cfg.interval_us * 1000ULL;
+      while (nanos() < next) std::this_thread::yield();
+    }
+  }
+  uint64_t send_end_ns = nanos();
+
+  // give readers that lost the last message (zmq high water mark) some time to finish
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  for (auto &r : results) {
+    while (!r.done && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  exit = true;
+  for (auto &t : readers) t.join();
+  if (bridge.joinable()) bridge.join();
+
+  // aggregate over all readers
+  std::vector<uint64_t> latencies;
+  uint64_t received = 0, bytes = 0, first_ns = UINT64_MAX, last_ns = 0;
+  for (auto &r : results) {
+    latencies.insert(latencies.end(), r.latencies_ns.begin(), r.latencies_ns.end());
+    received += r.received;
+    bytes += r.bytes;
+    if (r.received) {
+      first_ns = std::min(first_ns, r.first_ns);
+      last_ns = std::max(last_ns, r.last_ns);
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  uint64_t histogram[NUM_HISTOGRAM_BUCKETS] = {};
+  for (auto l : latencies) {
+    uint64_t us = l / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < NUM_HISTOGRAM_BUCKETS - 1) {
+      us >>= 1;
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+
+  double recv_seconds = received > 0 && last_ns > first_ns ? (last_ns - first_ns) * 1e-9 : 0;
+  double send_seconds = (send_end_ns - start_ns) * 1e-9;
+
+  printf("{\"transport\": \"%s\", \"size\": %zu, \"readers\": %d, \"conflate\": %s, \"sent\": %d, \"received\": %lu, "
+         "\"send_msgs_per_sec\": %.1f, \"recv_mb_per_sec\": %.3f, "
+         "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, \"histogram_us_log2\": [",
+         cfg.transport.c_str(), cfg.size, cfg.num_readers, cfg.conflate ? "true" : "false", cfg.count, received,
+         send_seconds > 0 ? cfg.count / send_seconds : 0, recv_seconds > 0 ? bytes / recv_seconds / 1e6 : 0,
+         percentile(latencies, 0.5) / 1e3, percentile(latencies, 0.99) / 1e3, percentile(latencies, 0.999) / 1e3,
+         latencies.empty() ? 0 : latencies.back() / 1e3);
+  for (int i = 0; i < NUM_HISTOGRAM_BUCKETS; i++) {
+    printf("%s%lu", i ? ", " : "", histogram[i]);
+  }
+  printf("]}\n");
+  fflush(stdout);
+
+  for (auto s : subs) delete s;
+  delete pub;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> transports = {"msgq", "zmq", "bridge"};
+  std::vector<size_t> sizes = {16, 256, 4096, 65536, 1024 * 1024};
+  std::vector<int> readers = {1, 2, 5, 10};
+  std::vector<bool> conflates = {false, true};
+  int count = 1000;
+  int interval_us = 1000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:r:c:n:i:h")) != -1) {
+    switch (opt) {
+      case 't':
+        transports = split(optarg);
+        break;
+      case 's':
+        sizes.clear();
+        for (auto &s : split(optarg)) sizes.push_back(std::stoul(s));
+        break;
+      case 'r':
+        readers.clear();
+        for (auto &s : split(optarg)) readers.push_back(std::stoi(s));
+        break;
+      case 'c':
+        conflates.clear();
+        for (auto &s : split(optarg)) conflates.push_back(s == "1" || s == "true");
+        break;
+      case 'n':
+        count = std::stoi(optarg);
+        break;
+      case 'i':
+        interval_us = std::stoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-t msgq,zmq,bridge] [-s sizes] [-r readers] [-c 0,1] [-n count] [-i interval_us]\n"
+                        "  -i 0 sends back to back to measure throughput\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  Context *msgq_ctx = new MSGQContext();
+  Context *zmq_ctx = new ZMQContext();
+
+  for (auto &transport : transports) {
+    assert(transport == "msgq" || transport == "zmq" || transport == "bridge");
+    for (auto size : sizes) {
+      for (auto num_readers : readers) {
+        for (bool conflate : conflates) {
+          run({transport, size, num_readers, conflate, count, interval_us}, msgq_ctx, zmq_ctx);
+        }
+      }
+    }
+  }
+
+  delete zmq_ctx;
+  delete msgq_ctx;
+  unlink(("/dev/shm/" + endpoint_name()).c_str());
+  return 0;
+}
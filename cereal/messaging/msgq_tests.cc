@@ -0,0 +1,313 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "msgq.h"
+
+TEST_CASE("msgq_init_subscriber reuses the slots of dead readers"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher;
+  msgq_new_queue(&publisher, "test_queue", 1024);
+  msgq_init_publisher(&publisher);
+
+  // Fill all slots with readers whose threads exit right away
+  for (int i = 0; i < NUM_READERS; i++){
+    std::thread([]{
+      msgq_queue_t q;
+      msgq_new_queue(&q, "test_queue", 1024);
+      msgq_init_subscriber(&q);
+      msgq_close_queue(&q);
+    }).join();
+  }
+  REQUIRE(*publisher.num_readers == NUM_READERS);
+
+  msgq_queue_t q1, q2;
+  msgq_new_queue(&q1, "test_queue", 1024);
+  msgq_new_queue(&q2, "test_queue", 1024);
+  msgq_init_subscriber(&q1);
+  msgq_init_subscriber(&q2);
+
+  REQUIRE(q1.reader_id != q2.reader_id);
+  REQUIRE(*q1.read_uids[q1.reader_id] == q1.read_uid_local);
+  REQUIRE(*q2.read_uids[q2.reader_id] == q2.read_uid_local);
+
+  msgq_close_queue(&q1);
+  msgq_close_queue(&q2);
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("msgq_init_subscriber fails when all readers are alive"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher;
+  msgq_new_queue(&publisher, "test_queue", 1024);
+  msgq_init_publisher(&publisher);
+
+  std::vector<msgq_queue_t> readers(NUM_READERS);
+  for (auto &q : readers){
+    msgq_new_queue(&q, "test_queue", 1024);
+    REQUIRE(msgq_init_subscriber(&q) == 0);
+  }
+
+  msgq_queue_t q;
+  msgq_new_queue(&q, "test_queue", 1024);
+  REQUIRE(msgq_init_subscriber(&q) == -1);
+
+  // all the existing readers keep their slots
+  for (auto &r : readers){
+    REQUIRE(*r.read_uids[r.reader_id] == r.read_uid_local);
+    msgq_close_queue(&r);
+  }
+  msgq_close_queue(&q);
+  msgq_close_queue(&publisher);
+}
+
+static size_t count(const std::string &s, const std::string &sub){
+  size_t n = 0;
+  for (size_t pos = s.find(sub); pos != std::string::npos; pos = s.find(sub, pos + 1)) n++;
+  return n;
+}
+
+TEST_CASE("an evicted reader logs once while it waits for a slot"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher;
+  msgq_new_queue(&publisher, "test_queue", 1024);
+  msgq_init_publisher(&publisher);
+
+  std::vector<msgq_queue_t> readers(NUM_READERS);
+  for (auto &r : readers){
+    msgq_new_queue(&r, "test_queue", 1024);
+    REQUIRE(msgq_init_subscriber(&r) == 0);
+  }
+
+  std::stringstream out;
+  std::streambuf *cout_buf = std::cout.rdbuf(out.rdbuf());
+
+  // another live reader takes over the slot, there are no free ones left
+  msgq_queue_t &q = readers[0];
+  *q.read_uids[q.reader_id] = readers[1].read_uid_local;
+  for (int i = 0; i < 10; i++){
+    REQUIRE(msgq_msg_ready(&q) == 0);
+  }
+  REQUIRE(q.evicted);
+
+  // reconnects once a slot is free
+  *q.read_uids[5] = 0;
+  REQUIRE(msgq_msg_ready(&q) == 0);
+  REQUIRE(q.reader_id == 5);
+  REQUIRE(!q.evicted);
+
+  // and logs the next eviction again
+  *q.read_uids[q.reader_id] = readers[1].read_uid_local;
+  REQUIRE(msgq_msg_ready(&q) == 0);
+
+  std::cout.rdbuf(cout_buf);
+  REQUIRE(count(out.str(), "Reader was evicted") == 2);
+  REQUIRE(count(out.str(), "has no free reader slots") == 2);
+
+  for (auto &r : readers){
+    msgq_close_queue(&r);
+  }
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("64 concurrent readers"){
+  const int num_readers = 64;
+  const int num_msgs = 1000;
+
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher;
+  msgq_new_queue(&publisher, "test_queue", DEFAULT_SEGMENT_SIZE);
+  msgq_init_publisher(&publisher);
+
+  std::atomic<int> ready(0);
+  // Catch assertions are not thread safe, collect results per reader
+  std::vector<int> received(num_readers, 0);
+  std::vector<int> in_order(num_readers, true);
+  std::vector<int> evicted(num_readers, false);
+  std::vector<std::thread> readers;
+
+  for (int i = 0; i < num_readers; i++){
+    readers.emplace_back([&, i]{
+      msgq_queue_t q;
+      msgq_new_queue(&q, "test_queue", DEFAULT_SEGMENT_SIZE);
+      msgq_init_subscriber(&q);
+      ready++;
+
+      uint64_t uid = q.read_uid_local;
+      int last = -1;
+      while (last != num_msgs - 1){
+        msgq_pollitem_t item = {&q, 0};
+        msgq_poll(&item, 1, 1000);
+
+        msgq_msg_t msg;
+        while (msgq_msg_recv(&msg, &q) > 0){
+          int seq = *(int *)msg.data;
+          in_order[i] &= (seq == last + 1);
+          last = seq;
+          received[i]++;
+          msgq_msg_close(&msg);
+        }
+      }
+      evicted[i] = uid != q.read_uid_local;
+      msgq_close_queue(&q);
+    });
+  }
+
+  while (ready < num_readers){
+    std::this_thread::yield();
+  }
+  REQUIRE(*publisher.num_readers == num_readers);
+
+  for (int i = 0; i < num_msgs; i++){
+    char data[64] = {};
+    *(int *)data = i;
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, data, sizeof(data));
+    msgq_msg_send(&msg, &publisher);
+    msgq_msg_close(&msg);
+  }
+
+  for (auto &t : readers){
+    t.join();
+  }
+
+  for (int i = 0; i < num_readers; i++){
+    REQUIRE(received[i] == num_msgs);
+    REQUIRE(in_order[i]);
+    REQUIRE(!evicted[i]);
+  }
+
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("msgq_msg_send_batch and msgq_msg_recv_batch across wraparound"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher, subscriber;
+  msgq_new_queue(&publisher, "test_queue", 4096);
+  msgq_init_publisher(&publisher);
+  msgq_new_queue(&subscriber, "test_queue", 4096);
+  msgq_init_subscriber(&subscriber);
+
+  int expected = 0;
+  for (int batch = 0; batch < 50; batch++){
+    char data[10][40] = {};
+    msgq_msg_t msgs[10];
+    for (int i = 0; i < 10; i++){
+      *(int *)data[i] = batch * 10 + i;
+      msgs[i].data = data[i];
+      msgs[i].size = sizeof(data[i]);
+    }
+    REQUIRE(msgq_msg_send_batch(msgs, 10, &publisher) == 10);
+
+    msgq_msg_t recv_msgs[16];
+    int n = msgq_msg_recv_batch(recv_msgs, 16, &subscriber);
+    REQUIRE(n == 10);
+    for (int i = 0; i < n; i++){
+      REQUIRE(*(int *)recv_msgs[i].data == expected++);
+      msgq_msg_close(&recv_msgs[i]);
+    }
+  }
+
+  msgq_close_queue(&subscriber);
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("msgq_msg_reserve and msgq_msg_commit across wraparound"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher, subscriber;
+  msgq_new_queue(&publisher, "test_queue", 4096);
+  msgq_init_publisher(&publisher);
+  msgq_new_queue(&subscriber, "test_queue", 4096);
+  msgq_init_subscriber(&subscriber);
+
+  for (int i = 0; i < 500; i++){
+    // commit less than was reserved, like a message whose size is only bounded up front
+    const size_t size = 8 + i % 100;
+    char *p = msgq_msg_reserve(&publisher, 200);
+    REQUIRE(p != NULL);
+    REQUIRE((uintptr_t)p % 8 == 0);
+    memset(p, i & 0xff, size);
+    REQUIRE(msgq_msg_commit(&publisher, size) == (int)size);
+
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &subscriber) == (int)size);
+    for (size_t j = 0; j < size; j++){
+      REQUIRE((uint8_t)msg.data[j] == (i & 0xff));
+    }
+    msgq_msg_close(&msg);
+  }
+
+  msgq_close_queue(&subscriber);
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("msgq_msg_release fails after the writer wraps over a borrow"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher, subscriber;
+  msgq_new_queue(&publisher, "test_queue", 4096);
+  msgq_init_publisher(&publisher);
+  msgq_new_queue(&subscriber, "test_queue", 4096);
+  msgq_init_subscriber(&subscriber);
+
+  char payload[256];
+  memset(payload, 'a', sizeof(payload));
+  msgq_msg_t out;
+  msgq_msg_init_data(&out, payload, sizeof(payload));
+
+  // released before the writer gets there
+  msgq_msg_send(&out, &publisher);
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv_borrow(&msg, &subscriber) == (int)sizeof(payload));
+  REQUIRE(msgq_msg_release(&msg, &subscriber) == 0);
+
+  // held while a full queue worth of messages goes by
+  msgq_msg_send(&out, &publisher);
+  REQUIRE(msgq_msg_recv_borrow(&msg, &subscriber) == (int)sizeof(payload));
+  for (int i = 0; i < 32; i++){
+    msgq_msg_send(&out, &publisher);
+  }
+  REQUIRE(msgq_msg_release(&msg, &subscriber) == -1);
+
+  // the reader starts over from the write pointer and borrows again
+  REQUIRE(msgq_msg_recv_borrow(&msg, &subscriber) == 0);
+  msgq_msg_send(&out, &publisher);
+  REQUIRE(msgq_msg_recv_borrow(&msg, &subscriber) == (int)sizeof(payload));
+  REQUIRE(memcmp(msg.data, payload, sizeof(payload)) == 0);
+  REQUIRE(msgq_msg_release(&msg, &subscriber) == 0);
+
+  msgq_msg_close(&out);
+  msgq_close_queue(&subscriber);
+  msgq_close_queue(&publisher);
+}
+
+TEST_CASE("msgq_poll without timeout returns when interrupted by a signal"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t publisher, subscriber;
+  msgq_new_queue(&publisher, "test_queue", 4096);
+  msgq_init_publisher(&publisher);
+  msgq_new_queue(&subscriber, "test_queue", 4096);
+  msgq_init_subscriber(&subscriber);
+
+  struct sigaction sa = {}, prev;
+  sa.sa_handler = [](int){};
+  sigaction(SIGUSR1, &sa, &prev);
+
+  std::atomic<int> ret = -1;
+  std::thread poller([&](){
+    msgq_pollitem_t items[1] = {{&subscriber, 0}};
+    ret = msgq_poll(items, 1, -1);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  pthread_kill(poller.native_handle(), SIGUSR1);
+  poller.join();
+  REQUIRE(ret == 0);
+
+  sigaction(SIGUSR1, &prev, NULL);
+  msgq_close_queue(&subscriber);
+  msgq_close_queue(&publisher);
+}
@@ -3,10 +3,13 @@
 #include <stdlib.h>
 #include <string>
 #include <mutex>
+#include <stdexcept>
 
 #include "services.h"
 #include "messaging.h"
 
+#define DRAIN_BATCH_SIZE 64
+
 const bool SIMULATION = (getenv("SIMULATION") != nullptr) && (std::string(getenv("SIMULATION")) == "1");
 
 static inline uint64_t nanos_since_boot() {
@@ -15,11 +18,11 @@ static inline uint64_t nanos_since_boot() {
   return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
-static const service *get_service(const char *name) {
-  for (const auto &it : services) {
-    if (strcmp(it.name, name) == 0) return &it;
+static int get_service_id(const char *name) {
+  for (int i = 0; i < NUM_SERVICES; i++) {
+    if (strcmp(services[i].name, name) == 0) return i;
   }
-  return nullptr;
+  return -1;
 }
 
 static inline bool inList(const std::vector<const char *> &list, const char *value) {
@@ -59,9 +62,11 @@ struct SubMaster::SubMessage {
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *address,
                      const std::vector<const char *> &ignore_alive) {
   poller_ = Poller::create();
+  services_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
-    const service *serv = get_service(name);
-    assert(serv != nullptr);
+    int id = get_service_id(name);
+    assert(id >= 0);
+    const service *serv = &services[id];
     SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", true);
     assert(socket != 0);
     poller_->registerSocket(socket);
@@ -73,7 +78,7 @@ SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *
       .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
     m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
     messages_[socket] = m;
-    services_[name] = m;
+    services_[id] = m;
   }
 }
 
@@ -83,34 +88,58 @@ void SubMaster::update(int timeout) {
   auto sockets = poller_->poll(timeout);
   uint64_t current_time = nanos_since_boot();
 
-  std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
+  std::vector<std::pair<SubMessage *, cereal::Event::Reader>> messages;
 
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
+    Message *msg = s->receive_borrowed(true);
     if (msg == nullptr) continue;
 
     SubMessage *m = messages_.at(s);
 
     m->msg_reader->~FlatArrayMessageReader();
+
+    // The reader is used until the next message arrives and the writer may wrap over the
+    // shared segment before that, so copy once out of the borrow and give it back right away.
+    // Parsing in place can't be made safe with release(): it only tells afterwards that the
+    // data was overwritten, while callers read the event lazily until the next update
+    auto words = m->aligned_buf.align(msg);
+    bool intact = msg->release();
+    delete msg;
+    if (!intact) {
+      // overwritten while copying, drop what was there until the next message
+      m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
+      m->event = cereal::Event::Reader();
+      m->valid = false;
+      continue;
+    }
+
     capnp::ReaderOptions options;
     options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
-    messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words, options);
+    messages.push_back({m, m->msg_reader->getRoot<cereal::Event>()});
   }
 
   update_msgs(current_time, messages);
 }
 
+// Looks the services up by name, for callers that bring their own events like tests and replay
 void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages){
+  std::vector<std::pair<SubMessage *, cereal::Event::Reader>> found;
+  found.reserve(messages.size());
+  for (auto &kv : messages) {
+    int id = get_service_id(kv.first.c_str());
+    if (id >= 0 && services_[id] != nullptr) {
+      found.push_back({services_[id], kv.second});
+    }
+  }
+  update_msgs(current_time, found);
+}
+
+void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<SubMessage *, cereal::Event::Reader>> &messages){
   if (++frame == UINT64_MAX) frame = 1;
 
   for(auto &kv : messages) {
-    auto m_find = services_.find(kv.first);
-    if (m_find == services_.end()){
-      continue;
-    }
-    SubMessage *m = m_find->second;
+    SubMessage *m = kv.first;
     m->event = kv.second;
     m->updated = true;
     m->rcv_time = current_time;
@@ -145,34 +174,79 @@ void SubMaster::drain() {
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      for (auto msg : sock->receive_batch(DRAIN_BATCH_SIZE)) {
+        delete msg;
+      }
     }
   }
 }
 
+std::vector<Message *> SubMaster::drain(const char *name, size_t max_messages) {
+  return find(name)->socket->receive_batch(max_messages);
+}
+
+// The name based lookups only scan the subscribed services, use ServiceId on hot paths
+SubMaster::SubMessage *SubMaster::find(const char *name) const {
+  for (auto &kv : messages_) {
+    if (strcmp(kv.second->name.c_str(), name) == 0) return kv.second;
+  }
+  throw std::out_of_range(std::string("SubMaster: not subscribed to ") + name);
+}
+
+SubMaster::SubMessage *SubMaster::find(ServiceId id) const {
+  SubMessage *m = services_[(int)id];
+  if (m == nullptr) {
+    throw std::out_of_range(std::string("SubMaster: not subscribed to ") + services[(int)id].name);
+  }
+  return m;
+}
+
 bool SubMaster::updated(const char *name) const {
-  return services_.at(name)->updated;
+  return find(name)->updated;
 }
 
 bool SubMaster::alive(const char *name) const {
-  return services_.at(name)->alive;
+  return find(name)->alive;
 }
 
 bool SubMaster::valid(const char *name) const {
-  return services_.at(name)->valid;
+  return find(name)->valid;
 }
 
 uint64_t SubMaster::rcv_frame(const char *name) const {
-  return services_.at(name)->rcv_frame;
+  return find(name)->rcv_frame;
 }
 
 uint64_t SubMaster::rcv_time(const char *name) const {
-  return services_.at(name)->rcv_time;
+  return find(name)->rcv_time;
 }
 
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
-  return services_.at(name)->event;
+  return find(name)->event;
+};
+
+bool SubMaster::updated(ServiceId id) const {
+  return find(id)->updated;
+}
+
+bool SubMaster::alive(ServiceId id) const {
+  return find(id)->alive;
+}
+
+bool SubMaster::valid(ServiceId id) const {
+  return find(id)->valid;
+}
+
+uint64_t SubMaster::rcv_frame(ServiceId id) const {
+  return find(id)->rcv_frame;
+}
+
+uint64_t SubMaster::rcv_time(ServiceId id) const {
+  return find(id)->rcv_time;
+}
+
+cereal::Event::Reader &SubMaster::operator[](ServiceId id) const {
+  return find(id)->event;
 };
 
 SubMaster::~SubMaster() {
@@ -187,12 +261,34 @@ SubMaster::~SubMaster() {
 }
 
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
+  sockets_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
-    assert(get_service(name) != nullptr);
+    int id = get_service_id(name);
+    assert(id >= 0);
     PubSocket *socket = PubSocket::create(message_context.context(), name);
     assert(socket);
-    sockets_[name] = socket;
+    sockets_[id] = socket;
+  }
+}
+
+PubSocket *PubMaster::find(const char *name) const {
+  int id = get_service_id(name);
+  if (id < 0 || sockets_[id] == nullptr) {
+    throw std::out_of_range(std::string("PubMaster: not publishing ") + name);
   }
+  return sockets_[id];
+}
+
+PubSocket *PubMaster::find(ServiceId id) const {
+  PubSocket *socket = sockets_[(int)id];
+  if (socket == nullptr) {
+    throw std::out_of_range(std::string("PubMaster: not publishing ") + services[(int)id].name);
+  }
+  return socket;
+}
+
+int PubMaster::send(const char *name, capnp::byte *data, size_t size) {
+  return find(name)->send((char *)data, size);
 }
 
 int PubMaster::send(const char *name, MessageBuilder &msg) {
@@ -200,6 +296,42 @@ int PubMaster::send(const char *name, MessageBuilder &msg) {
   return send(name, bytes.begin(), bytes.size());
 }
 
+int PubMaster::send(ServiceId id, capnp::byte *data, size_t size) {
+  return find(id)->send((char *)data, size);
+}
+
+int PubMaster::send(ServiceId id, MessageBuilder &msg) {
+  auto bytes = msg.toBytes();
+  return send(id, bytes.begin(), bytes.size());
+}
+
+int PubMaster::send_batch(const char *name, const std::vector<MessageBuilder *> &msgs) {
+  std::vector<char *> data;
+  std::vector<size_t> sizes;
+  for (auto msg : msgs) {
+    auto bytes = msg->toBytes();
+    data.push_back((char *)bytes.begin());
+    sizes.push_back(bytes.size());
+  }
+  return find(name)->send_batch(data.data(), sizes.data(), msgs.size());
+}
+
+char *PubMaster::reserve(const char *name, size_t size) {
+  return find(name)->reserve(size);
+}
+
+int PubMaster::commit(const char *name, size_t size) {
+  return find(name)->commit(size);
+}
+
+char *PubMaster::reserve(ServiceId id, size_t size) {
+  return find(id)->reserve(size);
+}
+
+int PubMaster::commit(ServiceId id, size_t size) {
+  return find(id)->commit(size);
+}
+
 PubMaster::~PubMaster() {
-  for (auto s : sockets_) delete s.second;
+  for (auto s : sockets_) delete s;
 }
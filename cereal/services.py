@@ -65,6 +65,9 @@ services = {
 
   # debug
   "testJoystick": (False, 0.),
+
+  # appended so that the ports of the services above stay the same
+  "loggerdState": (True, 1., 1),
 }
 service_list = {name: Service(new_port(idx), *vals) for  # type: ignore
                 idx, (name, vals) in enumerate(services.items())}
@@ -83,6 +86,13 @@ def build_header():
     h += '  { "%s", %d, %s, %d, %d },\n' % \
          (k, v.port, should_log, v.frequency, decimation)
   h += "};\n"
+  h += "\n"
+  h += "// indices into services[], for O(1) lookups in SubMaster and PubMaster\n"
+  h += "enum class ServiceId : int {\n"
+  for k in service_list.keys():
+    h += "  %s,\n" % k
+  h += "};\n"
+  h += "static const int NUM_SERVICES = %d;\n" % len(service_list)
   h += "#endif\n"
   return h
 
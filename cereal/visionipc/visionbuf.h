@@ -43,7 +43,8 @@ class VisionBuf {
   size_t idx = 0;
   VisionStreamType type;
 
-  // OpenCL
+  // OpenCL, only set up if a CL context is passed to the server/client. Without one the
+  // buffer is plain shared memory and sync() does nothing
   cl_mem buf_cl = nullptr;
   cl_command_queue copy_q = nullptr;
 
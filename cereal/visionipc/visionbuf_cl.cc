@@ -9,22 +9,51 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
+#define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+#ifdef __linux__
+
+static void *map_memfd(int fd, size_t len) {
+  if (ftruncate(fd, len) != 0) return MAP_FAILED;
+  return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+// Anonymous memfd, shared with clients over the visionipc socket. Explicit hugepages are used if
+// any are reserved (vm.nr_hugepages), otherwise the size is still hugepage aligned so
+// transparent hugepages can back it when shmem THP is enabled.
+static void *malloc_with_fd(size_t len, size_t *mmap_len, int *fd) {
+  *mmap_len = ALIGN(len, HUGEPAGE_SIZE);
+
+  *fd = memfd_create("visionbuf", MFD_CLOEXEC | MFD_HUGETLB);
+  if (*fd >= 0) {
+    void *addr = map_memfd(*fd, *mmap_len);
+    if (addr != MAP_FAILED) return addr;
+    close(*fd);
+  }
+
+  *fd = memfd_create("visionbuf", MFD_CLOEXEC);
+  assert(*fd >= 0);
+  void *addr = map_memfd(*fd, *mmap_len);
+  assert(addr != MAP_FAILED);
+  madvise(addr, *mmap_len, MADV_HUGEPAGE);
+  return addr;
+}
+
+#else
+
 std::atomic<int> offset = 0;
 
-static void *malloc_with_fd(size_t len, int *fd) {
+static void *malloc_with_fd(size_t len, size_t *mmap_len, int *fd) {
   char full_path[0x100];
-
-#ifdef __APPLE__
   snprintf(full_path, sizeof(full_path)-1, "/tmp/visionbuf_%d_%d", getpid(), offset++);
-#else
-  snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionbuf_%d_%d", getpid(), offset++);
-#endif
 
   *fd = open(full_path, O_RDWR | O_CREAT, 0777);
   assert(*fd >= 0);
 
   unlink(full_path);
 
+  *mmap_len = len;
   ftruncate(*fd, len);
   void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
   assert(addr != MAP_FAILED);
@@ -32,12 +61,15 @@ static void *malloc_with_fd(size_t len, int *fd) {
   return addr;
 }
 
+#endif
+
 void VisionBuf::allocate(size_t len) {
   int fd;
-  void *addr = malloc_with_fd(len, &fd);
+  size_t mmap_len;
+  void *addr = malloc_with_fd(len, &mmap_len, &fd);
 
   this->len = len;
-  this->mmap_len = len;
+  this->mmap_len = mmap_len;
   this->addr = addr;
   this->fd = fd;
 }
@@ -64,12 +96,13 @@ int VisionBuf::sync(int dir) {
   int err = 0;
   if (!this->buf_cl) return 0;
 
-  if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
-    err = clEnqueueReadBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
-  } else {
-    err = clEnqueueWriteBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
-  }
+  // buf_cl wraps addr (CL_MEM_USE_HOST_PTR), mapping it makes both sides coherent
+  // without a copy when the device works on host memory
+  cl_map_flags flags = (dir == VISIONBUF_SYNC_FROM_DEVICE) ? CL_MAP_READ : CL_MAP_WRITE_INVALIDATE_REGION;
+  void *ptr = clEnqueueMapBuffer(this->copy_q, this->buf_cl, CL_TRUE, flags, 0, this->len, 0, NULL, NULL, &err);
+  if (err != 0) return err;
 
+  err = clEnqueueUnmapMemObject(this->copy_q, this->buf_cl, ptr, 0, NULL, NULL);
   if (err == 0){
     err = clFinish(this->copy_q);
   }
@@ -87,7 +120,7 @@ int VisionBuf::free() {
     if (err != 0) return err;
   }
 
-  err = munmap(this->addr, this->len);
+  err = munmap(this->addr, this->mmap_len);
   if (err != 0) return err;
 
   err = close(this->fd);
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 
 constexpr int VISIONIPC_MAX_FDS = 128;
+constexpr int VISIONIPC_MAX_CLIENTS = 64;
 
 struct VisionIpcBufExtra {
   uint32_t frame_id;
@@ -14,5 +16,21 @@ struct VisionIpcBufExtra {
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint64_t gen;    // of the buffer when it was sent
+  uint64_t count;  // frames sent on this stream before this one
   struct VisionIpcBufExtra extra;
 };
+
+// Per buffer state in memory shared by the server and all clients of a stream.
+// gen is bumped every time the server hands the buffer out for writing, and clients set their
+// slot bit in readers while they use the buffer. A client sets its bit before checking gen, and the
+// server bumps gen before checking readers, so one of them always sees the other.
+struct VisionIpcBufState {
+  std::atomic<uint64_t> gen;
+  std::atomic<uint64_t> readers;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "VisionIpcBufState is shared between processes");
+
+struct VisionIpcStreamState {
+  VisionIpcBufState bufs[VISIONIPC_MAX_FDS];
+};
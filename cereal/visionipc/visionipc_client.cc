@@ -1,5 +1,6 @@
 #include <chrono>
 #include <cassert>
+#include <cstddef>
 #include <iostream>
 #include <thread>
 
@@ -16,23 +17,44 @@ VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool c
   poller->registerSocket(sock);
 }
 
-// Connect is not thread safe. Do not use the buffers while calling connect
-bool VisionIpcClient::connect(bool blocking){
+void VisionIpcClient::disconnect(){
+  release();
   connected = false;
+  for (size_t i = 0; i < num_buffers; i++) {
+    assert(hold_count[i] == 0);
+  }
 
-  // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
     if (buffers[i].free() != 0) {
       LOGE("Failed to free buffer %zu", i);
     }
   }
-
   num_buffers = 0;
 
+  if (state) {
+    if (state_buf.free() != 0) {
+      LOGE("Failed to free state buffer");
+    }
+    state = nullptr;
+  }
+
+  // the server frees our slot once it sees the socket close
+  if (socket_fd >= 0) {
+    close(socket_fd);
+    socket_fd = -1;
+  }
+  slot = -1;
+  last_count = -1;
+}
+
+// Connect is not thread safe. Do not use the buffers while calling connect
+bool VisionIpcClient::connect(bool blocking){
+  // Cleanup old buffers on reconnect
+  disconnect();
+
   // Connect to server socket and ask for all FDs of type
   std::string path = "/tmp/visionipc_" + name;
 
-  int socket_fd = -1;
   while (socket_fd < 0) {
     socket_fd = ipc_connect(path.c_str());
 
@@ -50,17 +72,20 @@ bool VisionIpcClient::connect(bool blocking){
   int r = ipc_sendrecv_with_fds(true, socket_fd, &type, sizeof(type), nullptr, 0, nullptr);
   assert(r == sizeof(type));
 
-  // Get FDs
+  // Get FDs, the last one is the shared state of the stream
   int fds[VISIONIPC_MAX_FDS];
-  VisionBuf bufs[VISIONIPC_MAX_FDS];
-  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_buffers);
+  int num_fds = 0;
+  VisionIpcConnectReply reply;
+  r = ipc_sendrecv_with_fds(false, socket_fd, &reply, sizeof(reply), fds, VISIONIPC_MAX_FDS, &num_fds);
 
-  assert(num_buffers > 0);
-  assert(r == sizeof(VisionBuf) * num_buffers);
+  assert(num_fds > 1);
+  assert(r == offsetof(VisionIpcConnectReply, bufs) + sizeof(VisionBuf) * num_fds);
+  num_buffers = num_fds - 1;
+  slot = reply.slot;
 
   // Import buffers
   for (size_t i = 0; i < num_buffers; i++){
-    buffers[i] = bufs[i];
+    buffers[i] = reply.bufs[i];
     buffers[i].fd = fds[i];
     buffers[i].import();
     if (buffers[i].rgb) {
@@ -72,11 +97,64 @@ bool VisionIpcClient::connect(bool blocking){
     if (device_id) buffers[i].init_cl(device_id, ctx);
   }
 
+  state_buf = reply.bufs[num_buffers];
+  state_buf.fd = fds[num_buffers];
+  state_buf.import();
+  state = (VisionIpcStreamState *)state_buf.addr;
+
+  if (slot < 0) {
+    close(socket_fd);
+    socket_fd = -1;
+  }
+
   connected = true;
   return true;
 }
 
+void VisionIpcClient::add_hold(size_t idx){
+  std::scoped_lock lk(hold_lock);
+  if (hold_count[idx]++ == 0) {
+    state->bufs[idx].readers |= 1ULL << slot;
+  }
+}
+
+void VisionIpcClient::drop_hold(size_t idx){
+  std::scoped_lock lk(hold_lock);
+  assert(hold_count[idx] > 0);
+  if (--hold_count[idx] == 0) {
+    state->bufs[idx].readers &= ~(1ULL << slot);
+  }
+}
+
+void VisionIpcClient::release(){
+  if (held == nullptr) return;
+
+  if (state->bufs[held->idx].gen != held_gen) {
+    frames_overwritten++;
+  }
+  drop_hold(held->idx);
+  held = nullptr;
+}
+
+VisionIpcBufHold VisionIpcClient::hold(){
+  if (held == nullptr) return {};
+
+  add_hold(held->idx);
+  return {.buf = held, .gen = held_gen};
+}
+
+bool VisionIpcClient::release(const VisionIpcBufHold &hold){
+  if (hold.buf == nullptr) return true;
+
+  // checked before dropping the hold, after that the server may reuse the buffer
+  const bool intact = state->bufs[hold.buf->idx].gen == hold.gen;
+  drop_hold(hold.buf->idx);
+  return intact;
+}
+
 VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
+  release();
+
   auto p = poller->poll(timeout_ms);
 
   if (!p.size()){
@@ -101,6 +179,24 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
     return nullptr;
   }
 
+  if (last_count >= 0 && (int64_t)packet->count > last_count + 1) {
+    frames_skipped += packet->count - last_count - 1;
+  }
+  last_count = packet->count;
+
+  // mark the buffer in use, then make sure the server didn't hand it out for writing since it was sent
+  if (slot >= 0) {
+    add_hold(packet->idx);
+    if (state->bufs[packet->idx].gen != packet->gen) {
+      drop_hold(packet->idx);
+      frames_skipped++;
+      delete r;
+      return nullptr;
+    }
+    held = buf;
+    held_gen = packet->gen;
+  }
+
   if (extra) {
     *extra = packet->extra;
   }
@@ -116,11 +212,7 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
 
 
 VisionIpcClient::~VisionIpcClient(){
-  for (size_t i = 0; i < num_buffers; i++){
-    if (buffers[i].free() != 0) {
-      LOGE("Failed to free buffer %zu", i);
-    }
-  }
+  disconnect();
 
   delete sock;
   delete poller;
@@ -1,4 +1,5 @@
 #pragma once
+#include <mutex>
 #include <vector>
 #include <string>
 #include <unistd.h>
@@ -7,6 +8,12 @@
 #include "visionipc/visionipc.h"
 #include "visionipc/visionbuf.h"
 
+// a buffer kept in use past the next recv(), from hold() until release(hold)
+struct VisionIpcBufHold {
+  VisionBuf *buf = nullptr;
+  uint64_t gen = 0;
+};
+
 class VisionIpcClient {
 private:
   std::string name;
@@ -19,14 +26,46 @@ private:
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
 
+  // reader slot on the server, the socket stays open while the slot is held
+  int socket_fd = -1;
+  int slot = -1;
+  VisionBuf state_buf;
+  VisionIpcStreamState *state = nullptr;
+
+  VisionBuf *held = nullptr;
+  uint64_t held_gen = 0;
+  int64_t last_count = -1;
+
+  // holds of this client per buffer, its reader bit is set while there are any
+  std::mutex hold_lock;
+  int hold_count[VISIONIPC_MAX_FDS] = {};
+
   void init_msgq(bool conflate);
+  void disconnect();
+  void add_hold(size_t idx);
+  void drop_hold(size_t idx);
 
 public:
   bool connected = false;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+
+  // frames sent by the server that this client never got, because they were conflated,
+  // or because the buffer was already reused by the time the client got to it
+  uint64_t frames_skipped = 0;
+  // frames the server overwrote while this client was still reading them
+  uint64_t frames_overwritten = 0;
+
+  // conflate is the latest-only mode for slow clients, recv always returns the newest frame
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
+  // the returned buffer is marked in use until release() or the next recv()
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  void release();
+  // keeps the buffer of the last recv() in use until release(hold), e.g. to read it on another
+  // thread. release(hold) may be called from any thread, but not after connect() or destruction
+  VisionIpcBufHold hold();
+  // false if the server had to overwrite the buffer while it was held
+  bool release(const VisionIpcBufHold &hold);
   bool connect(bool blocking=true);
 };
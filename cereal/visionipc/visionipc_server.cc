@@ -1,6 +1,7 @@
 #include <iostream>
 #include <chrono>
 #include <cassert>
+#include <cstddef>
 #include <random>
 
 #include <poll.h>
@@ -31,7 +32,8 @@ VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_co
 
 void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height){
   // TODO: assert that this type is not created yet
-  assert(num_buffers < VISIONIPC_MAX_FDS);
+  // every buffer and the shared buffer states are sent as one fd each on connect
+  assert(num_buffers + 1 <= VISIONIPC_MAX_FDS);
   int aligned_w = 0, aligned_h = 0;
 
   size_t size = 0;
@@ -61,6 +63,13 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
   }
 
   cur_idx[type] = 0;
+  send_count[type] = 0;
+  overwritten[type] = 0;
+
+  // reader refcounts and generations, zeroed by allocate
+  VisionBuf* state = new VisionBuf();
+  state->allocate(sizeof(VisionIpcStreamState));
+  states[type] = state;
 
   // Create msgq publisher for each of the `name` + type combos
   // TODO: compute port number directly if using zmq
@@ -81,12 +90,16 @@ void VisionIpcServer::listener(){
   assert(sock >= 0);
 
   while (!should_exit){
-    // Wait for incoming connection
-    struct pollfd polls[1] = {{0}};
+    // Wait for incoming connections, or clients going away
+    std::vector<struct pollfd> polls(clients.size() + 1);
     polls[0].fd = sock;
     polls[0].events = POLLIN;
+    for (size_t i = 0; i < clients.size(); i++) {
+      polls[i + 1].fd = clients[i].fd;
+      polls[i + 1].events = POLLIN;
+    }
 
-    int ret = poll(polls, 1, 100);
+    int ret = poll(polls.data(), polls.size(), 100);
     if (ret < 0) {
       if (errno == EINTR || errno == EAGAIN) continue;
       std::cout << "poll failed, stopping listener" << std::endl;
@@ -94,55 +107,110 @@ void VisionIpcServer::listener(){
     }
 
     if (should_exit) break;
-    if (!polls[0].revents) {
-      continue;
+
+    // clients never send anything after connecting, so any event is a hangup
+    for (size_t i = clients.size(); i > 0; i--) {
+      if (polls[i].revents) {
+        remove_client(clients[i - 1]);
+        clients.erase(clients.begin() + (i - 1));
+      }
     }
 
-    // Handle incoming request
-    int fd = accept(sock, NULL, NULL);
-    assert(fd >= 0);
-
-    VisionStreamType type = VisionStreamType::VISION_STREAM_MAX;
-    int r = ipc_sendrecv_with_fds(false, fd, &type, sizeof(type), nullptr, 0, nullptr);
-    assert(r == sizeof(type));
-    if (buffers.count(type) <= 0) {
-      std::cout << "got request for invalid buffer type: " << type << std::endl;
-      close(fd);
-      continue;
+    if (polls[0].revents) {
+      // Handle incoming request
+      int fd = accept(sock, NULL, NULL);
+      assert(fd >= 0);
+      accept_client(fd);
     }
+  }
 
-    int fds[VISIONIPC_MAX_FDS];
-    int num_fds = buffers[type].size();
-    VisionBuf bufs[VISIONIPC_MAX_FDS];
+  for (auto &client : clients) {
+    remove_client(client);
+  }
+  clients.clear();
 
-    for (int i = 0; i < num_fds; i++){
-      fds[i] = buffers[type][i]->fd;
-      bufs[i] = *buffers[type][i];
+  std::cout << "Stopping listener for: " << name << std::endl;
+  close(sock);
+}
 
-      // Remove some private openCL/ion metadata
-      bufs[i].buf_cl = 0;
-      bufs[i].copy_q = 0;
-      bufs[i].handle = 0;
+void VisionIpcServer::accept_client(int fd){
+  VisionStreamType type = VisionStreamType::VISION_STREAM_MAX;
+  int r = ipc_sendrecv_with_fds(false, fd, &type, sizeof(type), nullptr, 0, nullptr);
+  assert(r == sizeof(type));
+  if (buffers.count(type) <= 0) {
+    std::cout << "got request for invalid buffer type: " << type << std::endl;
+    close(fd);
+    return;
+  }
 
-      bufs[i].server_id = server_id;
+  int slot = -1;
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++) {
+    if (!(used_slots[type] & (1ULL << i))) {
+      slot = i;
+      used_slots[type] |= 1ULL << i;
+      break;
     }
+  }
 
-    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds, nullptr);
+  int fds[VISIONIPC_MAX_FDS];
+  int num_fds = buffers[type].size() + 1;
+  assert(num_fds <= VISIONIPC_MAX_FDS);
+  VisionIpcConnectReply reply = {};
+  reply.slot = slot;
 
-    close(fd);
+  for (int i = 0; i < num_fds; i++){
+    VisionBuf *buf = i < num_fds - 1 ? buffers[type][i] : states[type];
+    fds[i] = buf->fd;
+    reply.bufs[i] = *buf;
+
+    // Remove some private openCL/ion metadata
+    reply.bufs[i].buf_cl = 0;
+    reply.bufs[i].copy_q = 0;
+    reply.bufs[i].handle = 0;
+
+    reply.bufs[i].server_id = server_id;
   }
 
-  std::cout << "Stopping listener for: " << name << std::endl;
-  close(sock);
-}
+  size_t reply_size = offsetof(VisionIpcConnectReply, bufs) + sizeof(VisionBuf) * num_fds;
+  r = ipc_sendrecv_with_fds(true, fd, &reply, reply_size, fds, num_fds, nullptr);
 
+  if (slot < 0) {
+    close(fd);
+  } else {
+    clients.push_back({.fd = fd, .type = type, .slot = slot});
+  }
+}
 
+void VisionIpcServer::remove_client(const Client &client){
+  // release whatever the client was still reading
+  VisionIpcStreamState *state = (VisionIpcStreamState *)states[client.type]->addr;
+  for (size_t i = 0; i < buffers[client.type].size(); i++) {
+    state->bufs[i].readers &= ~(1ULL << client.slot);
+  }
+  used_slots[client.type] &= ~(1ULL << client.slot);
+  close(client.fd);
+}
 
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
   auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  VisionIpcStreamState *state = (VisionIpcStreamState *)states[type]->addr;
+
+  for (size_t i = 0; i < b.size(); i++) {
+    VisionBuf *buf = b[cur_idx[type]++ % b.size()];
+    VisionIpcBufState &bs = state->bufs[buf->idx];
+    if (bs.readers != 0) continue;
+
+    // clients that start reading after this see the new gen and back off
+    bs.gen++;
+    if (bs.readers == 0) return buf;
+  }
+
+  // every buffer is in use, take the next one anyway
+  VisionBuf *buf = b[cur_idx[type]++ % b.size()];
+  state->bufs[buf->idx].gen++;
+  overwritten[type]++;
+  return buf;
 }
 
 void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
@@ -158,6 +226,8 @@ void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.gen = ((VisionIpcStreamState *)states[buf->type]->addr)->bufs[buf->idx].gen;
+  packet.count = send_count[buf->type]++;
   packet.extra = *extra;
 
   sockets[buf->type]->send((char*)&packet, sizeof(packet));
@@ -176,6 +246,12 @@ VisionIpcServer::~VisionIpcServer(){
       delete b;
     }
   }
+  for (auto const& [type, state] : states) {
+    if (state->free() != 0) {
+      LOGE("Failed to free buffer");
+    }
+    delete state;
+  }
 
   // Messaging cleanup
   for( auto const& [type, sock] : sockets ) {
@@ -11,6 +11,12 @@
 
 std::string get_endpoint_name(std::string name, VisionStreamType type);
 
+// sent to a client on connect along with the fds of bufs, the last one is the VisionIpcStreamState
+struct VisionIpcConnectReply {
+  int64_t slot;  // -1 if all client slots are taken, the client then doesn't mark buffers in use
+  VisionBuf bufs[VISIONIPC_MAX_FDS];
+};
+
 class VisionIpcServer {
  private:
   cl_device_id device_id = nullptr;
@@ -24,17 +30,34 @@ class VisionIpcServer {
   std::map<VisionStreamType, std::atomic<size_t> > cur_idx;
   std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
   std::map<VisionStreamType, std::map<VisionBuf*, size_t> > idxs;
+  std::map<VisionStreamType, VisionBuf*> states;
+  std::map<VisionStreamType, uint64_t> send_count;
+  std::map<VisionStreamType, std::atomic<uint64_t> > overwritten;
+
+  // connected clients, the socket stays open so a slot can be freed when the client goes away
+  struct Client {
+    int fd;
+    VisionStreamType type;
+    int slot;
+  };
+  std::vector<Client> clients;
+  std::map<VisionStreamType, uint64_t> used_slots;
 
   Context * msg_ctx;
   std::map<VisionStreamType, PubSocket*> sockets;
 
   void listener(void);
+  void accept_client(int fd);
+  void remove_client(const Client &client);
 
  public:
   VisionIpcServer(std::string name, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcServer();
 
+  // the next buffer no client is reading, or the next one in line if every buffer is in use
   VisionBuf * get_buffer(VisionStreamType type);
+  // times get_buffer had to hand out a buffer a client was still reading
+  uint64_t get_overwritten(VisionStreamType type) { return overwritten[type]; }
 
   void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
   void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
@@ -37,6 +37,20 @@ TEST_CASE("Check buffers"){
   REQUIRE(client.num_buffers == num_buffers);
 }
 
+TEST_CASE("Check max buffers"){
+  // one fd is taken by the buffer states
+  size_t num_buffers = VISIONIPC_MAX_FDS - 1;
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, num_buffers, false, 16, 16);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  REQUIRE(client.num_buffers == num_buffers);
+  REQUIRE(client.buffers[num_buffers - 1].idx == num_buffers - 1);
+}
+
 TEST_CASE("Check yuv/rgb"){
   VisionIpcServer server("camerad");
   server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
@@ -133,3 +147,146 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Skip buffers in use"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->idx == buf->idx);
+
+  // the client still holds the first buffer
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx != buf->idx);
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx != buf->idx);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 0);
+
+  client.release();
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx == buf->idx);
+  REQUIRE(client.frames_overwritten == 0);
+}
+
+TEST_CASE("Overwritten while reading"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  REQUIRE(client.recv() != nullptr);
+
+  // the only buffer is in use, so the server has to take it anyway
+  server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 1);
+
+  client.release();
+  REQUIRE(client.frames_overwritten == 1);
+}
+
+TEST_CASE("Hold buffers past recv"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 3, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * first = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(first, &extra);
+  REQUIRE(client.recv() == &client.buffers[first->idx]);
+  VisionIpcBufHold hold = client.hold();
+  VisionIpcBufHold hold2 = client.hold();
+  REQUIRE(hold.buf == &client.buffers[first->idx]);
+
+  VisionBuf * second = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(second->idx != first->idx);
+  server.send(second, &extra);
+  REQUIRE(client.recv() == &client.buffers[second->idx]);
+
+  // the first buffer stays in use after the next recv and until every hold is released
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx != first->idx);
+  }
+  std::thread([&] { REQUIRE(client.release(hold)); }).join();
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx != first->idx);
+  }
+  REQUIRE(client.release(hold2));
+  client.release();
+
+  bool reused = false;
+  for (int i = 0; i < 3; i++) {
+    reused = reused || server.get_buffer(VISION_STREAM_YUV_BACK)->idx == first->idx;
+  }
+  REQUIRE(reused);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 0);
+}
+
+TEST_CASE("Held buffer overwritten"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  REQUIRE(client.recv() != nullptr);
+  VisionIpcBufHold hold = client.hold();
+  client.release();
+
+  server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 1);
+  REQUIRE(!client.release(hold));
+}
+
+TEST_CASE("Skipped frames"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 3, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, true);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  for (int i = 0; i < 3; i++) {
+    extra.frame_id = i;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  }
+  VisionIpcBufExtra extra_recv = {0};
+  REQUIRE(client.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.frame_id == 2);
+
+  extra.frame_id = 3;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  REQUIRE(client.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.frame_id == 3);
+  REQUIRE(client.frames_skipped == 0);
+
+  // a stale frame whose buffer was handed out again before the client got to it
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(buf, &extra);
+  client.release();
+  for (int i = 0; i < 3; i++) server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(client.recv() == nullptr);
+  REQUIRE(client.frames_skipped == 1);
+}
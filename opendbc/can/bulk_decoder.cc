@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <thread>
+
+#include "common.h"
+
+#define WARN printf
+
+namespace {
+
+struct FrameRef {
+  uint64_t ts;
+  const uint8_t *dat;
+  size_t size;
+};
+
+void decode_frames(const std::vector<FrameRef> &frames, MessageColumns &cols) {
+  const Msg *msg = cols.msg;
+  const size_t n = frames.size();
+  cols.ts.resize(n);
+  cols.values.assign(msg->num_sigs, std::vector<double>(n));
+
+  std::vector<double> vals(msg->num_sigs);
+  uint8_t dat[CAN_BUF_SIZE] = {0};
+  for (size_t j = 0; j < n; j++) {
+    const FrameRef &f = frames[j];
+    memcpy(dat, f.dat, f.size);
+    memset(dat + f.size, 0, CAN_BUF_SIZE - f.size);
+
+    int64_t checksum, counter;
+    msg->decode(dat, vals.data(), &checksum, &counter);
+
+    cols.ts[j] = f.ts;
+    for (int i = 0; i < msg->num_sigs; i++) {
+      cols.values[i][j] = vals[i];
+    }
+  }
+}
+
+}  // namespace
+
+CANBulkDecoder::CANBulkDecoder(const std::string& dbc_name, const std::vector<uint32_t> &addresses, int bus) : bus(bus) {
+  dbc = dbc_lookup(dbc_name);
+  assert(dbc);
+
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg *msg = &dbc->msgs[i];
+    if (addresses.empty() || std::find(addresses.begin(), addresses.end(), msg->address) != addresses.end()) {
+      message_lookup[msg->address] = msg;
+    }
+  }
+}
+
+std::vector<MessageColumns> CANBulkDecoder::decode(const char *data, size_t size, bool sendcan, int num_threads) {
+  // one aligned copy of the log, the frames below point into it
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word) + 1);
+  memcpy(buf.begin(), data, size);
+  kj::ArrayPtr<const capnp::word> words = buf.slice(0, size / sizeof(capnp::word));
+
+  // group the frames by bus and address, in a sorted map to get the columns in a stable order
+  std::map<std::pair<uint8_t, uint32_t>, size_t> group_lookup;
+  std::vector<MessageColumns> columns;
+  std::vector<std::vector<FrameRef>> groups;
+
+  try {
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+
+      if (sendcan ? !event.isSendcan() : !event.isCan()) continue;
+
+      uint64_t ts = event.getLogMonoTime();
+      for (auto cmsg : sendcan ? event.getSendcan() : event.getCan()) {
+        if (bus >= 0 && cmsg.getSrc() != bus) continue;
+        auto it = message_lookup.find(cmsg.getAddress());
+        if (it == message_lookup.end()) continue;
+        auto dat = cmsg.getDat();
+        if (dat.size() > CANFD_MAX_SIZE) continue;
+
+        auto key = std::make_pair((uint8_t)cmsg.getSrc(), cmsg.getAddress());
+        auto group_it = group_lookup.find(key);
+        if (group_it == group_lookup.end()) {
+          group_it = group_lookup.emplace(key, groups.size()).first;
+          groups.emplace_back();
+          columns.push_back({.bus = key.first, .address = key.second, .msg = it->second});
+        }
+        groups[group_it->second].push_back({.ts = ts, .dat = dat.begin(), .size = dat.size()});
+      }
+    }
+  } catch (const kj::Exception &e) {
+    WARN("failed to read log, decoding up to the truncated event: %s\n", e.getDescription().cStr());
+  }
+
+  // messages are independent, so the threads just take the next undecoded one
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < groups.size(); i = next++) {
+      decode_frames(groups[i], columns[i]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) t.join();
+
+  // sorted by bus and address
+  std::vector<MessageColumns> ret;
+  ret.reserve(columns.size());
+  for (const auto &kv : group_lookup) {
+    ret.push_back(std::move(columns[kv.second]));
+  }
+  return ret;
+}
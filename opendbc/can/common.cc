@@ -1,13 +1,13 @@
 #include "common.h"
 
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 4; // remove checksum
-
+unsigned int honda_checksum(unsigned int address, const uint8_t *dat, int l) {
   int s = 0;
   bool extended = address > 0x7FF; // extended can
   while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
+  for (int i = 0; i < l; i++) {
+    s += dat[i] >> 4;
+    if (i < l - 1) s += dat[i] & 0xF; // skip checksum
+  }
   s = 8-s;
   if (extended) s += 3;
   s &= 0xF;
@@ -15,35 +15,29 @@ unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
   return s;
 }
 
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
-
+unsigned int toyota_checksum(unsigned int address, const uint8_t *dat, int l) {
   unsigned int s = l;
   while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
+  for (int i = 0; i < l - 1; i++) { s += dat[i]; } // checksum is last byte
 
   return s & 0xFF;
 }
 
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-
+unsigned int subaru_checksum(unsigned int address, const uint8_t *dat, int l) {
   unsigned int s = 0;
   while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
+  for (int i = 1; i < l; i++) { s += dat[i]; } // checksum is first byte
 
   return s & 0xFF;
 }
 
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+unsigned int chrysler_checksum(unsigned int address, const uint8_t *dat, int l) {
   /* This function does not want the checksum byte in the input data.
   jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
   uint8_t checksum = 0xFF;
   for (int j = 0; j < (l - 1); j++) {
     uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
+    uint8_t curr = dat[j];
     for (int i=0; i<8; i++) {
       uint8_t bit_sum = curr & shift;
       uint8_t temp_chk = checksum & 0x80U;
@@ -94,7 +88,7 @@ void init_crc_lookup_tables() {
   gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
 }
 
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
+unsigned int volkswagen_crc(unsigned int address, const uint8_t *dat, int l) {
   // Volkswagen uses standard CRC8 8H2F/AUTOSAR, but they compute it with
   // a magic variable padding byte tacked onto the end of the payload.
   // https://www.autosar.org/fileadmin/user_upload/standards/classic/4-3/AUTOSAR_SWS_CRCLibrary.pdf
@@ -103,13 +97,13 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
 
   // CRC the payload first, skipping over the first byte where the CRC lives.
   for (int i = 1; i < l; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
+    crc ^= dat[i];
     crc = crc8_lut_8h2f[crc];
   }
 
   // Look up and apply the magic final CRC padding byte, which permutes by CAN
   // address, and additionally (for SOME addresses) by the message counter.
-  uint8_t counter = ((d >> 8) & 0xFF) & 0x0F;
+  uint8_t counter = dat[1] & 0x0F;
   switch(address) {
     case 0x86:  // LWI_01 Steering Angle
       crc ^= (uint8_t[]){0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86}[counter];
@@ -173,16 +167,14 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
 }
 
 
-unsigned int pedal_checksum(uint64_t d, int l) {
+unsigned int pedal_checksum(const uint8_t *dat, int l) {
   uint8_t crc = 0xFF;
   uint8_t poly = 0xD5; // standard crc8
 
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
-
+  // checksum is the last byte, the payload is processed back to front
   int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
+  for (i = l - 2; i >= 0; i--) {
+    crc ^= dat[i];
     for (j = 0; j < 8; j++) {
       if ((crc & 0x80) != 0) {
         crc = (uint8_t)((crc << 1) ^ poly);
@@ -194,26 +186,3 @@ unsigned int pedal_checksum(uint64_t d, int l) {
   }
   return crc;
 }
-
-
-uint64_t read_u64_be(const uint8_t* v) {
-  return (((uint64_t)v[0] << 56)
-          | ((uint64_t)v[1] << 48)
-          | ((uint64_t)v[2] << 40)
-          | ((uint64_t)v[3] << 32)
-          | ((uint64_t)v[4] << 24)
-          | ((uint64_t)v[5] << 16)
-          | ((uint64_t)v[6] << 8)
-          | (uint64_t)v[7]);
-}
-
-uint64_t read_u64_le(const uint8_t* v) {
-  return ((uint64_t)v[0]
-          | ((uint64_t)v[1] << 8)
-          | ((uint64_t)v[2] << 16)
-          | ((uint64_t)v[3] << 24)
-          | ((uint64_t)v[4] << 32)
-          | ((uint64_t)v[5] << 40)
-          | ((uint64_t)v[6] << 48)
-          | ((uint64_t)v[7] << 56));
-}
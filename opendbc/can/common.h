@@ -15,23 +15,24 @@
 #define MAX_BAD_COUNTER 5
 
 // Helper functions
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
+unsigned int honda_checksum(unsigned int address, const uint8_t *dat, int l);
+unsigned int toyota_checksum(unsigned int address, const uint8_t *dat, int l);
+unsigned int subaru_checksum(unsigned int address, const uint8_t *dat, int l);
+unsigned int chrysler_checksum(unsigned int address, const uint8_t *dat, int l);
 void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
-unsigned int pedal_checksum(uint64_t d, int l);
-uint64_t read_u64_be(const uint8_t* v);
-uint64_t read_u64_le(const uint8_t* v);
+unsigned int volkswagen_crc(unsigned int address, const uint8_t *dat, int l);
+unsigned int pedal_checksum(const uint8_t *dat, int l);
 
 class MessageState {
 public:
   uint32_t address;
   unsigned int size;
+  const Msg *msg;
 
   std::vector<Signal> parse_sigs;
   std::vector<double> vals;
+  std::vector<size_t> parse_idx;  // index of each parse_sigs entry in msg->sigs
+  std::vector<double> decoded;  // scratch space for all signals of msg
 
   uint16_t ts;
   uint64_t seen;
@@ -43,7 +44,9 @@ public:
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
-  bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
+  void add_signal(size_t idx, double default_value);
+  bool parse(uint64_t sec, uint16_t ts_, const uint8_t *dat);
+  bool check_checksum(int64_t checksum, const uint8_t *dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
 
@@ -54,6 +57,17 @@ private:
 
   const DBC *dbc = NULL;
   std::unordered_map<uint32_t, MessageState> message_states;
+  // direct lookup for standard 11 bit addresses, extended ones go through message_states
+  std::vector<MessageState *> message_table;
+
+  void init_message_table();
+  inline MessageState *lookup_state(uint32_t address) {
+    if (address < message_table.size()) {
+      return message_table[address];
+    }
+    auto it = message_states.find(address);
+    return it == message_states.end() ? nullptr : &it->second;
+  }
 
 public:
   bool can_valid = false;
@@ -72,14 +86,51 @@ public:
   std::vector<SignalValue> query_latest();
 };
 
+#ifndef DYNAMIC_CAPNP
+// All frames of one message on one bus, decoded into one column per signal
+struct MessageColumns {
+  uint8_t bus;
+  uint32_t address;
+  const Msg *msg;
+  std::vector<uint64_t> ts;  // logMonoTime of the event that carried the frame
+  std::vector<std::vector<double>> values;  // [signal][frame], signals in the order of msg->sigs
+};
+
+// Decodes whole logs at once for offline analysis. Checksums and counters are not verified.
+class CANBulkDecoder {
+private:
+  const DBC *dbc = NULL;
+  int bus;
+  std::unordered_map<uint32_t, const Msg *> message_lookup;
+
+public:
+  // only messages in addresses are decoded if it's not empty, bus -1 decodes all buses
+  CANBulkDecoder(const std::string& dbc_name, const std::vector<uint32_t> &addresses = {}, int bus = -1);
+  // data is a stream of serialized Events, like a decompressed rlog. Messages are decoded on num_threads threads.
+  std::vector<MessageColumns> decode(const char *data, size_t size, bool sendcan = false, int num_threads = 1);
+};
+#endif
+
+// A message and a fixed list of its signals, resolved once by CANPacker::resolve.
+// Signals that don't exist in the message are nullptr and skipped when packing.
+struct PackHandle {
+  const Msg *msg = nullptr;
+  std::vector<const Signal *> sigs;
+  const Signal *counter_sig = nullptr;
+  const Signal *checksum_sig = nullptr;
+};
+
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
-  std::map<uint32_t, Msg> message_lookup;
+  std::unordered_map<uint32_t, const Msg *> message_lookup;
 
 public:
   CANPacker(const std::string& dbc_name);
-  uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
-  Msg* lookup_message(uint32_t address);
+  PackHandle resolve(uint32_t address, const std::vector<std::string> &signal_names);
+  // values are in the order of the names passed to resolve, dat has to hold CAN_BUF_SIZE bytes.
+  // Returns the size of the message.
+  unsigned int pack(const PackHandle &handle, const double *values, int counter, uint8_t *dat);
+  std::vector<uint8_t> pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
+  const Msg* lookup_message(uint32_t address);
 };
@@ -1,7 +1,7 @@
 # distutils: language = c++
 #cython: language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uint16_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -10,6 +10,9 @@ from libcpp cimport bool
 
 
 cdef extern from "common_dbc.h":
+  cdef enum:
+    CAN_BUF_SIZE
+
   ctypedef enum SignalType:
     DEFAULT,
     HONDA_CHECKSUM,
@@ -79,6 +82,22 @@ cdef extern from "common.h":
     void update_string(string, bool)
     vector[SignalValue] query_latest()
 
+  cdef cppclass MessageColumns:
+    uint8_t bus
+    uint32_t address
+    const Msg *msg
+    vector[uint64_t] ts
+    vector[vector[double]] values
+
+  cdef cppclass CANBulkDecoder:
+    CANBulkDecoder(string, vector[uint32_t], int)
+    vector[MessageColumns] decode(const char*, size_t, bool, int) nogil
+
+  cdef cppclass PackHandle:
+    pass
+
   cdef cppclass CANPacker:
    CANPacker(string)
-   uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   PackHandle resolve(uint32_t, vector[string])
+   unsigned int pack(const PackHandle&, const double*, int counter, uint8_t*)
+   vector[uint8_t] pack(uint32_t, vector[SignalPackValue], int counter)
@@ -2,11 +2,16 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
 
+#define CANFD_MAX_SIZE 64
+// frame buffers carry zero padding after the payload, so a signal can always be read with 64 bit loads
+#define CAN_BUF_SIZE (CANFD_MAX_SIZE + 8)
+
 struct SignalPackValue {
   const char* name;
   double value;
@@ -43,6 +48,9 @@ enum SignalType {
   CHRYSLER_CHECKSUM,
 };
 
+// b1 is the first bit of the signal: the lsb for little endian signals, the msb for big endian ones,
+// counted from the msb of byte 0. b2 is the size in bits. bo is the shift of a big endian signal
+// within the first 8 bytes, it is only valid for signals that end in them.
 struct Signal {
   const char* name;
   int b1, b2, bo;
@@ -52,12 +60,21 @@ struct Signal {
   SignalType type;
 };
 
+// Generated per message by process_dbc.py. Writes the values of all signals to vals,
+// in the order of Msg::sigs, and the raw checksum and counter if the message has them.
+// dat has to be a zero padded buffer of CAN_BUF_SIZE bytes.
+typedef void (*MsgDecodeFn)(const uint8_t *dat, double *vals, int64_t *checksum, int64_t *counter);
+
 struct Msg {
   const char* name;
   uint32_t address;
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  SignalType checksum_type;
+  SignalType counter_type;
+  int counter_size;
+  MsgDecodeFn decode;
 };
 
 struct Val {
@@ -75,6 +92,39 @@ struct DBC {
   size_t num_vals;
 };
 
+// unaligned 64 bit loads and stores, the bit extraction kernel of the generated decoders
+static inline uint64_t load_u64_le(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint64_t load_u64_be(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline void store_u64_le(uint8_t *p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void store_u64_be(uint8_t *p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
 std::vector<const DBC*>& get_dbcs();
 const DBC* dbc_lookup(const std::string& dbc_name);
 
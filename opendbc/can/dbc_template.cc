@@ -6,11 +6,7 @@ namespace {
 const Signal sigs_{{address}}[] = {
   {% for sig in sigs %}
     {
-      {% if sig.is_little_endian %}
-        {% set b1 = sig.start_bit %}
-      {% else %}
-        {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
-      {% endif %}
+      {% set b1 = signal_b1(sig) %}
       .name = "{{sig.name}}",
       .b1 = {{b1}},
       .b2 = {{sig.size}},
@@ -19,30 +15,32 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{signal_type(address, sig)}},
     },
   {% endfor %}
 };
+
+// decodes all signals of the message, with the bit layout resolved at generation time
+void decode_{{address}}(const uint8_t *dat, double *vals, int64_t *checksum, int64_t *counter) {
+  int64_t tmp;
+  {% for sig in sigs %}
+  tmp = {{signal_extract(sig)}};
+  {% if sig.is_signed and sig.size < 64 %}
+  tmp -= (tmp >> {{sig.size - 1}}) ? (1ULL << {{sig.size}}) : 0;
+  {% endif %}
+  {% if signal_type(address, sig).endswith("_CHECKSUM") %}
+  *checksum = tmp;
+  {% elif signal_type(address, sig).endswith("_COUNTER") %}
+  *counter = tmp;
+  {% endif %}
+  {% if sig.factor == 1 and sig.offset == 0 %}
+  vals[{{loop.index0}}] = tmp;
+  {% else %}
+  vals[{{loop.index0}}] = tmp * {{sig.factor}} + {{sig.offset}};
+  {% endif %}
+  {% endfor %}
+}
+
 {% endfor %}
 
 const Msg msgs[] = {
@@ -54,6 +52,14 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    {% for sig in sigs if signal_type(address, sig).endswith("_CHECKSUM") %}
+    .checksum_type = SignalType::{{signal_type(address, sig)}},
+    {% endfor %}
+    {% for sig in sigs if signal_type(address, sig).endswith("_COUNTER") %}
+    .counter_type = SignalType::{{signal_type(address, sig)}},
+    .counter_size = {{sig.size}},
+    {% endfor %}
+    .decode = decode_{{address}},
   },
 {% endfor %}
 };
@@ -2,35 +2,54 @@
 #include <utility>
 #include <algorithm>
 #include <map>
+#include <cstring>
 #include <cmath>
 
 #include "common.h"
 
 #define WARN printf
 
-// this is the same as read_u64_le, but uses uint64_t as in/out
-uint64_t ReverseBytes(uint64_t x) {
-  return ((x & 0xff00000000000000ull) >> 56) |
-          ((x & 0x00ff000000000000ull) >> 40) |
-          ((x & 0x0000ff0000000000ull) >> 24) |
-          ((x & 0x000000ff00000000ull) >> 8) |
-          ((x & 0x00000000ff000000ull) << 8) |
-          ((x & 0x0000000000ff0000ull) << 24) |
-          ((x & 0x000000000000ff00ull) << 40) |
-          ((x & 0x00000000000000ffull) << 56);
+static inline uint64_t value_mask(int size) {
+  return size >= 64 ? ~0ULL : (1ULL << size) - 1;
 }
 
-static uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival) {
-  int shift = sig.is_little_endian? sig.b1 : sig.bo;
-  uint64_t mask = ((1ULL << sig.b2)-1) << shift;
-  uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
+// inverse of the generated decoders, dat has to be a zero padded buffer of CAN_BUF_SIZE bytes
+static void set_value(uint8_t *dat, const Signal& sig, int64_t ival) {
+  int byte = sig.b1 / 8, shift = sig.b1 % 8;
+  int spill = shift + sig.b2 - 64; // bits that don't fit in the 64 bit word at byte
+  uint64_t mask = value_mask(sig.b2);
+  uint64_t val = ival & mask;
+
   if (sig.is_little_endian) {
-    dat = ReverseBytes(dat);
-    mask = ReverseBytes(mask);
+    uint64_t w = load_u64_le(dat + byte);
+    w = (w & ~(mask << shift)) | (val << shift);
+    store_u64_le(dat + byte, w);
+    if (spill > 0) {
+      uint8_t m = (1U << spill) - 1;
+      dat[byte + 8] = (dat[byte + 8] & ~m) | ((val >> (64 - shift)) & m);
+    }
+  } else if (spill <= 0) {
+    uint64_t w = load_u64_be(dat + byte);
+    w = (w & ~(mask << -spill)) | (val << -spill);
+    store_u64_be(dat + byte, w);
+  } else {
+    uint64_t w = load_u64_be(dat + byte);
+    uint64_t m = value_mask(64 - shift);
+    w = (w & ~m) | (val >> spill);
+    store_u64_be(dat + byte, w);
+    uint8_t m2 = ((1U << spill) - 1) << (8 - spill);
+    dat[byte + 8] = (dat[byte + 8] & ~m2) | ((val << (8 - spill)) & m2);
+  }
+}
+
+// the last definition wins if a message defines a signal name twice
+static const Signal *find_signal(const Msg *msg, const char *name) {
+  for (int i = msg->num_sigs - 1; i >= 0; i--) {
+    if (strcmp(msg->sigs[i].name, name) == 0) {
+      return &msg->sigs[i];
+    }
   }
-  ret &= ~mask;
-  ret |= dat;
-  return ret;
+  return nullptr;
 }
 
 CANPacker::CANPacker(const std::string& dbc_name) {
@@ -39,80 +58,102 @@ CANPacker::CANPacker(const std::string& dbc_name) {
 
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    message_lookup[msg->address] = *msg;
-    for (int j=0; j<msg->num_sigs; j++) {
-      const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
-    }
+    message_lookup[msg->address] = msg;
   }
   init_crc_lookup_tables();
 }
 
-uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
-  uint64_t ret = 0;
-  for (const auto& sigval : signals) {
-    std::string name = std::string(sigval.name);
-    double value = sigval.value;
+PackHandle CANPacker::resolve(uint32_t address, const std::vector<std::string> &signal_names) {
+  PackHandle handle;
+  const Msg *msg = lookup_message(address);
+  if (msg == nullptr) {
+    WARN("undefined address %d\n", address);
+    return handle;
+  }
 
-    auto sig_it = signal_lookup.find(std::make_pair(address, name));
-    if (sig_it == signal_lookup.end()) {
+  handle.msg = msg;
+  for (const auto& name : signal_names) {
+    const Signal *sig = find_signal(msg, name.c_str());
+    if (sig == nullptr) {
       WARN("undefined signal %s - %d\n", name.c_str(), address);
-      continue;
     }
-    const auto& sig = sig_it->second;
+    handle.sigs.push_back(sig);
+  }
+  handle.counter_sig = find_signal(msg, "COUNTER");
+  handle.checksum_sig = find_signal(msg, "CHECKSUM");
+  return handle;
+}
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
-    }
+unsigned int CANPacker::pack(const PackHandle &handle, const double *values, int counter, uint8_t *dat) {
+  memset(dat, 0, CAN_BUF_SIZE);
+  const Msg *msg = handle.msg;
+  if (msg == nullptr) {
+    return 0;
+  }
+  const uint32_t address = msg->address;
+  const unsigned int size = msg->size;
 
-    ret = set_value(ret, sig, ival);
+  for (int i = 0; i < handle.sigs.size(); i++) {
+    const Signal *sig = handle.sigs[i];
+    if (sig == nullptr) continue;
+
+    int64_t ival = (int64_t)(round((values[i] - sig->offset) / sig->factor));
+    set_value(dat, *sig, ival);
   }
 
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    const Signal *sig = handle.counter_sig;
+    if (sig == nullptr) {
       WARN("COUNTER not defined\n");
-      return ret;
+      return size;
     }
-    const auto& sig = sig_it->second;
 
-    if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
+    if ((sig->type != SignalType::HONDA_COUNTER) && (sig->type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
     }
 
-    ret = set_value(ret, sig, counter);
+    set_value(dat, *sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
-    if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
-      // until later in the pack process. Checksums can be run backwards, CRCs not so much.
-      // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+  const Signal *sig = handle.checksum_sig;
+  if (sig != nullptr) {
+    if (sig->type == SignalType::HONDA_CHECKSUM) {
+      unsigned int chksm = honda_checksum(address, dat, size);
+      set_value(dat, *sig, chksm);
+    } else if (sig->type == SignalType::TOYOTA_CHECKSUM) {
+      unsigned int chksm = toyota_checksum(address, dat, size);
+      set_value(dat, *sig, chksm);
+    } else if (sig->type == SignalType::VOLKSWAGEN_CHECKSUM) {
+      unsigned int chksm = volkswagen_crc(address, dat, size);
+      set_value(dat, *sig, chksm);
+    } else if (sig->type == SignalType::SUBARU_CHECKSUM) {
+      unsigned int chksm = subaru_checksum(address, dat, size);
+      set_value(dat, *sig, chksm);
+    } else if (sig->type == SignalType::CHRYSLER_CHECKSUM) {
+      unsigned int chksm = chrysler_checksum(address, dat, size);
+      set_value(dat, *sig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
     }
   }
 
-  return ret;
+  return size;
+}
+
+std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  std::vector<std::string> names;
+  std::vector<double> values;
+  for (const auto& sigval : signals) {
+    names.push_back(sigval.name);
+    values.push_back(sigval.value);
+  }
+
+  uint8_t dat[CAN_BUF_SIZE];
+  unsigned int size = pack(resolve(address, names), values.data(), counter, dat);
+  return std::vector<uint8_t>(dat, dat + size);
 }
 
-Msg* CANPacker::lookup_message(uint32_t address) {
-  return &message_lookup[address];
+const Msg* CANPacker::lookup_message(uint32_t address) {
+  auto it = message_lookup.find(address);
+  return it == message_lookup.end() ? nullptr : it->second;
 }
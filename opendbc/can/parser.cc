@@ -13,76 +13,29 @@
 // #define DEBUG printf
 #define INFO printf
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
-
-  for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
-
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
-    }
-
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
-    }
+void MessageState::add_signal(size_t idx, double default_value) {
+  parse_sigs.push_back(msg->sigs[idx]);
+  parse_idx.push_back(idx);
+  vals.push_back(default_value);
+}
 
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+bool MessageState::parse(uint64_t sec, uint16_t ts_, const uint8_t *dat) {
+  int64_t checksum = 0, counter = 0;
+  msg->decode(dat, decoded.data(), &checksum, &counter);
 
-    if (!ignore_checksum) {
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        if (toyota_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-        if (volkswagen_crc(address, dat_le, size) != tmp) {
-          INFO("0x%X CRC FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-        if (subaru_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-        if (chrysler_checksum(address, dat_le, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-        if (pedal_checksum(dat_be, size) != tmp) {
-          INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
-          return false;
-        }
-      }
+  if (!ignore_checksum && msg->checksum_type != SignalType::DEFAULT) {
+    if (!check_checksum(checksum, dat)) {
+      return false;
     }
-    if (!ignore_counter) {
-      if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-          if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      }
+  }
+  if (!ignore_counter && msg->counter_type != SignalType::DEFAULT) {
+    if (!update_counter_generic(counter, msg->counter_size)) {
+      return false;
     }
+  }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+  for (int i = 0; i < parse_idx.size(); i++) {
+    vals[i] = decoded[parse_idx[i]];
   }
   ts = ts_;
   seen = sec;
@@ -90,6 +43,50 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
   return true;
 }
 
+bool MessageState::check_checksum(int64_t checksum, const uint8_t *dat) {
+  switch (msg->checksum_type) {
+    case SignalType::HONDA_CHECKSUM:
+      if (honda_checksum(address, dat, size) != checksum) {
+        INFO("0x%X CHECKSUM FAIL\n", address);
+        return false;
+      }
+      break;
+    case SignalType::TOYOTA_CHECKSUM:
+      if (toyota_checksum(address, dat, size) != checksum) {
+        INFO("0x%X CHECKSUM FAIL\n", address);
+        return false;
+      }
+      break;
+    case SignalType::VOLKSWAGEN_CHECKSUM:
+      if (volkswagen_crc(address, dat, size) != checksum) {
+        INFO("0x%X CRC FAIL\n", address);
+        return false;
+      }
+      break;
+    case SignalType::SUBARU_CHECKSUM:
+      if (subaru_checksum(address, dat, size) != checksum) {
+        INFO("0x%X CHECKSUM FAIL\n", address);
+        return false;
+      }
+      break;
+    case SignalType::CHRYSLER_CHECKSUM:
+      if (chrysler_checksum(address, dat, size) != checksum) {
+        INFO("0x%X CHECKSUM FAIL\n", address);
+        return false;
+      }
+      break;
+    case SignalType::PEDAL_CHECKSUM:
+      if (pedal_checksum(dat, size) != checksum) {
+        INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
+        return false;
+      }
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
 
 bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   uint8_t old_counter = counter;
@@ -141,13 +138,14 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
     }
 
     state.size = msg->size;
+    state.msg = msg;
+    state.decoded.resize(msg->num_sigs);
 
     // track checksums and counters for this message
     for (int i = 0; i < msg->num_sigs; i++) {
       const Signal *sig = &msg->sigs[i];
       if (sig->type != SignalType::DEFAULT) {
-        state.parse_sigs.push_back(*sig);
-        state.vals.push_back(0);
+        state.add_signal(i, 0);
       }
     }
 
@@ -159,13 +157,14 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         const Signal *sig = &msg->sigs[i];
         if (strcmp(sig->name, sigop.name) == 0
             && sig->type == SignalType::DEFAULT) {
-          state.parse_sigs.push_back(*sig);
-          state.vals.push_back(sigop.default_value);
+          state.add_signal(i, sigop.default_value);
           break;
         }
       }
     }
   }
+
+  init_message_table();
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -181,18 +180,37 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
     MessageState state = {
       .address = msg->address,
       .size = msg->size,
+      .msg = msg,
       .ignore_checksum = ignore_checksum,
       .ignore_counter = ignore_counter,
     };
+    state.decoded.resize(msg->num_sigs);
 
     for (int j = 0; j < msg->num_sigs; j++) {
-      const Signal *sig = &msg->sigs[j];
-      state.parse_sigs.push_back(*sig);
-      state.vals.push_back(0);
+      state.add_signal(j, 0);
     }
 
     message_states[state.address] = state;
   }
+
+  init_message_table();
+}
+
+void CANParser::init_message_table() {
+  // size the table for the largest standard address that is tracked
+  uint32_t table_size = 0;
+  for (const auto& kv : message_states) {
+    if (kv.first < 0x800) {
+      table_size = std::max(table_size, kv.first + 1);
+    }
+  }
+
+  message_table.assign(table_size, nullptr);
+  for (auto& kv : message_states) {
+    if (kv.first < table_size) {
+      message_table[kv.first] = &kv.second;
+    }
+  }
 }
 
 #ifndef DYNAMIC_CAPNP
@@ -228,17 +246,17 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
+    MessageState *state = lookup_state(cmsg.getAddress());
+    if (state == nullptr) {
       // DEBUG("skip %d: not specified\n", cmsg.getAddress());
       continue;
     }
 
-    if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-    uint8_t dat[8] = {0};
+    if (cmsg.getDat().size() > CANFD_MAX_SIZE) continue; //shouldn't ever happen
+    uint8_t dat[CAN_BUF_SIZE] = {0};
     memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
 
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    state->parse(sec, cmsg.getBusTime(), dat);
   }
 }
 #endif
@@ -252,17 +270,17 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  MessageState *state = lookup_state(cmsg.get("address").as<uint32_t>());
+  if (state == nullptr) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
 
   auto dat = cmsg.get("dat").as<capnp::Data>();
-  if (dat.size() > 8) return; //shouldn't ever happen
-  uint8_t data[8] = {0};
+  if (dat.size() > CANFD_MAX_SIZE) return; //shouldn't ever happen
+  uint8_t data[CAN_BUF_SIZE] = {0};
   memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  state->parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
@@ -9,12 +9,15 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport CANBulkDecoder as cpp_CANBulkDecoder
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC, MessageColumns
 
 import os
 import numbers
 from collections import defaultdict
 
+import numpy as np
+
 cdef int CAN_INVALID_CNT = 5
 
 cdef class CANParser:
@@ -144,6 +147,57 @@ cdef class CANParser:
 
     return updated_vals
 
+cdef class CANBulkDecoder:
+  """Decodes all CAN frames of a log into numpy columns, for offline analysis.
+
+  decode() takes the raw bytes of a decompressed rlog and returns
+  {bus: {msg_name: {'t': logMonoTimes, signal_name: values}}}.
+  """
+  cdef:
+    cpp_CANBulkDecoder *decoder
+    const DBC *dbc
+
+  def __init__(self, dbc_name, messages=None, bus=-1):
+    self.dbc = dbc_lookup(dbc_name)
+    if not self.dbc:
+      raise RuntimeError(f"Can't find DBC: {dbc_name}")
+
+    name_to_address = {}
+    for i in range(self.dbc[0].num_msgs):
+      msg = self.dbc[0].msgs[i]
+      name_to_address[msg.name.decode('utf8')] = msg.address
+
+    cdef vector[uint32_t] addresses
+    for m in messages or []:
+      addresses.push_back(m if isinstance(m, numbers.Number) else name_to_address[m])
+
+    self.decoder = new cpp_CANBulkDecoder(dbc_name, addresses, bus)
+
+  def __dealloc__(self):
+    del self.decoder
+
+  def decode(self, bytes dat, sendcan=False, num_threads=1):
+    cdef const char *data = dat
+    cdef size_t size = len(dat)
+    cdef bool c_sendcan = sendcan
+    cdef int c_num_threads = num_threads
+    cdef vector[MessageColumns] columns
+
+    with nogil:
+      columns = self.decoder.decode(data, size, c_sendcan, c_num_threads)
+
+    ret = defaultdict(dict)
+    cdef size_t n
+    for j in range(columns.size()):
+      # every message in the result has at least one frame
+      n = columns[j].ts.size()
+      msg = {'t': np.array(<uint64_t[:n]> columns[j].ts.data())}
+      for i in range(columns[j].msg.num_sigs):
+        msg[columns[j].msg.sigs[i].name.decode('utf8')] = np.array(<double[:n]> columns[j].values[i].data())
+      ret[columns[j].bus][columns[j].msg.name.decode('utf8')] = msg
+    return dict(ret)
+
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -104,7 +104,52 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+  def signal_type(address, sig):
+    if checksum_type is not None and sig.name == "CHECKSUM":
+      return checksum_type.upper() + "_CHECKSUM"
+    elif checksum_type in ("honda", "volkswagen") and sig.name == "COUNTER":
+      return checksum_type.upper() + "_COUNTER"
+    elif address in [0x200, 0x201] and sig.name == "CHECKSUM_PEDAL":
+      return "PEDAL_CHECKSUM"
+    elif address in [0x200, 0x201] and sig.name == "COUNTER_PEDAL":
+      return "PEDAL_COUNTER"
+    return "DEFAULT"
+
+  def signal_b1(sig):
+    return sig.start_bit if sig.is_little_endian else (sig.start_bit // 8) * 8 + (-sig.start_bit - 1) % 8
+
+  def signal_extract(sig):
+    # C expression for the raw value of sig: one unaligned 64 bit load at a constant byte offset,
+    # plus the following byte for the rare signal that spills over the loaded word
+    b1 = signal_b1(sig)
+    byte, shift = b1 // 8, b1 % 8
+    mask = "0x%XULL" % (2 ** sig.size - 1)
+    if sig.is_little_endian:
+      expr = "load_u64_le(dat + %d)" % byte
+      if shift:
+        expr = "(%s >> %d)" % (expr, shift)
+      if shift + sig.size > 64:
+        expr = "(%s | ((uint64_t)dat[%d] << %d))" % (expr, byte + 8, 64 - shift)
+      return "%s & %s" % (expr, mask)
+    else:
+      if shift + sig.size <= 64:
+        return "(load_u64_be(dat + %d) >> %d) & %s" % (byte, 64 - shift - sig.size, mask)
+      return "((load_u64_be(dat + %d) << %d) | (dat[%d] >> %d)) >> %d" % (byte, shift, byte + 8, 8 - shift, 64 - sig.size)
+
+  # the decoders below rely on this, parser.cc only verifies one checksum and one counter per message
+  for address, msg_name, msg_size, sigs in msgs:
+    if msg_size > 64:
+      sys.exit("%s %s: message is longer than 64 bytes" % (dbc_name, msg_name))
+    for sig in sigs:
+      if signal_b1(sig) // 8 >= 64:
+        sys.exit("%s %s: %s starts beyond 64 bytes" % (dbc_name, msg_name, sig.name))
+    types = [signal_type(address, sig) for sig in sigs]
+    if sum(t.endswith("_CHECKSUM") for t in types) > 1 or sum(t.endswith("_COUNTER") for t in types) > 1:
+      sys.exit("%s %s: more than one CHECKSUM or COUNTER signal" % (dbc_name, msg_name))
+
+  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len,
+                                signal_type=signal_type, signal_b1=signal_b1,
+                                signal_extract=signal_extract)
 
   with open(out_fn, "a+") as out_f:
     out_f.seek(0)
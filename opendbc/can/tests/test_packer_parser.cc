@@ -0,0 +1,331 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "opendbc/can/common.h"
+
+// The 8 byte implementation the generated decoders and the byte buffer packer replaced, as it was:
+// the frame as one 64 bit word, one shift and mask per signal, checksums over the word.
+namespace previous {
+
+uint64_t read_u64_be(const uint8_t *v) {
+  return ((uint64_t)v[0] << 56 | (uint64_t)v[1] << 48 | (uint64_t)v[2] << 40 | (uint64_t)v[3] << 32 |
+          (uint64_t)v[4] << 24 | (uint64_t)v[5] << 16 | (uint64_t)v[6] << 8 | (uint64_t)v[7]);
+}
+
+uint64_t read_u64_le(const uint8_t *v) {
+  return ((uint64_t)v[0] | (uint64_t)v[1] << 8 | (uint64_t)v[2] << 16 | (uint64_t)v[3] << 24 |
+          (uint64_t)v[4] << 32 | (uint64_t)v[5] << 40 | (uint64_t)v[6] << 48 | (uint64_t)v[7] << 56);
+}
+
+uint64_t ReverseBytes(uint64_t x) {
+  return ((x & 0xff00000000000000ull) >> 56) |
+          ((x & 0x00ff000000000000ull) >> 40) |
+          ((x & 0x0000ff0000000000ull) >> 24) |
+          ((x & 0x000000ff00000000ull) >> 8) |
+          ((x & 0x00000000ff000000ull) << 8) |
+          ((x & 0x0000000000ff0000ull) << 24) |
+          ((x & 0x000000000000ff00ull) << 40) |
+          ((x & 0x00000000000000ffull) << 56);
+}
+
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 4; // remove checksum
+
+  int s = 0;
+  bool extended = address > 0x7FF; // extended can
+  while (address) { s += (address & 0xF); address >>= 4; }
+  while (d) { s += (d & 0xF); d >>= 4; }
+  s = 8-s;
+  if (extended) s += 3;
+  s &= 0xF;
+
+  return s;
+}
+
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  unsigned int s = l;
+  while (address) { s += address & 0xFF; address >>= 8; }
+  while (d) { s += d & 0xFF; d >>= 8; }
+
+  return s & 0xFF;
+}
+
+// MessageState::parse for one signal
+double decode(const Signal &sig, const uint8_t *dat) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
+
+  int64_t tmp;
+  if (sig.is_little_endian){
+    tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
+  } else {
+    tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+  }
+
+  if (sig.is_signed) {
+    tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
+  }
+  return tmp * sig.factor + sig.offset;
+}
+
+bool checksum_ok(const Msg *msg, const Signal &sig, const uint8_t *dat) {
+  int64_t tmp = decode(sig, dat);
+  if (sig.type == SignalType::HONDA_CHECKSUM) {
+    return honda_checksum(msg->address, read_u64_be(dat), msg->size) == tmp;
+  } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
+    return toyota_checksum(msg->address, read_u64_be(dat), msg->size) == tmp;
+  }
+  return true;
+}
+
+uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival) {
+  int shift = sig.is_little_endian? sig.b1 : sig.bo;
+  uint64_t mask = ((1ULL << sig.b2)-1) << shift;
+  uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
+  if (sig.is_little_endian) {
+    dat = ReverseBytes(dat);
+    mask = ReverseBytes(mask);
+  }
+  ret &= ~mask;
+  ret |= dat;
+  return ret;
+}
+
+// CANPacker::pack, then the byte order of CANPacker.make_can_msg in packer_pyx
+std::vector<uint8_t> pack(const Msg *msg, const std::vector<SignalPackValue> &signals, int counter) {
+  auto find = [&](const char *name) -> const Signal * {
+    for (int i = 0; i < msg->num_sigs; i++) {
+      if (strcmp(msg->sigs[i].name, name) == 0) return &msg->sigs[i];
+    }
+    return nullptr;
+  };
+
+  uint64_t ret = 0;
+  for (const auto& sigval : signals) {
+    const Signal *sig = find(sigval.name);
+    int64_t ival = (int64_t)(round((sigval.value - sig->offset) / sig->factor));
+    if (ival < 0) {
+      ival = (1ULL << sig->b2) + ival;
+    }
+    ret = set_value(ret, *sig, ival);
+  }
+
+  if (counter >= 0) {
+    ret = set_value(ret, *find("COUNTER"), counter);
+  }
+
+  if (const Signal *sig = find("CHECKSUM")) {
+    if (sig->type == SignalType::HONDA_CHECKSUM) {
+      ret = set_value(ret, *sig, honda_checksum(msg->address, ret, msg->size));
+    } else if (sig->type == SignalType::TOYOTA_CHECKSUM) {
+      ret = set_value(ret, *sig, toyota_checksum(msg->address, ret, msg->size));
+    }
+  }
+
+  std::vector<uint8_t> dat(msg->size);
+  for (int i = 0; i < msg->size; i++) dat[i] = ret >> (56 - 8 * i);
+  return dat;
+}
+
+}  // namespace previous
+
+struct TestMessage {
+  const char *dbc;
+  uint32_t address;
+  bool has_checksum;
+};
+
+// signed big endian signals across byte boundaries with honda and toyota checksums and counters,
+// and little endian ones across byte boundaries with an offset
+static const TestMessage test_messages[] = {
+  {"honda_civic_touring_2016_can_generated", 0xE4, true},  // STEERING_CONTROL
+  {"honda_civic_touring_2016_can_generated", 0x14A, true},  // STEERING_SENSORS
+  {"toyota_corolla_2017_pt_generated", 0x2E4, true},  // STEERING_LKA
+  {"toyota_corolla_2017_pt_generated", 0x25, false},  // STEER_ANGLE_SENSOR
+  {"hyundai_kia_generic", 0x340, false},  // LKAS11
+};
+
+static const Msg *find_msg(const char *dbc_name, uint32_t address) {
+  const DBC *dbc = dbc_lookup(dbc_name);
+  REQUIRE(dbc != nullptr);
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    if (dbc->msgs[i].address == address) return &dbc->msgs[i];
+  }
+  FAIL("no message " << address << " in " << dbc_name);
+  return nullptr;
+}
+
+static const Signal *find_sig(const Msg *msg, const char *name) {
+  for (int i = 0; i < msg->num_sigs; i++) {
+    if (strcmp(msg->sigs[i].name, name) == 0) return &msg->sigs[i];
+  }
+  return nullptr;
+}
+
+// random values for every signal that isn't a checksum or counter, any raw value of the signal
+static std::vector<SignalPackValue> random_values(const Msg *msg, std::mt19937 &rng) {
+  std::vector<SignalPackValue> values;
+  for (int i = 0; i < msg->num_sigs; i++) {
+    const Signal &sig = msg->sigs[i];
+    if (sig.type != SignalType::DEFAULT) continue;
+    int64_t raw = std::uniform_int_distribution<uint64_t>(0, (1ULL << sig.b2) - 1)(rng);
+    if (sig.is_signed && (raw >> (sig.b2 - 1))) raw -= 1LL << sig.b2;
+    values.push_back({sig.name, raw * sig.factor + sig.offset});
+  }
+  return values;
+}
+
+// a serialized can Event
+static std::string can_event(uint64_t mono_time, const std::vector<std::pair<uint32_t, std::vector<uint8_t>>> &frames,
+                             uint8_t bus = 0) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(mono_time);
+  auto can = event.initCan(frames.size());
+  for (int i = 0; i < frames.size(); i++) {
+    can[i].setAddress(frames[i].first);
+    can[i].setBusTime(0);
+    can[i].setDat(kj::arrayPtr(frames[i].second.data(), frames[i].second.size()));
+    can[i].setSrc(bus);
+  }
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  return std::string((const char *)bytes.begin(), bytes.size());
+}
+
+TEST_CASE("CANPacker packs like the previous implementation") {
+  std::mt19937 rng(1);
+  for (const auto &t : test_messages) {
+    INFO(t.dbc << " " << t.address);
+    const Msg *msg = find_msg(t.dbc, t.address);
+    CANPacker packer(t.dbc);
+
+    for (int i = 0; i < 1000; i++) {
+      auto values = random_values(msg, rng);
+      const int cnt = msg->counter_type != SignalType::DEFAULT ? i % (1 << msg->counter_size) : -1;
+      std::vector<uint8_t> expected = previous::pack(msg, values, cnt);
+      REQUIRE(packer.pack(t.address, values, cnt) == expected);
+
+      // through a resolved handle
+      std::vector<std::string> names;
+      std::vector<double> vals;
+      for (auto &v : values) {
+        names.push_back(v.name);
+        vals.push_back(v.value);
+      }
+      uint8_t dat[CAN_BUF_SIZE];
+      REQUIRE(packer.pack(packer.resolve(t.address, names), vals.data(), cnt, dat) == msg->size);
+      REQUIRE(std::vector<uint8_t>(dat, dat + msg->size) == expected);
+      for (int j = msg->size; j < CAN_BUF_SIZE; j++) REQUIRE(dat[j] == 0);
+    }
+  }
+}
+
+TEST_CASE("CANParser parses like the previous implementation") {
+  std::mt19937 rng(2);
+  for (const auto &t : test_messages) {
+    INFO(t.dbc << " " << t.address);
+    const Msg *msg = find_msg(t.dbc, t.address);
+    CANPacker packer(t.dbc);
+
+    std::vector<SignalParseOptions> sig_options;
+    for (int i = 0; i < msg->num_sigs; i++) {
+      sig_options.push_back({t.address, msg->sigs[i].name, 0});
+    }
+    CANParser parser(0, t.dbc, {{t.address, 0}}, sig_options);
+
+    for (int i = 0; i < 1000; i++) {
+      const int cnt = msg->counter_type != SignalType::DEFAULT ? i % (1 << msg->counter_size) : -1;
+      std::vector<uint8_t> dat = packer.pack(t.address, random_values(msg, rng), cnt);
+      uint8_t padded[8] = {};
+      memcpy(padded, dat.data(), dat.size());
+
+      // the frame is only taken if its checksum and counter check out
+      bool checksum_ok = true;
+      for (int j = 0; j < msg->num_sigs; j++) {
+        checksum_ok = checksum_ok && previous::checksum_ok(msg, msg->sigs[j], padded);
+      }
+      REQUIRE(checksum_ok);
+
+      parser.update_string(can_event(2 * i + 2, {{t.address, dat}}), false);
+      auto latest = parser.query_latest();
+      REQUIRE(latest.size() == msg->num_sigs);
+      for (const auto &v : latest) {
+        INFO(v.name);
+        REQUIRE(v.address == t.address);
+        REQUIRE(v.value == previous::decode(*find_sig(msg, v.name), padded));
+      }
+
+      if (t.has_checksum) {
+        // the checksums are in the last byte, a flipped bit in the first one gets the frame dropped
+        std::vector<uint8_t> bad = dat;
+        bad[0] ^= 1 << (i % 8);
+        parser.update_string(can_event(2 * i + 3, {{t.address, bad}}), false);
+        REQUIRE(parser.query_latest().empty());
+      }
+    }
+  }
+}
+
+TEST_CASE("CANBulkDecoder decodes like the previous implementation") {
+  std::mt19937 rng(3);
+  for (const auto &t : test_messages) {
+    INFO(t.dbc << " " << t.address);
+    const Msg *msg = find_msg(t.dbc, t.address);
+    CANPacker packer(t.dbc);
+    const uint32_t other = t.address == 0x25 ? 0xE4 : 0x25;  // not decoded
+
+    // a log with the message on bus 0 and 1, a frame of another address and a truncated event at the end
+    std::string log;
+    std::vector<std::vector<uint8_t>> frames[2];
+    for (int i = 0; i < 500; i++) {
+      for (uint8_t bus : {0, 1}) {
+        frames[bus].push_back(packer.pack(t.address, random_values(msg, rng), -1));
+        log += can_event(1000 + i, {{other, {1, 2, 3}}, {t.address, frames[bus].back()}}, bus);
+      }
+    }
+    const std::string last = can_event(1000, {{t.address, frames[0][0]}});
+    log += last.substr(0, last.size() / 2);
+
+    for (int num_threads : {1, 4}) {
+      CANBulkDecoder decoder(t.dbc, {t.address, 0x7FF});
+      auto columns = decoder.decode(log.data(), log.size(), false, num_threads);
+      REQUIRE(columns.size() == 2);
+      for (int bus = 0; bus < 2; bus++) {
+        const MessageColumns &c = columns[bus];
+        REQUIRE(c.bus == bus);
+        REQUIRE(c.address == t.address);
+        REQUIRE(c.msg == msg);
+        REQUIRE(c.ts.size() == frames[bus].size());
+        REQUIRE(c.values.size() == msg->num_sigs);
+        for (int j = 0; j < frames[bus].size(); j++) {
+          REQUIRE(c.ts[j] == 1000 + j);
+          uint8_t padded[8] = {};
+          memcpy(padded, frames[bus][j].data(), frames[bus][j].size());
+          for (int s = 0; s < msg->num_sigs; s++) {
+            REQUIRE(c.values[s][j] == previous::decode(msg->sigs[s], padded));
+          }
+        }
+      }
+    }
+
+    // one bus only
+    auto columns = CANBulkDecoder(t.dbc, {t.address}, 1).decode(log.data(), log.size());
+    REQUIRE(columns.size() == 1);
+    REQUIRE(columns[0].bus == 1);
+    REQUIRE(columns[0].ts.size() == frames[1].size());
+  }
+}
@@ -12,6 +12,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
 #include <thread>
 #include <unordered_map>
 
@@ -38,6 +39,7 @@
 Panda * panda = nullptr;
 std::atomic<bool> safety_setter_thread_running(false);
 std::atomic<bool> ignition(false);
+CanRecvStats can_recv_stats;
 
 ExitHandler do_exit;
 
@@ -179,13 +181,6 @@ static bool usb_retry_connect() {
   return !do_exit;
 }
 
-void can_recv(PubMaster &pm) {
-  kj::Array<capnp::word> can_data;
-  panda->can_receive(can_data);
-  auto bytes = can_data.asBytes();
-  pm.send("can", bytes.begin(), bytes.size());
-}
-
 void can_send_thread(bool fake_send) {
   LOGD("start send thread");
 
@@ -197,7 +192,8 @@ void can_send_thread(bool fake_send) {
 
   // run as fast as messages come in
   while (!do_exit && panda->connected) {
-    Message * msg = subscriber->receive();
+    // borrowed from the queue and copied out, so nothing is allocated per message
+    Message * msg = subscriber->receive_borrowed();
 
     if (!msg) {
       if (errno == EINTR) {
@@ -206,7 +202,16 @@ void can_send_thread(bool fake_send) {
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
+    auto words = aligned_buf.align(msg);
+    // the copy may be torn if the slot was overwritten while it was held, never send that
+    const bool intact = msg->release();
+    delete msg;
+    if (!intact) {
+      LOGE("sendcan overwritten while it was read, dropped");
+      continue;
+    }
+
+    capnp::FlatArrayMessageReader cmsg(words);
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
     //Dont send if older than 1 second
@@ -215,8 +220,6 @@ void can_send_thread(bool fake_send) {
         panda->can_send(event.getSendcan());
       }
     }
-
-    delete msg;
   }
 
   delete subscriber;
@@ -229,25 +232,42 @@ void can_recv_thread() {
   // can = 8006
   PubMaster pm({"can"});
 
-  // run at 100hz
-  const uint64_t dt = 10000000ULL;
-  uint64_t next_frame_time = nanos_since_boot() + dt;
+  // the event is built straight in the msgq slot, nothing is allocated or copied per batch
+  auto publish = [&](const uint8_t *data, size_t size) -> size_t {
+    CanRecordsInfo info = can_records_info(data, size);
+    if (info.size != size) {
+      LOGW("Truncated CAN FD frame");
+    }
+    const size_t max_size = CanEventBuilder::max_size(info.frames, info.data_words);
+    char *buf = pm.reserve("can", max_size);
+    if (buf == nullptr) return 0;
+
+    CanEventBuilder event(buf, max_size, false, panda->comms_healthy, info.frames);
+    can_records_unpack(data, info, event);
+    pm.commit("can", event.finish());
+    return info.frames;
+  };
+
+  // by default publish at most at 100hz, the rate controlsd runs at
+  const int coalesce_us = util::getenv("BOARDD_CAN_COALESCE_US", 10000);
+  std::unique_ptr<UsbBulkIn> usb = panda->can_bulk_in();
+  CanReceiver receiver(usb.get(), &can_recv_stats, publish, coalesce_us);
 
   while (!do_exit && panda->connected) {
-    can_recv(pm);
-
-    uint64_t cur_time = nanos_since_boot();
-    int64_t remaining = next_frame_time - cur_time;
-    if (remaining > 0) {
-      std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
-    } else {
-      if (ignition) {
-        LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
-      }
-      next_frame_time = cur_time;
+    const uint64_t batches = can_recv_stats.batches;
+    if (!receiver.update(10)) {
+      LOGE("lost connection");
+      panda->connected = false;
+      break;
+    }
+    if (can_recv_stats.overflows > 0) {
+      panda->comms_healthy = false;
     }
 
-    next_frame_time += dt;
+    // keep publishing on a quiet bus, consumers time out on can
+    if (can_recv_stats.batches == batches) {
+      publish(nullptr, 0);
+    }
   }
 }
 
@@ -382,6 +402,19 @@ void panda_state_thread(bool spoofing_started) {
     ps.setHeartbeatLost((bool)(pandaState.heartbeat_lost));
     ps.setHarnessStatus(cereal::PandaState::HarnessStatus(pandaState.car_harness_status));
 
+    auto can_recv = ps.initCanRecv();
+    can_recv.setTransfers(can_recv_stats.transfers);
+    can_recv.setFullTransfers(can_recv_stats.full_transfers);
+    can_recv.setEmptyTransfers(can_recv_stats.empty_transfers);
+    can_recv.setOverflows(can_recv_stats.overflows);
+    can_recv.setErrors(can_recv_stats.errors);
+    can_recv.setBatches(can_recv_stats.batches);
+    can_recv.setFrames(can_recv_stats.frames);
+    uint32_t latency_avg_us, latency_max_us;
+    can_recv_stats.reset_latency(latency_avg_us, latency_max_us);
+    can_recv.setLatencyAvgUs(latency_avg_us);
+    can_recv.setLatencyMaxUs(latency_max_us);
+
     // Convert faults bitset to capnp list
     std::bitset<sizeof(pandaState.faults) * 8> fault_bits(pandaState.faults);
     auto faults = ps.initFaults(fault_bits.count());
@@ -0,0 +1,146 @@
+#include "selfdrive/boardd/can_capnp.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "selfdrive/common/timing.h"
+
+const uint8_t dlc_to_len[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+uint8_t len_to_dlc(size_t len) {
+  uint8_t dlc = 0;
+  while (dlc_to_len[dlc] < len) dlc++;
+  return dlc;
+}
+
+size_t can_record_data_len(uint32_t header) {
+  const uint8_t dlc = header & 0xF;
+  return (header & CAN_RECORD_FD) ? dlc_to_len[dlc] : std::min<size_t>(dlc, CAN_MAX_DATA_LEN);
+}
+
+size_t can_record_size(size_t len) {
+  return std::max<size_t>(1, (8 + len + CAN_RECORD_SIZE - 1) / CAN_RECORD_SIZE) * CAN_RECORD_SIZE;
+}
+
+static inline size_t data_words(size_t len) {
+  return (len + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+}
+
+CanRecordsInfo can_records_info(const uint8_t *data, size_t size) {
+  CanRecordsInfo info;
+  while (info.size + CAN_RECORD_SIZE <= size) {
+    uint32_t header;
+    memcpy(&header, data + info.size + 4, sizeof(header));
+    const size_t len = can_record_data_len(header);
+    const size_t rec_size = can_record_size(len);
+    if (info.size + rec_size > size) break;
+
+    info.size += rec_size;
+    info.data_words += data_words(len);
+    info.frames++;
+  }
+  return info;
+}
+
+// ***** CanEventBuilder *****
+
+size_t CanEventBuilder::max_size(size_t num_frames, size_t data_words) {
+  using EventLayout = cereal::Event::_capnpPrivate;
+  using CanDataLayout = cereal::CanData::_capnpPrivate;
+
+  // segment table, root pointer, the Event, then the list tag and its structs, then the data
+  const size_t words = 1 + 1 + EventLayout::dataWordSize + EventLayout::pointerCount +
+                       1 + num_frames * (CanDataLayout::dataWordSize + CanDataLayout::pointerCount) +
+                       data_words;
+  return words * sizeof(capnp::word);
+}
+
+// the segment after the segment table, zeroed as capnp builders expect
+static kj::ArrayPtr<capnp::word> zeroed_segment(char *buf, size_t size) {
+  assert((uintptr_t)buf % sizeof(capnp::word) == 0);
+  memset(buf, 0, size);
+  return kj::arrayPtr((capnp::word *)buf + 1, size / sizeof(capnp::word) - 1);
+}
+
+CanEventBuilder::CanEventBuilder(char *buf, size_t size, bool sendcan, bool valid, size_t num_frames)
+  : buf((capnp::word *)buf), msg(zeroed_segment(buf, size)) {
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  event.setValid(valid);
+  can_data = sendcan ? event.initSendcan(num_frames) : event.initCan(num_frames);
+}
+
+size_t CanEventBuilder::finish() {
+  auto segments = msg.getSegmentsForOutput();
+  assert(segments.size() == 1);
+
+  // a single segment: the segment count minus one, then its size in words
+  uint32_t *table = (uint32_t *)buf;
+  table[0] = 0;
+  table[1] = segments[0].size();
+  return (1 + segments[0].size()) * sizeof(capnp::word);
+}
+
+// ***** records *****
+
+void can_records_unpack(const uint8_t *data, const CanRecordsInfo &info, CanEventBuilder &event) {
+  size_t pos = 0;
+  for (size_t i = 0; i < info.frames; i++) {
+    uint32_t rec[2];
+    memcpy(rec, data + pos, sizeof(rec));
+
+    auto c = event[i];
+    if (rec[0] & 4) {
+      // extended
+      c.setAddress(rec[0] >> 3);
+    } else {
+      // normal
+      c.setAddress(rec[0] >> 21);
+    }
+    c.setBusTime(rec[1] >> 16);
+    const size_t len = can_record_data_len(rec[1]);
+    c.setDat(kj::arrayPtr(data + pos + sizeof(rec), len));
+    c.setSrc((rec[1] >> 4) & 0xff);
+    pos += can_record_size(len);
+  }
+}
+
+size_t can_records_pack_size(capnp::List<cereal::CanData>::Reader can_data_list, size_t max_len) {
+  size_t size = 0;
+  for (auto cmsg : can_data_list) {
+    const size_t len = cmsg.getDat().size();
+    if (len > max_len) continue;
+    size += can_record_size(dlc_to_len[len_to_dlc(len)]);
+  }
+  return size;
+}
+
+size_t can_records_pack(capnp::List<cereal::CanData>::Reader can_data_list, uint8_t *out, size_t max_len) {
+  assert(max_len <= CANFD_MAX_DATA_LEN);
+  size_t pos = 0, dropped = 0;
+  for (auto cmsg : can_data_list) {
+    auto can_data = cmsg.getDat();
+    if (can_data.size() > max_len) {
+      dropped++;
+      continue;
+    }
+    uint8_t dlc = len_to_dlc(can_data.size());
+
+    // frames are zero padded to the next valid CAN FD length
+    const size_t rec_size = can_record_size(dlc_to_len[dlc]);
+    memset(out + pos, 0, rec_size);
+
+    uint32_t header[2];
+    if (cmsg.getAddress() >= 0x800) { // extended
+      header[0] = (cmsg.getAddress() << 3) | 5;
+    } else { // normal
+      header[0] = (cmsg.getAddress() << 21) | 1;
+    }
+    header[1] = dlc | (cmsg.getSrc() << 4) | (dlc > CAN_MAX_DATA_LEN ? CAN_RECORD_FD : 0);
+    memcpy(out + pos, header, sizeof(header));
+    memcpy(out + pos + sizeof(header), can_data.begin(), can_data.size());
+    pos += rec_size;
+  }
+  return dropped;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <capnp/message.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// CAN frames are exchanged over USB as 16 byte records: an id word, a word with the DLC,
+// bus and bus time, and 8 bytes of data. CAN FD frames are marked with CAN_RECORD_FD in the
+// second word, use DLC codes 9 to 15 and their payload continues into as many following
+// records as needed. A classic frame may have a DLC over 8 too, it still carries 8 bytes.
+#define CAN_RECORD_SIZE 0x10
+#define CAN_RECORD_FD (1U << 15)
+#define CAN_MAX_DATA_LEN 8
+#define CANFD_MAX_DATA_LEN 64
+
+extern const uint8_t dlc_to_len[16];
+uint8_t len_to_dlc(size_t len);
+// bytes of data of a frame, from the second header word
+size_t can_record_data_len(uint32_t header);
+// size of a frame on the wire, the payload starts after the two header words
+size_t can_record_size(size_t len);
+
+// what a buffer of received records holds, up to the last whole frame
+struct CanRecordsInfo {
+  size_t frames = 0;
+  size_t data_words = 0;  // capnp words the frame data takes
+  size_t size = 0;        // bytes of whole frames
+};
+CanRecordsInfo can_records_info(const uint8_t *data, size_t size);
+
+// Builds a flat can or sendcan Event in place, e.g. in a msgq slot from PubMaster::reserve,
+// instead of in a MallocMessageBuilder that messageToFlatArray then copies out of.
+class CanEventBuilder {
+public:
+  // bytes of the flat message, exact for frames whose data takes data_words in total
+  static size_t max_size(size_t num_frames, size_t data_words);
+
+  // buf must be word aligned and hold size >= max_size() bytes, it is zeroed here
+  CanEventBuilder(char *buf, size_t size, bool sendcan, bool valid, size_t num_frames);
+  cereal::CanData::Builder operator[](size_t i) { return can_data[i]; }
+  // writes the segment table, returns the size of the flat message at the start of buf
+  size_t finish();
+
+private:
+  capnp::word *buf;
+  capnp::FlatMessageBuilder msg;
+  capnp::List<cereal::CanData>::Builder can_data;
+};
+
+// fills the frames of the Event from received records, info from can_records_info()
+void can_records_unpack(const uint8_t *data, const CanRecordsInfo &info, CanEventBuilder &event);
+
+// bytes of records for sending the frames with at most max_len bytes of data
+size_t can_records_pack_size(capnp::List<cereal::CanData>::Reader can_data_list, size_t max_len);
+// writes the records to out, which holds can_records_pack_size() bytes. Frames with more
+// than max_len bytes of data are left out, returns how many were.
+size_t can_records_pack(capnp::List<cereal::CanData>::Reader can_data_list, uint8_t *out, size_t max_len);
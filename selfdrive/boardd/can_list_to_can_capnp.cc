@@ -1,4 +1,7 @@
-#include "cereal/messaging/messaging.h"
+#include <string>
+#include <vector>
+
+#include "selfdrive/boardd/can_capnp.h"
 
 typedef struct {
 	long address;
@@ -10,22 +13,24 @@ typedef struct {
 extern "C" {
 
 void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid) {
-  MessageBuilder msg;
-  auto event = msg.initEvent(valid);
+  size_t data_words = 0;
+  for (auto &f : can_list) data_words += (f.dat.size() + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+
+  // built in a reused buffer, then copied once into the returned bytes
+  static thread_local std::vector<capnp::word> buf;
+  const size_t max_size = CanEventBuilder::max_size(can_list.size(), data_words);
+  if (buf.size() < max_size / sizeof(capnp::word)) buf.resize(max_size / sizeof(capnp::word));
 
-  auto canData = sendCan ? event.initSendcan(can_list.size()) : event.initCan(can_list.size());
-  int j = 0;
-  for (auto it = can_list.begin(); it != can_list.end(); it++, j++) {
-    auto c = canData[j];
-    c.setAddress(it->address);
-    c.setBusTime(it->busTime);
-    c.setDat(kj::arrayPtr((uint8_t*)it->dat.data(), it->dat.size()));
-    c.setSrc(it->src);
+  CanEventBuilder event((char *)buf.data(), max_size, sendCan, valid, can_list.size());
+  for (size_t i = 0; i < can_list.size(); i++) {
+    auto &f = can_list[i];
+    auto c = event[i];
+    c.setAddress(f.address);
+    c.setBusTime(f.busTime);
+    c.setDat(kj::arrayPtr((uint8_t*)f.dat.data(), f.dat.size()));
+    c.setSrc(f.src);
   }
-  const uint64_t msg_size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
-  out.resize(msg_size);
-  kj::ArrayOutputStream output_stream(kj::ArrayPtr<capnp::byte>((unsigned char *)out.data(), msg_size));
-  capnp::writeMessage(output_stream, msg);
+  out.assign((const char *)buf.data(), event.finish());
 }
 
 }
@@ -0,0 +1,205 @@
+#include "selfdrive/boardd/can_receiver.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+
+// ***** libusb *****
+
+LibusbBulkIn::~LibusbBulkIn() {
+  cancel();
+  for (auto t : transfers) libusb_free_transfer(t);
+}
+
+bool LibusbBulkIn::init(int num_transfers, int length) {
+  for (int i = 0; i < num_transfers; i++) {
+    buffers.emplace_back(length);
+    libusb_transfer *t = libusb_alloc_transfer(0);
+    if (t == NULL) return false;
+    // no timeout, the panda answers as soon as it sees the IN token
+    libusb_fill_bulk_transfer(t, dev_handle, endpoint, buffers[i].data(), length, transfer_cb, this, 0);
+    transfers.push_back(t);
+  }
+  return true;
+}
+
+bool LibusbBulkIn::submit(int slot) {
+  std::lock_guard lk(lock);
+  int err = libusb_submit_transfer(transfers[slot]);
+  if (err != 0) {
+    LOGE_100("usb error %d \"%s\" submitting transfer", err, libusb_strerror((enum libusb_error)err));
+    return false;
+  }
+  in_flight++;
+  return true;
+}
+
+void LIBUSB_CALL LibusbBulkIn::transfer_cb(libusb_transfer *transfer) {
+  LibusbBulkIn *self = (LibusbBulkIn *)transfer->user_data;
+  const int slot = std::find(self->transfers.begin(), self->transfers.end(), transfer) - self->transfers.begin();
+
+  UsbTransferStatus status;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: status = UsbTransferStatus::COMPLETED; break;
+    case LIBUSB_TRANSFER_OVERFLOW: status = UsbTransferStatus::OVERFLOW; break;
+    case LIBUSB_TRANSFER_NO_DEVICE: status = UsbTransferStatus::NO_DEVICE; break;
+    case LIBUSB_TRANSFER_CANCELLED: status = UsbTransferStatus::CANCELLED; break;
+    default: status = UsbTransferStatus::ERROR; break;
+  }
+
+  std::lock_guard lk(self->lock);
+  self->completed.push_back({slot, transfer->actual_length, status, nanos_since_boot()});
+  self->in_flight--;
+  self->completed_flag = 1;
+}
+
+void LibusbBulkIn::wait(int timeout_us, std::vector<UsbCompletion> &done) {
+  {
+    std::lock_guard lk(lock);
+    if (completed.empty()) {
+      completed_flag = 0;
+    }
+  }
+  if (!completed_flag) {
+    struct timeval tv = {.tv_sec = timeout_us / 1000000, .tv_usec = timeout_us % 1000000};
+    libusb_handle_events_timeout_completed(ctx, &tv, &completed_flag);
+  }
+
+  std::lock_guard lk(lock);
+  done.insert(done.end(), completed.begin(), completed.end());
+  completed.clear();
+}
+
+void LibusbBulkIn::cancel() {
+  {
+    std::lock_guard lk(lock);
+    for (auto t : transfers) libusb_cancel_transfer(t);
+  }
+  // cancelled transfers still complete through event handling, give up after a second
+  const uint64_t deadline = nanos_since_boot() + 1000000000ULL;
+  while (nanos_since_boot() < deadline) {
+    {
+      std::lock_guard lk(lock);
+      completed.clear();
+      if (in_flight == 0) return;
+    }
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 10000};
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+  LOGE("%d bulk transfers didn't come back after cancel", in_flight);
+}
+
+// ***** stats *****
+
+void CanRecvStats::add_latency(uint64_t us) {
+  latency_sum_us += us;
+  latency_count++;
+  uint32_t max = latency_max_us.load(std::memory_order_relaxed);
+  while (us > max && !latency_max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+}
+
+void CanRecvStats::reset_latency(uint32_t &avg_us, uint32_t &max_us) {
+  const uint64_t sum = latency_sum_us.exchange(0), count = latency_count.exchange(0);
+  avg_us = count > 0 ? sum / count : 0;
+  max_us = latency_max_us.exchange(0);
+}
+
+// ***** receiver *****
+
+CanReceiver::CanReceiver(UsbBulkIn *usb, CanRecvStats *stats, Publish publish, int coalesce_us,
+                         int num_transfers, int transfer_size)
+  : usb(usb), stats(stats), publish(publish), coalesce_ns(coalesce_us * 1000ULL), transfer_size(transfer_size) {
+  bool ret = usb->init(num_transfers, transfer_size);
+  assert(ret);
+  for (int i = 0; i < num_transfers; i++) {
+    if (!usb->submit(i)) device_lost = true;
+  }
+  pending.reserve(CAN_RECV_MAX_BATCH + transfer_size);
+}
+
+CanReceiver::~CanReceiver() {
+  usb->cancel();
+}
+
+bool CanReceiver::update(int timeout_ms) {
+  const uint64_t end = nanos_since_boot() + timeout_ms * 1000000ULL;
+  while (!device_lost) {
+    uint64_t now = nanos_since_boot();
+
+    // rearm slots that came back empty
+    for (auto it = idle.begin(); it != idle.end();) {
+      if (now - it->second >= CAN_RECV_IDLE_US * 1000ULL) {
+        if (!usb->submit(it->first)) device_lost = true;
+        it = idle.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    if (pending_since != 0 && now >= flush_time()) {
+      flush(now);
+    }
+    if (now >= end) break;
+
+    // sleep until the next thing to do: end of the window, an idle slot to rearm, or the timeout
+    uint64_t wake = end;
+    if (pending_since != 0) wake = std::min(wake, flush_time());
+    for (auto &[slot, ts] : idle) wake = std::min<uint64_t>(wake, ts + CAN_RECV_IDLE_US * 1000ULL);
+
+    done.clear();
+    usb->wait(std::max<int64_t>(0, (int64_t)(wake - now) / 1000), done);
+    for (auto &c : done) handle(c);
+  }
+  return !device_lost;
+}
+
+void CanReceiver::handle(const UsbCompletion &c) {
+  switch (c.status) {
+    case UsbTransferStatus::NO_DEVICE:
+      device_lost = true;
+      return;
+    case UsbTransferStatus::CANCELLED:
+      return;
+    case UsbTransferStatus::OVERFLOW:
+      stats->overflows++;
+      LOGE_100("overflow got 0x%x", c.actual);
+      break;
+    case UsbTransferStatus::ERROR:
+      stats->errors++;
+      break;
+    case UsbTransferStatus::COMPLETED:
+      break;
+  }
+
+  if (c.status == UsbTransferStatus::COMPLETED && c.actual > 0) {
+    stats->transfers++;
+    if (c.actual == transfer_size) stats->full_transfers++;
+
+    // copy out and hand the buffer straight back, so a transfer is in flight while we publish
+    pending.insert(pending.end(), usb->buffer(c.slot), usb->buffer(c.slot) + c.actual);
+    if (pending_since == 0) pending_since = c.ts;
+    if (!usb->submit(c.slot)) device_lost = true;
+
+    const uint64_t now = nanos_since_boot();
+    if (now >= flush_time() || pending.size() >= CAN_RECV_MAX_BATCH) {
+      flush(now);
+    }
+  } else {
+    if (c.status == UsbTransferStatus::COMPLETED) stats->empty_transfers++;
+    idle.push_back({c.slot, c.ts});
+  }
+}
+
+void CanReceiver::flush(uint64_t now) {
+  if (pending.empty()) return;
+
+  stats->frames += publish(pending.data(), pending.size());
+  stats->batches++;
+  stats->add_latency((nanos_since_boot() - pending_since) / 1000);
+
+  pending.clear();
+  pending_since = 0;
+  last_flush = now;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#define CAN_RECV_TRANSFERS 4
+// an idle panda answers a bulk IN right away with no data, empty transfers are
+// resubmitted after this instead of spinning
+#define CAN_RECV_IDLE_US 1000
+// a coalesced batch is published early once this much data is pending
+#define CAN_RECV_MAX_BATCH (4 * 0x1000)
+
+enum class UsbTransferStatus {
+  COMPLETED,
+  OVERFLOW,  // the device sent more than the buffer holds, data was lost
+  ERROR,
+  NO_DEVICE,
+  CANCELLED,
+};
+
+struct UsbCompletion {
+  int slot;
+  int actual;
+  UsbTransferStatus status;
+  uint64_t ts;  // nanos_since_boot when the transfer completed
+};
+
+// Bulk IN transfers for the CanReceiver, libusb on the device and a mock in tests.
+class UsbBulkIn {
+public:
+  virtual ~UsbBulkIn() {}
+  // allocates num_transfers buffers of length bytes, nothing is submitted yet
+  virtual bool init(int num_transfers, int length) = 0;
+  virtual uint8_t *buffer(int slot) = 0;
+  virtual bool submit(int slot) = 0;
+  // waits up to timeout_us for transfers to complete, appends them to done in completion order
+  virtual void wait(int timeout_us, std::vector<UsbCompletion> &done) = 0;
+  // cancels the transfers in flight and waits for them to come back
+  virtual void cancel() = 0;
+};
+
+class LibusbBulkIn : public UsbBulkIn {
+public:
+  LibusbBulkIn(libusb_context *ctx, libusb_device_handle *dev_handle, unsigned char endpoint)
+    : ctx(ctx), dev_handle(dev_handle), endpoint(endpoint) {}
+  ~LibusbBulkIn();
+  bool init(int num_transfers, int length);
+  uint8_t *buffer(int slot) { return buffers[slot].data(); }
+  bool submit(int slot);
+  void wait(int timeout_us, std::vector<UsbCompletion> &done);
+  void cancel();
+
+private:
+  static void LIBUSB_CALL transfer_cb(libusb_transfer *transfer);
+
+  libusb_context *ctx;
+  libusb_device_handle *dev_handle;
+  const unsigned char endpoint;
+  std::vector<libusb_transfer *> transfers;
+  std::vector<std::vector<uint8_t>> buffers;
+
+  // completions can be handled on any thread doing libusb event handling,
+  // e.g. one in a synchronous control transfer
+  std::mutex lock;
+  std::vector<UsbCompletion> completed;
+  int in_flight = 0;
+  int completed_flag = 0;
+};
+
+// counters for pandaState, written by the receive thread
+struct CanRecvStats {
+  std::atomic<uint64_t> transfers = 0;       // with data
+  std::atomic<uint64_t> full_transfers = 0;  // came back full, the panda likely had more queued
+  std::atomic<uint64_t> empty_transfers = 0;
+  std::atomic<uint64_t> overflows = 0;
+  std::atomic<uint64_t> errors = 0;
+  std::atomic<uint64_t> batches = 0;
+  std::atomic<uint64_t> frames = 0;
+
+  // from the first data of a batch arriving to it being published, since the last reset
+  std::atomic<uint64_t> latency_sum_us = 0;
+  std::atomic<uint64_t> latency_count = 0;
+  std::atomic<uint32_t> latency_max_us = 0;
+
+  void add_latency(uint64_t us);
+  // average and max latency since the last call
+  void reset_latency(uint32_t &avg_us, uint32_t &max_us);
+};
+
+// Keeps several bulk IN transfers in flight and publishes CAN data as soon as a transfer
+// returns some, instead of polling on a timer. Frames that arrive while one transfer is
+// being handled land in the next one. With a coalescing window, batches are at least
+// coalesce_us apart: data that comes in sooner after a publish is held and sent as one
+// batch at the end of the window, bounding the message rate.
+class CanReceiver {
+public:
+  // gets the CAN records of a batch, returns the number of frames in it
+  using Publish = std::function<size_t(const uint8_t *data, size_t size)>;
+
+  CanReceiver(UsbBulkIn *usb, CanRecvStats *stats, Publish publish, int coalesce_us = 0,
+              int num_transfers = CAN_RECV_TRANSFERS, int transfer_size = 0x1000);
+  ~CanReceiver();
+
+  // handles transfers for up to timeout_ms, false once the device is gone
+  bool update(int timeout_ms);
+
+private:
+  void handle(const UsbCompletion &c);
+  uint64_t flush_time() const { return std::max(pending_since, last_flush + coalesce_ns); }
+  void flush(uint64_t now);
+
+  UsbBulkIn *usb;
+  CanRecvStats *stats;
+  Publish publish;
+  const uint64_t coalesce_ns;
+  const int transfer_size;
+  bool device_lost = false;
+
+  std::vector<UsbCompletion> done;
+  std::vector<std::pair<int, uint64_t>> idle;  // empty slots and when they came back
+
+  std::vector<uint8_t> pending;
+  uint64_t pending_since = 0;
+  uint64_t last_flush = 0;
+};
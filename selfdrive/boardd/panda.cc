@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <vector>
@@ -11,30 +12,11 @@
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 
-Panda::Panda() {
-  // init libusb
-  int err = libusb_init(&ctx);
-  if (err != 0) { goto fail; }
-
-#if LIBUSB_API_VERSION >= 0x01000106
-  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
-#else
-  libusb_set_debug(ctx, 3);
-#endif
-
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
-  if (dev_handle == NULL) { goto fail; }
-
-  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
-    libusb_detach_kernel_driver(dev_handle, 0);
+Panda::Panda(std::unique_ptr<PandaTransport> t) : transport(std::move(t)) {
+  if (!transport) {
+    transport = panda_transport_open();
   }
 
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
-
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
-
   hw_type = get_hw_type();
 
   assert((hw_type != cereal::PandaState::PandaType::WHITE_PANDA) &&
@@ -42,31 +24,14 @@ Panda::Panda() {
 
   has_rtc = (hw_type == cereal::PandaState::PandaType::UNO) ||
             (hw_type == cereal::PandaState::PandaType::DOS);
-
-  return;
-
-fail:
-  cleanup();
-  throw std::runtime_error("Error connecting to panda");
 }
 
 Panda::~Panda() {
   std::lock_guard lk(usb_lock);
-  cleanup();
+  transport.reset();
   connected = false;
 }
 
-void Panda::cleanup() {
-  if (dev_handle) {
-    libusb_release_interface(dev_handle, 0);
-    libusb_close(dev_handle);
-  }
-
-  if (ctx) {
-    libusb_exit(ctx);
-  }
-}
-
 void Panda::handle_usb_issue(int err, const char func[]) {
   LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
   if (err == LIBUSB_ERROR_NO_DEVICE) {
@@ -86,7 +51,7 @@ int Panda::usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigne
 
   std::lock_guard lk(usb_lock);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+    err = transport->control_transfer(bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
 
@@ -103,7 +68,7 @@ int Panda::usb_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned
 
   std::lock_guard lk(usb_lock);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+    err = transport->control_transfer(bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
 
@@ -122,7 +87,7 @@ int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int lengt
   do {
     // Try sending can messages. If the receive buffer on the panda is full it will NAK
     // and libusb will try again. After 5ms, it will time out. We will drop the messages.
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = transport->bulk_transfer(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       LOGW("Transmit buffer full");
@@ -146,7 +111,7 @@ int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length
   std::lock_guard lk(usb_lock);
 
   do {
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = transport->bulk_transfer(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       break; // timeout is okay to exit, recv still happened
@@ -262,25 +227,15 @@ void Panda::send_heartbeat() {
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
-  static std::vector<uint32_t> send;
-  const int msg_count = can_data_list.size();
-
-  send.resize(msg_count*0x10);
-
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
-    if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
-    } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
-    }
-    auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+  // the buffer only grows, so there is no allocation once it fits the largest batch
+  const size_t size = can_records_pack_size(can_data_list, can_send_max_len);
+  if (send_buf.size() < size) send_buf.resize(size);
+  if (size_t dropped = can_records_pack(can_data_list, send_buf.data(), can_send_max_len); dropped > 0) {
+    LOGE("dropped %zu frames with more than %zu bytes of data", dropped, can_send_max_len);
   }
+  if (size == 0) return;
 
-  usb_bulk_write(3, (unsigned char*)send.data(), send.size(), 5);
+  usb_bulk_write(3, send_buf.data(), size, 5);
 }
 
 int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
@@ -294,27 +249,18 @@ int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
-  MessageBuilder msg;
-  auto evt = msg.initEvent();
-  evt.setValid(comms_healthy);
-
-  // populate message
-  auto canData = evt.initCan(num_msg);
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
-    } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
-    }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+  CanRecordsInfo info = can_records_info((const uint8_t *)data, recv);
+  if (info.size != (size_t)recv) {
+    LOGW("Truncated CAN FD frame");
   }
-  out_buf = capnp::messageToFlatArray(msg);
+  const size_t max_size = CanEventBuilder::max_size(info.frames, info.data_words);
+  out_buf = kj::heapArray<capnp::word>(max_size / sizeof(capnp::word));
+  CanEventBuilder event((char *)out_buf.begin(), max_size, false, comms_healthy, info.frames);
+  can_records_unpack((const uint8_t *)data, info, event);
+  event.finish();
   return recv;
 }
+
+std::unique_ptr<UsbBulkIn> Panda::can_bulk_in() {
+  return transport->bulk_in(0x81);
+}
@@ -3,6 +3,7 @@
 #include <atomic>
 #include <cstdint>
 #include <ctime>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <vector>
@@ -11,6 +12,9 @@
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/boardd/can_capnp.h"
+#include "selfdrive/boardd/can_receiver.h"
+#include "selfdrive/boardd/panda_transport.h"
 
 // double the FIFO size
 #define RECV_SIZE (0x1000)
@@ -42,20 +46,23 @@ struct __attribute__((packed)) health_t {
 
 class Panda {
  private:
-  libusb_context *ctx = NULL;
-  libusb_device_handle *dev_handle = NULL;
+  std::unique_ptr<PandaTransport> transport;
   std::mutex usb_lock;
+  std::vector<uint8_t> send_buf;
   void handle_usb_issue(int err, const char func[]);
-  void cleanup();
 
  public:
-  Panda();
+  // talks to the board through panda_transport_open() unless given another transport
+  Panda(std::unique_ptr<PandaTransport> transport = nullptr);
   ~Panda();
 
   std::atomic<bool> connected = true;
   std::atomic<bool> comms_healthy = true;
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool has_rtc = false;
+  // The firmware takes every record on the send endpoint for one classic frame. Raise to
+  // CANFD_MAX_DATA_LEN only for firmware that parses CAN FD records.
+  size_t can_send_max_len = CAN_MAX_DATA_LEN;
 
   // HW communication
   int usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
@@ -81,4 +88,6 @@ class Panda {
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
   int can_receive(kj::Array<capnp::word>& out_buf);
+  // asynchronous transfers on the CAN receive endpoint, for a CanReceiver
+  std::unique_ptr<UsbBulkIn> can_bulk_in();
 };
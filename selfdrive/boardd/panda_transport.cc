@@ -0,0 +1,69 @@
+#include "selfdrive/boardd/panda_transport.h"
+
+#include <stdexcept>
+
+std::unique_ptr<PandaTransport> panda_transport_open() {
+  return std::make_unique<LibusbTransport>();
+}
+
+LibusbTransport::LibusbTransport() {
+  // init libusb
+  int err = libusb_init(&ctx);
+  if (err != 0) { goto fail; }
+
+#if LIBUSB_API_VERSION >= 0x01000106
+  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#else
+  libusb_set_debug(ctx, 3);
+#endif
+
+  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  if (dev_handle == NULL) { goto fail; }
+
+  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
+    libusb_detach_kernel_driver(dev_handle, 0);
+  }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  return;
+
+fail:
+  cleanup();
+  throw std::runtime_error("Error connecting to panda");
+}
+
+LibusbTransport::~LibusbTransport() {
+  cleanup();
+}
+
+void LibusbTransport::cleanup() {
+  if (dev_handle) {
+    libusb_release_interface(dev_handle, 0);
+    libusb_close(dev_handle);
+    dev_handle = NULL;
+  }
+
+  if (ctx) {
+    libusb_exit(ctx);
+    ctx = NULL;
+  }
+}
+
+int LibusbTransport::control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                                      unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+}
+
+int LibusbTransport::bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred,
+                                   unsigned int timeout) {
+  return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+}
+
+std::unique_ptr<UsbBulkIn> LibusbTransport::bulk_in(unsigned char endpoint) {
+  return std::make_unique<LibusbBulkIn>(ctx, dev_handle, endpoint);
+}
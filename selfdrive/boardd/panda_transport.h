@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <libusb-1.0/libusb.h>
+
+#include "selfdrive/boardd/can_receiver.h"
+
+// What Panda talks to the board through: libusb, or a simulated panda for host-side testing.
+// Calls follow libusb_control_transfer and libusb_bulk_transfer, errors are LIBUSB_ERROR codes.
+class PandaTransport {
+public:
+  virtual ~PandaTransport() {}
+  // returns the bytes transferred, or a negative LIBUSB_ERROR
+  virtual int control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                               unsigned char *data, uint16_t wLength, unsigned int timeout) = 0;
+  // returns 0 or a negative LIBUSB_ERROR, with the bytes moved in transferred
+  virtual int bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred,
+                            unsigned int timeout) = 0;
+  // asynchronous transfers on a bulk IN endpoint
+  virtual std::unique_ptr<UsbBulkIn> bulk_in(unsigned char endpoint) = 0;
+};
+
+// The transport of a Panda made without one. Defined by the program: a libusb panda in
+// boardd, a simulated one in tests/boardd_sim.
+std::unique_ptr<PandaTransport> panda_transport_open();
+
+class LibusbTransport : public PandaTransport {
+public:
+  // throws std::runtime_error if there is no panda
+  LibusbTransport();
+  ~LibusbTransport();
+  int control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                       unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+  std::unique_ptr<UsbBulkIn> bulk_in(unsigned char endpoint);
+
+private:
+  void cleanup();
+
+  libusb_context *ctx = NULL;
+  libusb_device_handle *dev_handle = NULL;
+};
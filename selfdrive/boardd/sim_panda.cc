@@ -0,0 +1,390 @@
+#include "selfdrive/boardd/sim_panda.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <capnp/serialize.h>
+#include <zstd.h>
+
+#include "cereal/gen/cpp/car.capnp.h"
+#include "selfdrive/boardd/can_capnp.h"
+#include "selfdrive/boardd/panda.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+#define SIM_HEARTBEAT_TIMEOUT_NS (2 * 1000000000ULL)
+
+// ***** SimCanQueue *****
+
+bool SimCanQueue::push(const uint8_t *data, size_t size) {
+  std::lock_guard lk(lock);
+  if (records.size() >= max_records) return false;
+  records.emplace_back(data, data + size);
+  cv.notify_all();
+  return true;
+}
+
+void SimCanQueue::inject(UsbTransferStatus status) {
+  std::lock_guard lk(lock);
+  if (status == UsbTransferStatus::NO_DEVICE) no_device = true;
+  injected.push_back(status);
+  cv.notify_all();
+}
+
+size_t SimCanQueue::queued() {
+  std::lock_guard lk(lock);
+  return records.size();
+}
+
+bool SimCanQueue::device_lost() {
+  std::lock_guard lk(lock);
+  return no_device;
+}
+
+UsbTransferStatus SimCanQueue::read(uint8_t *buf, int length, int &actual) {
+  actual = 0;
+  if (!injected.empty()) {
+    UsbTransferStatus status = injected.front();
+    // a lost device stays lost
+    if (status != UsbTransferStatus::NO_DEVICE) injected.pop_front();
+    return status;
+  }
+  while (!records.empty() && actual + records.front().size() <= (size_t)length) {
+    memcpy(buf + actual, records.front().data(), records.front().size());
+    actual += records.front().size();
+    records.pop_front();
+  }
+  return UsbTransferStatus::COMPLETED;
+}
+
+// ***** SimBulkIn *****
+
+bool SimBulkIn::init(int num_transfers, int length) {
+  buffers.assign(num_transfers, std::vector<uint8_t>(length));
+  return true;
+}
+
+bool SimBulkIn::submit(int slot) {
+  if (queue->device_lost()) return false;
+
+  std::lock_guard lk(queue->lock);
+  submitted.push_back(slot);
+  queue->cv.notify_all();
+  return true;
+}
+
+void SimBulkIn::wait(int timeout_us, std::vector<UsbCompletion> &done) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+  std::unique_lock lk(queue->lock);
+  while (true) {
+    const size_t n = done.size();
+    complete(done);
+    if (done.size() > n) return;
+    if (queue->cv.wait_until(lk, deadline) == std::cv_status::timeout) {
+      complete(done);
+      return;
+    }
+  }
+}
+
+void SimBulkIn::cancel() {
+  std::lock_guard lk(queue->lock);
+  submitted.clear();
+}
+
+void SimBulkIn::complete(std::vector<UsbCompletion> &done) {
+  while (!submitted.empty()) {
+    const int slot = submitted.front();
+    int actual = 0;
+    UsbTransferStatus status = queue->read(buffers[slot].data(), buffers[slot].size(), actual);
+    if (status == UsbTransferStatus::COMPLETED && actual == 0 && !empty_completions) return;
+
+    done.push_back({slot, actual, status, nanos_since_boot()});
+    submitted.pop_front();
+    if (status == UsbTransferStatus::NO_DEVICE) {
+      // everything else in flight fails too
+      for (int s : submitted) done.push_back({s, 0, status, nanos_since_boot()});
+      submitted.clear();
+    }
+  }
+}
+
+// ***** SimPanda *****
+
+SimPandaConfig SimPandaConfig::parse(const std::string &s) {
+  SimPandaConfig config;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    const size_t eq = item.find('=');
+    const std::string key = item.substr(0, eq), value = eq == std::string::npos ? "" : item.substr(eq + 1);
+    if (key == "log") {
+      config.log_path = value;
+    } else if (key == "speed") {
+      config.speed = std::max(atof(value.c_str()), 0.01);
+    } else if (key == "rate") {
+      config.rate = atoi(value.c_str());
+    } else if (key == "buses") {
+      config.num_buses = std::clamp(atoi(value.c_str()), 1, 4);
+    } else if (key == "errors") {
+      config.errors = atof(value.c_str());
+    } else if (key == "disconnect") {
+      config.disconnect_s = atof(value.c_str());
+    } else if (!key.empty()) {
+      LOGE("unknown simulated panda option %s", key.c_str());
+    }
+  }
+  return config;
+}
+
+SimPanda::SimPanda(const SimPandaConfig &config)
+  : config(config), rx_queue(SIM_PANDA_RX_QUEUE), start_ns(nanos_since_boot()) {
+  last_heartbeat = start_ns;
+  if (!config.log_path.empty() && !load_log()) {
+    throw std::runtime_error("Error loading " + config.log_path);
+  }
+  LOGW("simulated panda: %s", config.log_path.empty() ? (std::to_string(config.rate) + " frames/s").c_str()
+                                                      : config.log_path.c_str());
+  thread = std::thread(&SimPanda::bus_thread, this);
+}
+
+SimPanda::~SimPanda() {
+  stop = true;
+  thread.join();
+}
+
+bool SimPanda::load_log() {
+  std::string raw = util::read_file(config.log_path);
+  if (raw.empty()) return false;
+
+  if (config.log_path.size() > 4 && config.log_path.compare(config.log_path.size() - 4, 4, ".zst") == 0) {
+    std::string out;
+    ZSTD_DStream *dstream = ZSTD_createDStream();
+    ZSTD_inBuffer in = {raw.data(), raw.size(), 0};
+    std::vector<char> buf(ZSTD_DStreamOutSize());
+    while (in.pos < in.size) {
+      ZSTD_outBuffer o = {buf.data(), buf.size(), 0};
+      size_t ret = ZSTD_decompressStream(dstream, &o, &in);
+      if (ZSTD_isError(ret)) {
+        LOGE("failed to decompress %s: %s", config.log_path.c_str(), ZSTD_getErrorName(ret));
+        break;
+      }
+      out.append(buf.data(), o.pos);
+    }
+    ZSTD_freeDStream(dstream);
+    raw = std::move(out);
+  }
+
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), words.size() * sizeof(capnp::word));
+
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    try {
+      capnp::FlatArrayMessageReader reader(remaining);
+      remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+
+      auto event = reader.getRoot<cereal::Event>();
+      if (event.which() != cereal::Event::CAN) continue;
+
+      log_times.push_back(event.getLogMonoTime());
+      log_offsets.push_back(log_records.size());
+      for (auto c : event.getCan()) {
+        auto dat = c.getDat();
+        const size_t len = std::min<size_t>(dat.size(), CANFD_MAX_DATA_LEN);
+        const uint8_t dlc = len_to_dlc(len);
+        const size_t pos = log_records.size();
+        log_records.resize(pos + can_record_size(dlc_to_len[dlc]));
+
+        uint32_t header[2];
+        header[0] = c.getAddress() >= 0x800 ? ((c.getAddress() << 3) | 4) : (c.getAddress() << 21);
+        header[1] = dlc | ((c.getSrc() & 0xff) << 4) | ((uint32_t)c.getBusTime() << 16) |
+                    (dlc > CAN_MAX_DATA_LEN ? CAN_RECORD_FD : 0);
+        memcpy(&log_records[pos], header, sizeof(header));
+        memcpy(&log_records[pos + sizeof(header)], dat.begin(), len);
+      }
+    } catch (const kj::Exception &e) {
+      LOGE("stopped reading %s at a corrupt event", config.log_path.c_str());
+      break;
+    }
+  }
+  log_offsets.push_back(log_records.size());
+  LOGW("loaded %zu can events from %s", log_times.size(), config.log_path.c_str());
+  return !log_times.empty();
+}
+
+void SimPanda::push_frame(uint32_t addr, uint8_t bus, uint16_t bus_time, const uint8_t *dat, size_t len) {
+  const uint8_t dlc = len_to_dlc(len);
+  uint8_t rec[CAN_RECORD_SIZE * 5] = {};
+  uint32_t header[2];
+  header[0] = addr >= 0x800 ? ((addr << 3) | 4) : (addr << 21);
+  header[1] = dlc | (bus << 4) | ((uint32_t)bus_time << 16) | (dlc > CAN_MAX_DATA_LEN ? CAN_RECORD_FD : 0);
+  memcpy(rec, header, sizeof(header));
+  memcpy(rec + sizeof(header), dat, len);
+
+  rx_frames++;
+  if (!rx_queue.push(rec, can_record_size(dlc_to_len[dlc]))) can_rx_errs++;
+}
+
+void SimPanda::bus_thread() {
+  set_thread_name("sim_panda");
+
+  uint64_t seq = 0, errors = 0;
+  size_t log_idx = 0;
+  uint64_t cycle_start = start_ns;
+
+  while (!stop) {
+    const uint64_t now = nanos_since_boot();
+    const double elapsed_s = (now - start_ns) * 1e-9;
+
+    if (config.disconnect_s > 0 && elapsed_s > config.disconnect_s) {
+      LOGW("simulated panda disconnecting");
+      rx_queue.inject(UsbTransferStatus::NO_DEVICE);
+      break;
+    }
+
+    // failed transfers, alternating like bus errors and a full receive buffer would
+    for (; errors < (uint64_t)(elapsed_s * config.errors); errors++) {
+      rx_queue.inject(errors % 2 ? UsbTransferStatus::OVERFLOW : UsbTransferStatus::ERROR);
+      can_rx_errs++;
+    }
+
+    if (log_times.empty()) {
+      const uint64_t due = elapsed_s * config.rate;
+      for (; seq < due; seq++) {
+        const uint8_t bus = seq % config.num_buses;
+        push_frame(0x100 + (seq / config.num_buses) % 64, bus, now / 1000, (const uint8_t *)&seq, sizeof(seq));
+      }
+    } else {
+      // play back at speed, from the start again at the end of the log
+      while (log_idx < log_times.size() &&
+             cycle_start + (log_times[log_idx] - log_times[0]) / config.speed <= now) {
+        for (size_t pos = log_offsets[log_idx]; pos < log_offsets[log_idx + 1];) {
+          uint32_t header[2];
+          memcpy(header, &log_records[pos], sizeof(header));
+          const size_t size = can_record_size(can_record_data_len(header[1]));
+          rx_frames++;
+          if (!rx_queue.push(&log_records[pos], size)) can_rx_errs++;
+          pos += size;
+        }
+        log_idx++;
+      }
+      if (log_idx == log_times.size()) {
+        log_idx = 0;
+        cycle_start = now;
+      }
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void SimPanda::fill_health(unsigned char *data, uint16_t length) {
+  const uint64_t now = nanos_since_boot();
+  health_t health = {};
+  health.uptime = (now - start_ns) / 1000000000ULL;
+  health.voltage = 12000;
+  health.current = 500;
+  health.can_rx_errs = can_rx_errs;
+  health.ignition_line = 1;
+  health.car_harness_status = 1;  // normal
+  health.usb_power_mode = usb_power_mode;
+  health.safety_model = safety_model;
+  health.safety_param = safety_param;
+  health.power_save_enabled = power_save;
+  health.heartbeat_lost = now - last_heartbeat > SIM_HEARTBEAT_TIMEOUT_NS;
+  memcpy(data, &health, std::min<size_t>(length, sizeof(health)));
+}
+
+int SimPanda::control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                               unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  if (rx_queue.device_lost()) return LIBUSB_ERROR_NO_DEVICE;
+
+  if (bmRequestType & LIBUSB_ENDPOINT_IN) {
+    switch (bRequest) {
+      case 0xc1:  // hw type
+        data[0] = (uint8_t)cereal::PandaState::PandaType::BLACK_PANDA;
+        return 1;
+      case 0xd2:  // health
+        fill_health(data, wLength);
+        return std::min<int>(wLength, sizeof(health_t));
+      case 0xd3:  // firmware signature
+      case 0xd4:
+        for (int i = 0; i < wLength; i++) data[i] = (bRequest == 0xd3 ? 0 : 64) + i;
+        return wLength;
+      case 0xd0: {  // serial
+        const char serial[] = "5111111111111111";
+        memcpy(data, serial, std::min<size_t>(wLength, sizeof(serial) - 1));
+        return std::min<int>(wLength, sizeof(serial) - 1);
+      }
+      case 0xb2:  // fan rpm
+        if (wLength >= sizeof(uint16_t)) {
+          const uint16_t rpm = fan_speed * 50;
+          memcpy(data, &rpm, sizeof(rpm));
+        }
+        return std::min<int>(wLength, sizeof(uint16_t));
+      default:
+        // e.g. no gps data
+        return 0;
+    }
+  }
+
+  switch (bRequest) {
+    case 0xdc: safety_model = wValue; safety_param = wIndex; break;
+    case 0xe5: loopback = wValue; break;
+    case 0xe6: usb_power_mode = wValue; break;
+    case 0xe7: power_save = wValue; break;
+    case 0xb1: fan_speed = wValue; break;
+    case 0xf3: last_heartbeat = nanos_since_boot(); break;
+    default: break;
+  }
+  return 0;
+}
+
+int SimPanda::bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred,
+                            unsigned int timeout) {
+  *transferred = 0;
+  if (rx_queue.device_lost()) return LIBUSB_ERROR_NO_DEVICE;
+
+  if (endpoint == 0x81) {
+    std::lock_guard lk(rx_queue.lock);
+    switch (rx_queue.read(data, length, *transferred)) {
+      case UsbTransferStatus::COMPLETED: return 0;
+      case UsbTransferStatus::OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+      case UsbTransferStatus::NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+      default: return LIBUSB_ERROR_IO;
+    }
+  } else if (endpoint == 3) {
+    // sendcan: sent frames come back as received on bus + 128, blocked ones on bus + 192,
+    // and in loopback as received on their own bus
+    const bool tx_allowed = safety_model != (uint16_t)cereal::CarParams::SafetyModel::SILENT &&
+                            safety_model != (uint16_t)cereal::CarParams::SafetyModel::NO_OUTPUT;
+    CanRecordsInfo info = can_records_info(data, length);
+    for (size_t pos = 0; pos < info.size;) {
+      uint32_t header[2];
+      memcpy(header, data + pos, sizeof(header));
+      const uint32_t addr = (header[0] & 4) ? (header[0] >> 3) : (header[0] >> 21);
+      const uint8_t bus = (header[1] >> 4) & 0xff;
+      const size_t len = can_record_data_len(header[1]);
+      const uint16_t bus_time = nanos_since_boot() / 1000;
+
+      push_frame(addr, bus | (tx_allowed ? 0x80 : 0xc0), bus_time, data + pos + sizeof(header), len);
+      if (loopback && tx_allowed) push_frame(addr, bus, bus_time, data + pos + sizeof(header), len);
+      pos += can_record_size(len);
+    }
+    tx_frames += info.frames;
+  }
+  // other endpoints, e.g. gps, take everything and have nothing to read
+  *transferred = (endpoint & LIBUSB_ENDPOINT_IN) ? 0 : length;
+  return 0;
+}
+
+std::unique_ptr<UsbBulkIn> SimPanda::bulk_in(unsigned char endpoint) {
+  assert(endpoint == 0x81);
+  return std::make_unique<SimBulkIn>(&rx_queue);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/boardd/can_receiver.h"
+#include "selfdrive/boardd/panda_transport.h"
+
+// records the panda holds before dropping received frames, like its CAN RX queue
+#define SIM_PANDA_RX_QUEUE 0x1000
+
+// CAN records waiting to be read from a simulated device. Transfer errors can be injected
+// and are returned by the next IN transfer, NO_DEVICE sticks.
+class SimCanQueue {
+public:
+  SimCanQueue(size_t max_records = SIZE_MAX) : max_records(max_records) {}
+
+  // false if the queue is full and the record was dropped
+  bool push(const uint8_t *data, size_t size);
+  void inject(UsbTransferStatus status);
+  size_t queued();
+  bool device_lost();
+
+  // moves whole records into buf, up to length bytes, or returns an injected error.
+  // Doesn't wait for data. Called with lock held.
+  UsbTransferStatus read(uint8_t *buf, int length, int &actual);
+
+  std::mutex lock;
+  std::condition_variable cv;
+
+private:
+  const size_t max_records;
+  std::deque<std::vector<uint8_t>> records;
+  std::deque<UsbTransferStatus> injected;
+  bool no_device = false;
+};
+
+// UsbBulkIn on a SimCanQueue, submitted transfers complete in order
+class SimBulkIn : public UsbBulkIn {
+public:
+  // empty_completions: answer right away with no data while nothing is queued,
+  // like the panda does, instead of holding the transfer until data comes in
+  SimBulkIn(SimCanQueue *queue, bool empty_completions = true) : queue(queue), empty_completions(empty_completions) {}
+  bool init(int num_transfers, int length);
+  uint8_t *buffer(int slot) { return buffers[slot].data(); }
+  bool submit(int slot);
+  void wait(int timeout_us, std::vector<UsbCompletion> &done);
+  void cancel();
+
+private:
+  // completes what can be completed now, called with the queue lock held
+  void complete(std::vector<UsbCompletion> &done);
+
+  SimCanQueue *queue;
+  const bool empty_completions;
+  std::vector<std::vector<uint8_t>> buffers;
+  std::deque<int> submitted;
+};
+
+struct SimPandaConfig {
+  std::string log_path;      // rlog, optionally .zst, whose can events are played back
+  double speed = 1.0;        // playback speed
+  int rate = 4000;           // frames per second of synthetic traffic, without a log
+  int num_buses = 3;
+  double errors = 0.0;       // failed receive transfers per second, as on a bus error
+  double disconnect_s = 0.0; // the panda goes away after this long, 0 for never
+
+  // from a comma separated list like "log=/data/rlog.zst,speed=2" or "rate=4000,errors=1"
+  static SimPandaConfig parse(const std::string &s);
+};
+
+// A panda in software for running boardd on a host. Plays back recorded or synthetic CAN
+// traffic, accepts sendcan and the control requests boardd makes, and reports them in its
+// health like the firmware does. Received frames carry a sequence number in the first
+// data bytes of synthetic traffic, so consumers can check for loss.
+class SimPanda : public PandaTransport {
+public:
+  SimPanda(const SimPandaConfig &config);
+  ~SimPanda();
+  int control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                       unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+  std::unique_ptr<UsbBulkIn> bulk_in(unsigned char endpoint);
+
+  // frames put on the buses and sent by boardd, and the safety boardd set, for tests
+  std::atomic<uint64_t> rx_frames = 0;
+  std::atomic<uint64_t> tx_frames = 0;
+  std::atomic<uint16_t> safety_model = 0;
+  std::atomic<int16_t> safety_param = 0;
+
+private:
+  bool load_log();
+  void bus_thread();
+  void push_frame(uint32_t addr, uint8_t bus, uint16_t bus_time, const uint8_t *dat, size_t len);
+  void fill_health(unsigned char *data, uint16_t length);
+
+  const SimPandaConfig config;
+  SimCanQueue rx_queue;
+  std::atomic<bool> stop = false;
+  std::thread thread;
+  const uint64_t start_ns;
+
+  // recorded can events: when, and their frames as receive records
+  std::vector<uint64_t> log_times;
+  std::vector<size_t> log_offsets;
+  std::vector<uint8_t> log_records;
+
+  std::atomic<bool> loopback = false;
+  std::atomic<uint16_t> fan_speed = 0;
+  std::atomic<uint8_t> usb_power_mode = 0;
+  std::atomic<uint8_t> power_save = 0;
+  std::atomic<uint32_t> can_rx_errs = 0;
+  std::atomic<uint64_t> last_heartbeat = 0;
+};
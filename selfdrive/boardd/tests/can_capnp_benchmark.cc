@@ -0,0 +1,253 @@
+// Compares serializing can and reading sendcan through MessageBuilder/messageToFlatArray and
+// copied messages, as boardd used to, against CanEventBuilder in a reserved msgq slot and
+// borrowed messages. Counts heap allocations and whole message copies per batch.
+// Prints one JSON object per path, e.g.
+//   ./can_capnp_benchmark -f 256 -n 10000 > results.jsonl
+
+#include <getopt.h>
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/boardd/can_capnp.h"
+
+// ***** allocation counting *****
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+static std::atomic<uint64_t> allocs = 0;
+
+extern "C" void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+  allocs++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) {
+  allocs++;
+  return __libc_realloc(p, size);
+}
+
+// ***** bench *****
+
+struct BenchResult {
+  const char *path;
+  uint64_t allocs = 0;
+  uint64_t copies = 0;
+  double total_us = 0;
+};
+
+static inline double micros() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a burst of classic frames as the panda sends them, with a CAN FD frame every fd_every frames
+static std::vector<uint8_t> make_records(int num_frames, int fd_every) {
+  std::vector<uint8_t> records;
+  for (int i = 0; i < num_frames; i++) {
+    const uint8_t dlc = (fd_every > 0 && i % fd_every == 0) ? 15 : 8;
+    const size_t pos = records.size();
+    records.resize(pos + can_record_size(dlc_to_len[dlc]));
+
+    uint32_t header[2] = {(uint32_t)(0x100 + i % 0x700) << 21,
+                          dlc | ((i % 3) << 4) | ((uint32_t)i << 16) | (dlc > CAN_MAX_DATA_LEN ? CAN_RECORD_FD : 0)};
+    memcpy(&records[pos], header, sizeof(header));
+    for (size_t j = 0; j < dlc_to_len[dlc]; j++) records[pos + 8 + j] = i + j;
+  }
+  return records;
+}
+
+// can as boardd built it before: a MallocMessageBuilder, flattened, then copied into the queue
+static size_t can_message_builder(PubSocket *sock, const std::vector<uint8_t> &records, uint64_t &copies) {
+  CanRecordsInfo info = can_records_info(records.data(), records.size());
+  MessageBuilder msg;
+  auto evt = msg.initEvent();
+  auto can_data = evt.initCan(info.frames);
+  size_t pos = 0;
+  for (size_t i = 0; i < info.frames; i++) {
+    uint32_t rec[2];
+    memcpy(rec, &records[pos], sizeof(rec));
+    can_data[i].setAddress(rec[0] >> 21);
+    can_data[i].setBusTime(rec[1] >> 16);
+    const size_t len = can_record_data_len(rec[1]);
+    can_data[i].setDat(kj::arrayPtr(&records[pos + 8], len));
+    can_data[i].setSrc((rec[1] >> 4) & 0xff);
+    pos += can_record_size(len);
+  }
+  auto flat = capnp::messageToFlatArray(msg);
+  auto bytes = flat.asBytes();
+  sock->send((char *)bytes.begin(), bytes.size());
+  copies += 2;  // messageToFlatArray, then into the queue
+  return bytes.size();
+}
+
+static size_t can_reserve(PubSocket *sock, const std::vector<uint8_t> &records, uint64_t &copies) {
+  CanRecordsInfo info = can_records_info(records.data(), records.size());
+  const size_t max_size = CanEventBuilder::max_size(info.frames, info.data_words);
+  char *buf = sock->reserve(max_size);
+  CanEventBuilder event(buf, max_size, false, true, info.frames);
+  can_records_unpack(records.data(), info, event);
+  if (messaging_use_zmq()) copies++;  // reserved in a local buffer that send() copies out of
+  return sock->commit(event.finish());
+}
+
+// reads sendcan and packs its records, as can_send_thread does
+static void sendcan_receive(SubSocket *sock, bool borrow, AlignedBuffer &aligned_buf, std::vector<uint8_t> &send_buf,
+                            uint64_t &copies) {
+  Message *msg = borrow ? sock->receive_borrowed(true) : sock->receive(true);
+  assert(msg != NULL);
+  if (!borrow) copies++;
+
+  // copied out of the borrow and released before parsing, a borrow can be overwritten while it's held
+  auto words = aligned_buf.align(msg);
+  copies++;
+  const bool intact = msg->release();
+  delete msg;
+  if (!intact) return;
+
+  capnp::FlatArrayMessageReader cmsg(words);
+  auto can_data_list = cmsg.getRoot<cereal::Event>().getSendcan();
+  const size_t size = can_records_pack_size(can_data_list, CANFD_MAX_DATA_LEN);
+  if (borrow) {
+    if (send_buf.size() < size) send_buf.resize(size);
+  } else {
+    // the old static vector, cleared and grown frame by frame
+    send_buf.clear();
+    send_buf.resize(size);
+  }
+  can_records_pack(can_data_list, send_buf.data(), CANFD_MAX_DATA_LEN);
+}
+
+static void print_result(const BenchResult &r, int frames, int batches) {
+  printf("{\"path\": \"%s\", \"frames\": %d, \"batches\": %d, \"allocs_per_batch\": %.2f, \"copies_per_batch\": %.2f, "
+         "\"mean_us\": %.2f}\n",
+         r.path, frames, batches, (double)r.allocs / batches, (double)r.copies / batches, r.total_us / batches);
+  fflush(stdout);
+}
+
+// both builders have to produce the same can event
+static bool check_same(PubSocket *pub, SubSocket *sub, const std::vector<uint8_t> &records) {
+  uint64_t copies = 0;
+  AlignedBuffer a, b;
+  can_message_builder(pub, records, copies);
+  Message *old_msg = sub->receive(true);
+  can_reserve(pub, records, copies);
+  Message *new_msg = sub->receive(true);
+  if (old_msg == NULL || new_msg == NULL) return false;
+
+  capnp::FlatArrayMessageReader old_reader(a.align(old_msg)), new_reader(b.align(new_msg));
+  auto old_can = old_reader.getRoot<cereal::Event>().getCan();
+  auto new_can = new_reader.getRoot<cereal::Event>().getCan();
+  bool same = old_can.size() == new_can.size();
+  for (size_t i = 0; same && i < old_can.size(); i++) {
+    same = old_can[i].getAddress() == new_can[i].getAddress() && old_can[i].getBusTime() == new_can[i].getBusTime() &&
+           old_can[i].getSrc() == new_can[i].getSrc() && old_can[i].getDat() == new_can[i].getDat();
+  }
+  delete old_msg;
+  delete new_msg;
+  return same;
+}
+
+int main(int argc, char *argv[]) {
+  int num_frames = 256, batches = 10000, fd_every = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:d:")) != -1) {
+    switch (opt) {
+      case 'f': num_frames = atoi(optarg); break;
+      case 'n': batches = atoi(optarg); break;
+      case 'd': fd_every = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-f frames per batch] [-n batches] [-d CAN FD frame every n frames]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  const std::vector<uint8_t> records = make_records(num_frames, fd_every);
+  Context *ctx = Context::create();
+  PubSocket *can_pub = PubSocket::create(ctx, "can");
+  SubSocket *can_sub = SubSocket::create(ctx, "can");
+  PubSocket *sendcan_pub = PubSocket::create(ctx, "sendcan");
+  SubSocket *sendcan_sub = SubSocket::create(ctx, "sendcan");
+  assert(can_pub && can_sub && sendcan_pub && sendcan_sub);
+
+  if (!check_same(can_pub, can_sub, records)) {
+    fprintf(stderr, "CanEventBuilder output differs from MessageBuilder\n");
+    return 1;
+  }
+
+  // can, the boardd receive side
+  for (bool reserve : {false, true}) {
+    BenchResult r = {reserve ? "can_reserve" : "can_message_builder"};
+    can_reserve(can_pub, records, r.copies);  // warm up the reserve buffer of non-msgq transports
+    r.copies = 0;
+    const uint64_t start_allocs = allocs;
+    const double start = micros();
+    for (int i = 0; i < batches; i++) {
+      if (reserve) {
+        can_reserve(can_pub, records, r.copies);
+      } else {
+        can_message_builder(can_pub, records, r.copies);
+      }
+    }
+    r.total_us = micros() - start;
+    r.allocs = allocs - start_allocs;
+    print_result(r, num_frames, batches);
+  }
+
+  // sendcan, the boardd send side, messages come from the same builder either way
+  std::vector<uint8_t> sendcan_msg;
+  {
+    MessageBuilder msg;
+    auto can_data = msg.initEvent().initSendcan(num_frames);
+    CanRecordsInfo info = can_records_info(records.data(), records.size());
+    for (size_t i = 0, pos = 0; i < info.frames; i++) {
+      uint32_t rec[2];
+      memcpy(rec, &records[pos], sizeof(rec));
+      const size_t len = can_record_data_len(rec[1]);
+      can_data[i].setAddress(rec[0] >> 21);
+      can_data[i].setDat(kj::arrayPtr(&records[pos + 8], len));
+      pos += can_record_size(len);
+    }
+    auto bytes = msg.toBytes();
+    sendcan_msg.assign(bytes.begin(), bytes.end());
+  }
+  for (bool borrow : {false, true}) {
+    BenchResult r = {borrow ? "sendcan_borrowed" : "sendcan_copied"};
+    AlignedBuffer aligned_buf;
+    std::vector<uint8_t> send_buf;
+    for (int i = 0; i < batches + 1; i++) {
+      sendcan_pub->send((char *)sendcan_msg.data(), sendcan_msg.size());
+      // the first batch warms up the buffers
+      const uint64_t start_allocs = allocs, start_copies = r.copies;
+      const double start = micros();
+      sendcan_receive(sendcan_sub, borrow, aligned_buf, send_buf, r.copies);
+      if (i == 0) {
+        r.copies = start_copies;
+        continue;
+      }
+      r.total_us += micros() - start;
+      r.allocs += allocs - start_allocs;
+    }
+    print_result(r, num_frames, batches);
+  }
+
+  delete sendcan_sub;
+  delete sendcan_pub;
+  delete can_sub;
+  delete can_pub;
+  delete ctx;
+  return 0;
+}
@@ -0,0 +1,204 @@
+// Measures CAN receive latency of the CanReceiver against the 10 ms polling loop it replaced,
+// on a simulated panda receive queue fed at a fixed frame rate. Every run checks that frames come out
+// in order with none lost. Prints one JSON object per configuration, e.g.
+//   ./can_recv_benchmark -r 1000,4000,10000 -c 0,1000,10000 -t 1,4 -d 2 > results.jsonl
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/boardd/can_receiver.h"
+#include "selfdrive/boardd/sim_panda.h"
+#include "selfdrive/common/timing.h"
+
+#define BENCH_RECORD_SIZE 0x10
+#define BENCH_POLL_NS 10000000ULL  // the old can_recv_thread ran at 100hz
+#define BENCH_POLL_SIZE 0x1000     // RECV_SIZE
+
+struct BenchResult {
+  std::vector<uint64_t> send_ns;  // by sequence number, written by the producer
+  std::vector<double> latency_us;
+  uint64_t next_seq = 0;
+  uint64_t batches = 0;
+  bool ok = true;
+};
+
+static std::vector<int> split(const std::string &s) {
+  std::vector<int> r;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) r.push_back(atoi(item.c_str()));
+  return r;
+}
+
+// classic CAN record with the sequence number as data
+static void make_record(uint8_t *rec, uint64_t seq) {
+  uint32_t hdr[2] = {0x123U << 21, 8 | (0 << 4)};
+  memcpy(rec, hdr, sizeof(hdr));
+  memcpy(rec + 8, &seq, sizeof(seq));
+}
+
+static size_t consume(BenchResult &r, const uint8_t *data, size_t size) {
+  const uint64_t now = nanos_since_boot();
+  size_t frames = 0;
+  for (size_t pos = 0; pos + BENCH_RECORD_SIZE <= size; pos += BENCH_RECORD_SIZE) {
+    uint64_t seq;
+    memcpy(&seq, data + pos + 8, sizeof(seq));
+    if (seq != r.next_seq) {
+      fprintf(stderr, "expected frame %lu, got %lu\n", r.next_seq, seq);
+      r.ok = false;
+    }
+    r.next_seq = seq + 1;
+    r.latency_us.push_back((now - r.send_ns[seq]) / 1000.0);
+    frames++;
+  }
+  r.batches++;
+  return frames;
+}
+
+// pushes rate frames per second for duration_s, in 1 ms steps
+static void produce(SimCanQueue *queue, BenchResult *r, int rate, double duration_s) {
+  const uint64_t total = rate * duration_s;
+  const uint64_t start = nanos_since_boot();
+  uint8_t rec[BENCH_RECORD_SIZE];
+  uint64_t seq = 0;
+  while (seq < total) {
+    const uint64_t due = std::min<uint64_t>(total, (nanos_since_boot() - start) * rate / 1000000000ULL);
+    for (; seq < due; seq++) {
+      r->send_ns[seq] = nanos_since_boot();
+      make_record(rec, seq);
+      queue->push(rec, sizeof(rec));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+static void print_result(const char *mode, int rate, int coalesce_us, int transfers, BenchResult &r) {
+  std::sort(r.latency_us.begin(), r.latency_us.end());
+  const size_t n = r.latency_us.size();
+  double total = 0;
+  for (double l : r.latency_us) total += l;
+  printf("{\"mode\": \"%s\", \"rate\": %d, \"coalesce_us\": %d, \"transfers\": %d, \"frames\": %zu, \"batches\": %lu, "
+         "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+         mode, rate, coalesce_us, transfers, n, r.batches, n ? total / n : 0.0,
+         n ? r.latency_us[n / 2] : 0.0, n ? r.latency_us[n * 99 / 100] : 0.0, n ? r.latency_us.back() : 0.0);
+  fflush(stdout);
+}
+
+static bool run_receiver(int rate, int coalesce_us, int transfers, double duration_s) {
+  BenchResult r;
+  r.send_ns.resize(rate * duration_s);
+
+  SimCanQueue queue;
+  SimBulkIn usb(&queue);
+  CanRecvStats stats;
+  {
+    CanReceiver receiver(&usb, &stats, [&](const uint8_t *data, size_t size) { return consume(r, data, size); },
+                         coalesce_us, transfers);
+    std::thread producer(produce, &queue, &r, rate, duration_s);
+    while (r.next_seq < r.send_ns.size()) {
+      if (!receiver.update(10)) break;
+    }
+    producer.join();
+  }
+
+  print_result("async", rate, coalesce_us, transfers, r);
+  return r.ok && r.next_seq == r.send_ns.size() && stats.frames == r.next_seq;
+}
+
+static bool run_poll(int rate, double duration_s) {
+  BenchResult r;
+  r.send_ns.resize(rate * duration_s);
+
+  SimCanQueue queue;
+  SimBulkIn usb(&queue);
+  usb.init(1, BENCH_POLL_SIZE);
+  std::thread producer(produce, &queue, &r, rate, duration_s);
+
+  uint64_t next_frame_time = nanos_since_boot() + BENCH_POLL_NS;
+  std::vector<UsbCompletion> done;
+  while (r.next_seq < r.send_ns.size()) {
+    done.clear();
+    usb.submit(0);
+    usb.wait(100000, done);
+    for (auto &c : done) consume(r, usb.buffer(0), c.actual);
+
+    const int64_t remaining = next_frame_time - nanos_since_boot();
+    if (remaining > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+    next_frame_time += BENCH_POLL_NS;
+  }
+  producer.join();
+
+  print_result("poll", rate, 0, 1, r);
+  return r.ok;
+}
+
+// error completions are counted, and a lost device ends update()
+static bool run_error_checks() {
+  SimCanQueue queue;
+  SimBulkIn usb(&queue);
+  CanRecvStats stats;
+  CanReceiver receiver(&usb, &stats, [](const uint8_t *data, size_t size) { return size / BENCH_RECORD_SIZE; });
+
+  queue.inject(UsbTransferStatus::OVERFLOW);
+  queue.inject(UsbTransferStatus::ERROR);
+  if (!receiver.update(5) || stats.overflows != 1 || stats.errors != 1) {
+    fprintf(stderr, "overflow/error not counted\n");
+    return false;
+  }
+  // the failed slots are rearmed and receive again
+  uint8_t rec[BENCH_RECORD_SIZE];
+  make_record(rec, 0);
+  queue.push(rec, sizeof(rec));
+  if (!receiver.update(5) || stats.frames != 1) {
+    fprintf(stderr, "no data after errors\n");
+    return false;
+  }
+  queue.inject(UsbTransferStatus::NO_DEVICE);
+  if (receiver.update(5)) {
+    fprintf(stderr, "lost device not reported\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<int> rates = {1000, 4000, 10000}, windows = {0, 1000, 10000}, transfer_counts = {1, CAN_RECV_TRANSFERS};
+  double duration_s = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:t:d:")) != -1) {
+    switch (opt) {
+      case 'r': rates = split(optarg); break;
+      case 'c': windows = split(optarg); break;
+      case 't': transfer_counts = split(optarg); break;
+      case 'd': duration_s = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-r frame rates] [-c coalesce windows us] [-t transfer counts] [-d seconds]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  bool ok = run_error_checks();
+  for (int rate : rates) {
+    ok &= run_poll(rate, duration_s);
+    for (int transfers : transfer_counts) {
+      for (int coalesce_us : windows) {
+        ok &= run_receiver(rate, coalesce_us, transfers, duration_s);
+      }
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "frames lost or out of order\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,9 @@
+#include <cstdlib>
+
+#include "selfdrive/boardd/sim_panda.h"
+
+// boardd_sim talks to a simulated panda, configured by BOARDD_SIM like "rate=4000,buses=3"
+std::unique_ptr<PandaTransport> panda_transport_open() {
+  const char *config = getenv("BOARDD_SIM");
+  return std::make_unique<SimPanda>(SimPandaConfig::parse(config ? config : ""));
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+import os
+import random
+import subprocess
+import time
+import unittest
+from collections import defaultdict
+
+import cereal.messaging as messaging
+from cereal import car
+from common.basedir import BASEDIR
+from common.params import Params
+from selfdrive.boardd.boardd_api_impl import can_list_to_can_capnp  # pylint: disable=no-name-in-module,import-error
+from selfdrive.test.helpers import phone_only
+
+BOARDD_PATH = os.path.join(BASEDIR, "selfdrive/boardd/boardd")
+SafetyModel = car.CarParams.SafetyModel
+
+
+# smoke test of boardd on a real panda: frames sent on sendcan come back on can, echoed on
+# bus + 128 and looped back on their bus. pandad must not be running.
+class TestBoarddLoopback(unittest.TestCase):
+
+  def setUp(self):
+    self.params = Params()
+    self.params.put("CarVin", "0" * 17)
+    cp = car.CarParams.new_message()
+    cp.safetyModel = SafetyModel.allOutput
+    self.params.put("CarParams", cp.to_bytes())
+    self.params.put_bool("ControlsReady", True)
+
+    self.can_sock = messaging.sub_sock('can', conflate=False, timeout=100)
+    self.panda_state_sock = messaging.sub_sock('pandaState', conflate=True, timeout=100)
+    self.sendcan = messaging.pub_sock('sendcan')
+
+    env = dict(os.environ, STARTED="1", BOARDD_LOOPBACK="1")
+    self.proc = subprocess.Popen([BOARDD_PATH], env=env)
+
+    start = time.monotonic()
+    while time.monotonic() - start < 30:
+      ps = messaging.recv_one_or_none(self.panda_state_sock)
+      if ps is not None and ps.pandaState.safetyModel == SafetyModel.allOutput:
+        break
+    else:
+      self.fail("boardd never set the safety model")
+
+  def tearDown(self):
+    self.proc.terminate()
+    try:
+      self.proc.wait(10)
+    except subprocess.TimeoutExpired:
+      self.proc.kill()
+    self.params.delete("CarParams")
+    self.params.delete("ControlsReady")
+
+  def echoed(self, sent_addrs, timeout):
+    echoed, looped = defaultdict(int), defaultdict(int)
+    start = time.monotonic()
+    while time.monotonic() - start < timeout:
+      for m in messaging.drain_sock(self.can_sock, wait_for_one=True):
+        for c in m.can:
+          if c.address not in sent_addrs:
+            continue
+          if c.src >= 128:
+            echoed[(c.address, c.src - 128, bytes(c.dat))] += 1
+          else:
+            looped[(c.address, c.src, bytes(c.dat))] += 1
+    return echoed, looped
+
+  @phone_only
+  def test_loopback(self):
+    for _ in range(20):
+      sent = defaultdict(int)
+      msgs = []
+      for bus in range(3):
+        for _ in range(random.randrange(1, 20)):
+          addr = random.choice([random.randrange(0x100, 0x7ff), random.randrange(0x800, 0x1fffffff)])
+          dat = bytes(random.getrandbits(8) for _ in range(random.randrange(0, 9)))
+          msgs.append((addr, 0, dat, bus))
+          sent[(addr, bus, dat)] += 1
+
+      messaging.drain_sock_raw(self.can_sock)
+      self.sendcan.send(can_list_to_can_capnp(msgs, msgtype='sendcan'))
+      echoed, looped = self.echoed({m[0] for m in msgs}, 1)
+
+      self.assertEqual(dict(sent), dict(echoed))
+      self.assertEqual(dict(sent), dict(looped))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+import os
+import struct
+import subprocess
+import time
+import unittest
+from collections import defaultdict
+
+import cereal.messaging as messaging
+from cereal import car
+from common.basedir import BASEDIR
+from common.params import Params
+from selfdrive.boardd.boardd_api_impl import can_list_to_can_capnp  # pylint: disable=no-name-in-module,import-error
+
+BOARDD_PATH = os.path.join(BASEDIR, "selfdrive/boardd/tests/boardd_sim")
+RATE = 4000
+NUM_BUSES = 3
+SafetyModel = car.CarParams.SafetyModel
+
+
+# runs boardd built against a simulated panda (scons --test) with synthetic bus load
+class TestBoarddSim(unittest.TestCase):
+
+  def setUp(self):
+    self.params = Params()
+    self.can_sock = messaging.sub_sock('can', conflate=False, timeout=100)
+    self.panda_state_sock = messaging.sub_sock('pandaState', conflate=True, timeout=100)
+    self.sendcan = messaging.pub_sock('sendcan')
+
+    env = dict(os.environ, BOARDD_SIM=f"rate={RATE},buses={NUM_BUSES}", BOARDD_LOOPBACK="1")
+    self.proc = subprocess.Popen([BOARDD_PATH], env=env)
+    self.wait_for_safety(SafetyModel.elm327, 10)
+
+  def tearDown(self):
+    self.proc.terminate()
+    if self.proc.wait(10) is None:
+      self.proc.kill()
+
+  def wait_for_safety(self, safety_model, timeout):
+    start = time.monotonic()
+    while time.monotonic() - start < timeout:
+      ps = messaging.recv_one_or_none(self.panda_state_sock)
+      if ps is not None and ps.pandaState.safetyModel == safety_model:
+        return
+    self.fail(f"safety model never set to {safety_model}")
+
+  def test_can_recv_load(self):
+    messaging.drain_sock_raw(self.can_sock)
+
+    last_seq = {}
+    lost, frames = 0, 0
+    start = time.monotonic()
+    while time.monotonic() - start < 10:
+      for m in messaging.drain_sock(self.can_sock, wait_for_one=True):
+        for c in m.can:
+          if c.src >= NUM_BUSES:
+            continue
+          seq = struct.unpack("<Q", c.dat)[0]
+          if c.src in last_seq:
+            lost += (seq - last_seq[c.src]) // NUM_BUSES - 1
+          last_seq[c.src] = seq
+          frames += 1
+    dt = time.monotonic() - start
+
+    self.assertEqual(lost, 0, "frames lost")
+    self.assertGreater(frames / dt, RATE * 0.9)
+    self.assertEqual(sorted(last_seq.keys()), list(range(NUM_BUSES)))
+
+  def test_safety_and_sendcan(self):
+    # boardd goes through the safety setter as on car start
+    self.params.put("CarVin", "0" * 17)
+    cp = car.CarParams.new_message()
+    cp.safetyModel = SafetyModel.toyota
+    self.params.put("CarParams", cp.to_bytes())
+    self.params.put_bool("ControlsReady", True)
+    self.wait_for_safety(SafetyModel.toyota, 10)
+
+    # sent frames come back on bus + 128, and looped back on their bus
+    messaging.drain_sock_raw(self.can_sock)
+    sent = defaultdict(int)
+    echoed = defaultdict(int)
+    start = time.monotonic()
+    while time.monotonic() - start < 5:
+      msgs = [(0x200 + i, 0, struct.pack("<Q", i), i % NUM_BUSES) for i in range(40)]
+      self.sendcan.send(can_list_to_can_capnp(msgs, msgtype='sendcan'))
+      for addr, _, _, bus in msgs:
+        sent[(addr, bus)] += 1
+      for m in messaging.drain_sock(self.can_sock):
+        for c in m.can:
+          if c.src >= 128 and 0x200 <= c.address < 0x200 + 40:
+            echoed[(c.address, c.src - 128)] += 1
+      time.sleep(0.01)
+
+    time.sleep(0.1)
+    for m in messaging.drain_sock(self.can_sock):
+      for c in m.can:
+        if c.src >= 128 and 0x200 <= c.address < 0x200 + 40:
+          echoed[(c.address, c.src - 128)] += 1
+    self.assertEqual(dict(sent), dict(echoed))
+
+
+if __name__ == "__main__":
+  unittest.main()
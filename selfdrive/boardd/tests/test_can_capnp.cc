@@ -0,0 +1,200 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "selfdrive/boardd/can_capnp.h"
+
+// as declared in boardd_api_impl.pyx
+typedef struct {
+  long address;
+  std::string dat;
+  long busTime;
+  long src;
+} can_frame;
+
+extern "C" void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid);
+
+static kj::Array<capnp::word> to_words(const void *data, size_t size) {
+  REQUIRE(size % sizeof(capnp::word) == 0);
+  auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  memcpy(words.begin(), data, size);
+  return words;
+}
+
+// the event as can_list_to_can_capnp built it with a MallocMessageBuilder before CanEventBuilder
+static kj::Array<capnp::word> reference_event(const std::vector<can_frame> &can_list, bool sendcan, bool valid,
+                                              uint64_t log_mono_time) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(log_mono_time);
+  event.setValid(valid);
+  auto can_data = sendcan ? event.initSendcan(can_list.size()) : event.initCan(can_list.size());
+  for (size_t i = 0; i < can_list.size(); i++) {
+    can_data[i].setAddress(can_list[i].address);
+    can_data[i].setBusTime(can_list[i].busTime);
+    can_data[i].setDat(kj::arrayPtr((const uint8_t *)can_list[i].dat.data(), can_list[i].dat.size()));
+    can_data[i].setSrc(can_list[i].src);
+  }
+  return capnp::canonicalize(event.asReader());
+}
+
+static void check_can_list(const std::vector<can_frame> &can_list, bool sendcan, bool valid) {
+  std::string out;
+  can_list_to_can_capnp_cpp(can_list, out, sendcan, valid);
+
+  auto words = to_words(out.data(), out.size());
+  capnp::FlatArrayMessageReader reader(words);
+  auto event = reader.getRoot<cereal::Event>();
+  REQUIRE(event.which() == (sendcan ? cereal::Event::SENDCAN : cereal::Event::CAN));
+  REQUIRE(event.getLogMonoTime() > 0);
+
+  // canonical forms are equal only if every field and the list sizes are
+  auto expected = reference_event(can_list, sendcan, valid, event.getLogMonoTime());
+  auto built = capnp::canonicalize(event);
+  REQUIRE(built.asBytes() == expected.asBytes());
+}
+
+static std::vector<can_frame> frames_of_all_lengths() {
+  std::vector<can_frame> can_list;
+  for (size_t len = 0; len <= CANFD_MAX_DATA_LEN; len++) {
+    can_frame f;
+    f.address = (len % 2) ? 0x18daf100 + len : 0x100 + len;  // extended and standard
+    f.dat = std::string(len, '\0');
+    for (size_t j = 0; j < len; j++) f.dat[j] = (char)(len * 3 + j);
+    f.busTime = 0xffff - len * 1000;
+    f.src = (len % 4 == 3) ? 128 + len % 3 : len % 3;  // includes echoed frames
+    can_list.push_back(f);
+  }
+  return can_list;
+}
+
+TEST_CASE("can_list_to_can_capnp matches a MessageBuilder event") {
+  for (bool sendcan : {false, true}) {
+    for (bool valid : {true, false}) {
+      INFO("sendcan " << sendcan << " valid " << valid);
+      check_can_list({}, sendcan, valid);
+      check_can_list({{0x123, "", 0, 0}}, sendcan, valid);
+      check_can_list(frames_of_all_lengths(), sendcan, valid);
+    }
+  }
+
+  // bigger than the first segment of a MallocMessageBuilder
+  std::vector<can_frame> many;
+  for (int i = 0; i < 20; i++) {
+    for (auto &f : frames_of_all_lengths()) many.push_back(f);
+  }
+  check_can_list(many, false, true);
+}
+
+// a frame on the wire, as the panda sends it
+static void add_record(std::vector<uint8_t> &records, uint32_t address, uint8_t dlc, bool fd, uint8_t src, uint16_t bus_time) {
+  const size_t len = fd ? dlc_to_len[dlc] : std::min<size_t>(dlc, CAN_MAX_DATA_LEN);
+  const size_t pos = records.size();
+  records.resize(pos + can_record_size(len));
+  uint32_t header[2];
+  header[0] = address >= 0x800 ? (address << 3) | 4 : address << 21;
+  header[1] = dlc | (src << 4) | ((uint32_t)bus_time << 16) | (fd ? CAN_RECORD_FD : 0);
+  memcpy(&records[pos], header, sizeof(header));
+  for (size_t j = 0; j < len; j++) records[pos + sizeof(header) + j] = dlc + j;
+}
+
+TEST_CASE("can_records_unpack reads every DLC, src and bus time") {
+  std::vector<uint8_t> records;
+  for (uint8_t dlc = 0; dlc < 16; dlc++) {
+    add_record(records, dlc % 2 ? 0x18daf100 + dlc : 0x100 + dlc, dlc, true, dlc % 2 ? 129 : 2, 0xf000 + dlc);
+  }
+  // a partial record at the end is left for the next read
+  records.resize(records.size() + CAN_RECORD_SIZE / 2);
+
+  CanRecordsInfo info = can_records_info(records.data(), records.size());
+  REQUIRE(info.frames == 16);
+  REQUIRE(info.size == records.size() - CAN_RECORD_SIZE / 2);
+
+  const size_t max_size = CanEventBuilder::max_size(info.frames, info.data_words);
+  auto buf = kj::heapArray<capnp::word>(max_size / sizeof(capnp::word));
+  CanEventBuilder event((char *)buf.begin(), max_size, false, true, info.frames);
+  can_records_unpack(records.data(), info, event);
+  const size_t size = event.finish();
+  REQUIRE(size <= max_size);
+
+  capnp::FlatArrayMessageReader reader(buf.slice(0, size / sizeof(capnp::word)));
+  auto can = reader.getRoot<cereal::Event>().getCan();
+  REQUIRE(can.size() == 16);
+  for (uint8_t dlc = 0; dlc < 16; dlc++) {
+    auto c = can[dlc];
+    REQUIRE(c.getAddress() == (dlc % 2 ? 0x18daf100u + dlc : 0x100u + dlc));
+    REQUIRE(c.getSrc() == (dlc % 2 ? 129 : 2));
+    REQUIRE(c.getBusTime() == 0xf000 + dlc);
+    REQUIRE(c.getDat().size() == dlc_to_len[dlc]);
+    for (size_t j = 0; j < c.getDat().size(); j++) REQUIRE(c.getDat()[j] == (uint8_t)(dlc + j));
+  }
+}
+
+TEST_CASE("can_records_unpack reads classic frames with a DLC over 8 as 8 bytes") {
+  std::vector<uint8_t> records;
+  for (uint8_t dlc = 0; dlc < 16; dlc++) {
+    add_record(records, 0x200 + dlc, dlc, false, 1, dlc);
+  }
+
+  CanRecordsInfo info = can_records_info(records.data(), records.size());
+  REQUIRE(info.frames == 16);
+  REQUIRE(info.size == 16 * CAN_RECORD_SIZE);
+  REQUIRE(info.size == records.size());
+
+  const size_t max_size = CanEventBuilder::max_size(info.frames, info.data_words);
+  auto buf = kj::heapArray<capnp::word>(max_size / sizeof(capnp::word));
+  CanEventBuilder event((char *)buf.begin(), max_size, false, true, info.frames);
+  can_records_unpack(records.data(), info, event);
+  const size_t size = event.finish();
+  REQUIRE(size <= max_size);
+
+  capnp::FlatArrayMessageReader reader(buf.slice(0, size / sizeof(capnp::word)));
+  auto can = reader.getRoot<cereal::Event>().getCan();
+  REQUIRE(can.size() == 16);
+  for (uint8_t dlc = 0; dlc < 16; dlc++) {
+    auto c = can[dlc];
+    REQUIRE(c.getAddress() == 0x200u + dlc);
+    REQUIRE(c.getBusTime() == dlc);
+    REQUIRE(c.getDat().size() == std::min<size_t>(dlc, CAN_MAX_DATA_LEN));
+    for (size_t j = 0; j < c.getDat().size(); j++) REQUIRE(c.getDat()[j] == (uint8_t)(dlc + j));
+  }
+}
+
+TEST_CASE("can_records_pack only sends frames up to max_len") {
+  std::string out;
+  can_list_to_can_capnp_cpp(frames_of_all_lengths(), out, true, true);
+  auto words = to_words(out.data(), out.size());
+  capnp::FlatArrayMessageReader reader(words);
+  auto sendcan = reader.getRoot<cereal::Event>().getSendcan();
+
+  for (size_t max_len : {(size_t)CAN_MAX_DATA_LEN, (size_t)CANFD_MAX_DATA_LEN}) {
+    std::vector<uint8_t> records(can_records_pack_size(sendcan, max_len));
+    const size_t dropped = can_records_pack(sendcan, records.data(), max_len);
+    REQUIRE(dropped == CANFD_MAX_DATA_LEN - max_len);
+
+    // the records read back as the frames that were sent, padded to the next DLC length
+    CanRecordsInfo info = can_records_info(records.data(), records.size());
+    REQUIRE(info.frames == max_len + 1);
+    REQUIRE(info.size == records.size());
+    size_t pos = 0;
+    for (size_t i = 0; i < info.frames; i++) {
+      auto c = sendcan[i];
+      uint32_t header[2];
+      memcpy(header, &records[pos], sizeof(header));
+      const uint32_t address = (header[0] & 4) ? header[0] >> 3 : header[0] >> 21;
+      const size_t len = can_record_data_len(header[1]);
+      REQUIRE(((header[1] & CAN_RECORD_FD) != 0) == (len > CAN_MAX_DATA_LEN));
+      REQUIRE(address == c.getAddress());
+      REQUIRE(((header[1] >> 4) & 0xff) == c.getSrc());
+      REQUIRE(len >= c.getDat().size());
+      REQUIRE(memcmp(&records[pos + sizeof(header)], c.getDat().begin(), c.getDat().size()) == 0);
+      for (size_t j = c.getDat().size(); j < len; j++) REQUIRE(records[pos + sizeof(header) + j] == 0);
+      pos += can_record_size(len);
+    }
+  }
+}
@@ -5,16 +5,27 @@
 #endif  // _GNU_SOURCE
 
 #include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
 
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
@@ -119,6 +130,45 @@ void ensure_params_path(const std::string &params_path) {
   }
 }
 
+// names of the entries in a directory, without . and ..
+bool list_dir(const std::string &path, std::vector<std::string> &names) {
+  DIR *d = opendir(path.c_str());
+  if (d == NULL) return false;
+
+  struct dirent *de = NULL;
+  while ((de = readdir(d))) {
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+      names.push_back(de->d_name);
+    }
+  }
+  closedir(d);
+  return true;
+}
+
+// removes a key directory and the values in it
+void remove_key_dir(const std::string &path) {
+  std::vector<std::string> names;
+  list_dir(path, names);
+  for (auto &name : names) {
+    unlink((path + "/" + name).c_str());
+  }
+  rmdir(path.c_str());
+}
+
+// writes a value file and returns its fd for the caller to fsync, < 0 on failure
+int write_value(const std::string &path, const std::string &value) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666));
+  if (fd < 0) return -1;
+
+  ssize_t bytes_written = HANDLE_EINTR(write(fd, value.data(), value.size()));
+  // change permissions to 0666 for apks
+  if (bytes_written < 0 || (size_t)bytes_written != value.size() || fchmod(fd, 0666) < 0) {
+    close(fd);
+    return -20;
+  }
+  return fd;
+}
+
 class FileLock {
  public:
   FileLock(const std::string& file_name, int op) : fn_(file_name), op_(op) {}
@@ -241,6 +291,226 @@ std::unordered_map<std::string, uint32_t> keys = {
     {"OpkrMapEnable", PERSISTENT},
 };
 
+// inotify on a params directory. Watches the key directory behind the d symlink, and the d link
+// itself, so that it follows a transaction swapping in a new key directory.
+class ParamsWatch {
+public:
+  ~ParamsWatch() {
+    if (fd >= 0) close(fd);
+  }
+
+  bool open(const std::string &params_path) {
+#ifdef __linux__
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+    key_path = params_path + "/d";
+    root_wd = inotify_add_watch(fd, params_path.c_str(), IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    dir_wd = inotify_add_watch(fd, key_path.c_str(), KEY_MASK);
+    if (root_wd < 0 || dir_wd < 0) {
+      LOGE("Failed to watch %s, errno=%d", params_path.c_str(), errno);
+      close(fd);
+      fd = -1;
+    }
+#endif
+    return fd >= 0;
+  }
+
+  // calls changed(key) for each changed key, changed(nullptr) if anything may have changed.
+  // closes the watch once the params directory itself is gone
+  template <typename F>
+  void drain(F changed) {
+#ifdef __linux__
+    alignas(struct inotify_event) char buf[4096];
+    while (fd >= 0) {
+      ssize_t n = HANDLE_EINTR(read(fd, buf, sizeof(buf)));
+      if (n <= 0) break;
+
+      for (char *p = buf; p < buf + n;) {
+        auto event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          changed(nullptr);
+        } else if (event->wd == root_wd && (event->mask & IN_MOVED_TO)) {
+          if (strcmp(event->name, "d") != 0) continue;
+          // a new key directory was swapped in, events of the old one don't matter anymore
+          inotify_rm_watch(fd, dir_wd);
+          dir_wd = inotify_add_watch(fd, key_path.c_str(), KEY_MASK);
+          changed(nullptr);
+          if (dir_wd < 0) {
+            LOGE("Failed to watch %s, errno=%d", key_path.c_str(), errno);
+            close(fd);
+            fd = -1;
+            return;
+          }
+        } else if (event->wd == root_wd && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+          close(fd);
+          fd = -1;
+          changed(nullptr);
+          return;
+        } else if (event->wd == dir_wd && event->len > 0) {
+          changed(event->name);
+        }
+      }
+    }
+#endif
+  }
+
+  int fd = -1;
+
+private:
+#ifdef __linux__
+  static constexpr uint32_t KEY_MASK = IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE;
+#endif
+  std::string key_path;
+  int root_wd = -1, dir_wd = -1;
+};
+
+// Process wide cache of the values in one params directory. Every lookup first drains the
+// inotify queue of the directory, so a value written by any process before the lookup started
+// is never served stale, and a hit costs one non-blocking read() instead of open/read/close.
+// Without inotify (macOS, or the directory went away) every lookup reads the file.
+class ParamsCache {
+public:
+  ParamsCache(const std::string &params_path) : params_path(params_path), key_path(params_path + "/d") {
+    watch.open(params_path);
+  }
+
+  std::string get(const std::string &key) {
+    std::unique_lock lk(lock);
+    watch.drain([this](const char *key) {
+      if (key) {
+        values.erase(key);
+      } else {
+        values.clear();
+      }
+    });
+    if (watch.fd < 0) {
+      lk.unlock();
+      return util::read_file(key_path + "/" + key);
+    }
+
+    auto it = values.find(key);
+    if (it == values.end()) {
+      // a write after the drain above queues an event, so this is dropped again on the next get
+      it = values.emplace(key, util::read_file(key_path + "/" + key)).first;
+    }
+    return it->second;
+  }
+
+  int subscribe(const std::string &key, Params::Callback cb) {
+    std::lock_guard lk(subs_lock);
+    if (!watcher_running) {
+      // the watcher has its own queue, lookups draining theirs don't steal its events
+      if (!subs_watch.open(params_path)) {
+        LOGE("Failed to watch %s for subscriptions", params_path.c_str());
+        return -1;
+      }
+      // never joined, the cache lives as long as the process
+      std::thread(&ParamsCache::watcher, this).detach();
+      watcher_running = true;
+    }
+    const int id = next_id++;
+    subs[id] = {key, get(key), cb};
+    return id;
+  }
+
+  void unsubscribe(int id) {
+    // wait for a running callback, unless it's the callback unsubscribing itself
+    std::unique_lock dispatch_lk(dispatch_lock, std::defer_lock);
+    if (std::this_thread::get_id() != watcher_id) dispatch_lk.lock();
+
+    std::lock_guard lk(subs_lock);
+    subs.erase(id);
+  }
+
+private:
+  void watcher() {
+    set_thread_name("params_watcher");
+    watcher_id = std::this_thread::get_id();
+
+    while (subs_watch.fd >= 0) {
+      // wait for events, then collect everything that is queued
+      struct pollfd pfd = {.fd = subs_watch.fd, .events = POLLIN};
+      if (HANDLE_EINTR(poll(&pfd, 1, -1)) < 0) break;
+
+      std::vector<std::string> changed_keys;
+      bool changed_all = false;
+      subs_watch.drain([&](const char *key) {
+        if (key) {
+          changed_keys.push_back(key);
+        } else {
+          changed_all = true;
+        }
+      });
+
+      std::lock_guard dispatch_lk(dispatch_lock);
+      std::vector<std::tuple<std::string, std::string, Params::Callback>> calls;
+      {
+        std::lock_guard lk(subs_lock);
+        for (auto &[id, sub] : subs) {
+          if (!changed_all && std::find(changed_keys.begin(), changed_keys.end(), sub.key) == changed_keys.end()) {
+            continue;
+          }
+          // a rewrite with the same value isn't a change
+          std::string value = get(sub.key);
+          if (value != sub.value) {
+            sub.value = value;
+            calls.emplace_back(sub.key, value, sub.cb);
+          }
+        }
+      }
+      for (auto &[key, value, cb] : calls) {
+        cb(key, value);
+      }
+    }
+    LOGE("params watcher for %s stopped", params_path.c_str());
+  }
+
+  const std::string params_path, key_path;
+
+  std::mutex lock;
+  ParamsWatch watch;
+  std::unordered_map<std::string, std::string> values;
+
+  struct Subscription {
+    std::string key;
+    std::string value;  // last value reported
+    Params::Callback cb;
+  };
+  std::mutex subs_lock, dispatch_lock;
+  std::map<int, Subscription> subs;
+  int next_id = 0;
+  bool watcher_running = false;
+  ParamsWatch subs_watch;
+  std::atomic<std::thread::id> watcher_id;
+};
+
+// one cache per params directory and process. a forked child starts over with new inotify
+// instances, the parent's queues are drained by the parent
+std::atomic<int> fork_generation = 0;
+
+ParamsCache *params_cache(const std::string &params_path) {
+  static std::mutex lock;
+  static std::map<std::string, ParamsCache *> *caches = nullptr;
+  static int generation = -1;
+
+  std::lock_guard lk(lock);
+  if (generation != fork_generation) {
+    if (generation == -1) {
+      pthread_atfork(nullptr, nullptr, [] { fork_generation++; });
+    }
+    generation = fork_generation;
+    // leaked on purpose, the watcher threads may outlive static destruction
+    caches = new std::map<std::string, ParamsCache *>;
+  }
+
+  ParamsCache *&cache = (*caches)[params_path];
+  if (cache == nullptr) {
+    cache = new ParamsCache(params_path);
+  }
+  return cache;
+}
+
 } // namespace
 
 Params::Params() : params_path(Path::params()) {
@@ -318,9 +588,9 @@ int Params::remove(const char *key) {
 }
 
 std::string Params::get(const char *key, bool block) {
-  std::string path = params_path + "/d/" + key;
+  ParamsCache *cache = params_cache(params_path);
   if (!block) {
-    return util::read_file(path);
+    return cache->get(key);
   } else {
     // blocking read until successful
     params_do_exit = 0;
@@ -329,7 +599,7 @@ std::string Params::get(const char *key, bool block) {
 
     std::string value;
     while (!params_do_exit) {
-      if (value = util::read_file(path); !value.empty()) {
+      if (value = cache->get(key); !value.empty()) {
         break;
       }
       util::sleep_for(100);  // 0.1 s
@@ -349,10 +619,104 @@ std::map<std::string, std::string> Params::readAll() {
   return util::read_files_in_dir(key_path);
 }
 
+int Params::subscribe(const std::string &key, Callback cb) {
+  return params_cache(params_path)->subscribe(key, cb);
+}
+
+void Params::unsubscribe(int id) {
+  params_cache(params_path)->unsubscribe(id);
+}
+
+ParamsTransaction Params::transaction() {
+  return ParamsTransaction(params_path);
+}
+
+int ParamsTransaction::commit() {
+  auto staged = std::move(changes);
+  changes.clear();
+
+  FileLock file_lock(params_path + "/.lock", LOCK_EX);
+  std::lock_guard<FileLock> lk(file_lock);
+
+  char old_dir[PATH_MAX];
+  std::vector<std::string> names;
+  if (realpath((params_path + "/d").c_str(), old_dir) == NULL || !list_dir(old_dir, names)) {
+    return -1;
+  }
+
+  // nothing to do for a batch of removes of keys that aren't set
+  bool modified = std::any_of(staged.begin(), staged.end(), [](auto &c) { return c.second.has_value(); }) ||
+                  std::any_of(names.begin(), names.end(), [&](auto &n) { return staged.count(n) > 0; });
+  if (!modified) return 0;
+
+  std::string new_dir = params_path + "/.tmp_XXXXXX";
+  if (mkdtemp((char *)new_dir.c_str()) == NULL) return -1;
+
+  int result = -1;
+  do {
+    if ((result = chmod(new_dir.c_str(), 0777)) < 0) break;
+
+    // unchanged values are hard links into the current key directory, only staged values are written
+    for (auto &name : names) {
+      if (staged.count(name) > 0) continue;
+      if ((result = link((std::string(old_dir) + "/" + name).c_str(), (new_dir + "/" + name).c_str())) < 0) break;
+    }
+    if (result < 0) break;
+    // write everything before the first fsync, so one journal commit can cover most of the files
+    std::vector<int> fds;
+    for (auto &[key, value] : staged) {
+      if (!value) continue;
+      int fd = write_value(new_dir + "/" + key, *value);
+      if (fd < 0) {
+        result = fd;
+        break;
+      }
+      fds.push_back(fd);
+    }
+    for (int fd : fds) {
+      if (result >= 0) result = fsync(fd);
+      close(fd);
+    }
+    if (result < 0) break;
+    if ((result = fsync_dir(new_dir.c_str())) < 0) break;
+
+    // swap the d symlink over to the new key directory
+    std::string link_path = new_dir + ".link";
+    if ((result = symlink(new_dir.c_str(), link_path.c_str())) < 0) break;
+    if ((result = rename(link_path.c_str(), (params_path + "/d").c_str())) < 0) {
+      unlink(link_path.c_str());
+      break;
+    }
+    result = fsync_dir(params_path.c_str());
+  } while (false);
+
+  if (result < 0) {
+    remove_key_dir(new_dir);
+    return result;
+  }
+
+  // the old key directory stays until the next commit, readers may have just resolved d to it
+  const std::string new_name = new_dir.substr(new_dir.rfind('/') + 1);
+  const std::string old_name = strrchr(old_dir, '/') + 1;
+  std::vector<std::string> entries;
+  list_dir(params_path, entries);
+  for (auto &entry : entries) {
+    const std::string path = params_path + "/" + entry;
+    struct stat st;
+    if (entry.rfind(".tmp_", 0) == 0 && entry != new_name && entry != old_name &&
+        lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      remove_key_dir(path);
+    }
+  }
+  return 0;
+}
+
 void Params::clearAll(ParamKeyType key_type) {
+  ParamsTransaction t = transaction();
   for (auto &[key, type] : keys) {
     if (type & key_type) {
-      remove(key);
+      t.remove(key);
     }
   }
+  t.commit();
 }
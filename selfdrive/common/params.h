@@ -1,6 +1,8 @@
 #pragma once
 
+#include <functional>
 #include <map>
+#include <optional>
 #include <sstream>
 #include <string>
 
@@ -16,6 +18,8 @@ enum ParamKeyType {
   ALL = 0xFFFFFFFF
 };
 
+class ParamsTransaction;
+
 class Params {
 public:
   Params();
@@ -76,6 +80,17 @@ public:
     return putBool(key.c_str(), val);
   }
 
+  // batched writes, see ParamsTransaction
+  ParamsTransaction transaction();
+
+  // change notification, cb(key, value) is called on a params watcher thread whenever the value
+  // of key changes, in this or any other process. returns an id for unsubscribe, -1 on failure.
+  // subscriptions don't carry over to a forked child
+  using Callback = std::function<void(const std::string &key, const std::string &value)>;
+  int subscribe(const std::string &key, Callback cb);
+  // cb isn't running and won't be called anymore once this returns
+  void unsubscribe(int id);
+
 private:
   const std::string params_path;
 
@@ -88,3 +103,30 @@ public:  // atom
     return ret_code;
   }
 };
+
+// Stages puts and removes and applies them together. commit() takes the params lock once, writes
+// the staged values into a new key directory that hard links all unchanged keys, and swaps the
+// d symlink over to it. Readers see all of the changes or none of them.
+class ParamsTransaction {
+public:
+  ParamsTransaction(const std::string &params_path) : params_path(params_path) {}
+
+  inline void put(const std::string &key, const std::string &val) {
+    changes[key] = val;
+  }
+
+  inline void putBool(const std::string &key, bool val) {
+    put(key, val ? "1" : "0");
+  }
+
+  inline void remove(const std::string &key) {
+    changes[key] = std::nullopt;
+  }
+
+  // 0 on success. the staged changes are dropped either way
+  int commit();
+
+private:
+  const std::string params_path;
+  std::map<std::string, std::optional<std::string>> changes;
+};
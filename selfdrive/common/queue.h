@@ -50,3 +50,66 @@ private:
   std::condition_variable cv;
   std::queue<T> q;
 };
+
+// Like SafeQueue, but try_push drops instead of growing past max_size and push waits for room.
+// close() wakes up both sides, push() then returns false and pop() returns false once
+// everything queued before it is popped.
+template <class T>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t max_size) : max_size(max_size) {}
+
+  bool try_push(const T& v) {
+    {
+      std::unique_lock lk(m);
+      if (closed || q.size() >= max_size) return false;
+      q.push(v);
+    }
+    cv.notify_one();
+    return true;
+  }
+
+  bool push(const T& v) {
+    {
+      std::unique_lock lk(m);
+      not_full.wait(lk, [this] { return closed || q.size() < max_size; });
+      if (closed) return false;
+      q.push(v);
+    }
+    cv.notify_one();
+    return true;
+  }
+
+  bool pop(T& v) {
+    {
+      std::unique_lock lk(m);
+      cv.wait(lk, [this] { return closed || !q.empty(); });
+      if (q.empty()) return false;
+      v = q.front();
+      q.pop();
+    }
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::unique_lock lk(m);
+      closed = true;
+    }
+    cv.notify_all();
+    not_full.notify_all();
+  }
+
+  size_t size() const {
+    std::scoped_lock lk(m);
+    return q.size();
+  }
+
+private:
+  const size_t max_size;
+  bool closed = false;
+  mutable std::mutex m;
+  std::condition_variable cv, not_full;
+  std::queue<T> q;
+};
@@ -0,0 +1,98 @@
+// Compares writing N keys with individual Params::put calls against one ParamsTransaction.
+// Prints one JSON object per configuration, e.g.
+//   ./params_benchmark -d /data/params_benchmark -n 1,5,10,50 -r 20 > results.jsonl
+// The params directory should be on the filesystem under test, ext4 on the device.
+
+#include <getopt.h>
+#include <sys/vfs.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/params.h"
+
+#define EXT4_SUPER_MAGIC 0xEF53
+#define BENCH_EXISTING_KEYS 100  // roughly what a device has set
+
+static inline double millis() {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<int> split(const std::string &s) {
+  std::vector<int> r;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) r.push_back(atoi(item.c_str()));
+  return r;
+}
+
+static void print_result(const char *mode, int num_keys, std::vector<double> &times_ms) {
+  std::sort(times_ms.begin(), times_ms.end());
+  double total = 0;
+  for (double t : times_ms) total += t;
+  printf("{\"mode\": \"%s\", \"keys\": %d, \"runs\": %zu, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"max_ms\": %.3f}\n",
+         mode, num_keys, times_ms.size(), total / times_ms.size(), times_ms[times_ms.size() / 2], times_ms.back());
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  std::string path = "/tmp/params_benchmark";
+  std::vector<int> counts = {1, 5, 10, 50};
+  int runs = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:r:")) != -1) {
+    switch (opt) {
+      case 'd': path = optarg; break;
+      case 'n': counts = split(optarg); break;
+      case 'r': runs = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d params dir] [-n key counts] [-r runs]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  Params params(path);
+  struct statfs fs;
+  if (statfs(path.c_str(), &fs) == 0 && fs.f_type != EXT4_SUPER_MAGIC) {
+    fprintf(stderr, "warning: %s is not on ext4 (f_type 0x%lx)\n", path.c_str(), (unsigned long)fs.f_type);
+  }
+
+  // a transaction links every key that is set, so start from a realistic number of them
+  for (int i = 0; i < BENCH_EXISTING_KEYS; i++) {
+    params.put("Existing" + std::to_string(i), std::to_string(i));
+  }
+
+  for (int n : counts) {
+    std::vector<double> put_ms, transaction_ms;
+    for (int r = 0; r < runs; r++) {
+      const std::string value = std::to_string(r);
+
+      double start = millis();
+      for (int i = 0; i < n; i++) {
+        params.put("Key" + std::to_string(i), value);
+      }
+      put_ms.push_back(millis() - start);
+
+      start = millis();
+      ParamsTransaction t = params.transaction();
+      for (int i = 0; i < n; i++) {
+        t.put("Key" + std::to_string(i), value + "t");
+      }
+      int err = t.commit();
+      transaction_ms.push_back(millis() - start);
+      if (err != 0) {
+        fprintf(stderr, "commit failed: %d\n", err);
+        return 1;
+      }
+    }
+    print_result("put", n, put_ms);
+    print_result("transaction", n, transaction_ms);
+  }
+  return 0;
+}
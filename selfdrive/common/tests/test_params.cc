@@ -0,0 +1,315 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "selfdrive/common/params.h"
+#include "selfdrive/common/util.h"
+
+// a new params directory, so that every test has its own cache
+static std::string make_params_dir() {
+  char dir[] = "/tmp/test_params_XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  return dir;
+}
+
+// runs f in a child process, which has none of this process' caches
+template <typename F>
+static void in_child(F f) {
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+}
+
+// the callbacks a subscription got, from the params watcher thread
+struct Calls {
+  Params::Callback callback() {
+    return [this](const std::string &key, const std::string &value) {
+      std::lock_guard lk(lock);
+      calls.emplace_back(key, value);
+      cv.notify_all();
+    };
+  }
+
+  // waits up to a second for at least n calls
+  std::vector<std::pair<std::string, std::string>> wait(size_t n) {
+    std::unique_lock lk(lock);
+    cv.wait_for(lk, std::chrono::seconds(1), [&] { return calls.size() >= n; });
+    return calls;
+  }
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<std::pair<std::string, std::string>> calls;
+};
+
+TEST_CASE("ParamsCache sees writes from another process") {
+  Params params(make_params_dir());
+  REQUIRE(params.put("CarVin", "1") == 0);
+  REQUIRE(params.get("CarVin") == "1");
+  REQUIRE(params.get("CarVin") == "1");  // from the cache
+
+  in_child([&] { Params(params.getParamsPath()).put("CarVin", "2"); });
+  REQUIRE(params.get("CarVin") == "2");
+
+  in_child([&] { Params(params.getParamsPath()).remove("CarVin"); });
+  REQUIRE(params.get("CarVin") == "");
+
+  // a transaction swaps the key directory, every cached value may be stale
+  REQUIRE(params.put("DongleId", "a") == 0);
+  REQUIRE(params.get("DongleId") == "a");
+  in_child([&] {
+    ParamsTransaction t = Params(params.getParamsPath()).transaction();
+    t.put("CarVin", "3");
+    t.put("DongleId", "b");
+    t.commit();
+  });
+  REQUIRE(params.get("CarVin") == "3");
+  REQUIRE(params.get("DongleId") == "b");
+}
+
+TEST_CASE("Params::subscribe calls back on put and on a transaction") {
+  Params params(make_params_dir());
+  REQUIRE(params.put("CarVin", "1") == 0);
+
+  Calls calls;
+  const int id = params.subscribe("CarVin", calls.callback());
+  REQUIRE(id >= 0);
+
+  REQUIRE(params.put("CarVin", "2") == 0);
+  auto got = calls.wait(1);
+  REQUIRE(got.size() == 1);
+  REQUIRE(got[0] == std::make_pair(std::string("CarVin"), std::string("2")));
+
+  ParamsTransaction t = params.transaction();
+  t.put("CarVin", "3");
+  t.put("DongleId", "a");
+  REQUIRE(t.commit() == 0);
+  got = calls.wait(2);
+  REQUIRE(got.size() == 2);
+  REQUIRE(got[1] == std::make_pair(std::string("CarVin"), std::string("3")));
+
+  // other keys, or the same value written again, aren't a change of CarVin
+  REQUIRE(params.put("DongleId", "b") == 0);
+  REQUIRE(params.put("CarVin", "3") == 0);
+  in_child([&] { Params(params.getParamsPath()).remove("CarVin"); });
+  got = calls.wait(3);
+  REQUIRE(got.size() == 3);
+  REQUIRE(got[2] == std::make_pair(std::string("CarVin"), std::string("")));
+
+  params.unsubscribe(id);
+  REQUIRE(params.put("CarVin", "4") == 0);
+  REQUIRE(calls.wait(4).size() == 3);
+}
+
+TEST_CASE("Params::unsubscribe from inside the callback") {
+  Params params(make_params_dir());
+
+  std::atomic<int> id = -1;
+  Calls calls;
+  auto record = calls.callback();
+  id = params.subscribe("CarVin", [&](const std::string &key, const std::string &value) {
+    params.unsubscribe(id);
+    record(key, value);
+  });
+  REQUIRE(id >= 0);
+
+  // a second subscription on the same key keeps getting called
+  Calls other;
+  const int other_id = params.subscribe("CarVin", other.callback());
+
+  REQUIRE(params.put("CarVin", "1") == 0);
+  REQUIRE(calls.wait(1).size() == 1);
+  REQUIRE(other.wait(1).size() == 1);
+
+  REQUIRE(params.put("CarVin", "2") == 0);
+  REQUIRE(other.wait(2).size() == 2);
+  REQUIRE(calls.wait(2).size() == 1);
+  params.unsubscribe(other_id);
+}
+
+// the .tmp_ key directories in a params directory
+static std::set<std::string> key_dirs(const std::string &params_path) {
+  std::set<std::string> dirs;
+  DIR *d = opendir(params_path.c_str());
+  REQUIRE(d != nullptr);
+  while (struct dirent *de = readdir(d)) {
+    struct stat st;
+    const std::string name = de->d_name;
+    if (name.rfind(".tmp_", 0) == 0 && lstat((params_path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      dirs.insert(name);
+    }
+  }
+  closedir(d);
+  return dirs;
+}
+
+static std::string current_key_dir(const std::string &params_path) {
+  char path[PATH_MAX];
+  REQUIRE(realpath((params_path + "/d").c_str(), path) != nullptr);
+  return strrchr(path, '/') + 1;
+}
+
+TEST_CASE("ParamsTransaction::commit is atomic") {
+  Params params(make_params_dir());
+  const std::vector<std::string> keys = {"CarVin", "DongleId", "GitBranch", "GitCommit"};
+
+  SECTION("readers see all of a commit or none of it") {
+    ParamsTransaction t = params.transaction();
+    for (auto &k : keys) t.put(k, "0");
+    REQUIRE(t.commit() == 0);
+
+    // a reader that resolves d once sees a single key directory, so every key has the same value.
+    // a directory the reader holds through two more commits is removed, that read is skipped
+    const int commits = 200;
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+      const std::string d = params.getParamsPath() + "/d";
+      std::string last;
+      while (last != std::to_string(commits)) {
+        int dir_fd = open(d.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) _exit(1);
+        std::vector<std::string> values;
+        for (auto &k : keys) {
+          int fd = openat(dir_fd, k.c_str(), O_RDONLY);
+          if (fd < 0) break;
+          char buf[32] = {};
+          if (read(fd, buf, sizeof(buf) - 1) < 0) _exit(2);
+          close(fd);
+          values.push_back(buf);
+        }
+        close(dir_fd);
+        if (values.size() < keys.size()) continue;
+        for (auto &v : values) {
+          if (v != values[0]) _exit(3);
+        }
+        last = values[0];
+      }
+      _exit(0);
+    }
+
+    for (int i = 1; i <= commits; i++) {
+      ParamsTransaction t = params.transaction();
+      for (auto &k : keys) t.put(k, std::to_string(i));
+      REQUIRE(t.commit() == 0);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+
+  SECTION("a failed commit changes nothing") {
+    REQUIRE(params.put("CarVin", "1") == 0);
+    const std::string dir = current_key_dir(params.getParamsPath());
+
+    ParamsTransaction t = params.transaction();
+    t.put("CarVin", "2");
+    t.put("DongleId", "2");
+    t.put("no/such/dir", "2");  // can't be written
+    REQUIRE(t.commit() < 0);
+
+    REQUIRE(current_key_dir(params.getParamsPath()) == dir);
+    REQUIRE(params.get("CarVin") == "1");
+    REQUIRE(params.get("DongleId") == "");
+    REQUIRE(key_dirs(params.getParamsPath()) == std::set<std::string>{dir});
+
+    // and the staged changes are gone
+    REQUIRE(t.commit() == 0);
+    REQUIRE(current_key_dir(params.getParamsPath()) == dir);
+  }
+}
+
+TEST_CASE("ParamsTransaction::commit applies removes and puts together") {
+  Params params(make_params_dir());
+  REQUIRE(params.put("CarVin", "1") == 0);
+  REQUIRE(params.put("DongleId", "1") == 0);
+  REQUIRE(params.put("GitBranch", "1") == 0);
+  REQUIRE(params.put("GitCommit", "1") == 0);
+
+  ParamsTransaction t = params.transaction();
+  t.remove("CarVin");
+  t.put("DongleId", "2");
+  t.put("GitRemote", "2");
+  t.remove("IsMetric");  // isn't set
+  // the last change of a key wins
+  t.put("GitBranch", "2");
+  t.remove("GitBranch");
+  t.remove("GitCommit");
+  t.put("GitCommit", "2");
+  REQUIRE(t.commit() == 0);
+
+  std::map<std::string, std::string> expected = {{"DongleId", "2"}, {"GitRemote", "2"}, {"GitCommit", "2"}};
+  REQUIRE(params.readAll() == expected);
+  REQUIRE(params.get("CarVin") == "");
+  REQUIRE(params.get("GitCommit") == "2");
+
+  // unchanged values are hard links, not copies
+  struct stat st;
+  REQUIRE(params.put("IsRHD", "1") == 0);
+  ParamsTransaction t2 = params.transaction();
+  t2.put("IsMetric", "1");
+  REQUIRE(t2.commit() == 0);
+  REQUIRE(stat((params.getParamsPath() + "/d/IsRHD").c_str(), &st) == 0);
+  REQUIRE(st.st_nlink == 2);
+
+  // removing keys that aren't set doesn't swap the key directory
+  const std::string dir = current_key_dir(params.getParamsPath());
+  ParamsTransaction t3 = params.transaction();
+  t3.remove("CarVin");
+  t3.remove("Passive");
+  REQUIRE(t3.commit() == 0);
+  REQUIRE(current_key_dir(params.getParamsPath()) == dir);
+}
+
+TEST_CASE("ParamsTransaction::commit keeps the current and previous key directories") {
+  Params params(make_params_dir());
+  const std::string path = params.getParamsPath();
+  const std::string first = current_key_dir(path);
+
+  // left behind by a commit that was killed before the swap
+  const std::string stale = path + "/.tmp_stale";
+  REQUIRE(mkdir(stale.c_str(), 0777) == 0);
+  REQUIRE(util::write_file((stale + "/CarVin").c_str(), "x", 1, O_WRONLY | O_CREAT) == 0);
+  // a value being written by Params::put isn't a key directory
+  const std::string value_tmp = path + "/.tmp_value_put";
+  REQUIRE(util::write_file(value_tmp.c_str(), "x", 1, O_WRONLY | O_CREAT) == 0);
+
+  std::string prev = first;
+  for (int i = 0; i < 5; i++) {
+    ParamsTransaction t = params.transaction();
+    t.put("CarVin", std::to_string(i));
+    REQUIRE(t.commit() == 0);
+
+    const std::string cur = current_key_dir(path);
+    REQUIRE(cur != prev);
+    REQUIRE(key_dirs(path) == std::set<std::string>{prev, cur});
+    REQUIRE(params.get("CarVin") == std::to_string(i));
+    prev = cur;
+  }
+  REQUIRE(util::file_exists(value_tmp));
+}
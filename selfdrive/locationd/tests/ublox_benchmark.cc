@@ -0,0 +1,221 @@
+// Feeds ubloxRaw streams through UbloxMsgParser and measures framing and event building
+// throughput. The stream comes from the ubloxRaw events of a log, or is synthesized. Fuzzing
+// corrupts random bytes and checks the parser only ever hands out messages with a valid
+// checksum and keeps going. Prints one JSON object per run, e.g.
+//   ./ublox_benchmark -f /data/media/0/realdata/<segment>/rlog.zst -n 20 > results.jsonl
+//   ./ublox_benchmark -z 100 -s 1
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/locationd/ublox_msg.h"
+#include "selfdrive/loggerd/indexed_log.h"
+
+#define BENCH_CHUNK_SIZE 0x400  // about what boardd reads from the pigeon at a time
+#define BENCH_SEGMENT_WORDS 1024
+
+struct BenchResult {
+  const char *mode;
+  size_t bytes = 0;
+  uint64_t msgs = 0;
+  uint64_t events = 0;
+  uint64_t errors = 0;
+  uint64_t dropped_bytes = 0;
+  uint64_t bad_checksums = 0;
+  double total_s = 0;
+};
+
+static inline double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ***** stream *****
+
+static void add_frame(std::vector<uint8_t> &out, uint8_t cls, uint8_t id, const void *payload, uint16_t len) {
+  std::string msg = "\xb5\x62"s;
+  msg.push_back(cls);
+  msg.push_back(id);
+  msg.append((const char *)&len, sizeof(len));
+  msg.append((const char *)payload, len);
+  msg = ublox::ubx_add_checksum(msg);
+  out.insert(out.end(), msg.begin(), msg.end());
+}
+
+// one second of what the receiver sends at 10hz: NAV-PVT, RXM-RAWX with 32 measurements,
+// a few SFRBX and some NMEA in between
+static std::vector<std::vector<uint8_t>> synthetic_stream() {
+  std::vector<uint8_t> stream;
+  for (int i = 0; i < 10; i++) {
+    ublox::ubx_nav_pvt_t pvt = {};
+    pvt.year = 2021;
+    pvt.month = 6;
+    pvt.day = 1;
+    pvt.lat = 377749000 + i;
+    pvt.lon = -1224194000 - i;
+    pvt.gSpeed = 20000;
+    add_frame(stream, ublox::CLASS_NAV, 0x07, &pvt, sizeof(pvt));
+
+    std::vector<uint8_t> rawx(sizeof(ublox::ubx_rxm_rawx_t) + 32 * sizeof(ublox::ubx_rxm_rawx_meas_t));
+    ublox::ubx_rxm_rawx_t hdr = {.rcvTow = 1000.0 + i, .week = 2160, .leapS = 18, .numMeas = 32};
+    memcpy(rawx.data(), &hdr, sizeof(hdr));
+    for (int m = 0; m < 32; m++) {
+      ublox::ubx_rxm_rawx_meas_t meas = {.prMes = 2e7 + m, .cpMes = 1e8 + m, .doMes = 100.0f, .svId = (uint8_t)m,
+                                         .cno = 40, .trkStat = 0xf};
+      memcpy(&rawx[sizeof(hdr) + m * sizeof(meas)], &meas, sizeof(meas));
+    }
+    add_frame(stream, ublox::CLASS_RXM, 0x15, rawx.data(), rawx.size());
+
+    for (int sv = 0; sv < 4; sv++) {
+      uint8_t sfrbx[sizeof(ublox::ubx_rxm_sfrbx_t) + 10 * sizeof(uint32_t)] = {};
+      ublox::ubx_rxm_sfrbx_t sh = {.gnssId = ublox::GNSS_ID_GPS, .svId = (uint8_t)(sv + 1), .numWords = 10};
+      memcpy(sfrbx, &sh, sizeof(sh));
+      // HOW word with the subframe id, above 2 reserved and 6 parity bits
+      const uint32_t how = ((uint32_t)((i % 5) + 1) << 2) << 6;
+      memcpy(sfrbx + sizeof(sh) + sizeof(uint32_t), &how, sizeof(how));
+      add_frame(stream, ublox::CLASS_RXM, 0x13, sfrbx, sizeof(sfrbx));
+    }
+
+    const char nmea[] = "$GNGGA,000000.00,3746.49,N,12225.16,W,1,12,0.9,10.0,M,-30.0,M,,*5A\r\n";
+    stream.insert(stream.end(), nmea, nmea + strlen(nmea));
+  }
+
+  std::vector<std::vector<uint8_t>> chunks;
+  for (size_t pos = 0; pos < stream.size(); pos += BENCH_CHUNK_SIZE) {
+    chunks.emplace_back(stream.begin() + pos, stream.begin() + std::min(stream.size(), pos + BENCH_CHUNK_SIZE));
+  }
+  return chunks;
+}
+
+// the ubloxRaw events of a log, as they were sent
+static std::vector<std::vector<uint8_t>> log_stream(const std::string &path) {
+  std::vector<std::vector<uint8_t>> chunks;
+  IndexedLogReader reader;
+  if (!reader.load(path)) return chunks;
+  reader.read(0, std::numeric_limits<uint64_t>::max(), {cereal::Event::UBLOX_RAW}, [&](cereal::Event::Reader event) {
+    auto raw = event.getUbloxRaw();
+    chunks.emplace_back(raw.begin(), raw.end());
+  });
+  return chunks;
+}
+
+// flips a byte at random every 1e6 / per_mb bytes on average
+static void corrupt(std::vector<std::vector<uint8_t>> &chunks, double per_mb, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> u(0, 1);
+  std::uniform_int_distribution<int> b(0, 255);
+  for (auto &c : chunks) {
+    for (auto &byte : c) {
+      if (u(rng) * 1e6 < per_mb) byte = b(rng);
+    }
+  }
+}
+
+// ***** bench *****
+
+static bool checksum_ok(const std::string &msg) {
+  return msg.size() >= 8 && ublox::ubx_add_checksum(msg.substr(0, msg.size() - 2)) == msg;
+}
+
+// runs the chunks through a parser, split further into pieces of at most split bytes
+static BenchResult run(const char *mode, const std::vector<std::vector<uint8_t>> &chunks, int passes, bool gen,
+                       size_t split, bool check) {
+  BenchResult r = {mode};
+  auto parser = std::make_unique<UbloxMsgParser>();
+  std::vector<capnp::word> segment(BENCH_SEGMENT_WORDS);
+
+  const double start = seconds();
+  for (int p = 0; p < passes; p++) {
+    for (auto &c : chunks) {
+      size_t consumed = 0;
+      while (consumed < c.size()) {
+        consumed += parser->add_data(c.data() + consumed, std::min(split, c.size() - consumed));
+        while (parser->next_msg()) {
+          r.msgs++;
+          if (check && !checksum_ok(parser->data())) r.errors++;
+          if (!gen) continue;
+
+          try {
+            MessageBuilder msg_builder(kj::arrayPtr(segment.data(), segment.size()));
+            if (parser->gen_msg(msg_builder)) r.events++;
+          } catch (const std::exception &e) {
+            // bad payloads that still passed the checksum
+          }
+        }
+      }
+      r.bytes += c.size();
+    }
+  }
+  r.total_s = seconds() - start;
+  r.dropped_bytes = parser->dropped_bytes;
+  r.bad_checksums = parser->bad_checksums;
+  return r;
+}
+
+static void print_result(const BenchResult &r) {
+  printf("{\"mode\": \"%s\", \"bytes\": %zu, \"msgs\": %lu, \"events\": %lu, \"dropped_bytes\": %lu, "
+         "\"bad_checksums\": %lu, \"errors\": %lu, \"mb_per_s\": %.1f, \"msgs_per_s\": %.0f}\n",
+         r.mode, r.bytes, r.msgs, r.events, r.dropped_bytes, r.bad_checksums, r.errors,
+         r.bytes / r.total_s / 1e6, r.msgs / r.total_s);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  std::string path;
+  int passes = 100;
+  double fuzz_per_mb = 0;
+  unsigned int seed = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:z:s:")) != -1) {
+    switch (opt) {
+      case 'f': path = optarg; break;
+      case 'n': passes = atoi(optarg); break;
+      case 'z': fuzz_per_mb = atof(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-f log] [-n passes] [-z corrupted bytes per MB] [-s seed]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> chunks = path.empty() ? synthetic_stream() : log_stream(path);
+  if (chunks.empty()) {
+    fprintf(stderr, "no ubloxRaw in %s\n", path.c_str());
+    return 1;
+  }
+
+  // framing can't depend on how the stream is split up
+  BenchResult whole = run("frame_check", chunks, 1, false, SIZE_MAX, true);
+  BenchResult bytewise = run("frame_check_bytewise", chunks, 1, false, 1, true);
+  if (whole.errors || bytewise.errors || whole.msgs != bytewise.msgs || whole.dropped_bytes != bytewise.dropped_bytes) {
+    print_result(whole);
+    print_result(bytewise);
+    fprintf(stderr, "framing differs with the split of the stream\n");
+    return 1;
+  }
+
+  print_result(run("frame", chunks, passes, false, SIZE_MAX, false));
+  print_result(run("frame_and_build", chunks, passes, true, SIZE_MAX, false));
+
+  if (fuzz_per_mb > 0) {
+    std::mt19937 rng(seed);
+    corrupt(chunks, fuzz_per_mb, rng);
+    BenchResult fuzzed = run("fuzz", chunks, passes, true, SIZE_MAX, true);
+    print_result(fuzzed);
+    if (fuzzed.errors || fuzzed.msgs == 0) {
+      fprintf(stderr, "parser returned bad messages or stopped framing\n");
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -2,169 +2,191 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <unordered_map>
 
 #include "selfdrive/common/swaglog.h"
 
 const double gpsPi = 3.1415926535898;
-#define UBLOX_MSG_SIZE(hdr) (*(uint16_t *)&hdr[4])
 
 inline static bool bit_to_bool(uint8_t val, int shifts) {
   return (bool)(val & (1 << shifts));
 }
 
-inline int UbloxMsgParser::needed_bytes() {
-  // Msg header incomplete?
-  if(bytes_in_parse_buf < ublox::UBLOX_HEADER_SIZE)
-    return ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_CHECKSUM_SIZE - bytes_in_parse_buf;
-  uint16_t needed = UBLOX_MSG_SIZE(msg_parse_buf) + ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_CHECKSUM_SIZE;
-  // too much data
-  if(needed < (uint16_t)bytes_in_parse_buf)
-    return -1;
-  return needed - (uint16_t)bytes_in_parse_buf;
+size_t UbloxMsgParser::add_data(const uint8_t *incoming_data, size_t incoming_data_len) {
+  const size_t len = std::min(incoming_data_len, UBLOX_RING_SIZE - used());
+  const size_t pos = tail & (UBLOX_RING_SIZE - 1);
+  const size_t first = std::min(len, UBLOX_RING_SIZE - pos);
+  memcpy(ring + pos, incoming_data, first);
+  memcpy(ring, incoming_data + first, len - first);
+  tail += len;
+  return len;
 }
 
-inline bool UbloxMsgParser::valid_cheksum() {
-  uint8_t ck_a = 0, ck_b = 0;
-  for(int i = 2; i < bytes_in_parse_buf - ublox::UBLOX_CHECKSUM_SIZE;i++) {
-    ck_a = (ck_a + msg_parse_buf[i]) & 0xFF;
-    ck_b = (ck_b + ck_a) & 0xFF;
+// skips to the next PREAMBLE1, memchr goes through the ring a vector at a time
+bool UbloxMsgParser::find_preamble() {
+  while (used() > 0) {
+    const size_t pos = head & (UBLOX_RING_SIZE - 1);
+    const size_t len = std::min(used(), UBLOX_RING_SIZE - pos);
+    const uint8_t *found = (const uint8_t *)memchr(ring + pos, ublox::PREAMBLE1, len);
+    const size_t skipped = found ? found - (ring + pos) : len;
+    head += skipped;
+    dropped_bytes += skipped;
+    if (found) return true;
   }
-  if(ck_a != msg_parse_buf[bytes_in_parse_buf - 2]) {
-    LOGD("Checksum a mismtach: %02X, %02X", ck_a, msg_parse_buf[6]);
-    return false;
-  }
-  if(ck_b != msg_parse_buf[bytes_in_parse_buf - 1]) {
-    LOGD("Checksum b mismtach: %02X, %02X", ck_b, msg_parse_buf[7]);
-    return false;
-  }
-  return true;
+  return false;
 }
 
-inline bool UbloxMsgParser::valid() {
-  return bytes_in_parse_buf >= ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_CHECKSUM_SIZE &&
-         needed_bytes() == 0 && valid_cheksum();
-}
+// the len bytes at head in one piece, copied out only if they wrap around the ring
+const uint8_t *UbloxMsgParser::frame(size_t len) {
+  const size_t pos = head & (UBLOX_RING_SIZE - 1);
+  if (pos + len <= UBLOX_RING_SIZE) return ring + pos;
 
-inline bool UbloxMsgParser::valid_so_far() {
-  if(bytes_in_parse_buf > 0 && msg_parse_buf[0] != ublox::PREAMBLE1) {
-    return false;
-  }
-  if(bytes_in_parse_buf > 1 && msg_parse_buf[1] != ublox::PREAMBLE2) {
-    return false;
-  }
-  if(needed_bytes() == 0 && !valid()) {
-    return false;
-  }
-  return true;
+  const size_t first = UBLOX_RING_SIZE - pos;
+  memcpy(msg_buf, ring + pos, first);
+  memcpy(msg_buf + first, ring, len - first);
+  return msg_buf;
 }
 
+bool UbloxMsgParser::next_msg() {
+  head += msg_len;
+  msg = nullptr;
+  msg_len = 0;
+
+  while (find_preamble()) {
+    if (used() < 2) return false;
+    if (at(head + 1) != ublox::PREAMBLE2) {
+      head++;
+      dropped_bytes++;
+      continue;
+    }
 
-bool UbloxMsgParser::add_data(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed) {
-  int needed = needed_bytes();
-  if(needed > 0) {
-    bytes_consumed = std::min((uint32_t)needed, incoming_data_len );
-    // Add data to buffer
-    memcpy(msg_parse_buf + bytes_in_parse_buf, incoming_data, bytes_consumed);
-    bytes_in_parse_buf += bytes_consumed;
-  } else {
-    bytes_consumed = incoming_data_len;
-  }
+    if (used() < ublox::UBLOX_HEADER_SIZE) return false;
+    const size_t len = ublox::UBLOX_HEADER_SIZE + (at(head + 4) | (at(head + 5) << 8)) + ublox::UBLOX_CHECKSUM_SIZE;
+    if (used() < len) return false;
 
-  // Validate msg format, detect invalid header and invalid checksum.
-  while(!valid_so_far() && bytes_in_parse_buf != 0) {
-    // Corrupted msg, drop a byte.
-    bytes_in_parse_buf -= 1;
-    if(bytes_in_parse_buf > 0)
-      memmove(&msg_parse_buf[0], &msg_parse_buf[1], bytes_in_parse_buf);
-  }
+    const uint8_t *data = frame(len);
+    uint8_t ck_a = 0, ck_b = 0;
+    for (size_t i = 2; i < len - ublox::UBLOX_CHECKSUM_SIZE; i++) {
+      ck_a = ck_a + data[i];
+      ck_b = ck_b + ck_a;
+    }
+    if (ck_a != data[len - 2] || ck_b != data[len - 1]) {
+      LOGD("Checksum mismatch: %02X%02X, %02X%02X", ck_a, ck_b, data[len - 2], data[len - 1]);
+      // could be a preamble in the payload of a corrupted message, resync right after it
+      head++;
+      dropped_bytes++;
+      bad_checksums++;
+      continue;
+    }
 
-  // There is redundant data at the end of buffer, reset the buffer.
-  if(needed_bytes() == -1) {
-    bytes_in_parse_buf = 0;
+    msg = data;
+    msg_len = len;
+    return true;
   }
-  return valid();
+  return false;
 }
 
 
-std::pair<std::string, kj::Array<capnp::word>> UbloxMsgParser::gen_msg() {
-  std::string dat = data();
-  kaitai::kstream stream(dat);
+const char *UbloxMsgParser::gen_msg(MessageBuilder &msg_builder) {
+  const uint8_t *payload = msg + ublox::UBLOX_HEADER_SIZE;
+  const size_t payload_len = msg_len - ublox::UBLOX_HEADER_SIZE - ublox::UBLOX_CHECKSUM_SIZE;
 
-  ubx_t ubx_message(&stream);
-  auto body = ubx_message.body();
-
-  switch (ubx_message.msg_type()) {
-  case 0x0107:
-    return {"gpsLocationExternal", gen_nav_pvt(static_cast<ubx_t::nav_pvt_t*>(body))};
-    break;
-  case 0x0213:
-    return {"ubloxGnss", gen_rxm_sfrbx(static_cast<ubx_t::rxm_sfrbx_t*>(body))};
-    break;
-  case 0x0215:
-    return {"ubloxGnss", gen_rxm_rawx(static_cast<ubx_t::rxm_rawx_t*>(body))};
-    break;
+  switch (msg_type()) {
+  case 0x0107: {
+    ublox::ubx_nav_pvt_t pvt;
+    if (payload_len < sizeof(pvt)) break;
+    memcpy(&pvt, payload, sizeof(pvt));
+    gen_nav_pvt(pvt, msg_builder);
+    return "gpsLocationExternal";
+  }
+  case 0x0213: {
+    ublox::ubx_rxm_sfrbx_t sfrbx;
+    if (payload_len < sizeof(sfrbx)) break;
+    memcpy(&sfrbx, payload, sizeof(sfrbx));
+    if (payload_len < sizeof(sfrbx) + sfrbx.numWords * sizeof(uint32_t)) break;
+    return gen_rxm_sfrbx(sfrbx, payload + sizeof(sfrbx), msg_builder) ? "ubloxGnss" : nullptr;
+  }
+  case 0x0215: {
+    ublox::ubx_rxm_rawx_t rawx;
+    if (payload_len < sizeof(rawx)) break;
+    memcpy(&rawx, payload, sizeof(rawx));
+    if (payload_len < sizeof(rawx) + rawx.numMeas * sizeof(ublox::ubx_rxm_rawx_meas_t)) break;
+    gen_rxm_rawx(rawx, payload + sizeof(rawx), msg_builder);
+    return "ubloxGnss";
+  }
   case 0x0a09:
-    return {"ubloxGnss", gen_mon_hw(static_cast<ubx_t::mon_hw_t*>(body))};
-    break;
-  case 0x0a0b:
-    return {"ubloxGnss", gen_mon_hw2(static_cast<ubx_t::mon_hw2_t*>(body))};
-    break;
+  case 0x0a0b: {
+    // once a second, not worth more than kaitai
+    std::string dat = data();
+    kaitai::kstream stream(dat);
+    ubx_t ubx_message(&stream);
+    if (msg_type() == 0x0a09) {
+      gen_mon_hw(static_cast<ubx_t::mon_hw_t*>(ubx_message.body()), msg_builder);
+    } else {
+      gen_mon_hw2(static_cast<ubx_t::mon_hw2_t*>(ubx_message.body()), msg_builder);
+    }
+    return "ubloxGnss";
+  }
   default:
-    LOGE("Unknown message type %x", ubx_message.msg_type());
-    return {"ubloxGnss", kj::Array<capnp::word>()};
-    break;
+    LOGE("Unknown message type %x", msg_type());
+    return nullptr;
   }
+
+  LOGE("Truncated message type %x, %zu bytes", msg_type(), payload_len);
+  return nullptr;
 }
 
 
-kj::Array<capnp::word> UbloxMsgParser::gen_nav_pvt(ubx_t::nav_pvt_t *msg) {
-  MessageBuilder msg_builder;
+void UbloxMsgParser::gen_nav_pvt(const ublox::ubx_nav_pvt_t &pvt, MessageBuilder &msg_builder) {
   auto gpsLoc = msg_builder.initEvent().initGpsLocationExternal();
   gpsLoc.setSource(cereal::GpsLocationData::SensorSource::UBLOX);
-  gpsLoc.setFlags(msg->flags());
-  gpsLoc.setLatitude(msg->lat() * 1e-07);
-  gpsLoc.setLongitude(msg->lon() * 1e-07);
-  gpsLoc.setAltitude(msg->height() * 1e-03);
-  gpsLoc.setSpeed(msg->g_speed() * 1e-03);
-  gpsLoc.setBearingDeg(msg->head_mot() * 1e-5);
-  gpsLoc.setAccuracy(msg->h_acc() * 1e-03);
+  gpsLoc.setFlags(pvt.flags);
+  gpsLoc.setLatitude(pvt.lat * 1e-07);
+  gpsLoc.setLongitude(pvt.lon * 1e-07);
+  gpsLoc.setAltitude(pvt.height * 1e-03);
+  gpsLoc.setSpeed(pvt.gSpeed * 1e-03);
+  gpsLoc.setBearingDeg(pvt.headMot * 1e-5);
+  gpsLoc.setAccuracy(pvt.hAcc * 1e-03);
   std::tm timeinfo = std::tm();
-  timeinfo.tm_year = msg->year() - 1900;
-  timeinfo.tm_mon = msg->month() - 1;
-  timeinfo.tm_mday = msg->day();
-  timeinfo.tm_hour = msg->hour();
-  timeinfo.tm_min = msg->min();
-  timeinfo.tm_sec = msg->sec();
+  timeinfo.tm_year = pvt.year - 1900;
+  timeinfo.tm_mon = pvt.month - 1;
+  timeinfo.tm_mday = pvt.day;
+  timeinfo.tm_hour = pvt.hour;
+  timeinfo.tm_min = pvt.min;
+  timeinfo.tm_sec = pvt.sec;
 
   std::time_t utc_tt = timegm(&timeinfo);
-  gpsLoc.setTimestamp(utc_tt * 1e+03 + msg->nano() * 1e-06);
-  float f[] = { msg->vel_n() * 1e-03f, msg->vel_e() * 1e-03f, msg->vel_d() * 1e-03f };
+  gpsLoc.setTimestamp(utc_tt * 1e+03 + pvt.nano * 1e-06);
+  float f[] = { pvt.velN * 1e-03f, pvt.velE * 1e-03f, pvt.velD * 1e-03f };
   gpsLoc.setVNED(f);
-  gpsLoc.setVerticalAccuracy(msg->v_acc() * 1e-03);
-  gpsLoc.setSpeedAccuracy(msg->s_acc() * 1e-03);
-  gpsLoc.setBearingAccuracyDeg(msg->head_acc() * 1e-05);
-  return capnp::messageToFlatArray(msg_builder);
+  gpsLoc.setVerticalAccuracy(pvt.vAcc * 1e-03);
+  gpsLoc.setSpeedAccuracy(pvt.sAcc * 1e-03);
+  gpsLoc.setBearingAccuracyDeg(pvt.headAcc * 1e-05);
 }
 
 
-kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
-  auto body = *msg->body();
-
-  if (msg->gnss_id() == ubx_t::gnss_type_t::GNSS_TYPE_GPS) {
+bool UbloxMsgParser::gen_rxm_sfrbx(const ublox::ubx_rxm_sfrbx_t &sfrbx, const uint8_t *words, MessageBuilder &msg_builder) {
+  if (sfrbx.gnssId == ublox::GNSS_ID_GPS) {
     // GPS subframes are packed into 10x 4 bytes, each containing 3 actual bytes
     // We will first need to separate the data from the padding and parity
-    assert(body.size() == 10);
+    if (sfrbx.numWords != 10) {
+      LOGE("GPS subframe with %d words", sfrbx.numWords);
+      return false;
+    }
 
     std::string subframe_data;
     subframe_data.reserve(30);
-    for (uint32_t word : body) {
+    for (int i = 0; i < sfrbx.numWords; i++) {
+      uint32_t word;
+      memcpy(&word, words + i * sizeof(word), sizeof(word));
       word = word >> 6; // TODO: Verify parity
       subframe_data.push_back(word >> 16);
       subframe_data.push_back(word >> 8);
@@ -176,17 +198,16 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
     gps_t subframe(&stream);
     int subframe_id = subframe.how()->subframe_id();
 
-    if (subframe_id == 1) gps_subframes[msg->sv_id()].clear();
-    gps_subframes[msg->sv_id()][subframe_id] = subframe_data;
+    if (subframe_id == 1) gps_subframes[sfrbx.svId].clear();
+    gps_subframes[sfrbx.svId][subframe_id] = subframe_data;
 
-    if (gps_subframes[msg->sv_id()].size() == 5) {
-      MessageBuilder msg_builder;
+    if (gps_subframes[sfrbx.svId].size() == 5) {
       auto eph = msg_builder.initEvent().initUbloxGnss().initEphemeris();
-      eph.setSvId(msg->sv_id());
+      eph.setSvId(sfrbx.svId);
 
       // Subframe 1
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][1]);
+        kaitai::kstream stream(gps_subframes[sfrbx.svId][1]);
         gps_t subframe(&stream);
         gps_t::subframe_1_t* subframe_1 = static_cast<gps_t::subframe_1_t*>(subframe.body());
 
@@ -200,7 +221,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 2
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][2]);
+        kaitai::kstream stream(gps_subframes[sfrbx.svId][2]);
         gps_t subframe(&stream);
         gps_t::subframe_2_t* subframe_2 = static_cast<gps_t::subframe_2_t*>(subframe.body());
 
@@ -216,7 +237,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 3
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][3]);
+        kaitai::kstream stream(gps_subframes[sfrbx.svId][3]);
         gps_t subframe(&stream);
         gps_t::subframe_3_t* subframe_3 = static_cast<gps_t::subframe_3_t*>(subframe.body());
 
@@ -233,7 +254,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 4
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][4]);
+        kaitai::kstream stream(gps_subframes[sfrbx.svId][4]);
         gps_t subframe(&stream);
         gps_t::subframe_4_t* subframe_4 = static_cast<gps_t::subframe_4_t*>(subframe.body());
 
@@ -254,52 +275,48 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
         }
       }
 
-      return capnp::messageToFlatArray(msg_builder);
+      return true;
     }
   }
-  return kj::Array<capnp::word>();
+  return false;
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_rxm_rawx(ubx_t::rxm_rawx_t *msg) {
-  MessageBuilder msg_builder;
+void UbloxMsgParser::gen_rxm_rawx(const ublox::ubx_rxm_rawx_t &rawx, const uint8_t *meas, MessageBuilder &msg_builder) {
   auto mr = msg_builder.initEvent().initUbloxGnss().initMeasurementReport();
-  mr.setRcvTow(msg->rcv_tow());
-  mr.setGpsWeek(msg->week());
-  mr.setLeapSeconds(msg->leap_s());
-  mr.setGpsWeek(msg->week());
-
-  auto mb = mr.initMeasurements(msg->num_meas());
-  auto measurements = *msg->measurements();
-  for(int8_t i = 0; i < msg->num_meas(); i++) {
-    mb[i].setSvId(measurements[i]->sv_id());
-    mb[i].setPseudorange(measurements[i]->pr_mes());
-    mb[i].setCarrierCycles(measurements[i]->cp_mes());
-    mb[i].setDoppler(measurements[i]->do_mes());
-    mb[i].setGnssId(measurements[i]->gnss_id());
-    mb[i].setGlonassFrequencyIndex(measurements[i]->freq_id());
-    mb[i].setLocktime(measurements[i]->lock_time());
-    mb[i].setCno(measurements[i]->cno());
-    mb[i].setPseudorangeStdev(0.01 * (pow(2, (measurements[i]->pr_stdev() & 15)))); // weird scaling, might be wrong
-    mb[i].setCarrierPhaseStdev(0.004 * (measurements[i]->cp_stdev() & 15));
-    mb[i].setDopplerStdev(0.002 * (pow(2, (measurements[i]->do_stdev() & 15)))); // weird scaling, might be wrong
+  mr.setRcvTow(rawx.rcvTow);
+  mr.setGpsWeek(rawx.week);
+  mr.setLeapSeconds(rawx.leapS);
+
+  auto mb = mr.initMeasurements(rawx.numMeas);
+  for(int i = 0; i < rawx.numMeas; i++) {
+    ublox::ubx_rxm_rawx_meas_t m;
+    memcpy(&m, meas + i * sizeof(m), sizeof(m));
+    mb[i].setSvId(m.svId);
+    mb[i].setPseudorange(m.prMes);
+    mb[i].setCarrierCycles(m.cpMes);
+    mb[i].setDoppler(m.doMes);
+    mb[i].setGnssId(m.gnssId);
+    mb[i].setGlonassFrequencyIndex(m.freqId);
+    mb[i].setLocktime(m.locktime);
+    mb[i].setCno(m.cno);
+    mb[i].setPseudorangeStdev(0.01 * (pow(2, (m.prStdev & 15)))); // weird scaling, might be wrong
+    mb[i].setCarrierPhaseStdev(0.004 * (m.cpStdev & 15));
+    mb[i].setDopplerStdev(0.002 * (pow(2, (m.doStdev & 15)))); // weird scaling, might be wrong
 
     auto ts = mb[i].initTrackingStatus();
-    auto trk_stat = measurements[i]->trk_stat();
-    ts.setPseudorangeValid(bit_to_bool(trk_stat, 0));
-    ts.setCarrierPhaseValid(bit_to_bool(trk_stat, 1));
-    ts.setHalfCycleValid(bit_to_bool(trk_stat, 2));
-    ts.setHalfCycleSubtracted(bit_to_bool(trk_stat, 3));
+    ts.setPseudorangeValid(bit_to_bool(m.trkStat, 0));
+    ts.setCarrierPhaseValid(bit_to_bool(m.trkStat, 1));
+    ts.setHalfCycleValid(bit_to_bool(m.trkStat, 2));
+    ts.setHalfCycleSubtracted(bit_to_bool(m.trkStat, 3));
   }
 
-  mr.setNumMeas(msg->num_meas());
+  mr.setNumMeas(rawx.numMeas);
   auto rs = mr.initReceiverStatus();
-  rs.setLeapSecValid(bit_to_bool(msg->rec_stat(), 0));
-  rs.setClkReset(bit_to_bool(msg->rec_stat(), 2));
-  return capnp::messageToFlatArray(msg_builder);
+  rs.setLeapSecValid(bit_to_bool(rawx.recStat, 0));
+  rs.setClkReset(bit_to_bool(rawx.recStat, 2));
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw(ubx_t::mon_hw_t *msg) {
-  MessageBuilder msg_builder;
+void UbloxMsgParser::gen_mon_hw(ubx_t::mon_hw_t *msg, MessageBuilder &msg_builder) {
   auto hwStatus = msg_builder.initEvent().initUbloxGnss().initHwStatus();
   hwStatus.setNoisePerMS(msg->noise_per_ms());
   hwStatus.setFlags(msg->flags());
@@ -307,11 +324,9 @@ kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw(ubx_t::mon_hw_t *msg) {
   hwStatus.setAStatus((cereal::UbloxGnss::HwStatus::AntennaSupervisorState) msg->a_status());
   hwStatus.setAPower((cereal::UbloxGnss::HwStatus::AntennaPowerStatus) msg->a_power());
   hwStatus.setJamInd(msg->jam_ind());
-  return capnp::messageToFlatArray(msg_builder);
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw2(ubx_t::mon_hw2_t *msg) {
-  MessageBuilder msg_builder;
+void UbloxMsgParser::gen_mon_hw2(ubx_t::mon_hw2_t *msg, MessageBuilder &msg_builder) {
   auto hwStatus = msg_builder.initEvent().initUbloxGnss().initHwStatus2();
   hwStatus.setOfsI(msg->ofs_i());
   hwStatus.setMagI(msg->mag_i());
@@ -338,6 +353,4 @@ kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw2(ubx_t::mon_hw2_t *msg) {
 
   hwStatus.setLowLevCfg(msg->low_lev_cfg());
   hwStatus.setPostStatus(msg->post_status());
-
-  return capnp::messageToFlatArray(msg_builder);
 }
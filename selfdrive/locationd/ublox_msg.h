@@ -14,6 +14,9 @@
 
 using namespace std::string_literals;
 
+// a power of two that holds the largest message
+#define UBLOX_RING_SIZE (1 << 17)
+
 // protocol constants
 namespace ublox {
   const uint8_t PREAMBLE1 = 0xb5;
@@ -22,6 +25,7 @@ namespace ublox {
   const int UBLOX_HEADER_SIZE = 6;
   const int UBLOX_CHECKSUM_SIZE = 2;
   const int UBLOX_MAX_MSG_SIZE = 65536;
+  const uint8_t GNSS_ID_GPS = 0;
 
   // Boardd still uses these:
   const uint8_t CLASS_NAV = 0x01;
@@ -46,6 +50,86 @@ namespace ublox {
     uint32_t tAccNs;
   } __attribute__((packed));
 
+  // payloads of the messages ubloxd reads most, little endian like the host
+  struct ubx_nav_pvt_t {
+    uint32_t iTOW;
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t min;
+    uint8_t sec;
+    uint8_t valid;
+    uint32_t tAcc;
+    int32_t nano;
+    uint8_t fixType;
+    uint8_t flags;
+    uint8_t flags2;
+    uint8_t numSV;
+    int32_t lon;
+    int32_t lat;
+    int32_t height;
+    int32_t hMSL;
+    uint32_t hAcc;
+    uint32_t vAcc;
+    int32_t velN;
+    int32_t velE;
+    int32_t velD;
+    int32_t gSpeed;
+    int32_t headMot;
+    int32_t sAcc;
+    uint32_t headAcc;
+    uint16_t pDOP;
+    uint8_t flags3;
+    uint8_t reserved1[5];
+    int32_t headVeh;
+    int16_t magDec;
+    uint16_t magAcc;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_nav_pvt_t) == 92);
+
+  struct ubx_rxm_rawx_t {
+    double rcvTow;
+    uint16_t week;
+    int8_t leapS;
+    uint8_t numMeas;
+    uint8_t recStat;
+    uint8_t reserved1[3];
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_rawx_t) == 16);
+
+  // numMeas of these follow ubx_rxm_rawx_t
+  struct ubx_rxm_rawx_meas_t {
+    double prMes;
+    double cpMes;
+    float doMes;
+    uint8_t gnssId;
+    uint8_t svId;
+    uint8_t reserved2;
+    uint8_t freqId;
+    uint16_t locktime;
+    uint8_t cno;
+    uint8_t prStdev;
+    uint8_t cpStdev;
+    uint8_t doStdev;
+    uint8_t trkStat;
+    uint8_t reserved3;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_rawx_meas_t) == 32);
+
+  // numWords uint32_t follow ubx_rxm_sfrbx_t
+  struct ubx_rxm_sfrbx_t {
+    uint8_t gnssId;
+    uint8_t svId;
+    uint8_t reserved1;
+    uint8_t freqId;
+    uint8_t numWords;
+    uint8_t reserved2;
+    uint8_t version;
+    uint8_t reserved3;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_sfrbx_t) == 8);
+
   inline std::string ubx_add_checksum(const std::string &msg) {
     assert(msg.size() > 2);
 
@@ -88,29 +172,46 @@ namespace ublox {
   }
 }
 
+// A UBX framer over a ring buffer. Data goes in with add_data, complete messages with a valid
+// checksum come out of next_msg, anything between them is skipped. The hot messages are read
+// straight from the buffer, everything else through kaitai.
 class UbloxMsgParser {
   public:
-    bool add_data(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed);
-    inline void reset() {bytes_in_parse_buf = 0;}
-    inline int needed_bytes();
-    inline std::string data() {return std::string((const char*)msg_parse_buf, bytes_in_parse_buf);}
-
-    std::pair<std::string, kj::Array<capnp::word>> gen_msg();
-    kj::Array<capnp::word> gen_nav_pvt(ubx_t::nav_pvt_t *msg);
-    kj::Array<capnp::word> gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg);
-    kj::Array<capnp::word> gen_rxm_rawx(ubx_t::rxm_rawx_t *msg);
-    kj::Array<capnp::word> gen_mon_hw(ubx_t::mon_hw_t *msg);
-    kj::Array<capnp::word> gen_mon_hw2(ubx_t::mon_hw2_t *msg);
+    // copies as much of incoming_data as fits, returns the bytes taken
+    size_t add_data(const uint8_t *incoming_data, size_t incoming_data_len);
+    // drops the current message and frames the next one, false until one is complete
+    bool next_msg();
+    inline void reset() {head = tail = 0; msg = nullptr; msg_len = 0;}
+    inline uint16_t msg_type() {return (msg[2] << 8) | msg[3];}
+    inline std::string data() {return std::string((const char*)msg, msg_len);}
+
+    // builds the event for the current message, returns the service to send it on
+    // or NULL if there is nothing to send
+    const char *gen_msg(MessageBuilder &msg_builder);
+    void gen_nav_pvt(const ublox::ubx_nav_pvt_t &pvt, MessageBuilder &msg_builder);
+    bool gen_rxm_sfrbx(const ublox::ubx_rxm_sfrbx_t &sfrbx, const uint8_t *words, MessageBuilder &msg_builder);
+    void gen_rxm_rawx(const ublox::ubx_rxm_rawx_t &rawx, const uint8_t *meas, MessageBuilder &msg_builder);
+    void gen_mon_hw(ubx_t::mon_hw_t *msg, MessageBuilder &msg_builder);
+    void gen_mon_hw2(ubx_t::mon_hw2_t *msg, MessageBuilder &msg_builder);
+
+    // bytes skipped while looking for a message, and messages with a bad checksum
+    uint64_t dropped_bytes = 0;
+    uint64_t bad_checksums = 0;
 
   private:
-    inline bool valid_cheksum();
-    inline bool valid();
-    inline bool valid_so_far();
+    inline size_t used() {return tail - head;}
+    inline uint8_t at(size_t pos) {return ring[pos & (UBLOX_RING_SIZE - 1)];}
+    bool find_preamble();
+    const uint8_t *frame(size_t len);
 
     std::unordered_map<int, std::unordered_map<int, std::string>> gps_subframes;
 
-    size_t bytes_in_parse_buf = 0;
-    uint8_t msg_parse_buf[ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_MAX_MSG_SIZE];
+    // positions only grow, they are masked on access
+    size_t head = 0, tail = 0;
+    uint8_t ring[UBLOX_RING_SIZE];
 
+    // the current message, in the ring or in msg_buf if it wraps around
+    const uint8_t *msg = nullptr;
+    size_t msg_len = 0;
+    uint8_t msg_buf[ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_MAX_MSG_SIZE + ublox::UBLOX_CHECKSUM_SIZE];
 };
-
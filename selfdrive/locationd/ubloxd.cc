@@ -1,4 +1,6 @@
 #include <cassert>
+#include <memory>
+#include <vector>
 
 #include <kaitai/kaitaistream.h>
 
@@ -7,13 +9,27 @@
 #include "selfdrive/common/util.h"
 #include "selfdrive/locationd/ublox_msg.h"
 
+#define UBLOXD_SEGMENT_WORDS 1024  // a rawx with 64 measurements fits
+
 ExitHandler do_exit;
 using namespace ublox;
 
+// serializes msg straight into the queue
+static void publish(PubMaster &pm, const char *name, MessageBuilder &msg) {
+  const size_t size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+  char *buf = pm.reserve(name, size);
+  if (buf == NULL) return;
+  kj::ArrayOutputStream out(kj::arrayPtr((kj::byte *)buf, size));
+  capnp::writeMessage(out, msg);
+  pm.commit(name, size);
+}
+
 int main() {
   LOGW("starting ubloxd");
   AlignedBuffer aligned_buf;
-  UbloxMsgParser parser;
+  auto parser = std::make_unique<UbloxMsgParser>();
+  // the first segment of every message, reused
+  std::vector<capnp::word> segment(UBLOXD_SEGMENT_WORDS);
 
   PubMaster pm({"ubloxGnss", "gpsLocationExternal"});
 
@@ -24,7 +40,8 @@ int main() {
 
 
   while (!do_exit) {
-    Message * msg = subscriber->receive();
+    // borrowed from the queue and copied out, so nothing is allocated per message
+    Message * msg = subscriber->receive_borrowed();
     if (!msg) {
       if (errno == EINTR) {
         do_exit = true;
@@ -32,7 +49,16 @@ int main() {
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
+    auto words = aligned_buf.align(msg);
+    // the copy may be torn if the slot was overwritten while it was held
+    const bool intact = msg->release();
+    delete msg;
+    if (!intact) {
+      LOGE("ubloxRaw overwritten while it was read, dropped");
+      continue;
+    }
+
+    capnp::FlatArrayMessageReader cmsg(words);
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
     auto ubloxRaw = event.getUbloxRaw();
 
@@ -41,24 +67,19 @@ int main() {
     size_t bytes_consumed = 0;
 
     while(bytes_consumed < len && !do_exit) {
-      size_t bytes_consumed_this_time = 0U;
-      if(parser.add_data(data + bytes_consumed, (uint32_t)(len - bytes_consumed), bytes_consumed_this_time)) {
+      bytes_consumed += parser->add_data(data + bytes_consumed, len - bytes_consumed);
 
+      while (parser->next_msg()) {
         try {
-          auto msg = parser.gen_msg();
-          if (msg.second.size() > 0) {
-            auto bytes = msg.second.asBytes();
-            pm.send(msg.first.c_str(), bytes.begin(), bytes.size());
+          MessageBuilder msg_builder(kj::arrayPtr(segment.data(), segment.size()));
+          if (const char *name = parser->gen_msg(msg_builder)) {
+            publish(pm, name, msg_builder);
           }
         } catch (const std::exception& e) {
           LOGE("Error parsing ublox message %s", e.what());
         }
-
-        parser.reset();
       }
-      bytes_consumed += bytes_consumed_this_time;
     }
-    delete msg;
   }
 
   delete subscriber;
@@ -0,0 +1,398 @@
+#include "selfdrive/loggerd/indexed_log.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <bzlib.h>
+#include <capnp/serialize.h>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+// size of the serialized capnp message at data, or 0 if size bytes don't hold all of it
+static size_t message_size(const uint8_t* data, size_t size) {
+  if (size < 8) return 0;
+
+  uint32_t num_segments;
+  memcpy(&num_segments, data, sizeof(num_segments));
+  num_segments += 1;
+  size_t header_size = ((4 + 4 * num_segments) + 7) & ~7;
+  if (size < header_size) return 0;
+
+  size_t total = header_size;
+  for (uint32_t i = 0; i < num_segments; i++) {
+    uint32_t segment_words;
+    memcpy(&segment_words, data + 4 + 4 * i, sizeof(segment_words));
+    total += (size_t)segment_words * sizeof(capnp::word);
+  }
+  return total <= size ? total : 0;
+}
+
+static void bitmap_set(std::vector<uint64_t>& bitmap, size_t bit) {
+  if (bit / 64 >= bitmap.size()) {
+    bitmap.resize(bit / 64 + 1, 0);
+  }
+  bitmap[bit / 64] |= 1ULL << (bit % 64);
+}
+
+// ***** writer *****
+
+IndexedLogFile::IndexedLogFile(const char* path, int level, int frame_msgs, uint64_t frame_ns)
+    : frame_msgs(frame_msgs), frame_ns(frame_ns) {
+  file = fopen(path, "wb");
+  assert(file != nullptr);
+  cctx = ZSTD_createCCtx();
+  assert(cctx != nullptr);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  pending.reserve(INDEXED_LOG_FRAME_MAX_BYTES);
+}
+
+IndexedLogFile::~IndexedLogFile() {
+  flush_frame();
+
+  size_t bitmap_words = 0;
+  for (const auto& b : bitmaps) {
+    bitmap_words = std::max(bitmap_words, b.size());
+  }
+
+  IndexedLogTrailer trailer = {
+    .version = INDEXED_LOG_VERSION,
+    .num_frames = (uint32_t)index.size(),
+    .bitmap_words = (uint32_t)bitmap_words,
+    .reserved = 0,
+    .index_size = index.size() * (sizeof(IndexedLogFrame) + bitmap_words * sizeof(uint64_t)) + sizeof(IndexedLogTrailer),
+    .magic = INDEXED_LOG_MAGIC,
+  };
+
+  uint32_t skippable_header[2] = {INDEXED_LOG_SKIPPABLE_MAGIC, (uint32_t)trailer.index_size};
+  write_file(skippable_header, sizeof(skippable_header));
+  write_file(index.data(), index.size() * sizeof(IndexedLogFrame));
+  for (auto& b : bitmaps) {
+    b.resize(bitmap_words, 0);
+    write_file(b.data(), bitmap_words * sizeof(uint64_t));
+  }
+  write_file(&trailer, sizeof(trailer));
+
+  ZSTD_freeCCtx(cctx);
+  int err = fclose(file);
+  assert(err == 0);
+}
+
+void IndexedLogFile::write(void* data, size_t size) {
+  pending.insert(pending.end(), (uint8_t*)data, (uint8_t*)data + size);
+
+  // index every message that is complete by now
+  size_t msg_size;
+  while ((msg_size = message_size(pending.data() + frame_bytes, pending.size() - frame_bytes)) > 0) {
+    uint64_t mono_time = 0;
+    int which = -1;
+    try {
+      kj::ArrayPtr<const capnp::word> words((const capnp::word*)(pending.data() + frame_bytes), msg_size / sizeof(capnp::word));
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      mono_time = event.getLogMonoTime();
+      which = (int)event.which();
+    } catch (const kj::Exception& e) {
+      LOGE("indexed log: failed to read event: %s", e.getDescription().cStr());
+    }
+
+    if (frame.num_msgs == 0) {
+      frame.min_mono_time = frame.max_mono_time = mono_time;
+    } else {
+      frame.min_mono_time = std::min(frame.min_mono_time, mono_time);
+      frame.max_mono_time = std::max(frame.max_mono_time, mono_time);
+    }
+    if (which >= 0) {
+      bitmap_set(frame_bitmap, (size_t)which);
+    }
+    frame.num_msgs++;
+    frame_bytes += msg_size;
+
+    if (frame.num_msgs >= (uint32_t)frame_msgs || frame.max_mono_time - frame.min_mono_time >= frame_ns ||
+        frame_bytes >= INDEXED_LOG_FRAME_MAX_BYTES) {
+      flush_frame();
+    }
+  }
+}
+
+void IndexedLogFile::flush_frame() {
+  if (frame.num_msgs == 0) return;
+
+  out_buf.resize(ZSTD_compressBound(frame_bytes));
+  size_t compressed = ZSTD_compress2(cctx, out_buf.data(), out_buf.size(), pending.data(), frame_bytes);
+  if (ZSTD_isError(compressed)) {
+    if (!error_logged) {
+      LOGE("ZSTD_compress2 error: %s", ZSTD_getErrorName(compressed));
+      error_logged = true;
+    }
+  } else {
+    frame.offset = file_offset;
+    frame.size = compressed;
+    write_file(out_buf.data(), compressed);
+    index.push_back(frame);
+    bitmaps.push_back(frame_bitmap);
+  }
+
+  // keep the partially written message for the next frame
+  pending.erase(pending.begin(), pending.begin() + frame_bytes);
+  frame_bytes = 0;
+  frame = {};
+  frame_bitmap.clear();
+}
+
+void IndexedLogFile::write_file(const void* data, size_t size) {
+  if (size == 0) return;
+  if (fwrite(data, 1, size, file) != size && !error_logged) {
+    LOGE("indexed log write error, errno=%d", errno);
+    error_logged = true;
+  }
+  file_offset += size;
+}
+
+// ***** reader *****
+
+IndexedLogReader::~IndexedLogReader() {
+  if (data != nullptr) {
+    munmap((void*)data, data_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool IndexedLogReader::load(const std::string& path) {
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+
+  data_size = st.st_size;
+  void* addr = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    data_size = 0;
+    return false;
+  }
+  data = (const uint8_t*)addr;
+
+  return load_index() || build_index();
+}
+
+bool IndexedLogReader::load_index() {
+  IndexedLogTrailer trailer;
+  if (data_size < sizeof(trailer) + 8) return false;
+  memcpy(&trailer, data + data_size - sizeof(trailer), sizeof(trailer));
+  if (trailer.magic != INDEXED_LOG_MAGIC || trailer.version != INDEXED_LOG_VERSION) return false;
+
+  size_t frames_size = (size_t)trailer.num_frames * sizeof(IndexedLogFrame);
+  size_t bitmaps_size = (size_t)trailer.num_frames * trailer.bitmap_words * sizeof(uint64_t);
+  if (trailer.index_size != frames_size + bitmaps_size + sizeof(trailer) || trailer.index_size > data_size) return false;
+
+  const uint8_t* p = data + data_size - trailer.index_size;
+  index.resize(trailer.num_frames);
+  memcpy(index.data(), p, frames_size);
+  bitmap_words = trailer.bitmap_words;
+  bitmaps.resize(trailer.num_frames * bitmap_words);
+  memcpy(bitmaps.data(), p + frames_size, bitmaps_size);
+
+  for (const auto& f : index) {
+    if (f.offset + f.size > data_size - trailer.index_size) {
+      LOGE("indexed log: frame out of bounds");
+      index.clear();
+      bitmaps.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IndexedLogReader::build_index() {
+  index.clear();
+  bitmaps.clear();
+  bitmap_words = 0;
+
+  size_t offset = 0;
+  while (offset < data_size) {
+    size_t frame_size = ZSTD_findFrameCompressedSize(data + offset, data_size - offset);
+    if (ZSTD_isError(frame_size)) break;  // truncated frame at the end of a crashed segment
+
+    uint32_t magic;
+    memcpy(&magic, data + offset, sizeof(magic));
+    if ((magic & 0xFFFFFFF0) != (INDEXED_LOG_SKIPPABLE_MAGIC & 0xFFFFFFF0)) {
+      IndexedLogFrame f = {.offset = offset, .size = frame_size};
+      index.push_back(f);
+      kj::Array<capnp::word> events = read_frame(index.size() - 1);
+      index.pop_back();
+      add_frame(offset, frame_size, events);
+    }
+    offset += frame_size;
+  }
+  return !index.empty();
+}
+
+void IndexedLogReader::add_frame(uint64_t offset, uint64_t size, kj::ArrayPtr<const capnp::word> events) {
+  IndexedLogFrame f = {.offset = offset, .size = size};
+  std::vector<uint64_t> bitmap(bitmap_words, 0);
+
+  try {
+    while (events.size() > 0) {
+      capnp::FlatArrayMessageReader reader(events);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      uint64_t mono_time = event.getLogMonoTime();
+      f.min_mono_time = f.num_msgs == 0 ? mono_time : std::min(f.min_mono_time, mono_time);
+      f.max_mono_time = f.num_msgs == 0 ? mono_time : std::max(f.max_mono_time, mono_time);
+      bitmap_set(bitmap, (size_t)event.which());
+      f.num_msgs++;
+      events = kj::arrayPtr(reader.getEnd(), events.end());
+    }
+  } catch (const kj::Exception& e) {
+    LOGE("indexed log: failed to read event: %s", e.getDescription().cStr());
+  }
+
+  // grow all bitmaps if this frame has a type beyond the current width
+  if (bitmap.size() > bitmap_words) {
+    std::vector<uint64_t> grown(index.size() * bitmap.size(), 0);
+    for (size_t i = 0; i < index.size(); i++) {
+      std::copy_n(&bitmaps[i * bitmap_words], bitmap_words, &grown[i * bitmap.size()]);
+    }
+    bitmaps = std::move(grown);
+    bitmap_words = bitmap.size();
+  }
+  bitmap.resize(bitmap_words, 0);
+
+  index.push_back(f);
+  bitmaps.insert(bitmaps.end(), bitmap.begin(), bitmap.end());
+}
+
+bool IndexedLogReader::frame_has(size_t frame, cereal::Event::Which which) const {
+  size_t bit = (size_t)which;
+  if (bit / 64 >= bitmap_words) return false;
+  return bitmaps[frame * bitmap_words + bit / 64] & (1ULL << (bit % 64));
+}
+
+std::vector<size_t> IndexedLogReader::find_frames(uint64_t start_mono, uint64_t end_mono,
+                                                  const std::vector<cereal::Event::Which>& types) const {
+  std::vector<size_t> ret;
+  for (size_t i = 0; i < index.size(); i++) {
+    const IndexedLogFrame& f = index[i];
+    if (f.max_mono_time < start_mono || f.min_mono_time > end_mono) continue;
+
+    bool has_type = types.empty();
+    for (auto t : types) {
+      has_type = has_type || frame_has(i, t);
+    }
+    if (has_type) {
+      ret.push_back(i);
+    }
+  }
+  return ret;
+}
+
+kj::Array<capnp::word> IndexedLogReader::read_frame(size_t frame) const {
+  const IndexedLogFrame& f = index[frame];
+  const uint8_t* src = data + f.offset;
+
+  unsigned long long size = ZSTD_getFrameContentSize(src, f.size);
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+    LOGE("indexed log: bad frame %zu", frame);
+    return kj::heapArray<capnp::word>(0);
+  }
+
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  size_t ret = ZSTD_decompress(buf.begin(), buf.size() * sizeof(capnp::word), src, f.size);
+  if (ZSTD_isError(ret)) {
+    LOGE("indexed log: failed to decompress frame %zu: %s", frame, ZSTD_getErrorName(ret));
+    return kj::heapArray<capnp::word>(0);
+  }
+  return buf;
+}
+
+void IndexedLogReader::read(uint64_t start_mono, uint64_t end_mono, const std::vector<cereal::Event::Which>& types,
+                            const std::function<void(cereal::Event::Reader)>& cb) const {
+  for (size_t i : find_frames(start_mono, end_mono, types)) {
+    kj::Array<capnp::word> buf = read_frame(i);
+    kj::ArrayPtr<const capnp::word> events = buf;
+    try {
+      while (events.size() > 0) {
+        capnp::FlatArrayMessageReader reader(events);
+        cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+        events = kj::arrayPtr(reader.getEnd(), events.end());
+
+        uint64_t mono_time = event.getLogMonoTime();
+        if (mono_time < start_mono || mono_time > end_mono) continue;
+        if (!types.empty() && std::find(types.begin(), types.end(), event.which()) == types.end()) continue;
+        cb(event);
+      }
+    } catch (const kj::Exception& e) {
+      LOGE("indexed log: failed to read event: %s", e.getDescription().cStr());
+    }
+  }
+}
+
+// ***** any log *****
+
+static bool read_bz2_events(const std::string& path, const std::vector<cereal::Event::Which>& types,
+                            const std::function<void(cereal::Event::Reader)>& cb) {
+  std::string compressed = util::read_file(path);
+  if (compressed.empty()) return false;
+
+  bz_stream strm = {};
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+  strm.next_in = compressed.data();
+  strm.avail_in = compressed.size();
+
+  // as words, so the events can be read in place
+  std::vector<capnp::word> buf(compressed.size() + 1);
+  size_t size = 0;
+  int ret;
+  while (true) {
+    if (size == buf.size() * sizeof(capnp::word)) buf.resize(buf.size() * 2);
+    strm.next_out = (char*)buf.data() + size;
+    strm.avail_out = buf.size() * sizeof(capnp::word) - size;
+    ret = BZ2_bzDecompress(&strm);
+    size = buf.size() * sizeof(capnp::word) - strm.avail_out;
+    if (ret != BZ_OK) break;
+    // no stream end in a log cut off by a crash
+    if (strm.avail_in == 0 && strm.avail_out > 0) break;
+  }
+  BZ2_bzDecompressEnd(&strm);
+  if (ret != BZ_OK && ret != BZ_STREAM_END) {
+    LOGE("failed to decompress %s: %d", path.c_str(), ret);
+    if (size == 0) return false;
+  }
+
+  kj::ArrayPtr<const capnp::word> events(buf.data(), size / sizeof(capnp::word));
+  try {
+    while (events.size() > 0) {
+      capnp::FlatArrayMessageReader reader(events);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      events = kj::arrayPtr(reader.getEnd(), events.end());
+      if (!types.empty() && std::find(types.begin(), types.end(), event.which()) == types.end()) continue;
+      cb(event);
+    }
+  } catch (const kj::Exception& e) {
+    // a message cut in half at the end
+    LOGW("failed to read event in %s: %s", path.c_str(), e.getDescription().cStr());
+  }
+  return true;
+}
+
+bool log_read_events(const std::string& path, const std::vector<cereal::Event::Which>& types,
+                     const std::function<void(cereal::Event::Reader)>& cb) {
+  if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".bz2") == 0) {
+    return read_bz2_events(path, types, cb);
+  }
+
+  IndexedLogReader reader;
+  if (!reader.load(path)) return false;
+  reader.read(0, UINT64_MAX, types, cb);
+  return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <zstd.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/loggerd/logger.h"
+
+// Indexed log segments are a sequence of independently compressed zstd frames, each holding
+// whole Events, followed by the index in a zstd skippable frame. Plain zstd decoders skip the
+// index, so an indexed segment still decompresses to the usual stream of Events.
+//
+// The index is an array of IndexedLogFrame, then a bitmap of the Event types in each frame
+// (bitmap_words uint64_t per frame) and an IndexedLogTrailer at the very end of the file.
+
+#define INDEXED_LOG_MAGIC 0x58444E49474F4C4FULL  // "OLOGINDX"
+#define INDEXED_LOG_VERSION 1
+#define INDEXED_LOG_SKIPPABLE_MAGIC 0x184D2A5E
+
+#define INDEXED_LOG_FRAME_MSGS 1000
+#define INDEXED_LOG_FRAME_NS (500 * 1000000ULL)
+#define INDEXED_LOG_FRAME_MAX_BYTES (4 * 1024 * 1024)
+
+struct IndexedLogFrame {
+  uint64_t offset;  // of the zstd frame in the file
+  uint64_t size;    // compressed
+  uint64_t min_mono_time;
+  uint64_t max_mono_time;
+  uint32_t num_msgs;
+  uint32_t reserved;
+};
+
+struct IndexedLogTrailer {
+  uint32_t version;
+  uint32_t num_frames;
+  uint32_t bitmap_words;
+  uint32_t reserved;
+  uint64_t index_size;  // everything after the skippable frame header, including this trailer
+  uint64_t magic;
+};
+static_assert(sizeof(IndexedLogFrame) == 40 && sizeof(IndexedLogTrailer) == 32, "unexpected index layout");
+
+// Splits the stream of Events written to it into frames of at most frame_msgs messages,
+// frame_ns of logMonoTime or INDEXED_LOG_FRAME_MAX_BYTES, and writes the index on close.
+class IndexedLogFile : public LogFile {
+ public:
+  IndexedLogFile(const char* path, int level = 3,
+                 int frame_msgs = INDEXED_LOG_FRAME_MSGS, uint64_t frame_ns = INDEXED_LOG_FRAME_NS);
+  ~IndexedLogFile();
+  void write(void* data, size_t size) override;
+  using LogFile::write;
+
+ private:
+  void flush_frame();
+  void write_file(const void* data, size_t size);
+
+  FILE* file = nullptr;
+  ZSTD_CCtx* cctx = nullptr;
+  bool error_logged = false;
+  const int frame_msgs;
+  const uint64_t frame_ns;
+  uint64_t file_offset = 0;
+
+  // complete messages of the current frame, followed by a partially written message
+  std::vector<uint8_t> pending;
+  size_t frame_bytes = 0;
+  IndexedLogFrame frame = {};
+  std::vector<uint64_t> frame_bitmap;
+  std::vector<uint8_t> out_buf;
+
+  std::vector<IndexedLogFrame> index;
+  std::vector<std::vector<uint64_t>> bitmaps;
+};
+
+// Random access to an indexed segment through mmap. Segments without an index,
+// e.g. from a crash, are indexed on load by decompressing every frame once.
+class IndexedLogReader {
+ public:
+  ~IndexedLogReader();
+  bool load(const std::string& path);
+
+  const std::vector<IndexedLogFrame>& frames() const { return index; }
+  bool frame_has(size_t frame, cereal::Event::Which which) const;
+  // frames that may contain events in [start_mono, end_mono] of one of the types, all types if empty
+  std::vector<size_t> find_frames(uint64_t start_mono, uint64_t end_mono,
+                                  const std::vector<cereal::Event::Which>& types = {}) const;
+  // the Events of one frame, as a buffer of concatenated messages
+  kj::Array<capnp::word> read_frame(size_t frame) const;
+  // calls cb for every event in [start_mono, end_mono] of one of the types, all types if empty
+  void read(uint64_t start_mono, uint64_t end_mono, const std::vector<cereal::Event::Which>& types,
+            const std::function<void(cereal::Event::Reader)>& cb) const;
+
+ private:
+  bool load_index();
+  bool build_index();
+  void add_frame(uint64_t offset, uint64_t size, kj::ArrayPtr<const capnp::word> events);
+
+  int fd = -1;
+  const uint8_t* data = nullptr;
+  size_t data_size = 0;
+  size_t bitmap_words = 0;
+  std::vector<IndexedLogFrame> index;
+  std::vector<uint64_t> bitmaps;  // bitmap_words per frame
+};
+
+// Reads every event of one of the types, all types if empty, from an indexed zstd or a bz2 log,
+// going by the extension. Logs cut off by a crash are read up to where they end. False if the
+// file can't be read at all.
+bool log_read_events(const std::string& path, const std::vector<cereal::Event::Which>& types,
+                     const std::function<void(cereal::Event::Reader)>& cb);
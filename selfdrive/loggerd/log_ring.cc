@@ -0,0 +1,114 @@
+#include "selfdrive/loggerd/log_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+#include "selfdrive/common/timing.h"
+
+LogRing::LogRing(size_t capacity) {
+  size_t size = 64;
+  while (size < capacity) size <<= 1;
+  mask = size - 1;
+  buf = std::make_unique<uint64_t[]>(size / 8);  // zeroed, nothing is published yet
+}
+
+bool LogRing::push(uint32_t tag, const void* data, size_t size) {
+  if (!try_push(tag, data, size)) {
+    dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+    dropped_msgs.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void LogRing::push_wait(uint32_t tag, const void* data, size_t size) {
+  assert(record_size(size) <= capacity());
+  if (try_push(tag, data, size)) return;
+
+  std::unique_lock lk(producer_lock);
+  producers_waiting++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // the consumer checks producers_waiting after moving tail, so it either sees us or we see the room
+  while (!try_push(tag, data, size)) {
+    producer_cv.wait(lk);
+  }
+  producers_waiting--;
+}
+
+bool LogRing::try_push(uint32_t tag, const void* data, size_t size) {
+  const size_t rec_size = record_size(size);
+
+  uint64_t pos = head.load(std::memory_order_relaxed);
+  size_t used;
+  do {
+    const uint64_t t = tail.load(std::memory_order_acquire);
+    used = pos + rec_size - t;
+    // pos < t only if pos is stale, the CAS below fails and reloads it
+    if (size >= UINT32_MAX || (pos >= t && used > capacity())) {
+      return false;
+    }
+  } while (!head.compare_exchange_weak(pos, pos + rec_size, std::memory_order_relaxed));
+
+  size_t hw = high_water.load(std::memory_order_relaxed);
+  while (used > hw && !high_water.compare_exchange_weak(hw, used, std::memory_order_relaxed)) {}
+
+  uint64_t enqueue_ns = nanos_since_boot();
+  copy_in(pos + 8, &enqueue_ns, sizeof(enqueue_ns));
+  if (size > 0) {
+    copy_in(pos + HEADER_SIZE, data, size);
+  }
+
+  // publish, the size is stored + 1 so that an empty record still has a non zero header
+  uint64_t header = ((uint64_t)tag << 32) | (uint32_t)(size + 1);
+  __atomic_store_n(&buf[(pos & mask) / 8], header, __ATOMIC_RELEASE);
+
+  // pairs with the fence in wait(), either the consumer sees the record or we see it waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (consumer_waiting.load(std::memory_order_relaxed)) {
+    std::lock_guard lk(consumer_lock);
+    consumer_cv.notify_one();
+  }
+  return true;
+}
+
+void LogRing::wait(int timeout_ms) {
+  std::unique_lock lk(consumer_lock);
+  consumer_waiting.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const uint64_t pos = tail.load(std::memory_order_relaxed);
+  consumer_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return published(pos); });
+  consumer_waiting.store(false, std::memory_order_relaxed);
+}
+
+void LogRing::wake_producers() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (producers_waiting.load(std::memory_order_relaxed) > 0) {
+    std::lock_guard lk(producer_lock);
+    producer_cv.notify_all();
+  }
+}
+
+void LogRing::copy_in(uint64_t pos, const void* src, size_t size) {
+  uint8_t* dst = (uint8_t*)buf.get();
+  const size_t offset = pos & mask;
+  const size_t first = std::min(size, capacity() - offset);
+  memcpy(dst + offset, src, first);
+  memcpy(dst, (const uint8_t*)src + first, size - first);
+}
+
+void LogRing::copy_out(uint64_t pos, void* dst, size_t size) const {
+  const uint8_t* src = (const uint8_t*)buf.get();
+  const size_t offset = pos & mask;
+  const size_t first = std::min(size, capacity() - offset);
+  memcpy(dst, src + offset, first);
+  memcpy((uint8_t*)dst + first, src, size - first);
+}
+
+void LogRing::clear(uint64_t pos, size_t size) {
+  uint8_t* dst = (uint8_t*)buf.get();
+  const size_t offset = pos & mask;
+  const size_t first = std::min(size, capacity() - offset);
+  memset(dst + offset, 0, first);
+  memset(dst, 0, size - first);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Multi-producer, single-consumer ring of variable sized records. Producers reserve space with
+// a CAS on head and publish a record by storing its header last, so push() never waits for the
+// consumer. When the ring is full the record is dropped and counted. A producer only takes a
+// lock to wake the consumer when it is sleeping in wait() on an empty ring.
+//
+// Every record starts with an 8 byte header (payload size + 1, tag) and the enqueue time,
+// and is padded to 8 bytes. The consumer zeroes records after reading them, a zero header
+// means the record at that position is not published yet.
+
+struct LogRingRecord {
+  uint32_t tag;
+  uint64_t enqueue_ns;
+  const uint8_t* data;
+  size_t size;
+};
+
+class LogRing {
+ public:
+  // capacity is rounded up to a power of two
+  LogRing(size_t capacity);
+
+  // returns false if the record was dropped because the ring is full
+  bool push(uint32_t tag, const void* data, size_t size);
+  // for records that can't be dropped, waits until the consumer made room
+  void push_wait(uint32_t tag, const void* data, size_t size);
+
+  // consumer side, calls cb(const LogRingRecord&) for every published record in order
+  template <typename F>
+  size_t pop(F cb);
+  // consumer side, sleeps until a record is published or timeout_ms passed
+  void wait(int timeout_ms);
+
+  size_t capacity() const { return mask + 1; }
+  size_t used() const { return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed); }
+
+  // high-water mark of used bytes since the last call
+  size_t reset_high_water() { return high_water.exchange(0, std::memory_order_relaxed); }
+  std::atomic<uint64_t> dropped_bytes = 0;
+  std::atomic<uint64_t> dropped_msgs = 0;
+
+ private:
+  static constexpr size_t HEADER_SIZE = 16;
+  static size_t record_size(size_t size) { return (HEADER_SIZE + size + 7) & ~(size_t)7; }
+
+  bool try_push(uint32_t tag, const void* data, size_t size);
+  bool published(uint64_t pos) const { return __atomic_load_n(&buf[(pos & mask) / 8], __ATOMIC_ACQUIRE) != 0; }
+  void wake_producers();
+
+  void copy_in(uint64_t pos, const void* src, size_t size);
+  void copy_out(uint64_t pos, void* dst, size_t size) const;
+  void clear(uint64_t pos, size_t size);
+
+  std::unique_ptr<uint64_t[]> buf;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head = 0;
+  alignas(64) std::atomic<uint64_t> tail = 0;
+  std::atomic<size_t> high_water = 0;
+  std::vector<uint8_t> scratch;  // consumer only, for records that wrap around the end
+
+  // separate locks, a producer in push_wait() can wake the consumer
+  std::atomic<bool> consumer_waiting = false;
+  std::mutex consumer_lock;
+  std::condition_variable consumer_cv;
+  std::atomic<int> producers_waiting = 0;
+  std::mutex producer_lock;
+  std::condition_variable producer_cv;
+};
+
+template <typename F>
+size_t LogRing::pop(F cb) {
+  size_t count = 0;
+  uint64_t pos = tail.load(std::memory_order_relaxed);
+  while (true) {
+    uint64_t header = __atomic_load_n(&buf[(pos & mask) / 8], __ATOMIC_ACQUIRE);
+    if (header == 0) break;
+
+    LogRingRecord rec = {.tag = (uint32_t)(header >> 32), .size = (uint32_t)header - 1};
+    copy_out(pos + 8, &rec.enqueue_ns, sizeof(rec.enqueue_ns));
+
+    const uint64_t data_pos = pos + HEADER_SIZE;
+    const size_t offset = data_pos & mask;
+    if (offset + rec.size <= capacity()) {
+      rec.data = (const uint8_t*)buf.get() + offset;
+    } else {
+      scratch.resize(rec.size);
+      copy_out(data_pos, scratch.data(), rec.size);
+      rec.data = scratch.data();
+    }
+    cb(rec);
+
+    const size_t size = record_size(rec.size);
+    clear(pos, size);
+    pos += size;
+    tail.store(pos, std::memory_order_release);
+    count++;
+  }
+  if (count > 0) wake_producers();
+  return count;
+}
@@ -20,7 +20,9 @@
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/version.h"
+#include "selfdrive/loggerd/indexed_log.h"
 
 // ***** logging helpers *****
 
@@ -47,6 +49,92 @@ int logger_mkpath(char* file_path) {
   return 0;
 }
 
+// ***** log files *****
+
+AsyncLogFile::AsyncLogFile(std::unique_ptr<LogFile> file) : file(std::move(file)) {
+  chunk.reserve(ASYNC_LOG_CHUNK_SIZE);
+  last_push_ms = millis_since_boot();
+  thread = std::thread(&AsyncLogFile::worker, this);
+}
+
+AsyncLogFile::~AsyncLogFile() {
+  push_chunk();
+  {
+    std::unique_lock lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+void AsyncLogFile::write(void* data, size_t size) {
+  chunk.insert(chunk.end(), (uint8_t*)data, (uint8_t*)data + size);
+
+  double ts = millis_since_boot();
+  if (chunk.size() >= ASYNC_LOG_CHUNK_SIZE || ts - last_push_ms > ASYNC_LOG_FLUSH_INTERVAL_MS) {
+    push_chunk();
+    last_push_ms = ts;
+  }
+}
+
+void AsyncLogFile::push_chunk() {
+  if (chunk.empty()) return;
+
+  std::unique_lock lk(lock);
+  if (queued_bytes + chunk.size() > ASYNC_LOG_MAX_QUEUED) {
+    if (!stall_logged) {
+      LOGW("log compression is falling behind, blocking writer");
+      stall_logged = true;
+    }
+    cv.wait(lk, [&] { return queued_bytes + chunk.size() <= ASYNC_LOG_MAX_QUEUED || queue.empty(); });
+  }
+  queued_bytes += chunk.size();
+  queue.push_back(std::move(chunk));
+  lk.unlock();
+  cv.notify_all();
+
+  chunk = std::vector<uint8_t>();
+  chunk.reserve(ASYNC_LOG_CHUNK_SIZE);
+}
+
+void AsyncLogFile::worker() {
+  set_thread_name("loggerd_compress");
+
+  std::unique_lock lk(lock);
+  while (true) {
+    cv.wait(lk, [&] { return exit || !queue.empty(); });
+    if (queue.empty()) break;  // exit once everything is written
+
+    std::vector<uint8_t> data = std::move(queue.front());
+    queue.pop_front();
+    lk.unlock();
+
+    file->write(data.data(), data.size());
+
+    lk.lock();
+    queued_bytes -= data.size();
+    cv.notify_all();
+  }
+  lk.unlock();
+
+  // close the file on this thread as well, flushing the compressor can take a while
+  file.reset();
+}
+
+const char* log_compression_ext(LogCompression compression) {
+  return compression == LogCompression::ZSTD ? "zst" : "bz2";
+}
+
+std::unique_ptr<LogFile> log_file_open(const char* path, LogCompression compression, int level, bool async) {
+  std::unique_ptr<LogFile> file;
+  if (compression == LogCompression::ZSTD) {
+    file = std::make_unique<IndexedLogFile>(path, level);
+  } else {
+    file = std::make_unique<BZFile>(path, level);
+  }
+  return async ? std::make_unique<AsyncLogFile>(std::move(file)) : std::move(file);
+}
+
 // ***** log metadata *****
 kj::Array<capnp::word> logger_build_init_data() {
   MessageBuilder msg;
@@ -126,9 +214,11 @@ std::string logger_get_route_name() {
   return route_name;
 }
 
+static void logger_log_wait(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+
 void log_init_data(LoggerState *s) {
   auto bytes = s->init_data.asBytes();
-  logger_log(s, bytes.begin(), bytes.size(), s->has_qlog);
+  logger_log_wait(s, bytes.begin(), bytes.size(), s->has_qlog);
 }
 
 
@@ -139,11 +229,81 @@ static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type, in
   sen.setSignal(signal);
   auto bytes = msg.toBytes();
 
-  logger_log(s, bytes.begin(), bytes.size(), true);
+  logger_log_wait(s, bytes.begin(), bytes.size(), true);
 }
 
 // ***** logging functions *****
 
+// ring record tags, the low bits are the handle index
+#define LOGGER_TAG_HANDLE_MASK 0xff
+#define LOGGER_TAG_QLOG (1 << 8)
+#define LOGGER_TAG_CLOSE (1 << 9)
+
+// for records that can't be dropped, waits for the writer to make room
+static void lh_push_wait(LoggerHandle* h, uint32_t tag, const void* data, size_t size) {
+  h->ring->push_wait(tag, data, size);
+}
+
+static void lh_release(LoggerHandle* h) {
+  h->log.reset(nullptr);
+  h->q_log.reset(nullptr);
+  unlink(h->lock_path);
+  // last, logger_open can reuse the handle from here on
+  h->open = false;
+}
+
+// takes a reference to the current handle without s->lock. the handle may be closed and
+// reopened for the next segment between reading cur_handle and pinning it, so it is only
+// pinned while it still has references and then checked to still be the current one
+static LoggerHandle* logger_pin(LoggerState *s) {
+  while (true) {
+    LoggerHandle* h = s->cur_handle;
+    if (!h) return nullptr;
+
+    int refcnt = h->refcnt;
+    do {
+      if (refcnt == 0) break;
+    } while (!h->refcnt.compare_exchange_weak(refcnt, refcnt + 1));
+
+    if (refcnt == 0) continue;
+    if (h == s->cur_handle) return h;
+    lh_close(h);
+  }
+}
+
+static void logger_writer(LoggerState *s) {
+  set_thread_name("loggerd_writer");
+
+  while (true) {
+    // everything pushed before the exit flag was set is written before exiting
+    const bool exit = s->writer_exit;
+    size_t count = s->ring->pop([=](const LogRingRecord &rec) {
+      LoggerHandle* h = &s->handles[rec.tag & LOGGER_TAG_HANDLE_MASK];
+      if (rec.tag & LOGGER_TAG_CLOSE) {
+        lh_release(h);
+      } else {
+        h->log->write((void*)rec.data, rec.size);
+        if ((rec.tag & LOGGER_TAG_QLOG) && h->q_log) {
+          h->q_log->write((void*)rec.data, rec.size);
+        }
+        s->written_bytes += rec.size;
+      }
+
+      uint64_t latency_us = (nanos_since_boot() - rec.enqueue_ns) / 1000;
+      s->latency_sum_us += latency_us;
+      s->latency_count++;
+      if (latency_us > s->latency_max_us) {
+        s->latency_max_us = latency_us;
+      }
+    });
+
+    if (count == 0) {
+      if (exit) break;
+      s->ring->wait(LOGGER_WRITER_WAIT_MS);
+    }
+  }
+}
+
 void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   umask(0);
 
@@ -154,6 +314,16 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   s->route_name = logger_get_route_name();
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
   s->init_data = logger_build_init_data();
+
+  // bz2 stays the default, that's what the rest of the tooling expects
+  const char* compression = getenv("LOGGERD_COMPRESSION");
+  s->compression = (compression && strcmp(compression, "zstd") == 0) ? LogCompression::ZSTD : LogCompression::BZ2;
+  const char* level = getenv("LOGGERD_COMPRESSION_LEVEL");
+  s->compression_level = level ? atoi(level) : (s->compression == LogCompression::ZSTD ? 3 : 9);
+
+  s->ring = std::make_unique<LogRing>(LOGGER_RING_SIZE);
+  s->writer_exit = false;
+  s->writer = std::thread(logger_writer, s);
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
@@ -161,7 +331,7 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
 
   LoggerHandle *h = NULL;
   for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
-    if (s->handles[i].refcnt == 0) {
+    if (!s->handles[i].open) {
       h = &s->handles[i];
       break;
     }
@@ -171,8 +341,9 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  const char* ext = log_compression_ext(s->compression);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.%s", h->segment_path, s->log_name, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.%s", h->segment_path, ext);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
   err = logger_mkpath(h->log_path);
@@ -182,13 +353,16 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<BZFile>(h->log_path);
+  h->log = log_file_open(h->log_path, s->compression, s->compression_level, true);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    h->q_log = log_file_open(h->qlog_path, s->compression, s->compression_level, true);
   }
 
-  pthread_mutex_init(&h->lock, NULL);
-  h->refcnt++;
+  h->idx = h - s->handles;
+  h->ring = s->ring.get();
+  h->open = true;
+  // last, publishes the handle to logger_pin
+  h->refcnt = 1;
   return h;
 }
 
@@ -207,10 +381,7 @@ int logger_next(LoggerState *s, const char* root_path,
     return -1;
   }
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
-  s->cur_handle = next_h;
+  LoggerHandle* prev_h = s->cur_handle.exchange(next_h);
 
   if (out_segment_path) {
     snprintf(out_segment_path, out_segment_path_len, "%s", next_h->segment_path);
@@ -221,6 +392,11 @@ int logger_next(LoggerState *s, const char* root_path,
 
   pthread_mutex_unlock(&s->lock);
 
+  // loggers that still hold it finish their record first, the last reference queues the close
+  if (prev_h) {
+    lh_close(prev_h);
+  }
+
   // write beggining of log metadata
   log_init_data(s);
   log_sentinel(s, is_start_of_route ? cereal::Sentinel::SentinelType::START_OF_ROUTE : cereal::Sentinel::SentinelType::START_OF_SEGMENT);
@@ -229,22 +405,46 @@ int logger_next(LoggerState *s, const char* root_path,
 
 LoggerHandle* logger_get_handle(LoggerState *s) {
   pthread_mutex_lock(&s->lock);
+  // logger_next only replaces cur_handle under s->lock, it holds a reference until then
   LoggerHandle* h = s->cur_handle;
   if (h) {
-    pthread_mutex_lock(&h->lock);
     h->refcnt++;
-    pthread_mutex_unlock(&h->lock);
   }
   pthread_mutex_unlock(&s->lock);
   return h;
 }
 
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&s->lock);
-  if (s->cur_handle) {
-    lh_log(s->cur_handle, data, data_size, in_qlog);
+  // the handle can't be closed and reused by a logger_next while its record goes in
+  LoggerHandle* h = logger_pin(s);
+  if (h) {
+    lh_log(h, data, data_size, in_qlog);
+    lh_close(h);
   }
-  pthread_mutex_unlock(&s->lock);
+}
+
+// the segment metadata, which readers of the log expect to find
+static void logger_log_wait(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
+  LoggerHandle* h = logger_pin(s);
+  if (h) {
+    lh_push_wait(h, h->idx | (in_qlog ? LOGGER_TAG_QLOG : 0), data, data_size);
+    lh_close(h);
+  }
+}
+
+LoggerStats logger_get_stats(LoggerState *s) {
+  LoggerStats stats = {
+    .queue_capacity = s->ring->capacity(),
+    .queue_high_water = s->ring->reset_high_water(),
+    .dropped_bytes = s->ring->dropped_bytes,
+    .dropped_msgs = s->ring->dropped_msgs,
+    .written_bytes = s->written_bytes,
+  };
+  uint64_t count = s->latency_count.exchange(0);
+  uint64_t sum_us = s->latency_sum_us.exchange(0);
+  stats.writer_latency_avg_ms = count > 0 ? (sum_us / (float)count) / 1000.0 : 0;
+  stats.writer_latency_max_ms = s->latency_max_us.exchange(0) / 1000.0;
+  return stats;
 }
 
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
@@ -252,33 +452,30 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_ROUTE, signal);
 
   pthread_mutex_lock(&s->lock);
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
+  LoggerHandle* h = s->cur_handle.exchange(nullptr);
   pthread_mutex_unlock(&s->lock);
+  if (h) {
+    lh_close(h);
+  }
+
+  // wait for the writer to write out and close everything
+  s->writer_exit = true;
+  if (s->writer.joinable()) {
+    s->writer.join();
+  }
 }
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&h->lock);
-  assert(h->refcnt > 0);
-  h->log->write(data, data_size);
-  if (in_qlog && h->q_log) {
-    h->q_log->write(data, data_size);
-  }
-  pthread_mutex_unlock(&h->lock);
+  h->ring->push(h->idx | (in_qlog ? LOGGER_TAG_QLOG : 0), data, data_size);
 }
 
 void lh_close(LoggerHandle* h) {
-  pthread_mutex_lock(&h->lock);
-  assert(h->refcnt > 0);
-  h->refcnt--;
-  if (h->refcnt == 0) {
-    h->log.reset(nullptr);
-    h->q_log.reset(nullptr);
-    unlink(h->lock_path);
-    pthread_mutex_unlock(&h->lock);
-    pthread_mutex_destroy(&h->lock);
-    return;
-  }
-  pthread_mutex_unlock(&h->lock);
+  const int refcnt = h->refcnt.fetch_sub(1);
+  assert(refcnt > 0);
+  if (refcnt > 1) return;
+
+  // every record of the handle was pushed before its reference was dropped, so the writer
+  // closes the files after writing them, and only then lets logger_open reuse the handle.
+  // unlike writes this can't be dropped
+  lh_push_wait(h, h->idx | LOGGER_TAG_CLOSE, nullptr, 0);
 }
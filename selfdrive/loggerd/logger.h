@@ -3,9 +3,15 @@
 #include <cassert>
 #include <pthread.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <bzlib.h>
 #include <capnp/serialize.h>
@@ -14,18 +20,42 @@
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/hardware/hw.h"
+#include "selfdrive/loggerd/log_ring.h"
 
 const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
 
-class BZFile {
+// the async writer hands data to its worker in chunks of this size, or at least once per flush interval
+#define ASYNC_LOG_CHUNK_SIZE (256 * 1024)
+#define ASYNC_LOG_FLUSH_INTERVAL_MS 1000
+#define ASYNC_LOG_MAX_QUEUED (64 * 1024 * 1024)
+
+// messages are handed to the logger writer thread through a ring of this size,
+// producers drop messages rather than wait when it is full
+#define LOGGER_RING_SIZE (16 * 1024 * 1024)
+// pushes wake the writer, this only bounds how long it takes to notice logger_close
+#define LOGGER_WRITER_WAIT_MS 100
+
+enum class LogCompression {
+  BZ2,
+  ZSTD,
+};
+
+class LogFile {
+ public:
+  virtual ~LogFile() {}
+  virtual void write(void* data, size_t size) = 0;
+  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+};
+
+class BZFile : public LogFile {
  public:
-  BZFile(const char* path) {
+  BZFile(const char* path, int level = 9) {
     file = fopen(path, "wb");
     assert(file != nullptr);
     int bzerror;
-    bz_file = BZ2_bzWriteOpen(&bzerror, file, 9, 0, 30);
+    bz_file = BZ2_bzWriteOpen(&bzerror, file, level, 0, 30);
     assert(bzerror == BZ_OK);
   }
   ~BZFile() {
@@ -37,7 +67,7 @@ class BZFile {
     int err = fclose(file);
     assert(err == 0);
   }
-  inline void write(void* data, size_t size) {
+  inline void write(void* data, size_t size) override {
     int bzerror;
     do {
       BZ2_bzWrite(&bzerror, bz_file, data, size);
@@ -48,7 +78,7 @@ class BZFile {
       error_logged = true;
     }
   }
-  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  using LogFile::write;
 
  private:
   bool error_logged = false;
@@ -56,14 +86,50 @@ class BZFile {
   BZFILE* bz_file = nullptr;
 };
 
+// Moves compression off the calling thread. write() only copies into the current chunk,
+// full chunks go through a bounded queue to a worker thread that writes them to file.
+// The writer only blocks if the worker falls behind by more than ASYNC_LOG_MAX_QUEUED bytes.
+class AsyncLogFile : public LogFile {
+ public:
+  AsyncLogFile(std::unique_ptr<LogFile> file);
+  // writes out everything queued before closing file
+  ~AsyncLogFile();
+  void write(void* data, size_t size) override;
+  using LogFile::write;
+
+ private:
+  void push_chunk();
+  void worker();
+
+  std::unique_ptr<LogFile> file;
+  std::vector<uint8_t> chunk;
+  double last_push_ms = 0;
+  bool stall_logged = false;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::vector<uint8_t>> queue;
+  size_t queued_bytes = 0;
+  bool exit = false;
+  std::thread thread;
+};
+
+const char* log_compression_ext(LogCompression compression);
+std::unique_ptr<LogFile> log_file_open(const char* path, LogCompression compression, int level, bool async);
+
 typedef struct LoggerHandle {
-  pthread_mutex_t lock;
-  int refcnt;
+  // pins the handle, the last reference queues the close to the writer. loggers pin it
+  // without a lock, so it only goes from 0 to 1 when the handle is opened
+  std::atomic<int> refcnt;
+  // cleared by the writer once the files are closed, the handle can be reused from then on
+  std::atomic<bool> open;
+  int idx;
+  LogRing* ring;
   char segment_path[4096];
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<BZFile> log, q_log;
+  std::unique_ptr<LogFile> log, q_log;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -73,11 +139,28 @@ typedef struct LoggerState {
   std::string route_name;
   char log_name[64];
   bool has_qlog;
+  LogCompression compression;
+  int compression_level;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
-  LoggerHandle* cur_handle;
+  std::atomic<LoggerHandle*> cur_handle;
+
+  // all file writes and closes happen on the writer thread, in ring order
+  std::unique_ptr<LogRing> ring;
+  std::thread writer;
+  std::atomic<bool> writer_exit;
+  std::atomic<uint64_t> written_bytes;
+  std::atomic<uint64_t> latency_sum_us, latency_count, latency_max_us;
 } LoggerState;
 
+typedef struct LoggerStats {
+  size_t queue_capacity;
+  size_t queue_high_water;  // since the last call
+  uint64_t dropped_bytes, dropped_msgs;
+  uint64_t written_bytes;
+  float writer_latency_avg_ms, writer_latency_max_ms;  // since the last call
+} LoggerStats;
+
 int logger_mkpath(char* file_path);
 kj::Array<capnp::word> logger_build_init_data();
 std::string logger_get_route_name();
@@ -87,7 +170,10 @@ int logger_next(LoggerState *s, const char* root_path,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
+// takes no lock and never waits for the writer, unless it is the last to log to a segment
+// that logger_next just closed and the ring is full when it queues the close
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+LoggerStats logger_get_stats(LoggerState *s);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
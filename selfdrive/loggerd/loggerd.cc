@@ -6,11 +6,11 @@
 #include <atomic>
 #include <cassert>
 #include <cerrno>
-#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <string>
@@ -23,6 +23,7 @@
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/camerad/cameras/camera_common.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/queue.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
@@ -32,10 +33,9 @@
 #include "selfdrive/loggerd/logger.h"
 #if defined(QCOM) || defined(QCOM2)
 #include "selfdrive/loggerd/omx_encoder.h"
-#define Encoder OmxEncoder
 #else
 #include "selfdrive/loggerd/raw_logger.h"
-#define Encoder RawLogger
+#include "selfdrive/loggerd/software_encoder.h"
 #endif
 
 namespace {
@@ -46,6 +46,8 @@ const int MAX_CAM_IDX = Hardware::TICI() ? LOG_CAMERA_ID_ECAMERA : LOG_CAMERA_ID
 const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
+#define DRAIN_BATCH_SIZE 64
+#define ENCODER_QUEUE_SIZE 4 // frames waiting per encoder, more are dropped
 
 const int SEGMENT_LENGTH = getenv("LOGGERD_TEST") ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
@@ -96,30 +98,138 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
   },
 };
 
+struct EncoderStats {
+  std::atomic<uint32_t> received, skipped, dropped, encoded;
+};
+
 struct LoggerdState {
   Context *ctx;
   LoggerState logger = {};
   char segment_path[4096];
   std::mutex rotate_lock;
-  std::condition_variable rotate_cv;
   std::atomic<int> rotate_segment;
   std::atomic<double> last_camera_seen_tms;
   std::atomic<int> waiting_rotate;
   int max_waiting = 0;
   double last_rotate_tms = 0.;
+  uint64_t last_dropped_msgs = 0;
+  EncoderStats encoder_stats[LOG_CAMERA_ID_MAX];
 };
 LoggerdState s;
 
+VideoEncoder *encoder_create(const LogCameraInfo &info, int width, int height) {
+#if defined(QCOM) || defined(QCOM2)
+  return new OmxEncoder(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+#else
+  // lossless, only for debugging, the files are huge
+  if (getenv("LOGGERD_RAW")) {
+    return new RawLogger(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+  }
+  if (!SoftwareEncoder::available(info.is_h265)) {
+    LOGE("no %s encoder in libavcodec, logging %s raw", info.is_h265 ? "HEVC" : "H.264", info.filename);
+    return new RawLogger(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+  }
+  return new SoftwareEncoder(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+#endif
+}
+
+// a segment as seen by the encoders, the log handle is released once no frame refers to it
+struct EncoderSegment {
+  int num;
+  std::string path;
+  LoggerHandle *lh;
+  ~EncoderSegment() {
+    if (lh) lh_close(lh);
+  }
+};
+
+// a camera frame encoded straight from the VisionBuf, camerad doesn't reuse the buffer while
+// the frame is held
+struct EncoderFrame {
+  VisionBuf *buf;
+  VisionIpcBufHold hold;
+  VisionIpcBufExtra extra;
+  std::shared_ptr<EncoderSegment> segment;
+};
+
+struct EncoderStage {
+  int cam_idx;
+  VideoEncoder *encoder;
+  BoundedQueue<std::shared_ptr<EncoderFrame>> queue{ENCODER_QUEUE_SIZE};
+  std::thread thread;
+};
+
+void encoder_stage(EncoderStage *stage) {
+  const LogCameraInfo &cam_info = cameras_logged[stage->cam_idx];
+  EncoderStats &stats = s.encoder_stats[stage->cam_idx];
+  const bool publish_idx = stage->cam_idx != LOG_CAMERA_ID_QCAMERA;
+  set_thread_name(cam_info.filename);
+
+  int encode_idx = 0;
+  std::shared_ptr<EncoderSegment> segment;
+  std::shared_ptr<EncoderFrame> f;
+  while (stage->queue.pop(f)) {
+    // rotate the encoder with the first frame of a new segment
+    if (f->segment != segment) {
+      segment = f->segment;
+      LOGW("camera %d rotate encoder to %s", stage->cam_idx, segment->path.c_str());
+      stage->encoder->encoder_close();
+      stage->encoder->encoder_open(segment->path.c_str());
+    }
+
+    VisionBuf *buf = f->buf;
+    int out_id = stage->encoder->encode_frame(buf->y, buf->u, buf->v, buf->width, buf->height, f->extra.timestamp_eof);
+    if (out_id == -1) {
+      LOGE("Failed to encode frame. frame_id: %d encode_id: %d", f->extra.frame_id, encode_idx);
+    }
+    stats.encoded++;
+
+    // publish encode index
+    if (publish_idx && out_id != -1) {
+      MessageBuilder msg;
+      // this is really ugly
+      auto eidx = stage->cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initDriverEncodeIdx() :
+                 (stage->cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideRoadEncodeIdx() : msg.initEvent().initRoadEncodeIdx());
+      eidx.setFrameId(f->extra.frame_id);
+      eidx.setTimestampSof(f->extra.timestamp_sof);
+      eidx.setTimestampEof(f->extra.timestamp_eof);
+      if (Hardware::TICI()) {
+        eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      } else {
+        eidx.setType(stage->cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      }
+      eidx.setEncodeId(encode_idx);
+      eidx.setSegmentNum(segment->num);
+      eidx.setSegmentId(out_id);
+      if (segment->lh) {
+        // TODO: this should read cereal/services.h for qlog decimation
+        auto bytes = msg.toBytes();
+        lh_log(segment->lh, bytes.begin(), bytes.size(), true);
+      }
+    }
+    encode_idx++;
+    f.reset();
+  }
+
+  stage->encoder->encoder_close();
+}
+
+// receives frames from camerad and hands them to the main and qcamera encoder stages, holding
+// the buffer until both are done. never waits on the encoders, frames are dropped and counted
+// when an encoder falls behind
 void encoder_thread(int cam_idx) {
   assert(cam_idx < LOG_CAMERA_ID_MAX-1);
   const LogCameraInfo &cam_info = cameras_logged[cam_idx];
+  EncoderStats &stats = s.encoder_stats[cam_idx];
   set_thread_name(cam_info.filename);
 
-  int cnt = 0, cur_seg = -1;
-  int encode_idx = 0;
-  LoggerHandle *lh = NULL;
-  std::vector<Encoder *> encoders;
+  // first, frames still queued when the stages are destroyed release their hold on it
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
+  int cnt = 0;
+  bool rotate_requested = false;
+  uint32_t last_frame_id = 0;
+  std::shared_ptr<EncoderSegment> segment;
+  std::vector<std::unique_ptr<EncoderStage>> stages;
 
   while (!do_exit) {
     if (!vipc_client.connect(false)) {
@@ -128,20 +238,25 @@ void encoder_thread(int cam_idx) {
     }
 
     // init encoders
-    if (encoders.empty()) {
+    if (stages.empty()) {
       VisionBuf buf_info = vipc_client.buffers[0];
       LOGD("encoder init %dx%d", buf_info.width, buf_info.height);
 
       // main encoder
-      encoders.push_back(new Encoder(cam_info.filename, buf_info.width, buf_info.height,
-                                     cam_info.fps, cam_info.bitrate, cam_info.is_h265, cam_info.downscale));
+      stages.push_back(std::make_unique<EncoderStage>());
+      stages.back()->cam_idx = cam_idx;
+      stages.back()->encoder = encoder_create(cam_info, buf_info.width, buf_info.height);
 
       // qcamera encoder
       if (cam_info.has_qcamera) {
         LogCameraInfo &qcam_info = cameras_logged[LOG_CAMERA_ID_QCAMERA];
-        encoders.push_back(new Encoder(qcam_info.filename,
-                                       qcam_info.frame_width, qcam_info.frame_height,
-                                       qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+        stages.push_back(std::make_unique<EncoderStage>());
+        stages.back()->cam_idx = LOG_CAMERA_ID_QCAMERA;
+        stages.back()->encoder = encoder_create(qcam_info, qcam_info.frame_width, qcam_info.frame_height);
+      }
+
+      for (auto &stage : stages) {
+        stage->thread = std::thread(encoder_stage, stage.get());
       }
     }
 
@@ -150,82 +265,59 @@ void encoder_thread(int cam_idx) {
       VisionBuf* buf = vipc_client.recv(&extra);
       if (buf == nullptr) continue;
 
+      if (stats.received > 0 && extra.frame_id > last_frame_id + 1) {
+        stats.skipped += extra.frame_id - last_frame_id - 1;
+      }
+      last_frame_id = extra.frame_id;
+      stats.received++;
+
       if (cam_info.trigger_rotate) {
         s.last_camera_seen_tms = millis_since_boot();
       }
 
-      if (cam_info.trigger_rotate && (cnt >= SEGMENT_LENGTH * MAIN_FPS)) {
-        // trigger rotate and wait logger rotated to new segment
+      // ask for a rotate, frames keep going to the current segment until the logger rotated
+      if (cam_info.trigger_rotate && (cnt >= SEGMENT_LENGTH * MAIN_FPS) && !rotate_requested) {
         ++s.waiting_rotate;
-        std::unique_lock lk(s.rotate_lock);
-        s.rotate_cv.wait(lk, [&] { return s.rotate_segment > cur_seg || do_exit; });
+        rotate_requested = true;
       }
-      if (do_exit) break;
 
-      // rotate the encoder if the logger is on a newer segment
-      if (s.rotate_segment > cur_seg) {
-        cur_seg = s.rotate_segment;
+      // move to the new segment if the logger rotated
+      if (s.rotate_segment > (segment ? segment->num : -1)) {
+        std::unique_lock lk(s.rotate_lock);
+        segment = std::make_shared<EncoderSegment>();
+        segment->num = s.rotate_segment;
+        segment->path = s.segment_path;
+        segment->lh = logger_get_handle(&s.logger);
         cnt = 0;
-
-        LOGW("camera %d rotate encoder to %s", cam_idx, s.segment_path);
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(s.segment_path);
-        }
-        if (lh) {
-          lh_close(lh);
-        }
-        lh = logger_get_handle(&s.logger);
+        rotate_requested = false;
       }
+      if (!segment) continue;
 
-      // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf->y, buf->u, buf->v,
-                                               buf->width, buf->height, extra.timestamp_eof);
-        
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d encode_id: %d", extra.frame_id, encode_idx);
+      // released by whichever stage is done with the frame last, or when it's dropped
+      auto f = std::shared_ptr<EncoderFrame>(new EncoderFrame{buf, vipc_client.hold(), extra, segment},
+                                             [&vipc_client, cam_idx](EncoderFrame *f) {
+        if (!vipc_client.release(f->hold)) {
+          LOGE("camera %d frame %d overwritten while it was encoded", cam_idx, f->extra.frame_id);
         }
+        delete f;
+      });
 
-        // publish encode index
-        if (i == 0 && out_id != -1) {
-          MessageBuilder msg;
-          // this is really ugly
-          auto eidx = cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initDriverEncodeIdx() :
-                     (cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideRoadEncodeIdx() : msg.initEvent().initRoadEncodeIdx());
-          eidx.setFrameId(extra.frame_id);
-          eidx.setTimestampSof(extra.timestamp_sof);
-          eidx.setTimestampEof(extra.timestamp_eof);
-          if (Hardware::TICI()) {
-            eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          } else {
-            eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          }
-          eidx.setEncodeId(encode_idx);
-          eidx.setSegmentNum(cur_seg);
-          eidx.setSegmentId(out_id);
-          if (lh) {
-            // TODO: this should read cereal/services.h for qlog decimation
-            auto bytes = msg.toBytes();
-            lh_log(lh, bytes.begin(), bytes.size(), true);
-          }
+      for (auto &stage : stages) {
+        if (!stage->queue.try_push(f)) {
+          s.encoder_stats[stage->cam_idx].dropped++;
         }
       }
-
       cnt++;
-      encode_idx++;
-    }
-
-    if (lh) {
-      lh_close(lh);
-      lh = NULL;
     }
   }
 
   LOG("encoder destroy");
-  for(auto &e : encoders) {
-    e->encoder_close();
-    delete e;
+  for (auto &stage : stages) {
+    stage->queue.close();
+  }
+  for (auto &stage : stages) {
+    stage->thread.join();
+    delete stage->encoder;
   }
 }
 
@@ -251,7 +343,6 @@ void logger_rotate() {
     s.waiting_rotate = 0;
     s.last_rotate_tms = millis_since_boot();
   }
-  s.rotate_cv.notify_all();
   LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", s.segment_path);
 }
 
@@ -268,6 +359,39 @@ void rotate_if_needed() {
   }
 }
 
+void publish_stats(PubMaster &pm) {
+  LoggerStats stats = logger_get_stats(&s.logger);
+  if (stats.dropped_msgs > s.last_dropped_msgs) {
+    LOGW("log queue full, dropped %lu messages", stats.dropped_msgs - s.last_dropped_msgs);
+    s.last_dropped_msgs = stats.dropped_msgs;
+  }
+
+  MessageBuilder msg;
+  auto ls = msg.initEvent().initLoggerdState();
+  ls.setQueueCapacity(stats.queue_capacity);
+  ls.setQueueHighWater(stats.queue_high_water);
+  ls.setDroppedBytes(stats.dropped_bytes);
+  ls.setDroppedMessages(stats.dropped_msgs);
+  ls.setWrittenBytes(stats.written_bytes);
+  ls.setWriterLatencyAvg(stats.writer_latency_avg_ms);
+  ls.setWriterLatencyMax(stats.writer_latency_max_ms);
+
+  std::vector<int> active;
+  for (int i = 0; i < LOG_CAMERA_ID_MAX; i++) {
+    if (s.encoder_stats[i].encoded > 0) active.push_back(i);
+  }
+  auto encoders = ls.initEncoders(active.size());
+  for (int j = 0; j < active.size(); j++) {
+    const EncoderStats &es = s.encoder_stats[active[j]];
+    encoders[j].setName(cameras_logged[active[j]].filename);
+    encoders[j].setReceivedFrames(es.received);
+    encoders[j].setSkippedFrames(es.skipped);
+    encoders[j].setDroppedFrames(es.dropped);
+    encoders[j].setEncodedFrames(es.encoded);
+  }
+  pm.send("loggerdState", msg);
+}
+
 } // namespace
 
 int main(int argc, char** argv) {
@@ -295,6 +419,7 @@ int main(int argc, char** argv) {
   }
 
   Params params;
+  PubMaster pm({"loggerdState"});
 
   // init logger
   logger_init(&s.logger, "rlog", true);
@@ -325,30 +450,38 @@ int main(int argc, char** argv) {
 
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
+  double last_stats_ts = start_ts;
   while (!do_exit) {
     // poll for new messages on all sockets
     for (auto sock : poller->poll(1000)) {
       // drain socket
       QlogState &qs = qlog_states[sock];
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-        bytes_count += msg->getSize();
-        delete msg;
-
-        rotate_if_needed();
-
-        if ((++msg_count % 1000) == 0) {
-          double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+      std::vector<Message *> msgs;
+      while (!do_exit && !(msgs = sock->receive_batch(DRAIN_BATCH_SIZE)).empty()) {
+        for (auto msg : msgs) {
+          const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
+          logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+          bytes_count += msg->getSize();
+          delete msg;
+
+          rotate_if_needed();
+
+          if ((++msg_count % 1000) == 0) {
+            double seconds = (millis_since_boot() - start_ts) / 1000.0;
+            LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+          }
         }
       }
     }
+
+    double ts = millis_since_boot();
+    if (ts - last_stats_ts >= 1000) {
+      publish_stats(pm);
+      last_stats_ts = ts;
+    }
   }
 
   LOGW("closing encoders");
-  s.rotate_cv.notify_all();
   for (auto &t : encoder_threads) t.join();
 
   LOGW("closing logger");
@@ -0,0 +1,199 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include "selfdrive/loggerd/software_encoder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#define __STDC_CONSTANT_MACROS
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+#include "libyuv.h"
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+AVCodec *SoftwareEncoder::find_codec(bool h265) {
+  av_register_all();
+  AVCodec *codec = avcodec_find_encoder_by_name(h265 ? "libx265" : "libx264");
+  if (codec == NULL) {
+    codec = avcodec_find_encoder(h265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+  }
+  return codec;
+}
+
+SoftwareEncoder::SoftwareEncoder(const char* filename, int width, int height, int fps,
+                                 int bitrate, bool h265, bool downscale)
+  : filename(filename), width(width), height(height), fps(fps), bitrate(bitrate), downscale(downscale) {
+
+  codec = find_codec(h265);
+  assert(codec);  // encoder_create checks available() first
+
+  const char* preset_env = getenv("LOGGERD_ENCODER_PRESET");
+  preset = preset_env ? preset_env : "veryfast";
+  const char* threads_env = getenv("LOGGERD_ENCODER_THREADS");
+  thread_count = threads_env ? atoi(threads_env) : 0;  // 0 lets libavcodec pick from the core count
+
+  if (downscale) {
+    downscale_buf.resize(width*height*3/2);
+  }
+
+  frame = av_frame_alloc();
+  assert(frame);
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  frame->linesize[0] = width;
+  frame->linesize[1] = width/2;
+  frame->linesize[2] = width/2;
+
+  pkt = av_packet_alloc();
+  assert(pkt);
+}
+
+SoftwareEncoder::~SoftwareEncoder() {
+  encoder_close();
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+}
+
+void SoftwareEncoder::encoder_open(const char* path) {
+  vid_path = util::string_format("%s/%s", path, filename);
+  LOGD("encoder_open %s %s preset:%s threads:%d", vid_path.c_str(), codec->name, preset.c_str(), thread_count);
+
+  // a fresh codec context per segment, so every file starts with a keyframe and its own headers
+  codec_ctx = avcodec_alloc_context3(codec);
+  assert(codec_ctx);
+  codec_ctx->width = width;
+  codec_ctx->height = height;
+  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_ctx->time_base = (AVRational){ 1, fps };
+  codec_ctx->framerate = (AVRational){ fps, 1 };
+  codec_ctx->bit_rate = bitrate;
+  codec_ctx->gop_size = fps;
+  // no reordering, packets come out in frame order like on the hardware encoders
+  codec_ctx->max_b_frames = 0;
+  codec_ctx->thread_count = thread_count;
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  av_opt_set(codec_ctx->priv_data, "preset", preset.c_str(), 0);
+
+  avformat_alloc_output_context2(&format_ctx, NULL, NULL, vid_path.c_str());
+  assert(format_ctx);
+  if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  int err = avcodec_open2(codec_ctx, codec, NULL);
+  assert(err >= 0);
+
+  stream = avformat_new_stream(format_ctx, NULL);
+  assert(stream);
+  stream->id = 0;
+  stream->time_base = codec_ctx->time_base;
+  err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+  assert(err >= 0);
+
+  err = avio_open(&format_ctx->pb, vid_path.c_str(), AVIO_FLAG_WRITE);
+  assert(err >= 0);
+  err = avformat_write_header(format_ctx, NULL);
+  assert(err >= 0);
+
+  // create camera lock file
+  lock_path = util::string_format("%s/%s.lock", path, filename);
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0777);
+  assert(lock_fd >= 0);
+  close(lock_fd);
+
+  is_open = true;
+  counter = 0;
+}
+
+void SoftwareEncoder::encoder_close() {
+  if (!is_open) return;
+
+  // flush the frames still in the encoder threads into this segment
+  int err = avcodec_send_frame(codec_ctx, NULL);
+  if (err < 0) {
+    LOGE("encoder flush error %d", err);
+  }
+  write_packets();
+
+  av_write_trailer(format_ctx);
+  avcodec_free_context(&codec_ctx);
+  avio_closep(&format_ctx->pb);
+  avformat_free_context(format_ctx);
+  format_ctx = NULL;
+  stream = NULL;
+
+  unlink(lock_path.c_str());
+  is_open = false;
+}
+
+int SoftwareEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                                  int in_width, int in_height, uint64_t ts) {
+  if (!is_open) {
+    return -1;
+  }
+
+  if (downscale) {
+    uint8_t *y = downscale_buf.data();
+    uint8_t *u = y + width*height;
+    uint8_t *v = u + width*height/4;
+    libyuv::I420Scale(y_ptr, in_width,
+                      u_ptr, in_width/2,
+                      v_ptr, in_width/2,
+                      in_width, in_height,
+                      y, width,
+                      u, width/2,
+                      v, width/2,
+                      width, height,
+                      libyuv::kFilterNone);
+    y_ptr = y;
+    u_ptr = u;
+    v_ptr = v;
+  }
+
+  // the frame isn't refcounted, so libavcodec copies it before returning and the buffer can be reused
+  frame->data[0] = (uint8_t*)y_ptr;
+  frame->data[1] = (uint8_t*)u_ptr;
+  frame->data[2] = (uint8_t*)v_ptr;
+  frame->pts = counter;
+
+  int err = avcodec_send_frame(codec_ctx, frame);
+  if (err < 0) {
+    LOGE("encoding error %d", err);
+    return -1;
+  }
+
+  int ret = counter++;
+  write_packets();
+  return ret;
+}
+
+void SoftwareEncoder::write_packets() {
+  while (true) {
+    int err = avcodec_receive_packet(codec_ctx, pkt);
+    if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+      break;
+    } else if (err < 0) {
+      LOGE("encoder receive error %d", err);
+      break;
+    }
+
+    av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    err = av_interleaved_write_frame(format_ctx, pkt);
+    if (err < 0) {
+      LOGE("encoder writer error %d", err);
+    }
+    av_packet_unref(pkt);
+  }
+}
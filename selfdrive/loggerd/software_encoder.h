@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "selfdrive/loggerd/encoder.h"
+
+// SoftwareEncoder, lossy H.264/HEVC through libavcodec's threaded encoders (libx264/libx265).
+// The preset and thread count come from LOGGERD_ENCODER_PRESET and LOGGERD_ENCODER_THREADS.
+class SoftwareEncoder : public VideoEncoder {
+public:
+  SoftwareEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale);
+  ~SoftwareEncoder();
+  int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                   int in_width, int in_height, uint64_t ts);
+  void encoder_open(const char* path);
+  void encoder_close();
+  // false if libavcodec was built without an H.264/HEVC encoder
+  static bool available(bool h265) { return find_codec(h265) != NULL; }
+
+private:
+  static AVCodec *find_codec(bool h265);
+  void write_packets();
+
+  const char* filename;
+  int width, height, fps, bitrate;
+  bool downscale;
+  std::string preset;
+  int thread_count;
+
+  std::string vid_path, lock_path;
+  bool is_open = false;
+  int counter = 0;
+
+  AVCodec *codec = NULL;
+  AVCodecContext *codec_ctx = NULL;
+  AVFormatContext *format_ctx = NULL;
+  AVStream *stream = NULL;
+  AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+
+  std::vector<uint8_t> downscale_buf;
+};
@@ -0,0 +1,142 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/common/timing.h"
+#include "selfdrive/loggerd/log_ring.h"
+
+// records carry their producer in the tag and a sequence number with a pattern that depends on it
+static size_t record_len(int p, uint32_t i) { return (i * 7 + p) % 120 + 4; }
+
+static void fill(uint8_t *buf, int p, uint32_t i) {
+  memcpy(buf, &i, sizeof(i));
+  for (size_t k = 4; k < record_len(p, i); k++) buf[k] = (uint8_t)(i + k + p);
+}
+
+static void check(const LogRingRecord &rec, std::vector<int64_t> &last) {
+  const int p = rec.tag;
+  uint32_t i;
+  memcpy(&i, rec.data, sizeof(i));
+  REQUIRE((int64_t)i > last[p]);
+  REQUIRE(rec.size == record_len(p, i));
+  for (size_t k = 4; k < rec.size; k++) REQUIRE(rec.data[k] == (uint8_t)(i + k + p));
+  last[p] = i;
+}
+
+TEST_CASE("LogRing keeps records in order across wraparound") {
+  LogRing ring(256);
+  REQUIRE(ring.capacity() == 256);
+
+  std::vector<int64_t> last(1, -1);
+  uint8_t buf[128];
+  for (uint32_t i = 0; i < 1000; i++) {
+    fill(buf, 0, i);
+    REQUIRE(ring.push(0, buf, record_len(0, i)));
+    REQUIRE(ring.pop([&](const LogRingRecord &rec) { check(rec, last); }) == 1);
+  }
+  REQUIRE(last[0] == 999);
+  REQUIRE(ring.dropped_msgs == 0);
+}
+
+TEST_CASE("LogRing drops and counts records when full") {
+  LogRing ring(256);
+  uint8_t buf[48] = {};
+  int pushed = 0;
+  while (ring.push(0, buf, sizeof(buf))) pushed++;
+  REQUIRE(pushed == 256 / (16 + 48));
+  REQUIRE(ring.dropped_msgs == 1);
+  REQUIRE(ring.dropped_bytes == sizeof(buf));
+
+  REQUIRE(ring.pop([](const LogRingRecord &rec) { REQUIRE(rec.size == 48); }) == (size_t)pushed);
+  REQUIRE(ring.push(0, buf, sizeof(buf)));
+}
+
+TEST_CASE("LogRing push_wait waits for the consumer instead of dropping") {
+  LogRing ring(256);
+  uint8_t buf[48] = {};
+  while (ring.push(0, buf, sizeof(buf))) {}
+  const uint64_t dropped = ring.dropped_msgs;
+
+  std::atomic<bool> done = false;
+  std::thread producer([&] {
+    ring.push_wait(1, nullptr, 0);
+    done = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(!done);
+
+  std::vector<uint32_t> tags;
+  ring.pop([&](const LogRingRecord &rec) { tags.push_back(rec.tag); });
+  producer.join();
+  ring.pop([&](const LogRingRecord &rec) { tags.push_back(rec.tag); });
+
+  REQUIRE(tags.back() == 1);
+  REQUIRE(ring.dropped_msgs == dropped);
+}
+
+TEST_CASE("LogRing wait returns when a record is pushed") {
+  LogRing ring(4096);
+  std::thread producer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ring.push(0, "a", 1);
+  });
+
+  const uint64_t start = nanos_since_boot();
+  ring.wait(10000);
+  const double waited_ms = (nanos_since_boot() - start) / 1e6;
+  producer.join();
+
+  REQUIRE(waited_ms < 5000);
+  REQUIRE(ring.pop([](const LogRingRecord &rec) { REQUIRE(rec.size == 1); }) == 1);
+
+  // nothing published, times out
+  ring.wait(10);
+  REQUIRE(ring.pop([](const LogRingRecord &) {}) == 0);
+}
+
+TEST_CASE("LogRing with concurrent producers and a waiting consumer") {
+  const int num_producers = 4;
+  const uint32_t num_records = 100000;
+  LogRing ring(4096);
+
+  std::atomic<int> running = num_producers;
+  std::vector<std::thread> producers;
+  std::vector<uint64_t> accepted(num_producers, 0);
+  for (int p = 0; p < num_producers; p++) {
+    producers.emplace_back([&, p] {
+      uint8_t buf[128];
+      for (uint32_t i = 0; i < num_records; i++) {
+        fill(buf, p, i);
+        if (i % 100 == 0) {
+          ring.push_wait(p, buf, record_len(p, i));
+          accepted[p]++;
+        } else if (ring.push(p, buf, record_len(p, i))) {
+          accepted[p]++;
+        }
+      }
+      running--;
+    });
+  }
+
+  std::vector<int64_t> last(num_producers, -1);
+  uint64_t received = 0;
+  while (true) {
+    const bool stopped = running == 0;
+    size_t count = ring.pop([&](const LogRingRecord &rec) { check(rec, last); });
+    received += count;
+    if (count == 0) {
+      if (stopped) break;
+      ring.wait(100);
+    }
+  }
+  for (auto &t : producers) t.join();
+
+  uint64_t total = 0;
+  for (auto a : accepted) total += a;
+  REQUIRE(received == total);
+  REQUIRE(total + ring.dropped_msgs == num_producers * num_records);
+}
@@ -0,0 +1,386 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/indexed_log.h"
+#include "selfdrive/loggerd/logger.h"
+
+static std::string make_temp_dir() {
+  char dir[] = "/tmp/test_logger_XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  return dir;
+}
+
+static kj::Array<capnp::word> encode_idx_event(uint32_t frame_id, uint64_t mono_time) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(mono_time);
+  auto idx = event.initRoadEncodeIdx();
+  idx.setFrameId(frame_id);
+  idx.setSegmentId(frame_id);
+  idx.setTimestampEof(mono_time);
+  return capnp::messageToFlatArray(msg);
+}
+
+static kj::Array<capnp::word> can_event(uint64_t mono_time) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(mono_time);
+  event.initCan(3);
+  return capnp::messageToFlatArray(msg);
+}
+
+// frames 0..num_frames-1 with a can event after each. bz2 at level 1 for 100k blocks, so that
+// a log cut in half still holds whole blocks
+static void write_log(const std::string &path, LogCompression compression, uint32_t num_frames, bool async = false) {
+  auto file = log_file_open(path.c_str(), compression, compression == LogCompression::ZSTD ? 3 : 1, async);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    auto idx = encode_idx_event(i, 1000 + i * 50000000ULL);
+    file->write(idx.asBytes().begin(), idx.asBytes().size());
+    auto can = can_event(1001 + i * 50000000ULL);
+    file->write(can.asBytes().begin(), can.asBytes().size());
+  }
+}
+
+static std::vector<uint32_t> read_frame_ids(const std::string &path, bool &ok) {
+  std::vector<uint32_t> ids;
+  ok = log_read_events(path, {cereal::Event::ROAD_ENCODE_IDX}, [&](cereal::Event::Reader event) {
+    REQUIRE(event.which() == cereal::Event::ROAD_ENCODE_IDX);
+    REQUIRE(event.getLogMonoTime() == event.getRoadEncodeIdx().getTimestampEof());
+    ids.push_back(event.getRoadEncodeIdx().getFrameId());
+  });
+  return ids;
+}
+
+TEST_CASE("log_read_events reads bz2 and zstd logs") {
+  const std::string dir = make_temp_dir();
+  const uint32_t num_frames = 20000;  // many zstd frames and bz2 blocks
+
+  for (auto compression : {LogCompression::BZ2, LogCompression::ZSTD}) {
+    const std::string path = dir + "/rlog." + log_compression_ext(compression);
+    INFO(path);
+    write_log(path, compression, num_frames);
+
+    bool ok = false;
+    std::vector<uint32_t> ids = read_frame_ids(path, ok);
+    REQUIRE(ok);
+    REQUIRE(ids.size() == num_frames);
+    for (uint32_t i = 0; i < num_frames; i++) REQUIRE(ids[i] == i);
+
+    // all types
+    size_t count = 0;
+    REQUIRE(log_read_events(path, {}, [&](cereal::Event::Reader) { count++; }));
+    REQUIRE(count == num_frames * 2);
+
+    // cut off by a crash, the events up to the cut are read
+    std::string data = util::read_file(path);
+    REQUIRE(util::write_file(path.c_str(), data.data(), data.size() / 2, O_WRONLY | O_TRUNC) == 0);
+    ids = read_frame_ids(path, ok);
+    REQUIRE(ok);
+    REQUIRE(ids.size() > 0);
+    REQUIRE(ids.size() < num_frames);
+    for (uint32_t i = 0; i < ids.size(); i++) REQUIRE(ids[i] == i);
+
+    unlink(path.c_str());
+  }
+
+  bool ok = true;
+  read_frame_ids(dir + "/rlog.bz2", ok);
+  REQUIRE(!ok);
+  rmdir(dir.c_str());
+}
+
+// keeps what is written to it, for checking what an AsyncLogFile hands over
+struct MemLog {
+  std::string get() {
+    std::lock_guard lk(lock);
+    return data;
+  }
+
+  std::mutex lock;
+  std::string data;
+  bool closed = false;
+  bool written_after_close = false;
+  std::thread::id closed_by;
+};
+
+class MemLogFile : public LogFile {
+ public:
+  MemLogFile(MemLog &log) : log(log) {}
+  ~MemLogFile() {
+    std::lock_guard lk(log.lock);
+    log.closed = true;
+    log.closed_by = std::this_thread::get_id();
+  }
+  void write(void *data, size_t size) override {
+    // called on the worker thread, catch2 assertions aren't thread safe
+    std::lock_guard lk(log.lock);
+    log.written_after_close |= log.closed;
+    log.data.append((const char *)data, size);
+  }
+  using LogFile::write;
+
+ private:
+  MemLog &log;
+};
+
+TEST_CASE("AsyncLogFile writes everything in order and closes the file when destroyed") {
+  MemLog log;
+  std::string expected;
+  {
+    AsyncLogFile file(std::make_unique<MemLogFile>(log));
+    // small writes fill chunks, one over the chunk size goes out on its own
+    for (int i = 0; i < 5000; i++) {
+      std::string msg(1 + (i * 7919) % 4000, 'a' + i % 26);
+      if (i == 2500) msg.assign(ASYNC_LOG_CHUNK_SIZE * 2 + 1, 'z');
+      file.write(msg.data(), msg.size());
+      expected += msg;
+    }
+    REQUIRE(log.get().size() < expected.size());  // the last chunk is still held
+  }
+  REQUIRE(log.closed);
+  REQUIRE(!log.written_after_close);
+  REQUIRE(log.closed_by != std::this_thread::get_id());
+  REQUIRE(log.data == expected);
+}
+
+TEST_CASE("AsyncLogFile hands over a chunk after the flush interval") {
+  MemLog log;
+  AsyncLogFile file(std::make_unique<MemLogFile>(log));
+  file.write((void *)"a", 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(ASYNC_LOG_FLUSH_INTERVAL_MS + 100));
+  file.write((void *)"b", 1);
+
+  // the worker writes it out without the file being destroyed
+  for (int i = 0; i < 100 && log.get() != "ab"; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  REQUIRE(log.get() == "ab");
+  REQUIRE(!log.closed);
+}
+
+TEST_CASE("log_file_open async logs read back") {
+  const std::string dir = make_temp_dir();
+  const uint32_t num_frames = 5000;
+  for (auto compression : {LogCompression::BZ2, LogCompression::ZSTD}) {
+    const std::string path = dir + "/rlog." + log_compression_ext(compression);
+    INFO(path);
+    write_log(path, compression, num_frames, true);
+
+    bool ok = false;
+    std::vector<uint32_t> ids = read_frame_ids(path, ok);
+    REQUIRE(ok);
+    REQUIRE(ids.size() == num_frames);
+    for (uint32_t i = 0; i < num_frames; i++) REQUIRE(ids[i] == i);
+    unlink(path.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+struct LoggedEvent {
+  uint64_t mono_time;
+  cereal::Event::Which which;
+};
+
+// 1000 road encode indexes 1ms apart, can events only in the 200ms from 200ms on and a
+// loggerdState, which needs a second bitmap word, every 250ms. 10 messages per frame
+static std::vector<LoggedEvent> write_indexed_log(const std::string &path) {
+  std::vector<LoggedEvent> events;
+  IndexedLogFile file(path.c_str(), 3, 10);
+  for (uint32_t i = 0; i < 1000; i++) {
+    const uint64_t t = 1000 + i * 1000000ULL;
+    file.write(encode_idx_event(i, t).asBytes());
+    events.push_back({t, cereal::Event::ROAD_ENCODE_IDX});
+    if (i >= 200 && i < 400) {
+      file.write(can_event(t + 1).asBytes());
+      events.push_back({t + 1, cereal::Event::CAN});
+    }
+    if (i % 250 == 0) {
+      capnp::MallocMessageBuilder msg;
+      auto event = msg.initRoot<cereal::Event>();
+      event.setLogMonoTime(t + 2);
+      event.initLoggerdState();
+      file.write(capnp::messageToFlatArray(msg).asBytes());
+      events.push_back({t + 2, cereal::Event::LOGGERD_STATE});
+    }
+  }
+  return events;
+}
+
+// the events of every frame, by decompressing it
+static std::vector<std::vector<LoggedEvent>> frame_events(const IndexedLogReader &reader) {
+  std::vector<std::vector<LoggedEvent>> frames;
+  for (size_t i = 0; i < reader.frames().size(); i++) {
+    frames.emplace_back();
+    kj::Array<capnp::word> buf = reader.read_frame(i);
+    kj::ArrayPtr<const capnp::word> words = buf;
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader msg(words);
+      auto event = msg.getRoot<cereal::Event>();
+      frames.back().push_back({event.getLogMonoTime(), event.which()});
+      words = kj::arrayPtr(msg.getEnd(), words.end());
+    }
+  }
+  return frames;
+}
+
+static const std::vector<std::vector<cereal::Event::Which>> type_sets = {
+  {},
+  {cereal::Event::ROAD_ENCODE_IDX},
+  {cereal::Event::CAN},
+  {cereal::Event::LOGGERD_STATE},
+  {cereal::Event::CAN, cereal::Event::LOGGERD_STATE},
+  {cereal::Event::SENDCAN},
+};
+
+// find_frames as it should be, from the decompressed frames
+static std::vector<size_t> expected_frames(const std::vector<std::vector<LoggedEvent>> &frames, uint64_t start,
+                                           uint64_t end, const std::vector<cereal::Event::Which> &types) {
+  std::vector<size_t> ret;
+  for (size_t i = 0; i < frames.size(); i++) {
+    uint64_t min_time = UINT64_MAX, max_time = 0;
+    bool has_type = types.empty();
+    for (auto &e : frames[i]) {
+      min_time = std::min(min_time, e.mono_time);
+      max_time = std::max(max_time, e.mono_time);
+      has_type = has_type || std::find(types.begin(), types.end(), e.which) != types.end();
+    }
+    if (max_time >= start && min_time <= end && has_type) ret.push_back(i);
+  }
+  return ret;
+}
+
+static void check_index(const IndexedLogReader &reader, const std::vector<LoggedEvent> &events) {
+  auto frames = frame_events(reader);
+  std::vector<LoggedEvent> all;
+  for (size_t i = 0; i < frames.size(); i++) {
+    const IndexedLogFrame &f = reader.frames()[i];
+    REQUIRE(f.num_msgs == frames[i].size());
+    REQUIRE(f.num_msgs <= 10);
+    for (auto &e : frames[i]) {
+      REQUIRE(e.mono_time >= f.min_mono_time);
+      REQUIRE(e.mono_time <= f.max_mono_time);
+      all.push_back(e);
+    }
+  }
+  REQUIRE(all.size() == events.size());
+  for (size_t i = 0; i < all.size(); i++) {
+    REQUIRE(all[i].mono_time == events[i].mono_time);
+    REQUIRE(all[i].which == events[i].which);
+  }
+
+  const std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+    {0, UINT64_MAX}, {0, 999}, {0, 1000}, {150000000, 250000000}, {200000999, 200001001},
+    {450000000, 750000000}, {1000 + 999000000ULL, UINT64_MAX}, {2000000000, UINT64_MAX},
+  };
+  for (auto [start, end] : ranges) {
+    for (auto &types : type_sets) {
+      INFO(start << " " << end << " " << types.size());
+      REQUIRE(reader.find_frames(start, end, types) == expected_frames(frames, start, end, types));
+
+      size_t count = 0;
+      reader.read(start, end, types, [&](cereal::Event::Reader event) {
+        REQUIRE(event.getLogMonoTime() >= start);
+        REQUIRE(event.getLogMonoTime() <= end);
+        REQUIRE((types.empty() || std::find(types.begin(), types.end(), event.which()) != types.end()));
+        count++;
+      });
+      REQUIRE(count == (size_t)std::count_if(events.begin(), events.end(), [&](auto &e) {
+        return e.mono_time >= start && e.mono_time <= end &&
+               (types.empty() || std::find(types.begin(), types.end(), e.which) != types.end());
+      }));
+    }
+  }
+}
+
+TEST_CASE("IndexedLogReader find_frames") {
+  const std::string dir = make_temp_dir();
+  const std::string path = dir + "/rlog.zst";
+  auto events = write_indexed_log(path);
+
+  IndexedLogReader reader;
+  REQUIRE(reader.load(path));
+  REQUIRE(reader.frames().size() == (events.size() + 9) / 10);
+  check_index(reader, events);
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST_CASE("IndexedLogReader builds the index of a segment without one") {
+  const std::string dir = make_temp_dir();
+  const std::string path = dir + "/rlog.zst";
+  auto events = write_indexed_log(path);
+  const std::string data = util::read_file(path);
+
+  IndexedLogReader indexed;
+  REQUIRE(indexed.load(path));
+
+  IndexedLogTrailer trailer;
+  memcpy(&trailer, data.data() + data.size() - sizeof(trailer), sizeof(trailer));
+  REQUIRE(trailer.magic == INDEXED_LOG_MAGIC);
+  // the index is the last skippable frame, its 8 byte header before index_size bytes
+  const size_t frames_size = data.size() - trailer.index_size - 8;
+
+  auto check_built = [&](const std::string &contents, size_t num_frames) {
+    REQUIRE(util::write_file(path.c_str(), contents.data(), contents.size(), O_WRONLY | O_TRUNC) == 0);
+    IndexedLogReader reader;
+    REQUIRE(reader.load(path));
+    REQUIRE(reader.frames().size() == num_frames);
+    for (size_t i = 0; i < num_frames; i++) {
+      const IndexedLogFrame &a = reader.frames()[i], &b = indexed.frames()[i];
+      REQUIRE(a.offset == b.offset);
+      REQUIRE(a.size == b.size);
+      REQUIRE(a.min_mono_time == b.min_mono_time);
+      REQUIRE(a.max_mono_time == b.max_mono_time);
+      REQUIRE(a.num_msgs == b.num_msgs);
+      for (auto &types : type_sets) {
+        for (auto t : types) REQUIRE(reader.frame_has(i, t) == indexed.frame_has(i, t));
+      }
+    }
+  };
+
+  SECTION("no trailer, e.g. loggerd was killed before closing the segment") {
+    check_built(data.substr(0, frames_size), indexed.frames().size());
+    IndexedLogReader reader;
+    REQUIRE(reader.load(path));
+    check_index(reader, events);
+  }
+
+  SECTION("a trailer that doesn't check out") {
+    std::string corrupt = data;
+    corrupt[corrupt.size() - 1] ^= 0xff;  // the magic
+    check_built(corrupt, indexed.frames().size());
+  }
+
+  SECTION("cut off in the middle of a frame") {
+    const IndexedLogFrame &last = indexed.frames().back();
+    check_built(data.substr(0, last.offset + last.size / 2), indexed.frames().size() - 1);
+  }
+
+  SECTION("nothing but a partial frame") {
+    REQUIRE(util::write_file(path.c_str(), data.data(), indexed.frames()[0].size / 2, O_WRONLY | O_TRUNC) == 0);
+    IndexedLogReader reader;
+    REQUIRE(!reader.load(path));
+  }
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+}
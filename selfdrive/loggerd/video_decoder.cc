@@ -0,0 +1,123 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include "selfdrive/loggerd/video_decoder.h"
+
+#include "libyuv.h"
+
+#include "selfdrive/common/swaglog.h"
+
+VideoDecoder::~VideoDecoder() {
+  close();
+}
+
+bool VideoDecoder::open(const std::string &path, int threads) {
+  close();
+  av_register_all();
+
+  // the raw hevc files from loggerd have no container, don't leave that to probing
+  const bool raw_hevc = path.size() >= 5 && path.compare(path.size() - 5, 5, ".hevc") == 0;
+  AVInputFormat *fmt = raw_hevc ? av_find_input_format("hevc") : NULL;
+  if (avformat_open_input(&format_ctx, path.c_str(), fmt, NULL) != 0) {
+    LOGE("failed to open %s", path.c_str());
+    return false;
+  }
+  if (avformat_find_stream_info(format_ctx, NULL) < 0) {
+    LOGE("failed to find stream info in %s", path.c_str());
+    close();
+    return false;
+  }
+
+  AVCodec *codec = NULL;
+  stream_idx = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+  if (stream_idx < 0 || codec == NULL) {
+    LOGE("no video stream in %s", path.c_str());
+    close();
+    return false;
+  }
+
+  codec_ctx = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(codec_ctx, format_ctx->streams[stream_idx]->codecpar);
+  codec_ctx->thread_count = threads;
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (avcodec_open2(codec_ctx, codec, NULL) != 0) {
+    LOGE("failed to open decoder for %s", path.c_str());
+    close();
+    return false;
+  }
+
+  width = codec_ctx->width;
+  height = codec_ctx->height;
+  frame = av_frame_alloc();
+  pkt = av_packet_alloc();
+  eof = false;
+  return true;
+}
+
+void VideoDecoder::close() {
+  if (sws_ctx) sws_freeContext(sws_ctx);
+  sws_ctx = NULL;
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&codec_ctx);
+  avformat_close_input(&format_ctx);
+  stream_idx = -1;
+}
+
+bool VideoDecoder::decode(uint8_t *yuv) {
+  if (codec_ctx == NULL) return false;
+
+  while (true) {
+    int err = avcodec_receive_frame(codec_ctx, frame);
+    if (err == 0) {
+      return copy_frame(yuv);
+    } else if (err == AVERROR_EOF) {
+      return false;
+    } else if (err != AVERROR(EAGAIN)) {
+      LOGE("decoder receive error %d", err);
+      return false;
+    }
+
+    // the decoder wants more input, at the end of the file flush out the frames still in its threads
+    if (eof) return false;
+    if (av_read_frame(format_ctx, pkt) < 0) {
+      eof = true;
+      avcodec_send_packet(codec_ctx, NULL);
+      continue;
+    }
+    if (pkt->stream_index == stream_idx) {
+      err = avcodec_send_packet(codec_ctx, pkt);
+      if (err < 0) {
+        LOGE("decoder send error %d", err);
+      }
+    }
+    av_packet_unref(pkt);
+  }
+}
+
+bool VideoDecoder::copy_frame(uint8_t *yuv) {
+  uint8_t *y = yuv;
+  uint8_t *u = y + width * height;
+  uint8_t *v = u + (width / 2) * (height / 2);
+
+  if (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) {
+    libyuv::I420Copy(frame->data[0], frame->linesize[0],
+                     frame->data[1], frame->linesize[1],
+                     frame->data[2], frame->linesize[2],
+                     y, width,
+                     u, width / 2,
+                     v, width / 2,
+                     width, height);
+  } else {
+    sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format,
+                                   width, height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if (sws_ctx == NULL) {
+      LOGE("can't convert from pixel format %d", frame->format);
+      return false;
+    }
+    uint8_t *dst[] = {y, u, v};
+    int dst_stride[] = {width, width / 2, width / 2};
+    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, dst, dst_stride);
+  }
+  av_frame_unref(frame);
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+// VideoDecoder, reads a recorded camera file (fcamera.hevc, qcamera.ts, ...) front to back
+// and hands out the frames in presentation order as packed I420.
+class VideoDecoder {
+public:
+  ~VideoDecoder();
+  // threads = 0 lets libavcodec pick from the core count
+  bool open(const std::string &path, int threads = 0);
+  // decodes the next frame into yuv, which holds width*height*3/2 bytes. false at the end of the file
+  bool decode(uint8_t *yuv);
+  void close();
+
+  int width = 0, height = 0;
+
+private:
+  bool copy_frame(uint8_t *yuv);
+
+  AVFormatContext *format_ctx = NULL;
+  AVCodecContext *codec_ctx = NULL;
+  SwsContext *sws_ctx = NULL;
+  AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+  int stream_idx = -1;
+  bool eof = false;
+};
@@ -0,0 +1,321 @@
+// vipc_replay: serves the cameras of a recorded segment over VisionIpc as "camerad", so modeld,
+// dmonitoringmodeld and loggerd can run on recorded video.
+//
+// usage: vipc_replay [--speed X] [--throughput] [--step] [--prefetch N] [--threads N] <segment dir>
+//
+//   --speed X       play at X times real time (default 1)
+//   --throughput    publish frames as fast as they decode, for benchmarking the consumers
+//   --step          publish one road camera frame interval per line read from stdin
+//   --prefetch N    frames decoded ahead per camera (default 8)
+//   --threads N     decoder threads per camera, 0 picks from the core count (default 0)
+//
+// Frame ids and timestamps come from the EncodeIndex events in the segment's rlog.zst or
+// rlog.bz2. Without a log the frames are numbered from 0 and spaced at REPLAY_DEFAULT_FPS.
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/visionipc/visionipc_server.h"
+#include "selfdrive/common/queue.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/indexed_log.h"
+#include "selfdrive/loggerd/video_decoder.h"
+
+#define REPLAY_DEFAULT_FPS 20
+#define REPLAY_BUFFER_COUNT 8
+#define REPLAY_STATS_INTERVAL_NS (5 * 1000000000ULL)
+
+ExitHandler do_exit;
+
+namespace {
+
+enum class ReplayMode {
+  REALTIME,
+  THROUGHPUT,
+  STEP,
+};
+
+struct ReplayCamera {
+  const char *filename;
+  VisionStreamType stream_type;
+  cereal::Event::Which idx_which;
+};
+
+const ReplayCamera replay_cameras[] = {
+  {"fcamera.hevc", VISION_STREAM_YUV_BACK, cereal::Event::ROAD_ENCODE_IDX},
+  {"dcamera.hevc", VISION_STREAM_YUV_FRONT, cereal::Event::DRIVER_ENCODE_IDX},
+  {"ecamera.hevc", VISION_STREAM_YUV_WIDE, cereal::Event::WIDE_ROAD_ENCODE_IDX},
+};
+
+struct ReplayFrame {
+  VisionIpcBufExtra extra;
+  std::vector<uint8_t> yuv;
+};
+
+// decides when a frame is due, by its timestamp_eof relative to the first frame of the segment
+class ReplayClock {
+public:
+  ReplayClock(ReplayMode mode, float speed, uint64_t start_ts)
+    : mode(mode), speed(speed), start_ts(start_ts), start_wall(nanos_since_boot()), step_ts(start_ts) {}
+
+  // false if replay is exiting
+  bool wait(uint64_t ts) {
+    if (mode == ReplayMode::THROUGHPUT) {
+      return !do_exit;
+    } else if (mode == ReplayMode::STEP) {
+      std::unique_lock lk(lock);
+      while (!do_exit && ts > step_ts) {
+        cv.wait_for(lk, std::chrono::milliseconds(100));
+      }
+      return !do_exit;
+    }
+
+    const uint64_t due = start_wall + (uint64_t)((ts - std::min(ts, start_ts)) / speed);
+    while (!do_exit) {
+      const uint64_t now = nanos_since_boot();
+      if (now >= due) break;
+      // wake up now and then to notice exit
+      std::this_thread::sleep_for(std::chrono::nanoseconds(std::min<uint64_t>(due - now, 100000000ULL)));
+    }
+    return !do_exit;
+  }
+
+  void step(uint64_t interval_ns) {
+    {
+      std::unique_lock lk(lock);
+      step_ts += interval_ns;
+    }
+    cv.notify_all();
+  }
+
+private:
+  const ReplayMode mode;
+  const float speed;
+  const uint64_t start_ts, start_wall;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  uint64_t step_ts;
+};
+
+struct CameraReplay {
+  const ReplayCamera *cam;
+  VideoDecoder decoder;
+  std::vector<VisionIpcBufExtra> frame_info;  // by index in the file, from the log
+
+  std::vector<ReplayFrame> frames;
+  std::unique_ptr<BoundedQueue<ReplayFrame *>> free_frames, decoded;
+
+  uint64_t published = 0;
+  std::thread decode_thread, publish_thread;
+};
+
+cereal::EncodeIndex::Reader encode_idx(cereal::Event::Reader event) {
+  switch (event.which()) {
+    case cereal::Event::DRIVER_ENCODE_IDX: return event.getDriverEncodeIdx();
+    case cereal::Event::WIDE_ROAD_ENCODE_IDX: return event.getWideRoadEncodeIdx();
+    default: return event.getRoadEncodeIdx();
+  }
+}
+
+void add_frame_info(cereal::Event::Reader event, std::vector<std::unique_ptr<CameraReplay>> &cameras) {
+  for (auto &c : cameras) {
+    if (event.which() != c->cam->idx_which) continue;
+
+    auto idx = encode_idx(event);
+    if (idx.getSegmentId() >= c->frame_info.size()) {
+      c->frame_info.resize(idx.getSegmentId() + 1, VisionIpcBufExtra{});
+    }
+    c->frame_info[idx.getSegmentId()] = {
+      .frame_id = idx.getFrameId(),
+      .timestamp_sof = idx.getTimestampSof(),
+      .timestamp_eof = idx.getTimestampEof(),
+    };
+  }
+}
+
+void load_frame_info(const std::string &segment_path, std::vector<std::unique_ptr<CameraReplay>> &cameras) {
+  std::vector<cereal::Event::Which> types;
+  for (auto &c : cameras) types.push_back(c->cam->idx_which);
+
+  // loggerd writes bz2 unless LOGGERD_COMPRESSION=zstd
+  for (const char *name : {"rlog.zst", "rlog.bz2"}) {
+    const std::string log_path = segment_path + "/" + name;
+    if (util::file_exists(log_path) &&
+        log_read_events(log_path, types, [&](cereal::Event::Reader event) { add_frame_info(event, cameras); })) {
+      return;
+    }
+  }
+
+  LOGE("no readable rlog.zst or rlog.bz2 in %s, frame ids and timestamps are made up", segment_path.c_str());
+  fprintf(stderr, "WARNING: no readable rlog in %s, numbering frames from 0 at %d fps\n",
+          segment_path.c_str(), REPLAY_DEFAULT_FPS);
+}
+
+VisionIpcBufExtra frame_extra(const CameraReplay *c, uint32_t n) {
+  if (n < c->frame_info.size() && c->frame_info[n].timestamp_eof != 0) {
+    return c->frame_info[n];
+  }
+  const uint64_t ts = n * (1000000000ULL / REPLAY_DEFAULT_FPS);
+  return {.frame_id = n, .timestamp_sof = ts, .timestamp_eof = ts};
+}
+
+void decode_thread(CameraReplay *c) {
+  set_thread_name(c->cam->filename);
+
+  uint32_t n = 0;
+  ReplayFrame *f = nullptr;
+  while (!do_exit && c->free_frames->pop(f)) {
+    if (!c->decoder.decode(f->yuv.data())) break;
+
+    f->extra = frame_extra(c, n++);
+    if (!c->decoded->push(f)) break;
+  }
+  LOGW("%s: decoded %u frames", c->cam->filename, n);
+  c->decoded->close();
+}
+
+void publish_thread(CameraReplay *c, VisionIpcServer *vipc_server, ReplayClock *clock) {
+  uint64_t last_stats = nanos_since_boot(), last_published = 0;
+
+  ReplayFrame *f = nullptr;
+  while (c->decoded->pop(f)) {
+    if (!clock->wait(f->extra.timestamp_eof)) break;
+
+    VisionBuf *buf = vipc_server->get_buffer(c->cam->stream_type);
+    memcpy(buf->addr, f->yuv.data(), f->yuv.size());
+    vipc_server->send(buf, &f->extra, false);
+    c->published++;
+    c->free_frames->push(f);
+
+    const uint64_t now = nanos_since_boot();
+    if (now - last_stats > REPLAY_STATS_INTERVAL_NS) {
+      LOGW("%s: %.1f fps, %zu decoded ahead, %lu overwritten", c->cam->filename,
+           (c->published - last_published) * 1e9 / (now - last_stats), c->decoded->size(),
+           vipc_server->get_overwritten(c->cam->stream_type));
+      last_stats = now;
+      last_published = c->published;
+    }
+  }
+
+  // unblock the decoder if we stopped early
+  c->decoded->close();
+  c->free_frames->close();
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--speed X] [--throughput] [--step] [--prefetch N] [--threads N] <segment dir>\n", argv0);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  ReplayMode mode = ReplayMode::REALTIME;
+  float speed = 1.0;
+  int prefetch = 8, threads = 0;
+  std::string segment_path;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--speed" && i + 1 < argc) {
+      speed = atof(argv[++i]);
+    } else if (arg == "--throughput") {
+      mode = ReplayMode::THROUGHPUT;
+    } else if (arg == "--step") {
+      mode = ReplayMode::STEP;
+    } else if (arg == "--prefetch" && i + 1 < argc) {
+      prefetch = atoi(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (arg[0] != '-' && segment_path.empty()) {
+      segment_path = arg;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (segment_path.empty() || speed <= 0 || prefetch < 1) usage(argv[0]);
+
+  std::vector<std::unique_ptr<CameraReplay>> cameras;
+  for (auto &cam : replay_cameras) {
+    const std::string path = segment_path + "/" + cam.filename;
+    if (!util::file_exists(path)) continue;
+
+    auto c = std::make_unique<CameraReplay>();
+    c->cam = &cam;
+    if (!c->decoder.open(path, threads)) continue;
+    cameras.push_back(std::move(c));
+  }
+  if (cameras.empty()) {
+    fprintf(stderr, "no camera files in %s\n", segment_path.c_str());
+    return 1;
+  }
+
+  load_frame_info(segment_path, cameras);
+
+  VisionIpcServer vipc_server("camerad");
+  uint64_t start_ts = UINT64_MAX;
+  for (auto &c : cameras) {
+    const int w = c->decoder.width, h = c->decoder.height;
+    vipc_server.create_buffers(c->cam->stream_type, REPLAY_BUFFER_COUNT, false, w, h);
+
+    // prefetch frames go around between the decoder and the publisher, nothing is allocated per frame
+    c->frames.resize(prefetch);
+    c->free_frames = std::make_unique<BoundedQueue<ReplayFrame *>>(prefetch);
+    c->decoded = std::make_unique<BoundedQueue<ReplayFrame *>>(prefetch);
+    for (auto &f : c->frames) {
+      f.yuv.resize(w * h * 3 / 2);
+      c->free_frames->push(&f);
+    }
+
+    start_ts = std::min(start_ts, frame_extra(c.get(), 0).timestamp_eof);
+    LOGW("replaying %s %dx%d, %zu frames in log", c->cam->filename, w, h, c->frame_info.size());
+  }
+  vipc_server.start_listener();
+
+  ReplayClock clock(mode, speed, start_ts);
+  const uint64_t replay_start = nanos_since_boot();
+  for (auto &c : cameras) {
+    c->decode_thread = std::thread(decode_thread, c.get());
+    c->publish_thread = std::thread(publish_thread, c.get(), &vipc_server, &clock);
+  }
+
+  if (mode == ReplayMode::STEP) {
+    // poll so that ctrl-c isn't stuck in getline
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    std::string line;
+    while (!do_exit) {
+      if (poll(&pfd, 1, 100) <= 0) continue;
+      if (!std::getline(std::cin, line)) break;
+      clock.step(1000000000ULL / REPLAY_DEFAULT_FPS);
+    }
+    do_exit = true;
+  }
+
+  for (auto &c : cameras) {
+    c->publish_thread.join();
+    c->decode_thread.join();
+  }
+
+  const double secs = (nanos_since_boot() - replay_start) * 1e-9;
+  for (auto &c : cameras) {
+    printf("%s: %lu frames in %.2f s, %.1f fps, %lu overwritten\n", c->cam->filename, c->published, secs,
+           c->published / secs, vipc_server.get_overwritten(c->cam->stream_type));
+  }
+  return 0;
+}
@@ -1,6 +1,7 @@
 
 #include <sys/resource.h>
 
+#include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/proclogd/proclog.h"
 
@@ -9,13 +10,23 @@ ExitHandler do_exit;
 int main(int argc, char **argv) {
   setpriority(PRIO_PROCESS, 0, -15);
 
+  // a stat file stays open for every process, and thread if they are sampled
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0) LOGW("failed to raise the open file limit");
+  }
+
+  const int interval_ms = util::getenv("PROCLOGD_INTERVAL_MS", 2000);
+  ProcSampler sampler(util::getenv("PROCLOGD_THREADS", 0) != 0);
+
   PubMaster publisher({"procLog"});
   while (!do_exit) {
     MessageBuilder msg;
-    buildProcLogMessage(msg);
+    buildProcLogMessage(sampler, msg);
     publisher.send("procLog", msg);
 
-    util::sleep_for(2000);  // 2 secs
+    util::sleep_for(interval_ms);
   }
 
   return 0;
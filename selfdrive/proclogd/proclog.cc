@@ -1,8 +1,13 @@
 #include "selfdrive/proclogd/proclog.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <iterator>
 #include <sstream>
@@ -107,11 +112,9 @@ std::optional<ProcStat> procStat(std::string stat) {
   return std::nullopt;
 }
 
-// return list of PIDs from /proc
-std::vector<int> pids() {
+// return list of numeric directories, like the PIDs in /proc
+std::vector<int> ids(DIR *d) {
   std::vector<int> ids;
-  DIR *d = opendir("/proc");
-  assert(d);
   char *p_end;
   struct dirent *de = NULL;
   while ((de = readdir(d))) {
@@ -122,10 +125,18 @@ std::vector<int> pids() {
       }
     }
   }
-  closedir(d);
   return ids;
 }
 
+// return list of PIDs from /proc
+std::vector<int> pids() {
+  DIR *d = opendir("/proc");
+  assert(d);
+  std::vector<int> ret = ids(d);
+  closedir(d);
+  return ret;
+}
+
 // null-delimited cmdline arguments to vector
 std::vector<std::string> cmdline(std::istream &stream) {
   std::vector<std::string> ret;
@@ -191,21 +202,132 @@ void buildMemInfo(cereal::ProcLog::Builder &builder) {
   mem.setShared(mem_info["Shmem:"]);
 }
 
-void buildProcs(cereal::ProcLog::Builder &builder) {
-  auto pids = Parser::pids();
-  std::vector<ProcStat> proc_stats;
-  proc_stats.reserve(pids.size());
+// ***** ProcSampler *****
+
+ProcSampler::ProcSampler(bool sample_threads) : sample_threads(sample_threads) {
+  proc_dir = opendir("/proc");
+  assert(proc_dir);
+}
+
+ProcSampler::~ProcSampler() {
+  for (auto &[pid, proc] : procs) {
+    close_proc(proc);
+  }
+  closedir(proc_dir);
+}
+
+void ProcSampler::close_threads(Proc &proc) {
+  if (proc.task_dir) closedir(proc.task_dir);
+  proc.task_dir = nullptr;
+  for (auto &[tid, t] : proc.threads) {
+    if (t.fd >= 0) close(t.fd);
+  }
+  proc.threads.clear();
+  proc.tids.clear();
+}
+
+void ProcSampler::close_proc(Proc &proc) {
+  if (proc.file.fd >= 0) close(proc.file.fd);
+  proc.file.fd = -1;
+  close_threads(proc);
+}
+
+// rereads <id>/stat under dirfd, opening it the first time. false if the process or thread is gone.
+// reopened is set when an open file stopped reading and was opened again, the id was reused.
+bool ProcSampler::update(StatFile &f, int dirfd, int id, bool *reopened) {
+  char buf[4096];
+  ssize_t len = f.fd >= 0 ? pread(f.fd, buf, sizeof(buf), 0) : -1;
+  if (len <= 0) {
+    // not open yet, or the process is gone and the id may belong to a new one
+    if (f.fd >= 0) {
+      close(f.fd);
+      if (reopened) *reopened = true;
+    }
+    f.fd = openat(dirfd, (std::to_string(id) + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+    if (f.fd < 0) {
+      if (errno != ENOENT) LOGE_100("failed to open %d/stat: %s", id, strerror(errno));
+      return false;
+    }
+    f.utime = f.stime = 0;
+    len = pread(f.fd, buf, sizeof(buf), 0);
+    if (len <= 0) return false;
+  }
+
+  f.stat = Parser::procStat(std::string(buf, len));
+  if (!f.stat) return false;
+
+  // everything is new in the first sample, after that new ids count their whole cpu time
+  f.utime_delta = first_sample ? 0 : f.stat->utime - std::min(f.utime, f.stat->utime);
+  f.stime_delta = first_sample ? 0 : f.stat->stime - std::min(f.stime, f.stat->stime);
+  f.utime = f.stat->utime;
+  f.stime = f.stat->stime;
+  f.seen = true;
+  return true;
+}
+
+void ProcSampler::update_threads(int pid, Proc &proc) {
+  if (!proc.task_dir) {
+    int fd = openat(dirfd(proc_dir), (std::to_string(pid) + "/task").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    proc.task_dir = fdopendir(fd);
+    if (!proc.task_dir) {
+      close(fd);
+      return;
+    }
+  }
+
+  rewinddir(proc.task_dir);
+  proc.tids = Parser::ids(proc.task_dir);
+  for (auto &[tid, t] : proc.threads) t.seen = false;
+  for (int tid : proc.tids) {
+    update(proc.threads[tid], dirfd(proc.task_dir), tid);
+  }
+  for (auto it = proc.threads.begin(); it != proc.threads.end();) {
+    if (!it->second.seen) {
+      if (it->second.fd >= 0) close(it->second.fd);
+      it = proc.threads.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ProcSampler::build(cereal::ProcLog::Builder &builder) {
+  rewinddir(proc_dir);
+  std::vector<int> pids = Parser::ids(proc_dir);
+
+  for (auto &[pid, proc] : procs) proc.file.seen = false;
+  size_t num_procs = 0;
   for (int pid : pids) {
-    std::string path = "/proc/" + std::to_string(pid) + "/stat";
-    if (auto stat = Parser::procStat(util::read_file(path))) {
-      proc_stats.push_back(*stat);
+    Proc &proc = procs[pid];
+    bool reopened = false;
+    bool ok = update(proc.file, dirfd(proc_dir), pid, &reopened);
+    // the task dir and thread files still belong to the process that exited
+    if (reopened) close_threads(proc);
+    if (ok) {
+      num_procs++;
+      if (sample_threads) update_threads(pid, proc);
+    }
+  }
+  for (auto it = procs.begin(); it != procs.end();) {
+    if (!it->second.file.seen) {
+      close_proc(it->second);
+      it = procs.erase(it);
+    } else {
+      ++it;
     }
   }
+  first_sample = false;
 
-  auto procs = builder.initProcs(proc_stats.size());
-  for (size_t i = 0; i < proc_stats.size(); i++) {
-    auto l = procs[i];
-    const ProcStat &r = proc_stats[i];
+  auto log_procs = builder.initProcs(num_procs);
+  size_t i = 0;
+  for (int pid : pids) {
+    auto it = procs.find(pid);
+    if (it == procs.end()) continue;
+
+    const StatFile &f = it->second.file;
+    const ProcStat &r = *f.stat;
+    auto l = log_procs[i++];
     l.setPid(r.pid);
     l.setState(r.state);
     l.setPpid(r.ppid);
@@ -213,6 +335,8 @@ void buildProcs(cereal::ProcLog::Builder &builder) {
     l.setCpuSystem(r.stime / jiffy);
     l.setCpuChildrenUser(r.cutime / jiffy);
     l.setCpuChildrenSystem(r.cstime / jiffy);
+    l.setCpuUserDelta(f.utime_delta / jiffy);
+    l.setCpuSystemDelta(f.stime_delta / jiffy);
     l.setPriority(r.priority);
     l.setNice(r.nice);
     l.setNumThreads(r.num_threads);
@@ -228,12 +352,38 @@ void buildProcs(cereal::ProcLog::Builder &builder) {
     for (size_t i = 0; i < lcmdline.size(); i++) {
       lcmdline.set(i, extra_info.cmdline[i]);
     }
+
+    if (sample_threads) {
+      const Proc &proc = it->second;
+      auto lthreads = l.initThreads(proc.threads.size());
+      size_t j = 0;
+      for (int tid : proc.tids) {
+        auto t = proc.threads.find(tid);
+        if (t == proc.threads.end()) continue;
+
+        const StatFile &tf = t->second;
+        auto lt = lthreads[j++];
+        lt.setTid(tf.stat->pid);
+        lt.setName(tf.stat->name);
+        lt.setState(tf.stat->state);
+        lt.setProcessor(tf.stat->processor);
+        lt.setCpuUser(tf.stat->utime / jiffy);
+        lt.setCpuSystem(tf.stat->stime / jiffy);
+        lt.setCpuUserDelta(tf.utime_delta / jiffy);
+        lt.setCpuSystemDelta(tf.stime_delta / jiffy);
+      }
+    }
   }
 }
 
-void buildProcLogMessage(MessageBuilder &msg) {
+void buildProcLogMessage(ProcSampler &sampler, MessageBuilder &msg) {
   auto procLog = msg.initEvent().initProcLog();
-  buildProcs(procLog);
+  sampler.build(procLog);
   buildCPUTimes(procLog);
   buildMemInfo(procLog);
 }
+
+void buildProcLogMessage(MessageBuilder &msg) {
+  static ProcSampler sampler;
+  buildProcLogMessage(sampler, msg);
+}
@@ -1,3 +1,5 @@
+#include <dirent.h>
+
 #include <optional>
 #include <string>
 #include <unordered_map>
@@ -29,6 +31,7 @@ struct ProcStat {
 namespace Parser {
 
 std::vector<int> pids();
+std::vector<int> ids(DIR *d);
 std::optional<ProcStat> procStat(std::string stat);
 std::vector<std::string> cmdline(std::istream &stream);
 std::vector<CPUTime> cpuTimes(std::istream &stream);
@@ -37,4 +40,42 @@ const ProcCache &getProcExtraInfo(int pid, const std::string &name);
 
 };  // namespace Parser
 
+// Samples processes, and optionally their threads, through /proc stat files that stay open
+// between samples and are reread with pread. New pids are picked up from /proc each sample,
+// files of exited ones are closed. CPU time is also published as the change since the
+// previous sample.
+class ProcSampler {
+public:
+  ProcSampler(bool sample_threads = false);
+  ~ProcSampler();
+  void build(cereal::ProcLog::Builder &builder);
+
+private:
+  struct StatFile {
+    int fd = -1;
+    bool seen = false;
+    unsigned long utime = 0, stime = 0;
+    // cpu time since the previous sample, in jiffies
+    unsigned long utime_delta = 0, stime_delta = 0;
+    std::optional<ProcStat> stat;
+  };
+  struct Proc {
+    StatFile file;
+    DIR *task_dir = nullptr;
+    std::vector<int> tids;
+    std::unordered_map<int, StatFile> threads;
+  };
+
+  bool update(StatFile &f, int dirfd, int id, bool *reopened = nullptr);
+  void update_threads(int pid, Proc &proc);
+  void close_threads(Proc &proc);
+  void close_proc(Proc &proc);
+
+  const bool sample_threads;
+  DIR *proc_dir = nullptr;
+  bool first_sample = true;
+  std::unordered_map<int, Proc> procs;
+};
+
 void buildProcLogMessage(MessageBuilder &msg);
+void buildProcLogMessage(ProcSampler &sampler, MessageBuilder &msg);
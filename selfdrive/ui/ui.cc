@@ -6,6 +6,7 @@
 #include <cmath>
 #include <cstdio>
 
+#include "cereal/services.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/visionimg.h"
@@ -132,17 +133,17 @@ static void update_state(UIState *s) {
 
   // update engageability and DM icons at 2Hz
   if (sm.frame % (UI_FREQ / 2) == 0) {
-    scene.engageable = sm["controlsState"].getControlsState().getEngageable();
-    scene.dm_active = sm["driverMonitoringState"].getDriverMonitoringState().getIsActiveMode();
+    scene.engageable = sm[ServiceId::controlsState].getControlsState().getEngageable();
+    scene.dm_active = sm[ServiceId::driverMonitoringState].getDriverMonitoringState().getIsActiveMode();
   }
-  if (sm.updated("modelV2") && s->vg) {
-    auto model = sm["modelV2"].getModelV2();
+  if (sm.updated(ServiceId::modelV2) && s->vg) {
+    auto model = sm[ServiceId::modelV2].getModelV2();
     update_model(s, model);
     update_leads(s, model);
   }
-  if (sm.updated("liveCalibration")) {
+  if (sm.updated(ServiceId::liveCalibration)) {
     scene.world_objects_visible = true;
-    auto rpy_list = sm["liveCalibration"].getLiveCalibration().getRpyCalib();
+    auto rpy_list = sm[ServiceId::liveCalibration].getLiveCalibration().getRpyCalib();
     Eigen::Vector3d rpy;
     rpy << rpy_list[0], rpy_list[1], rpy_list[2];
     Eigen::Matrix3d device_from_calib = euler2rot(rpy);
@@ -157,18 +158,18 @@ static void update_state(UIState *s) {
       }
     }
   }
-  if (sm.updated("pandaState")) {
-    auto pandaState = sm["pandaState"].getPandaState();
+  if (sm.updated(ServiceId::pandaState)) {
+    auto pandaState = sm[ServiceId::pandaState].getPandaState();
     scene.pandaType = pandaState.getPandaType();
     scene.ignition = pandaState.getIgnitionLine() || pandaState.getIgnitionCan();
-  } else if ((s->sm->frame - s->sm->rcv_frame("pandaState")) > 5*UI_FREQ) {
+  } else if ((s->sm->frame - s->sm->rcv_frame(ServiceId::pandaState)) > 5*UI_FREQ) {
     scene.pandaType = cereal::PandaState::PandaType::UNKNOWN;
   }
-  if (sm.updated("carParams")) {
-    scene.longitudinal_control = sm["carParams"].getCarParams().getOpenpilotLongitudinalControl();
+  if (sm.updated(ServiceId::carParams)) {
+    scene.longitudinal_control = sm[ServiceId::carParams].getCarParams().getOpenpilotLongitudinalControl();
   }
-  if (sm.updated("sensorEvents")) {
-    for (auto sensor : sm["sensorEvents"].getSensorEvents()) {
+  if (sm.updated(ServiceId::sensorEvents)) {
+    for (auto sensor : sm[ServiceId::sensorEvents].getSensorEvents()) {
       if (!scene.started && sensor.which() == cereal::SensorEventData::ACCELERATION) {
         auto accel = sensor.getAcceleration().getV();
         if (accel.totalSize().wordCount) { // TODO: sometimes empty lists are received. Figure out why
@@ -182,8 +183,8 @@ static void update_state(UIState *s) {
       }
     }
   }
-  if (sm.updated("roadCameraState")) {
-    auto camera_state = sm["roadCameraState"].getRoadCameraState();
+  if (sm.updated(ServiceId::roadCameraState)) {
+    auto camera_state = sm[ServiceId::roadCameraState].getRoadCameraState();
 
     float max_lines = Hardware::EON() ? 5408 : 1904;
     float max_gain = Hardware::EON() ? 1.0: 10.0;
@@ -200,50 +201,50 @@ static void update_state(UIState *s) {
   }
 
   if( scene.IsOpenpilotViewEnabled )
-    scene.started = sm["deviceState"].getDeviceState().getStarted();
+    scene.started = sm[ServiceId::deviceState].getDeviceState().getStarted();
   else
-    scene.started = sm["deviceState"].getDeviceState().getStarted() && scene.ignition;
+    scene.started = sm[ServiceId::deviceState].getDeviceState().getStarted() && scene.ignition;
 
 
 
 
   // atom 
-   if (sm.updated("gpsLocationExternal")) {
-    scene.gpsLocationExternal = sm["gpsLocationExternal"].getGpsLocationExternal();
+   if (sm.updated(ServiceId::gpsLocationExternal)) {
+    scene.gpsLocationExternal = sm[ServiceId::gpsLocationExternal].getGpsLocationExternal();
    }
 
-   if (sm.updated("deviceState")) {
-    scene.deviceState = sm["deviceState"].getDeviceState();
+   if (sm.updated(ServiceId::deviceState)) {
+    scene.deviceState = sm[ServiceId::deviceState].getDeviceState();
    }
     
-   if (scene.started && sm.updated("controlsState")) {
-    scene.controls_state = sm["controlsState"].getControlsState();
+   if (scene.started && sm.updated(ServiceId::controlsState)) {
+    scene.controls_state = sm[ServiceId::controlsState].getControlsState();
 // debug Message
     scene.alert.alertTextMsg1 = scene.controls_state.getAlertTextMsg1();
     scene.alert.alertTextMsg2 = scene.controls_state.getAlertTextMsg2();
     scene.alert.alertTextMsg3 = scene.controls_state.getAlertTextMsg3();
    } 
-   if (sm.updated("carState")) {
-    scene.car_state = sm["carState"].getCarState();
+   if (sm.updated(ServiceId::carState)) {
+    scene.car_state = sm[ServiceId::carState].getCarState();
 
     auto cruiseState = scene.car_state.getCruiseState();
     scene.scr.awake = cruiseState.getCruiseSwState();
    } 
    
-   if( sm.updated("liveNaviData"))
+   if( sm.updated(ServiceId::liveNaviData))
    {
-     scene.liveNaviData = sm["liveNaviData"].getLiveNaviData();
+     scene.liveNaviData = sm[ServiceId::liveNaviData].getLiveNaviData();
      scene.scr.map_is_running = scene.liveNaviData.getMapEnable();
    } 
 
-   if( sm.updated("liveParameters") )
+   if( sm.updated(ServiceId::liveParameters) )
    {
-      scene.liveParameters = sm["liveParameters"].getLiveParameters();
+      scene.liveParameters = sm[ServiceId::liveParameters].getLiveParameters();
    }
 
-   if (sm.updated("lateralPlan"))
+   if (sm.updated(ServiceId::lateralPlan))
    {
-    scene.lateralPlan = sm["lateralPlan"].getLateralPlan();
+    scene.lateralPlan = sm[ServiceId::lateralPlan].getLateralPlan();
    } 
 }
 